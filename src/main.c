@@ -1,6 +1,10 @@
+// ftruncate for the disk memo index and posix_memalign for ordered map nodes, also under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "mpc.h"
 
 //#include "debug_alloc.h"
@@ -23,22 +27,87 @@ typedef enum
     LVAL_BOOLEAN,
     LVAL_INTEGER,
     LVAL_DECIMAL,
+    LVAL_BIGNUM,
     LVAL_SYM,
     LVAL_SEXPR,
     LVAL_QEXPR,
     LVAL_FUN,
     LVAL_STR,
+    LVAL_VECTOR,
+    LVAL_ARRAY,
+    LVAL_MAP,
+    LVAL_PMAP,
+    LVAL_OMAP,
+    LVAL_DEQUE,
+    LVAL_PQ,
+    LVAL_RECORD,
+    LVAL_BITS,
+    LVAL_BYTES,
+    LVAL_LAZY,
+    LVAL_PROMISE,
+    LVAL_RECUR,  // arguments of 'recur' on their way back to 'loop'
     LVAL_OK
 } lval_type_t;
 
 struct lval;
 struct lenv;
+struct lbig;
+struct lmemo;
+struct ldisk;
+struct lvec;
+struct larr;
+struct lmap;
+struct lhamt_node;
+struct lomap;
+struct lomap_node;
+struct ldeque;
+struct lpq;
+struct lshape;
+struct lrec;
+struct lrecfn;
+struct lbits;
+struct lbytes;
+struct llazy;
+struct lpromise;
+struct lfolded;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lbig lbig;
+typedef struct lmemo lmemo;
+typedef struct ldisk ldisk;
+typedef struct lvec lvec;
+typedef struct larr larr;
+typedef struct lmap lmap;
+typedef struct lhamt_node lhamt_node;
+typedef struct lomap lomap;
+typedef struct lomap_node lomap_node;
+typedef struct ldeque ldeque;
+typedef struct lpq lpq;
+typedef struct lshape lshape;
+typedef struct lrec lrec;
+typedef struct lrecfn lrecfn;
+typedef struct lbits lbits;
+typedef struct lbytes lbytes;
+typedef struct llazy llazy;
+typedef struct lpromise lpromise;
+typedef struct lfolded lfolded;
 
 #define LBUILTIN_DECL(name) lval* (name)(lenv* e, lval* a)
 typedef LBUILTIN_DECL(*lbuiltin);
 
+#define LBUILTIN_PURE 1  // no side effects, result depends only on the arguments
+#define LBUILTIN_ENV 2   // reads or changes the calling environment
+#define LBUILTIN_SPECIAL 4  // special form, gets its operands unevaluated
+#define LBUILTIN_MACRO 8  // lambda made by 'defmacro'
+
+typedef struct
+{
+    char* name;
+    char* c_name;
+    lbuiltin func;
+    int flags;
+} lbuiltin_entry;
+
 struct lval
 {
     lval_type_t type;
@@ -50,9 +119,34 @@ struct lval
     char *str;
 
     lbuiltin builtin;
+    int flags;  // LBUILTIN_* flags of the builtin
+    lmemo* memo;  // results cache of a function made by 'memo'
+    lrecfn* recfn;  // what a function made by 'defrecord' does
+    // Storage of big integers and the container types, only the member of the value's type is set
+    union
+    {
+        lbig* big;
+        lvec* vec;
+        larr* arr;
+        lmap* map;
+        lhamt_node* hamt;  // root of a persistent map
+        lomap* omap;
+        ldeque* dq;
+        lpq* pq;
+        lrec* rec;
+        lbits* bits;
+        struct
+        {
+            lbytes* bytes;
+            int offset, length;  // the part of the buffer a bytes value sees
+        };
+        llazy* lazy;
+        lpromise* promise;
+    };
     lenv* env;
     lval* formals;
     lval* body;
+    lfolded* folded;  // folded body, shared by the copies of a lambda
 
     int count;
     lval** cell;
@@ -66,6 +160,248 @@ struct lenv
     lval** vals;
 };
 
+// Storage of a vector, shared by all copies of the value so updates are seen through every one of them
+struct lvec
+{
+    int refs;
+    int count;
+    int capacity;
+    lval** items;
+};
+
+typedef enum
+{
+    LARR_F64,
+    LARR_I64
+} larr_kind;
+
+// Unboxed items of a typed array, shared by copies and never changed once filled
+struct larr
+{
+    int refs;
+    larr_kind kind;
+    int count;
+    void* data;
+};
+
+typedef struct
+{
+    unsigned long hash;
+    int dist;  // how far the entry sits from the slot its hash points at
+    lval* key;  // NULL in an empty slot
+    lval* val;
+} lmap_entry;
+
+// Storage of a hash map, shared by copies like that of a vector
+struct lmap
+{
+    int refs;
+    int count;
+    int capacity;  // a power of two
+    lmap_entry* entries;
+};
+
+// Entry of a persistent map, shared between the versions that contain it
+typedef struct
+{
+    int refs;
+    unsigned long hash;
+    lval* key;
+    lval* val;
+} lhamt_leaf;
+
+typedef struct
+{
+    lhamt_node* node;  // either a child node
+    lhamt_leaf* leaf;  // or an entry
+} lhamt_slot;
+
+// Node of a persistent map, never changed once it is shared
+struct lhamt_node
+{
+    int refs;
+    int size;  // entries in the whole subtree
+    unsigned int bitmap;  // used slots by 5 bit chunk of the hash
+    int collision;  // entries whose hashes are all equal, searched linearly
+    int count;
+    lhamt_slot* slots;
+};
+
+// Unboxed stand-in for an ordered map key, compared before the key itself
+typedef union
+{
+    double num;
+    unsigned long long prefix;  // first 8 bytes of a string, big endian
+} lomap_key;
+
+#define LOMAP_DEGREE 8
+#define LOMAP_MAX (2 * LOMAP_DEGREE - 1)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LALIGN(n) __declspec(align(n))
+#else
+#define LALIGN(n) __attribute__((aligned(n)))
+#endif
+
+// B-tree node of an ordered map, between LOMAP_DEGREE - 1 and LOMAP_MAX entries unless it is the root
+struct lomap_node
+{
+    LALIGN(64) lomap_key sort[LOMAP_MAX];
+    lval* keys[LOMAP_MAX];
+    lval* vals[LOMAP_MAX];
+    lomap_node* children[LOMAP_MAX + 1];  // children[0] is NULL in leaves
+    int count;
+};
+
+struct lomap
+{
+    int refs;
+    int count;
+    int strings;  // whether the keys are strings rather than numbers
+    lomap_node* root;
+};
+
+// Storage of a deque, a ring buffer shared by all copies of the value
+struct ldeque
+{
+    int refs;
+    int head;  // slot of the front item
+    int count;
+    int capacity;  // power of two
+    lval** items;
+};
+
+// Item i counting from the front
+#define LDEQUE_AT(dq, i) ((dq)->items[((dq)->head + (i)) & ((dq)->capacity - 1)])
+
+typedef struct
+{
+    double rank;  // the priority as a double
+    unsigned long long seq;  // order of insertion
+    lval* prio;  // what the key function returned, NULL if the item is its own priority
+    lval* item;
+} lpq_entry;
+
+// Storage of a priority queue, a binary heap shared by all copies of the value
+struct lpq
+{
+    int refs;
+    int max;  // whether the largest priority comes out first
+    int count;
+    int capacity;
+    unsigned long long seq;
+    lval* key;  // key function or NULL
+    lpq_entry* entries;
+};
+
+// Type of the records made by one 'defrecord', shared by all of them
+struct lshape
+{
+    int refs;
+    char* name;
+    int count;
+    char** fields;
+};
+
+// Storage of a record, shared by all copies of the value
+struct lrec
+{
+    int refs;
+    lshape* shape;
+    lval* slots[];
+};
+
+typedef enum
+{
+    LREC_MAKE,
+    LREC_IS,
+    LREC_GET,
+    LREC_SET
+} lrec_op;
+
+struct lrecfn
+{
+    int refs;
+    lrec_op op;
+    int slot;  // field of an accessor or setter
+    lshape* shape;
+};
+
+// Storage of a bitset, shared by all copies of the value
+struct lbits
+{
+    int refs;
+    int count;  // bits
+    int words;
+    unsigned long long* data;
+};
+
+// Buffer of a bytes value, shared by its copies and slices
+struct lbytes
+{
+    int refs;
+    int length;  // bytes in use, no view goes past them
+    int capacity;
+    unsigned char* data;
+};
+
+#define LBYTES_AT(v) ((v)->bytes->data + (v)->offset)
+
+// State of a promise made by 'delay', shared by all copies
+struct lpromise
+{
+    int refs;
+    int forcing;  // being evaluated, forcing it again could never finish
+    lval* expr;  // NULL once forced
+    lenv* env;  // local bindings around the 'delay'
+    lval* value;  // NULL until forced
+};
+
+// Where a lazy sequence pulls its items from
+typedef enum
+{
+    LLAZY_RANGE,
+    LLAZY_LIST,
+    LLAZY_SEQ
+} llazy_source_t;
+
+typedef enum
+{
+    LLAZY_MAP,
+    LLAZY_FILTER,
+    LLAZY_DROP_WHILE,
+    LLAZY_TAKE
+} llazy_stage_t;
+
+typedef struct
+{
+    llazy_stage_t kind;
+    lval* fn;
+    long n;  // items a take stage lets through
+    long seen;  // items taken so far, or 1 once a drop-while stage stopped dropping
+} llazy_stage;
+
+struct llazy
+{
+    int refs;
+    llazy_source_t source;
+    long next;  // next value of a range, or index in a list or sequence
+    long end, step;
+    int bounded;  // whether a range stops at end
+    lvec* list;
+    llazy* seq;
+    int stage_count;
+    llazy_stage* stages;
+    int started;  // an item has been pulled, the stages have state
+    int busy;  // pulling, the stages are calling back into the interpreter
+    int finished;
+    lval* err;  // error that ended the sequence
+    lvec* items;  // realised so far
+};
+
+unsigned long lfold_epoch = 1;
+lval* lfold_shadowed = NULL;
+
 #ifdef _WIN32
 #include <windows.h>
 
@@ -180,11 +516,25 @@ char* ltype_name(lval_type_t type)
         case LVAL_BOOLEAN: return "Boolean";
         case LVAL_INTEGER: return "Integer";
         case LVAL_DECIMAL: return "Decimal";
+        case LVAL_BIGNUM: return "Big Integer";
         case LVAL_SYM: return "Symbol";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
         case LVAL_FUN: return "Function";
         case LVAL_STR: return "String";
+        case LVAL_VECTOR: return "Vector";
+        case LVAL_ARRAY: return "Array";
+        case LVAL_MAP: return "Map";
+        case LVAL_PMAP: return "Persistent Map";
+        case LVAL_OMAP: return "Ordered Map";
+        case LVAL_DEQUE: return "Deque";
+        case LVAL_PQ: return "Priority Queue";
+        case LVAL_RECORD: return "Record";
+        case LVAL_BITS: return "Bitset";
+        case LVAL_BYTES: return "Bytes";
+        case LVAL_LAZY: return "Lazy Sequence";
+        case LVAL_PROMISE: return "Promise";
+        case LVAL_RECUR: return "Recur";
         default: return "Unknown";
     }
 }
@@ -272,14 +622,118 @@ lval* lval_qexpr()
     return v;
 }
 
+int lbuiltin_flags(lbuiltin func);
+
 lval* lval_builtin(lbuiltin func)
 {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_FUN;
     v->builtin = func;
+    v->flags = lbuiltin_flags(func);
+    v->memo = NULL;
+    v->recfn = NULL;
     v->env = NULL;
     v->formals = NULL;
     v->body = NULL;
+    v->folded = NULL;
+    return v;
+}
+
+lval* lval_vector(lvec* vec)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_VECTOR;
+    v->vec = vec;
+    return v;
+}
+
+lval* lval_array(larr* arr)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_ARRAY;
+    v->arr = arr;
+    return v;
+}
+
+lval* lval_map(lmap* map)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_MAP;
+    v->map = map;
+    return v;
+}
+
+lval* lval_pmap(lhamt_node* root)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_PMAP;
+    v->hamt = root;
+    return v;
+}
+
+lval* lval_omap(lomap* m)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_OMAP;
+    v->omap = m;
+    return v;
+}
+
+lval* lval_deque(ldeque* dq)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_DEQUE;
+    v->dq = dq;
+    return v;
+}
+
+lval* lval_pq(lpq* q)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_PQ;
+    v->pq = q;
+    return v;
+}
+
+lval* lval_record(lrec* r)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_RECORD;
+    v->rec = r;
+    return v;
+}
+
+lval* lval_bits(lbits* b)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_BITS;
+    v->bits = b;
+    return v;
+}
+
+lval* lval_bytes(lbytes* b, int offset, int length)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_BYTES;
+    v->bytes = b;
+    v->offset = offset;
+    v->length = length;
+    return v;
+}
+
+lval* lval_lazy(llazy* l)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_LAZY;
+    v->lazy = l;
+    return v;
+}
+
+lval* lval_promise(lpromise* p)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_PROMISE;
+    v->promise = p;
     return v;
 }
 
@@ -290,14 +744,35 @@ lval* lval_lambda(lval* formals, lval* body)
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_FUN;
     v->builtin = NULL;
+    v->flags = 0;
+    v->memo = NULL;
+    v->recfn = NULL;
     v->env = lenv_new();
     v->formals = formals;
     v->body = body;
+    v->folded = NULL;
     return v;
 }
 
 void lenv_del(lenv *);
 
+void lbig_del(lbig* b);
+void lmemo_release(lmemo* m);
+void lvec_release(lvec* vec);
+void larr_release(larr* arr);
+void lmap_release(lmap* map);
+void lhamt_node_release(lhamt_node* n);
+void lomap_release(lomap* m);
+void ldeque_release(ldeque* dq);
+void lpq_release(lpq* q);
+void lrec_release(lrec* r);
+void lrecfn_release(lrecfn* f);
+void lbits_release(lbits* b);
+void lbytes_release(lbytes* b);
+void llazy_release(llazy* l);
+void lpromise_release(lpromise* p);
+void lfolded_release(lfolded* c);
+
 void lval_del(lval *v)
 {
     switch (v->type)
@@ -308,12 +783,76 @@ void lval_del(lval *v)
         case LVAL_OK:
             break;
 
+        case LVAL_BIGNUM:
+            lbig_del(v->big);
+            break;
+
+        case LVAL_VECTOR:
+            lvec_release(v->vec);
+            break;
+
+        case LVAL_ARRAY:
+            larr_release(v->arr);
+            break;
+
+        case LVAL_MAP:
+            lmap_release(v->map);
+            break;
+
+        case LVAL_PMAP:
+            lhamt_node_release(v->hamt);
+            break;
+
+        case LVAL_OMAP:
+            lomap_release(v->omap);
+            break;
+
+        case LVAL_DEQUE:
+            ldeque_release(v->dq);
+            break;
+
+        case LVAL_PQ:
+            lpq_release(v->pq);
+            break;
+
+        case LVAL_RECORD:
+            lrec_release(v->rec);
+            break;
+
+        case LVAL_BITS:
+            lbits_release(v->bits);
+            break;
+
+        case LVAL_BYTES:
+            lbytes_release(v->bytes);
+            break;
+
+        case LVAL_LAZY:
+            llazy_release(v->lazy);
+            break;
+
+        case LVAL_PROMISE:
+            lpromise_release(v->promise);
+            break;
+
         case LVAL_FUN:
+            if (v->memo != NULL)
+            {
+                lmemo_release(v->memo);
+            }
+            if (v->recfn != NULL)
+            {
+                lrecfn_release(v->recfn);
+            }
             if (v->builtin == NULL)
             {
                 lenv_del(v->env);
                 lval_del(v->formals);
                 lval_del(v->body);
+                if (v->folded != NULL)
+                {
+                    lfolded_release(v->folded);
+                }
             }
             break;
 
@@ -331,6 +870,7 @@ void lval_del(lval *v)
 
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+        case LVAL_RECUR:
             for (int i = 0; i < v->count; i++)
             {
                 lval_del(v->cell[i]);
@@ -341,1435 +881,11562 @@ void lval_del(lval *v)
     free(v);
 }
 
-lval* eval_op(lval* x, char* op, lval* y)
+/* Arbitrary-precision integers
+
+Integers live in a plain C long until an operation overflows, then the operation is redone on lbig values.
+Results that fit in a long again are turned back into ordinary integers, so a Big Integer is always outside the
+range of long. Magnitudes are arrays of 32-bit limbs, least significant first, with no leading zero limbs.
+*/
+
+typedef unsigned int lbig_limb;
+typedef unsigned long long lbig_wide;
+
+#define LBIG_KARATSUBA 32  // limbs below which schoolbook multiplication is faster
+#define LBIG_POW_BITS (1UL << 21)  // largest power '^' computes, about 630000 decimal digits
+
+struct lbig
 {
-    lval *result = NULL;
-    if (x->type == LVAL_INTEGER && y->type == LVAL_INTEGER)
+    int sign;  // 1 or -1, zero is positive with count 0
+    int count;
+    lbig_limb* limbs;
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LADD_OVERFLOW(a, b, r) __builtin_add_overflow(a, b, r)
+#define LSUB_OVERFLOW(a, b, r) __builtin_sub_overflow(a, b, r)
+#define LMUL_OVERFLOW(a, b, r) __builtin_mul_overflow(a, b, r)
+#else
+int ladd_overflow(long a, long b, long* r)
+{
+    if ((b > 0 && a > LONG_MAX - b) || (b < 0 && a < LONG_MIN - b))
     {
-        if (strcmp(op, "+") == 0)
-        {
-            result = lval_integer(x->integer + y->integer);
-        }
-        else if (strcmp(op, "-") == 0)
-        {
-            result = lval_integer(x->integer - y->integer);
-        }
-        else if (strcmp(op, "*") == 0)
-        {
-            result = lval_integer(x->integer * y->integer);
-        }
-        else if (strcmp(op, "/") == 0)
-        {
-            if (y->integer == 0)
-            {
-                result = lval_err("Divison by zero");
-            }
-            else
-            {
-                result = lval_integer(x->integer / y->integer);
-            }
-        }
-        else if (strcmp(op, "%") == 0)
-        {
-            if (y->integer == 0)
-            {
-                result = lval_err("Division by zero");
-            }
-            else
-            {
-                result = lval_integer(x->integer % y->integer);
-            }
-        }
-        else if (strcmp(op, "^") == 0)
-        {
-            long z = 1;
-            for (long l = 0; l < y->integer; l++)
-            {
-                z *= x->integer;
-            }
-            result = lval_integer(z);
-        }
-        else if (strcmp(op, "min") == 0)
-        {
-            result = lval_integer(x->integer < y->integer ? x->integer : y->integer);
-        }
-        else if (strcmp(op, "max") == 0)
-        {
-            result = lval_integer(x->integer > y->integer ? x->integer : y->integer);
-        }
-        else if (strcmp(op, "&&") == 0)
-        {
-            result = lval_integer(x->integer && y->integer);
-        }
-        else if (strcmp(op, "||") == 0)
-        {
-            result = lval_integer(x->integer || y->integer);
-        }
+        return 1;
     }
-    else if (x->type == LVAL_DECIMAL && y->type == LVAL_DECIMAL)
+    *r = a + b;
+    return 0;
+}
+
+int lsub_overflow(long a, long b, long* r)
+{
+    if ((b < 0 && a > LONG_MAX + b) || (b > 0 && a < LONG_MIN + b))
     {
-        if (strcmp(op, "+") == 0)
-        {
-            result = lval_decimal(x->decimal + y->decimal);
-        }
-        else if (strcmp(op, "-") == 0)
-        {
-            result = lval_decimal(x->decimal - y->decimal);
-        }
-        else if (strcmp(op, "*") == 0)
-        {
-            result = lval_decimal(x->decimal * y->decimal);
-        }
-        else if (strcmp(op, "/") == 0)
-        {
-            if (y->decimal == 0)
-            {
-                result = lval_err("Division by zero");
-            }
-            else
-            {
-                result = lval_decimal(x->decimal / y->decimal);
-            }
-        }
-        else if (strcmp(op, "%") == 0)
+        return 1;
+    }
+    *r = a - b;
+    return 0;
+}
+
+int lmul_overflow(long a, long b, long* r)
+{
+    if (a != 0 && b != 0)
+    {
+        if (a > 0 ? (b > 0 ? a > LONG_MAX / b : b < LONG_MIN / a) : (b > 0 ? a < LONG_MIN / b : b < LONG_MAX / a))
         {
-            if (y->decimal == 0)
-            {
-                result = lval_err("Division by zero");
-            }
-            else
-            {
-                result = lval_decimal(fmod(x->decimal, y->decimal));
-            }
+            return 1;
         }
-        else if (strcmp(op, "^") == 0)
-        {
-            result = lval_decimal(pow(x->decimal, y->decimal));
-        }
-        else if (strcmp(op, "min") == 0)
-        {
-            result = lval_decimal(x->decimal < y->decimal ? x->decimal : y->decimal);
-        }
-        else if (strcmp(op, "max") == 0)
-        {
-            result = lval_decimal(x->decimal > y->decimal ? x->decimal : y->decimal);
-        }
-        else if (strcmp(op, "&&") == 0)
-        {
-            result = lval_integer(x->decimal && y->decimal);
-        }
-        else if (strcmp(op, "||") == 0)
-        {
-            result = lval_integer(x->decimal || y->decimal);
-        }
-    }
-    else if (x->type == LVAL_DECIMAL && y->type == LVAL_INTEGER)
-    {
-        y->type = LVAL_DECIMAL;
-        y->decimal = (double) y->integer;
-        return eval_op(x, op, y);
-    }
-    else if (x->type == LVAL_INTEGER && y->type == LVAL_DECIMAL)
-    {
-        x->type = LVAL_DECIMAL;
-        x->decimal = (double) x->integer;
-        return eval_op(x, op, y);
-    }
-
-    lval_del(x);
-    lval_del(y);
-    if (result == NULL)
-    {
-        return lval_err("Operator not implemented: %s", op);
     }
-    return result;
+    *r = a * b;
+    return 0;
 }
+#define LADD_OVERFLOW(a, b, r) ladd_overflow(a, b, r)
+#define LSUB_OVERFLOW(a, b, r) lsub_overflow(a, b, r)
+#define LMUL_OVERFLOW(a, b, r) lmul_overflow(a, b, r)
+#endif
 
-lval* lval_read_integer(mpc_ast_t *t)
+lbig* lbig_new(int count)
 {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno == ERANGE ? lval_err("Bad number: %s", t->contents) : lval_integer(x);
+    lbig* b = malloc(sizeof(lbig));
+    b->sign = 1;
+    b->count = count;
+    b->limbs = calloc(count > 0 ? count : 1, sizeof(lbig_limb));
+    return b;
 }
 
-lval* lval_read_decimal(mpc_ast_t *t)
+void lbig_del(lbig* b)
 {
-    errno = 0;
-    double x = strtof(t->contents, NULL);
-    return errno == ERANGE ? lval_err("Bad number: %s", t->contents) : lval_decimal(x);
+    free(b->limbs);
+    free(b);
 }
 
-lval* lval_read_string(mpc_ast_t *t)
+lbig* lbig_copy(lbig* b)
 {
-    size_t len = strlen(t->contents);
-    t->contents[len - 1] = '\0';
-    char* str = malloc(len);
-    strcpy(str, t->contents + 1);
-    char* unescaped = mpcf_unescape(str);
-    //debug_update_ptr(str, unescaped);
-    lval* x = lval_string(unescaped);
-    free(unescaped);
+    lbig* x = lbig_new(b->count);
+    x->sign = b->sign;
+    memcpy(x->limbs, b->limbs, sizeof(lbig_limb) * b->count);
     return x;
 }
 
-lenv* lenv_copy(lenv* e);
-
-lval* lval_copy(lval* v)
+lbig* lbig_trim(lbig* b)
 {
-    lval* x = malloc(sizeof(lval));
-
-    x->type = v->type;
-
-    switch (v->type)
+    while (b->count > 0 && b->limbs[b->count - 1] == 0)
     {
-        case LVAL_BOOLEAN:
-        case LVAL_INTEGER:
-            x->integer = v->integer;
-            break;
-        case LVAL_DECIMAL:
-            x->decimal = v->decimal;
-            break;
-        case LVAL_FUN:
-            if (v->builtin == NULL)
-            {
-                x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-            }
-            else
-            {
-                x->builtin = v->builtin;
-                x->env = NULL;
-                x->formals = NULL;
-                x->body = NULL;
-            }
-            break;
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
-            break;
-        case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
-            break;
-        case LVAL_STR:
-            x->str = malloc(strlen(v->str) + 1);
-            strcpy(x->str, v->str);
-            break;
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval) * v->count);
-            for (int i = 0; i < v->count; i++)
-            {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
-        default:
-            free(x);
-            x = lval_err("Copy not implemented for %s", ltype_name(v->type));
-            break;
+        b->count--;
     }
-    return x;
-}
-
-lval* lval_add(lval* v, lval* new_cell)
-{
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = new_cell;
-    return v;
+    if (b->count == 0)
+    {
+        b->sign = 1;
+    }
+    return b;
 }
 
-lenv* lenv_new(void)
+lbig* lbig_from_long(long v)
 {
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+    unsigned long long m = v < 0 ? 0ULL - (unsigned long long) v : (unsigned long long) v;
+    lbig* b = lbig_new(2);
+    b->sign = v < 0 ? -1 : 1;
+    b->limbs[0] = (lbig_limb) m;
+    b->limbs[1] = (lbig_limb) (m >> 32);
+    return lbig_trim(b);
 }
 
-void lenv_del(lenv* e)
+int lbig_to_long(lbig* b, long* out)
 {
-    for (int i = 0; i < e->count; i++)
+    if (b->count > 2)
     {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        return 0;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
-}
-
-lval* lenv_get(lenv* e, lval* k)
-{
-    lval* result = NULL;
-    for (int i = 0; i < e->count; i++)
+    unsigned long long m = 0;
+    for (int i = b->count - 1; i >= 0; i--)
     {
-        if (strcmp(e->syms[i], k->sym) == 0)
-        {
-            result = lval_copy(e->vals[i]);
-            break;
-        }
+        m = (m << 32) | b->limbs[i];
     }
-    if (result == NULL && e->par != NULL)
+    if (b->sign > 0 && m <= (unsigned long long) LONG_MAX)
     {
-        result = lenv_get(e->par, k);
+        *out = (long) m;
+        return 1;
     }
-    if (result == NULL)
+    if (b->sign < 0 && m <= (unsigned long long) LONG_MAX + 1)
     {
-        result = lval_err("Unbound symbol '%s'", k->sym);
+        *out = (long) (0ULL - m);
+        return 1;
     }
-    return result;
+    return 0;
 }
 
-char* lenv_get_name(lenv* e, lval* v)
+double lbig_to_double(lbig* b)
 {
-    for (int i = 0; i < e->count; i++)
+    double d = 0.0;
+    for (int i = b->count - 1; i >= 0; i--)
     {
-        if (v->type == LVAL_FUN && e->vals[i]->type == LVAL_FUN && v->builtin == e->vals[i]->builtin)
-        {
-            return e->syms[i];
-        }
-    }
-    if (e->par != NULL)
-    {
-        return lenv_get_name(e->par, v);
+        d = d * 4294967296.0 + b->limbs[i];
     }
-    return "(Unknown)";
+    return b->sign * d;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v)
+int lmag_cmp(lbig_limb* a, int an, lbig_limb* b, int bn)
 {
-    for (int i = 0; i < e->count; i++)
+    while (an > 0 && a[an - 1] == 0)
+    {
+        an--;
+    }
+    while (bn > 0 && b[bn - 1] == 0)
+    {
+        bn--;
+    }
+    if (an != bn)
+    {
+        return an < bn ? -1 : 1;
+    }
+    for (int i = an - 1; i >= 0; i--)
     {
-        if (strcmp(e->syms[i], k->sym) == 0)
+        if (a[i] != b[i])
         {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+            return a[i] < b[i] ? -1 : 1;
         }
     }
-    e->count++;
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    e->vals = realloc(e->vals, sizeof(lval) * e->count);
-    int last = e->count - 1;
-    e->vals[last] = lval_copy(v);
-    e->syms[last] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[last], k->sym);
+    return 0;
 }
 
-lenv* lenv_copy(lenv* e)
+int lbig_cmp(lbig* a, lbig* b)
 {
-    lenv* n = lenv_new();
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++)
+    if (a->sign != b->sign)
     {
-        n->vals[i] = lval_copy(e->vals[i]);
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
+        return a->sign;
     }
-    return n;
+    return a->sign * lmag_cmp(a->limbs, a->count, b->limbs, b->count);
 }
 
-lval* lval_read(mpc_ast_t* t)
+// r[0..an] = a + b with an >= bn
+void lmag_add(lbig_limb* r, lbig_limb* a, int an, lbig_limb* b, int bn)
 {
-    if (strstr(t->tag, "integer"))
-    {
-        return lval_read_integer(t);
-    }
-    else if (strstr(t->tag, "decimal"))
+    lbig_wide carry = 0;
+    int i = 0;
+    for (; i < bn; i++)
     {
-        return lval_read_decimal(t);
+        carry += (lbig_wide) a[i] + b[i];
+        r[i] = (lbig_limb) carry;
+        carry >>= 32;
     }
-    else if (strstr(t->tag, "symbol"))
+    for (; i < an; i++)
     {
-        return lval_symbol(t->contents);
+        carry += a[i];
+        r[i] = (lbig_limb) carry;
+        carry >>= 32;
     }
-    else if (strstr(t->tag, "string"))
+    r[an] = (lbig_limb) carry;
+}
+
+// r[0..an) = a - b with a >= b
+void lmag_sub(lbig_limb* r, lbig_limb* a, int an, lbig_limb* b, int bn)
+{
+    lbig_wide borrow = 0;
+    for (int i = 0; i < an; i++)
     {
-        return lval_read_string(t);
+        lbig_wide d = (lbig_wide) a[i] - (i < bn ? b[i] : 0) - borrow;
+        r[i] = (lbig_limb) d;
+        borrow = d >> 63;
     }
+}
 
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0)
+// r[0..rn) += x, the sum must fit in rn limbs
+void lmag_add_into(lbig_limb* r, int rn, lbig_limb* x, int xn)
+{
+    while (xn > 0 && x[xn - 1] == 0)
     {
-        x = lval_sexpr();
+        xn--;
     }
-    else if (strstr(t->tag, "sexpr"))
+    lbig_wide carry = 0;
+    for (int i = 0; i < rn && (i < xn || carry); i++)
     {
-        x = lval_sexpr();
+        carry += (lbig_wide) r[i] + (i < xn ? x[i] : 0);
+        r[i] = (lbig_limb) carry;
+        carry >>= 32;
     }
-    else if (strstr(t->tag, "qexpr"))
+}
+
+// r[0..rn) -= x, the result must not be negative
+void lmag_sub_into(lbig_limb* r, int rn, lbig_limb* x, int xn)
+{
+    lbig_wide borrow = 0;
+    for (int i = 0; i < rn && (i < xn || borrow); i++)
     {
-        x = lval_qexpr();
+        lbig_wide d = (lbig_wide) r[i] - (i < xn ? x[i] : 0) - borrow;
+        r[i] = (lbig_limb) d;
+        borrow = d >> 63;
     }
+}
 
-    for (int i = 0; i < t->children_num - 1; i++)
+// r[0..an+bn) = a * b, r must be zeroed
+void lmag_mul_school(lbig_limb* r, lbig_limb* a, int an, lbig_limb* b, int bn)
+{
+    for (int i = 0; i < an; i++)
     {
-        if (strcmp(t->children[i]->contents, "(") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, ")") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "{") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "}") == 0)
+        lbig_wide carry = 0;
+        lbig_wide ai = a[i];
+        if (ai == 0)
         {
             continue;
         }
-        if (strcmp(t->children[i]->tag, "regex") == 0)
+        for (int j = 0; j < bn; j++)
         {
-            continue;
+            carry += ai * b[j] + r[i + j];
+            r[i + j] = (lbig_limb) carry;
+            carry >>= 32;
         }
-        if (strstr(t->children[i]->tag, "comment"))
+        r[i + bn] = (lbig_limb) carry;
+    }
+}
+
+// r[0..an+bn) = a * b, r must be zeroed. Karatsuba splits both operands in halves and replaces one of the four
+// half-size products by (a0 + a1)(b0 + b1) - a0 b0 - a1 b1.
+void lmag_mul(lbig_limb* r, lbig_limb* a, int an, lbig_limb* b, int bn)
+{
+    if (an < bn)
+    {
+        lbig_limb* t = a;
+        a = b;
+        b = t;
+        int tn = an;
+        an = bn;
+        bn = tn;
+    }
+    if (bn < LBIG_KARATSUBA)
+    {
+        lmag_mul_school(r, a, an, b, bn);
+        return;
+    }
+    if (2 * bn <= an)
+    {
+        // Very different sizes: multiply b by slices of a the size of b
+        lbig_limb* t = malloc(sizeof(lbig_limb) * 2 * bn);
+        for (int i = 0; i < an; i += bn)
         {
-            continue;
+            int len = an - i < bn ? an - i : bn;
+            memset(t, 0, sizeof(lbig_limb) * 2 * bn);
+            lmag_mul(t, a + i, len, b, bn);
+            lmag_add_into(r + i, an + bn - i, t, len + bn);
         }
-        x = lval_add(x, lval_read(t->children[i]));
+        free(t);
+        return;
     }
 
-    return x;
-
+    int m = an / 2;
+    int a1n = an - m;
+    int b1n = bn - m;
+    int sn = a1n + 1;
+    int tn = (b1n > m ? b1n : m) + 1;
+
+    lbig_limb* z0 = calloc(2 * m, sizeof(lbig_limb));
+    lbig_limb* z2 = calloc(a1n + b1n, sizeof(lbig_limb));
+    lbig_limb* s = calloc(sn, sizeof(lbig_limb));
+    lbig_limb* t = calloc(tn, sizeof(lbig_limb));
+    lbig_limb* z1 = calloc(sn + tn, sizeof(lbig_limb));
+
+    lmag_mul(z0, a, m, b, m);
+    lmag_mul(z2, a + m, a1n, b + m, b1n);
+    lmag_add(s, a + m, a1n, a, m);
+    if (b1n >= m)
+    {
+        lmag_add(t, b + m, b1n, b, m);
+    }
+    else
+    {
+        lmag_add(t, b, m, b + m, b1n);
+    }
+    lmag_mul(z1, s, sn, t, tn);
+    lmag_sub_into(z1, sn + tn, z0, 2 * m);
+    lmag_sub_into(z1, sn + tn, z2, a1n + b1n);
+
+    memcpy(r, z0, sizeof(lbig_limb) * 2 * m);
+    lmag_add_into(r + 2 * m, an + bn - 2 * m, z2, a1n + b1n);
+    lmag_add_into(r + m, an + bn - m, z1, sn + tn);
+
+    free(z0);
+    free(z1);
+    free(z2);
+    free(s);
+    free(t);
 }
 
-void lval_print(lenv* e, lval* v);
-
-void lval_expr_print(lenv* e, lval* v, char open, char close)
+lbig* lbig_addsub(lbig* a, lbig* b, int bsign)
 {
-    putchar(open);
-    for (int i = 0; i < v->count; i++)
+    lbig* x;
+    if (a->sign == bsign)
     {
-        lval_print(e, v->cell[i]);
-        if (i != (v->count - 1))
+        int an = a->count >= b->count ? a->count : b->count;
+        x = lbig_new(an + 1);
+        if (a->count >= b->count)
         {
-            putchar(' ');
+            lmag_add(x->limbs, a->limbs, a->count, b->limbs, b->count);
         }
+        else
+        {
+            lmag_add(x->limbs, b->limbs, b->count, a->limbs, a->count);
+        }
+        x->sign = a->sign;
     }
-    putchar(close);
+    else if (lmag_cmp(a->limbs, a->count, b->limbs, b->count) >= 0)
+    {
+        x = lbig_new(a->count);
+        lmag_sub(x->limbs, a->limbs, a->count, b->limbs, b->count);
+        x->sign = a->sign;
+    }
+    else
+    {
+        x = lbig_new(b->count);
+        lmag_sub(x->limbs, b->limbs, b->count, a->limbs, a->count);
+        x->sign = bsign;
+    }
+    return lbig_trim(x);
 }
 
-void lval_str_print(lval* v)
+lbig* lbig_add(lbig* a, lbig* b)
 {
-    char* str = malloc(strlen(v->str) + 1);
-    strcpy(str, v->str);
-    char* escaped = mpcf_escape(str);
-    //debug_update_ptr(str, escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+    return lbig_addsub(a, b, b->sign);
 }
 
-void lval_print(lenv* e, lval* v)
+lbig* lbig_sub(lbig* a, lbig* b)
 {
-    switch (v->type)
+    return lbig_addsub(a, b, -b->sign);
+}
+
+lbig* lbig_mul(lbig* a, lbig* b)
+{
+    lbig* x = lbig_new(a->count + b->count);
+    if (a->count > 0 && b->count > 0)
     {
-        case LVAL_OK:
-            printf("ok");
-            break;
-        case LVAL_BOOLEAN:
-            printf("%s", v->integer ? "true" : "false");
-            break;
-        case LVAL_INTEGER:
-            printf("%li", v->integer);
-            break;
-        case LVAL_DECIMAL:
-            printf("%lf", v->decimal);
-            break;
-        case LVAL_SYM:
-            printf("%s", v->sym);
-            break;
-        case LVAL_STR:
-            lval_str_print(v);
-            break;
-        case LVAL_SEXPR:
-            lval_expr_print(e, v, '(', ')');
-            break;
-        case LVAL_QEXPR:
-            lval_expr_print(e, v, '{', '}');
-            break;
-        case LVAL_FUN:
-            if (v->builtin == NULL)
+        lmag_mul(x->limbs, a->limbs, a->count, b->limbs, b->count);
+    }
+    x->sign = a->sign * b->sign;
+    return lbig_trim(x);
+}
+
+// Truncating division like C: the quotient rounds towards zero and the remainder takes the sign of a.
+// Knuth's algorithm D, as laid out in Hacker's Delight. b must not be zero.
+lbig* lbig_divmod(lbig* a, lbig* b, lbig** rem)
+{
+    int an = a->count;
+    int bn = b->count;
+    if (lmag_cmp(a->limbs, an, b->limbs, bn) < 0)
+    {
+        *rem = lbig_copy(a);
+        return lbig_new(0);
+    }
+
+    lbig* q = lbig_new(an - bn + 1);
+    lbig* r = lbig_new(bn);
+    if (bn == 1)
+    {
+        lbig_wide d = b->limbs[0];
+        lbig_wide k = 0;
+        for (int j = an - 1; j >= 0; j--)
+        {
+            lbig_wide num = (k << 32) | a->limbs[j];
+            q->limbs[j] = (lbig_limb) (num / d);
+            k = num % d;
+        }
+        r->limbs[0] = (lbig_limb) k;
+    }
+    else
+    {
+        int s = 0;
+        lbig_limb top = b->limbs[bn - 1];
+        while (!(top & 0x80000000u))
+        {
+            top <<= 1;
+            s++;
+        }
+        lbig_limb* vn = malloc(sizeof(lbig_limb) * bn);
+        lbig_limb* un = malloc(sizeof(lbig_limb) * (an + 1));
+        for (int i = bn - 1; i > 0; i--)
+        {
+            vn[i] = (b->limbs[i] << s) | (s ? (lbig_limb) ((lbig_wide) b->limbs[i - 1] >> (32 - s)) : 0);
+        }
+        vn[0] = b->limbs[0] << s;
+        un[an] = s ? (lbig_limb) ((lbig_wide) a->limbs[an - 1] >> (32 - s)) : 0;
+        for (int i = an - 1; i > 0; i--)
+        {
+            un[i] = (a->limbs[i] << s) | (s ? (lbig_limb) ((lbig_wide) a->limbs[i - 1] >> (32 - s)) : 0);
+        }
+        un[0] = a->limbs[0] << s;
+
+        for (int j = an - bn; j >= 0; j--)
+        {
+            lbig_wide num = ((lbig_wide) un[j + bn] << 32) | un[j + bn - 1];
+            lbig_wide qhat = num / vn[bn - 1];
+            lbig_wide rhat = num % vn[bn - 1];
+            while (qhat >= 0x100000000ULL || qhat * vn[bn - 2] > ((rhat << 32) | un[j + bn - 2]))
             {
-                printf("(\\ ");
-                lval_print(e, v->formals);
-                putchar(' ');
-                lval_print(e, v->body);
-                putchar(')');
+                qhat--;
+                rhat += vn[bn - 1];
+                if (rhat >= 0x100000000ULL)
+                {
+                    break;
+                }
             }
-            else
+
+            long long k = 0;
+            long long t;
+            for (int i = 0; i < bn; i++)
             {
-                char* s = lenv_get_name(e, v);
-                printf("<builtin: %s>", s);
+                lbig_wide p = qhat * vn[i];
+                t = (long long) un[i + j] - k - (long long) (p & 0xFFFFFFFFULL);
+                un[i + j] = (lbig_limb) t;
+                k = (long long) (p >> 32) - (t >> 32);
             }
-            break;
-        case LVAL_ERR:
-            fore_color(12);
-            printf("Error: %s", v->err);
-            break;
-        default:
-            fore_color(12);
-            printf("Internal error!!!");
-            exit(2);
+            t = (long long) un[j + bn] - k;
+            un[j + bn] = (lbig_limb) t;
+
+            q->limbs[j] = (lbig_limb) qhat;
+            if (t < 0)
+            {
+                // qhat was one too large, add the divisor back
+                q->limbs[j]--;
+                lbig_wide c = 0;
+                for (int i = 0; i < bn; i++)
+                {
+                    c += (lbig_wide) un[i + j] + vn[i];
+                    un[i + j] = (lbig_limb) c;
+                    c >>= 32;
+                }
+                un[j + bn] += (lbig_limb) c;
+            }
+        }
+
+        for (int i = 0; i < bn; i++)
+        {
+            r->limbs[i] = (un[i] >> s) | (s ? (lbig_limb) ((lbig_wide) un[i + 1] << (32 - s)) : 0);
+        }
+        free(vn);
+        free(un);
     }
+
+    q->sign = a->sign * b->sign;
+    r->sign = a->sign;
+    *rem = lbig_trim(r);
+    return lbig_trim(q);
 }
 
-void lval_println(lenv* e, lval* v)
+// Bits in the magnitude of b
+unsigned long lbig_bits(lbig* b)
 {
-    lval_print(e, v);
-    putchar('\n');
+    if (b->count == 0)
+    {
+        return 0;
+    }
+    unsigned long bits = (unsigned long) (b->count - 1) * 32;
+    for (lbig_limb top = b->limbs[b->count - 1]; top != 0; top >>= 1)
+    {
+        bits++;
+    }
+    return bits;
 }
 
-void lenv_list(lenv* e)
+// Exponentiation by squaring
+lbig* lbig_pow(lbig* a, unsigned long e)
 {
-    for (int i = 0; i < e->count; i++)
+    lbig* result = lbig_from_long(1);
+    lbig* base = lbig_copy(a);
+    while (e > 0)
     {
-        fore_color(13);
-        printf("%s = ", e->syms[i]);
-        lval_println(e, e->vals[i]);
+        if (e & 1)
+        {
+            lbig* x = lbig_mul(result, base);
+            lbig_del(result);
+            result = x;
+        }
+        e >>= 1;
+        if (e > 0)
+        {
+            lbig* x = lbig_mul(base, base);
+            lbig_del(base);
+            base = x;
+        }
     }
+    lbig_del(base);
+    return result;
 }
 
-lval* lval_pop(lval* v, int i)
+// Decimal digits, converted 9 at a time
+char* lbig_to_string(lbig* b)
 {
-    if (v->count == 0)
+    lbig* x = lbig_copy(b);
+    int chunks_count = 0;
+    lbig_limb* chunks = malloc(sizeof(lbig_limb) * (x->count * 10 / 9 + 2));
+    while (x->count > 0)
     {
-        return lval_err("Popping a value from empty expression");
+        lbig_wide k = 0;
+        for (int j = x->count - 1; j >= 0; j--)
+        {
+            lbig_wide num = (k << 32) | x->limbs[j];
+            x->limbs[j] = (lbig_limb) (num / 1000000000ULL);
+            k = num % 1000000000ULL;
+        }
+        chunks[chunks_count++] = (lbig_limb) k;
+        lbig_trim(x);
     }
-    if (i < 0 || i >= v->count)
+    lbig_del(x);
+
+    char* str = malloc(chunks_count * 9 + 3);
+    char* p = str;
+    if (b->sign < 0)
     {
-        return lval_err("Trying to access out of bounds at %i (count %i)", i, v->count);
+        *p++ = '-';
     }
-    lval* x = v->cell[i];
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
-    v->count--;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+    p += sprintf(p, "%u", chunks_count > 0 ? chunks[chunks_count - 1] : 0);
+    for (int i = chunks_count - 2; i >= 0; i--)
+    {
+        p += sprintf(p, "%09u", chunks[i]);
+    }
+    free(chunks);
+    return str;
 }
 
-lval* lval_take(lval* v, int i)
+lbig* lbig_from_string(char* s)
 {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+    int sign = 1;
+    if (*s == '-')
+    {
+        sign = -1;
+        s++;
+    }
+    int len = (int) strlen(s);
+    lbig* b = lbig_new(len / 9 + 2);
+    b->count = 0;
+    for (int i = 0; i < len; )
+    {
+        int digits = (len - i) % 9 == 0 ? 9 : (len - i) % 9;
+        lbig_wide chunk = 0;
+        lbig_wide scale = 1;
+        for (int j = 0; j < digits; j++, i++)
+        {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        lbig_wide carry = chunk;
+        for (int j = 0; j < b->count; j++)
+        {
+            carry += b->limbs[j] * scale;
+            b->limbs[j] = (lbig_limb) carry;
+            carry >>= 32;
+        }
+        if (carry)
+        {
+            b->limbs[b->count++] = (lbig_limb) carry;
+        }
+    }
+    b->sign = sign;
+    return lbig_trim(b);
 }
 
-lval *lval_join(lval *x, lval *y)
+// Takes ownership of b, gives back an ordinary integer when the value fits
+lval* lval_bignum(lbig* b)
 {
-    while (y->count > 0)
+    long n;
+    if (lbig_to_long(b, &n))
     {
-        x = lval_add(x, lval_pop(y, 0));
+        lbig_del(b);
+        return lval_integer(n);
     }
-    lval_del(y);
-    return x;
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_BIGNUM;
+    v->big = b;
+    return v;
 }
 
-int lval_eq(lval* x, lval* y)
+lval* lval_parse_integer(char* s)
+{
+    errno = 0;
+    long x = strtol(s, NULL, 10);
+    return errno == ERANGE ? lval_bignum(lbig_from_string(s)) : lval_integer(x);
+}
+
+int lval_is_number(lval* v)
 {
-    if (x->type == LVAL_DECIMAL && y->type == LVAL_INTEGER)
+    return v->type == LVAL_INTEGER || v->type == LVAL_DECIMAL || v->type == LVAL_BIGNUM;
+}
+
+// In place conversions used when promoting operands
+lval* lval_to_big(lval* v)
+{
+    if (v->type == LVAL_INTEGER)
     {
-        y->type = LVAL_DECIMAL;
-        y->decimal = (double) y->integer;
+        v->type = LVAL_BIGNUM;
+        v->big = lbig_from_long(v->integer);
     }
-    else if (x->type == LVAL_INTEGER && y->type == LVAL_DECIMAL)
+    return v;
+}
+
+// Back to an ordinary integer if the value fits
+lval* lval_big_normalize(lval* v)
+{
+    long n;
+    if (v->type == LVAL_BIGNUM && lbig_to_long(v->big, &n))
     {
-        x->type = LVAL_DECIMAL;
-        x->decimal = (double) x->integer;
+        lbig_del(v->big);
+        v->type = LVAL_INTEGER;
+        v->integer = n;
     }
+    return v;
+}
 
-    int result;
-    if (x->type != y->type)
+/* Arithmetic and ordering operators
+
+Each operator is listed once in LOPS/LORDS. The lists expand into the opcode enum, the builtins and tables of
+kernels indexed by opcode and operand types. Arithmetic operands are promoted to a common type in a single pass,
+then one kernel call folds every operand into the first one, accumulating in a plain C variable. Integer kernels
+check for overflow and give up by returning NULL, the operation is then redone with big integers.
+*/
+
+#define LOPS(X) \
+    X(ADD, "+", add) \
+    X(SUB, "-", sub) \
+    X(MUL, "*", mul) \
+    X(DIV, "/", div) \
+    X(MOD, "%", mod) \
+    X(POW, "^", pow) \
+    X(MIN, "min", min) \
+    X(MAX, "max", max)
+
+#define LORDS(X) \
+    X(LT, "<", lt, <) \
+    X(LE, "<=", le, <=) \
+    X(GT, ">", gt, >) \
+    X(GE, ">=", ge, >=)
+
+#define LOP_ENUM(id, sym, name) LOP_##id,
+typedef enum
+{
+    LOPS(LOP_ENUM)
+    LOP_COUNT
+} lop_t;
+
+#define LORD_ENUM(id, sym, name, op) LORD_##id,
+typedef enum
+{
+    LORDS(LORD_ENUM)
+    LORD_COUNT
+} lord_t;
+
+#define LOP_NAME(id, sym, name) sym,
+char* lop_names[] = { LOPS(LOP_NAME) };
+
+#define LORD_NAME(id, sym, name, op) sym,
+char* lord_names[] = { LORDS(LORD_NAME) };
+
+// Kernel table index of a number: 0 for integers, 1 for decimals, 2 for big integers
+#define LNUM(v) ((v)->type == LVAL_DECIMAL ? 1 : (v)->type == LVAL_BIGNUM ? 2 : 0)
+
+// Folds y[0..n) into x, returns x or an error (x is then deleted). Integer kernels return NULL on overflow and
+// leave x untouched.
+typedef lval* (*lop_kernel)(lval* x, lval** y, int n);
+typedef int (*lord_kernel)(lval* x, lval* y);
+
+lval* lval_to_decimal(lval* v)
+{
+    if (v->type == LVAL_INTEGER)
     {
-        result = 0;
+        v->type = LVAL_DECIMAL;
+        v->decimal = (double) v->integer;
     }
-    else
+    else if (v->type == LVAL_BIGNUM)
     {
-        switch (x->type)
-        {
-            case LVAL_DECIMAL:
-                result = x->decimal == y->decimal;
-                break;
-            case LVAL_BOOLEAN:
-            case LVAL_INTEGER:
-                result = x->integer == y->integer;
-                break;
-            case LVAL_ERR:
-                result = strcmp(x->err, y->err) == 0;
-                break;
-            case LVAL_SYM:
-                result = strcmp(x->sym, y->sym) == 0;
-                break;
-            case LVAL_STR:
-                result = strcmp(x->str, y->str) == 0;
-                break;
-            case LVAL_SEXPR:
-            case LVAL_QEXPR:
-                if (x->count != y->count)
-                {
-                    result = 0;
-                }
-                else
-                {
-                    result = 1;
-                    for (int i = 0; i < x->count; i++)
-                    {
-                        if (!lval_eq(x->cell[i], y->cell[i]))
-                        {
-                            result = 0;
-                            break;
-                        }
-                    }
-                }
-                break;
-            case LVAL_FUN:
-                if (x->builtin != NULL || y->builtin != NULL)
-                {
-                    result = x->builtin == y->builtin;
-                }
-                else
-                {
-                    result = lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-                }
-                break;
-            default:
-                result = 0;
-                break;
-        }
+        double d = lbig_to_double(v->big);
+        lbig_del(v->big);
+        v->type = LVAL_DECIMAL;
+        v->decimal = d;
     }
-    return result;
+    return v;
 }
 
+lval* lop_zero_division(lval* x)
+{
+    lval_del(x);
+    return lval_err("Division by zero");
+}
 
-#define LASSERT(args, cond, fmt, ...) \
-    if (!(cond)) { \
-        lval* err = lval_err(fmt, ##__VA_ARGS__); \
-        lval_del(args); \
-        return err; \
-                }
-
-#define LASSERT_ARG_COUNT(a, c1, n1) \
-    LASSERT(a, a->count == c1, "Function '%s' takes %i arguments but %i was given.", n1, c1, a->count)
-
-#define LASSERT_ARG_MIN(a, cmin, n1) \
-    LASSERT(a, a->count >= cmin, "Function '%s' takes at least %i arguments but %i was given.", n1, cmin, a->count)
-
-#define LASSERT_ARG_TYPE(a, pos, t1, n1) \
-    LASSERT(a, a->cell[pos]->type == t1, "Function '%s' expected %s at position %i but got %s.", n1, ltype_name(t1), pos, ltype_name(a->cell[pos]->type))
+// Four independent accumulators keep the loop from being serialised on a single one. Integer sums and products
+// are exact, so the lanes give the same result as a left fold. The overflow flags are or-ed without branching and
+// checked once per four operands. A lane may overflow where the left fold would not, the big integer path then
+// still gets the right result. Decimals are always folded left, so rounding does not depend on the operand count.
+#define LOP_LANES_CHECKED(name, overflow, unit) \
+    lval* name(lval* x, lval** y, int n) \
+    { \
+        long acc[4] = { x->integer, unit, unit, unit }; \
+        int i = 0; \
+        for (; i + 4 <= n; i += 4) \
+        { \
+            if (overflow(acc[0], y[i]->integer, &acc[0]) | overflow(acc[1], y[i + 1]->integer, &acc[1]) | \
+                overflow(acc[2], y[i + 2]->integer, &acc[2]) | overflow(acc[3], y[i + 3]->integer, &acc[3])) \
+            { \
+                return NULL; \
+            } \
+        } \
+        for (; i < n; i++) \
+        { \
+            if (overflow(acc[0], y[i]->integer, &acc[0])) \
+            { \
+                return NULL; \
+            } \
+        } \
+        if (overflow(acc[0], acc[1], &acc[0]) | overflow(acc[2], acc[3], &acc[2]) | overflow(acc[0], acc[2], &acc[0])) \
+        { \
+            return NULL; \
+        } \
+        x->integer = acc[0]; \
+        return x; \
+    }
 
-#define LASSERT_ARG_TYPE2(a, pos, t1, t2, n1) \
-    LASSERT(a, a->cell[pos]->type == t1 || a->cell[pos]->type == t2, "Function '%s' expected %s or %s at position %i but got %s.", n1, ltype_name(t1), ltype_name(t2), pos, ltype_name(a->cell[pos]->type))
+LOP_LANES_CHECKED(lop_add_i, LADD_OVERFLOW, 0)
+LOP_LANES_CHECKED(lop_mul_i, LMUL_OVERFLOW, 1)
+
+#define LOP_FOLD(name, T, field, expr) \
+    lval* name(lval* x, lval** y, int n) \
+    { \
+        T acc = x->field; \
+        for (int i = 0; i < n; i++) \
+        { \
+            T b = y[i]->field; \
+            acc = (expr); \
+        } \
+        x->field = acc; \
+        return x; \
+    }
 
-#define LASSERT_ARG_NOT_EMPTY(a, pos, t1, n1) \
-    LASSERT(a, a->cell[pos]->count != 0, "Function '%s' expected a non-empty %s at position %i.", n1, ltype_name(t1), pos)
+LOP_FOLD(lop_add_d, double, decimal, acc + b)
+LOP_FOLD(lop_sub_d, double, decimal, acc - b)
+LOP_FOLD(lop_mul_d, double, decimal, acc * b)
+LOP_FOLD(lop_pow_d, double, decimal, pow(acc, b))
+LOP_FOLD(lop_min_i, long, integer, acc < b ? acc : b)
+LOP_FOLD(lop_min_d, double, decimal, acc < b ? acc : b)
+LOP_FOLD(lop_max_i, long, integer, acc > b ? acc : b)
+LOP_FOLD(lop_max_d, double, decimal, acc > b ? acc : b)
 
-lval* builtin_var(lenv* e, lval* a, char* fun)
+lval* lop_sub_i(lval* x, lval** y, int n)
 {
-    LASSERT_ARG_MIN(a, 2, fun);
-    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, fun);
-    lval *k = lval_pop(a, 0);
-    if (k->count != a->count)
+    long first = x->integer;
+    x->integer = 0;
+    if (lop_add_i(x, y, n) == NULL || LSUB_OVERFLOW(first, x->integer, &x->integer))
     {
-        lval* err = lval_err("Function '%' got %i symbols but %i values.", k->count, a->count);
-        lval_del(k);
-        lval_del(a);
-        return err;
+        x->integer = first;
+        return NULL;
     }
-    for (int i = 0; i < k->count; i++)
-    {
-        if (k->cell[i]->type != LVAL_SYM)
+    return x;
+}
+
+lval* lop_div_i(lval* x, lval** y, int n)
+{
+    long acc = x->integer;
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->integer == 0)
+        {
+            return lop_zero_division(x);
+        }
+        if (acc == LONG_MIN && y[i]->integer == -1)
+        {
+            return NULL;
+        }
+        acc /= y[i]->integer;
+    }
+    x->integer = acc;
+    return x;
+}
+
+lval* lop_div_d(lval* x, lval** y, int n)
+{
+    double acc = x->decimal;
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->decimal == 0)
+        {
+            return lop_zero_division(x);
+        }
+        acc /= y[i]->decimal;
+    }
+    x->decimal = acc;
+    return x;
+}
+
+lval* lop_mod_i(lval* x, lval** y, int n)
+{
+    long acc = x->integer;
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->integer == 0)
+        {
+            return lop_zero_division(x);
+        }
+        acc = y[i]->integer == -1 ? 0 : acc % y[i]->integer;
+    }
+    x->integer = acc;
+    return x;
+}
+
+lval* lop_mod_d(lval* x, lval** y, int n)
+{
+    double acc = x->decimal;
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->decimal == 0)
+        {
+            return lop_zero_division(x);
+        }
+        acc = fmod(acc, y[i]->decimal);
+    }
+    x->decimal = acc;
+    return x;
+}
+
+// Exponentiation by squaring, negative exponents give 1
+lval* lop_pow_i(lval* x, lval** y, int n)
+{
+    long acc = x->integer;
+    for (int i = 0; i < n; i++)
+    {
+        long base = acc;
+        long z = 1;
+        for (long e = y[i]->integer; e > 0; )
+        {
+            if ((e & 1) && LMUL_OVERFLOW(z, base, &z))
+            {
+                return NULL;
+            }
+            e >>= 1;
+            if (e > 0 && LMUL_OVERFLOW(base, base, &base))
+            {
+                return NULL;
+            }
+        }
+        acc = z;
+    }
+    x->integer = acc;
+    return x;
+}
+
+#define LOP_FOLD_BIG(name, fn) \
+    lval* name(lval* x, lval** y, int n) \
+    { \
+        for (int i = 0; i < n; i++) \
+        { \
+            lbig* r = fn(x->big, y[i]->big); \
+            lbig_del(x->big); \
+            x->big = r; \
+        } \
+        return lval_big_normalize(x); \
+    }
+
+lbig* lbig_quot(lbig* a, lbig* b)
+{
+    lbig* r;
+    lbig* q = lbig_divmod(a, b, &r);
+    lbig_del(r);
+    return q;
+}
+
+lbig* lbig_rem(lbig* a, lbig* b)
+{
+    lbig* r;
+    lbig_del(lbig_divmod(a, b, &r));
+    return r;
+}
+
+lbig* lbig_min(lbig* a, lbig* b)
+{
+    return lbig_copy(lbig_cmp(a, b) <= 0 ? a : b);
+}
+
+lbig* lbig_max(lbig* a, lbig* b)
+{
+    return lbig_copy(lbig_cmp(a, b) >= 0 ? a : b);
+}
+
+LOP_FOLD_BIG(lop_add_b, lbig_add)
+LOP_FOLD_BIG(lop_sub_b, lbig_sub)
+LOP_FOLD_BIG(lop_mul_b, lbig_mul)
+LOP_FOLD_BIG(lop_min_b, lbig_min)
+LOP_FOLD_BIG(lop_max_b, lbig_max)
+LOP_FOLD_BIG(lop_quot_b, lbig_quot)
+LOP_FOLD_BIG(lop_rem_b, lbig_rem)
+
+lval* lop_div_b(lval* x, lval** y, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->big->count == 0)
+        {
+            return lop_zero_division(x);
+        }
+    }
+    return lop_quot_b(x, y, n);
+}
+
+lval* lop_mod_b(lval* x, lval** y, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (y[i]->big->count == 0)
+        {
+            return lop_zero_division(x);
+        }
+    }
+    return lop_rem_b(x, y, n);
+}
+
+lval* lop_pow_b(lval* x, lval** y, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        long e;
+        lbig* r;
+        if (y[i]->big->sign < 0)
+        {
+            r = lbig_from_long(1);
+        }
+        else if (lbig_to_long(y[i]->big, &e))
+        {
+            // The power has at most bits(x) * e bits, only 0, 1 and -1 stay small whatever the exponent
+            unsigned long bits = lbig_bits(x->big);
+            if (bits > 1 && (unsigned long) e > LBIG_POW_BITS / bits)
+            {
+                lval_del(x);
+                return lval_err("Exponent too large");
+            }
+            r = lbig_pow(x->big, (unsigned long) e);
+        }
+        else
+        {
+            lval_del(x);
+            return lval_err("Exponent too large");
+        }
+        lbig_del(x->big);
+        x->big = r;
+    }
+    return lval_big_normalize(x);
+}
+
+#define LOP_KERNELS(id, sym, name) { lop_##name##_i, lop_##name##_d, lop_##name##_b },
+lop_kernel lop_kernels[LOP_COUNT][3] = { LOPS(LOP_KERNELS) };
+
+double lnum_to_double(lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_INTEGER: return (double) v->integer;
+        case LVAL_BIGNUM: return lbig_to_double(v->big);
+        default: return v->decimal;
+    }
+}
+
+// Comparison involving a big integer. Against a long only the sign of the big integer matters since it lies
+// outside the range of long.
+int lnum_cmp(lval* x, lval* y)
+{
+    if (x->type == LVAL_DECIMAL || y->type == LVAL_DECIMAL)
+    {
+        double a = lnum_to_double(x);
+        double b = lnum_to_double(y);
+        return (a > b) - (a < b);
+    }
+    if (x->type == LVAL_BIGNUM && y->type == LVAL_BIGNUM)
+    {
+        return lbig_cmp(x->big, y->big);
+    }
+    return x->type == LVAL_BIGNUM ? x->big->sign : -y->big->sign;
+}
+
+#define LORD_KERNELS_DEF(id, sym, name, op) \
+    int lord_##name##_ii(lval* x, lval* y) { return x->integer op y->integer; } \
+    int lord_##name##_id(lval* x, lval* y) { return (double) x->integer op y->decimal; } \
+    int lord_##name##_di(lval* x, lval* y) { return x->decimal op (double) y->integer; } \
+    int lord_##name##_dd(lval* x, lval* y) { return x->decimal op y->decimal; } \
+    int lord_##name##_big(lval* x, lval* y) { return lnum_cmp(x, y) op 0; }
+LORDS(LORD_KERNELS_DEF)
+
+#define LORD_KERNELS(id, sym, name, op) { \
+    { lord_##name##_ii, lord_##name##_id, lord_##name##_big }, \
+    { lord_##name##_di, lord_##name##_dd, lord_##name##_big }, \
+    { lord_##name##_big, lord_##name##_big, lord_##name##_big } },
+lord_kernel lord_kernels[LORD_COUNT][3][3] = { LORDS(LORD_KERNELS) };
+
+lval* lval_read_integer(mpc_ast_t *t)
+{
+    return lval_parse_integer(t->contents);
+}
+
+lval* lval_read_decimal(mpc_ast_t *t)
+{
+    errno = 0;
+    double x = strtof(t->contents, NULL);
+    return errno == ERANGE ? lval_err("Bad number: %s", t->contents) : lval_decimal(x);
+}
+
+lval* lval_read_string(mpc_ast_t *t)
+{
+    size_t len = strlen(t->contents);
+    t->contents[len - 1] = '\0';
+    char* str = malloc(len);
+    strcpy(str, t->contents + 1);
+    char* unescaped = mpcf_unescape(str);
+    //debug_update_ptr(str, unescaped);
+    lval* x = lval_string(unescaped);
+    free(unescaped);
+    return x;
+}
+
+lenv* lenv_copy(lenv* e);
+lmemo* lmemo_retain(lmemo* m);
+lvec* lvec_retain(lvec* vec);
+larr* larr_retain(larr* arr);
+lmap* lmap_retain(lmap* map);
+lhamt_node* lhamt_node_retain(lhamt_node* n);
+lomap* lomap_retain(lomap* m);
+ldeque* ldeque_retain(ldeque* dq);
+lpq* lpq_retain(lpq* q);
+lrec* lrec_retain(lrec* r);
+lrecfn* lrecfn_retain(lrecfn* f);
+lbits* lbits_retain(lbits* b);
+lbytes* lbytes_retain(lbytes* b);
+llazy* llazy_retain(llazy* l);
+lpromise* lpromise_retain(lpromise* p);
+lfolded* lfolded_retain(lfolded* c);
+
+lval* lval_copy(lval* v)
+{
+    lval* x = malloc(sizeof(lval));
+
+    x->type = v->type;
+
+    switch (v->type)
+    {
+        case LVAL_BOOLEAN:
+        case LVAL_INTEGER:
+            x->integer = v->integer;
+            break;
+        case LVAL_DECIMAL:
+            x->decimal = v->decimal;
+            break;
+        case LVAL_BIGNUM:
+            x->big = lbig_copy(v->big);
+            break;
+        case LVAL_VECTOR:
+            x->vec = lvec_retain(v->vec);
+            break;
+        case LVAL_ARRAY:
+            x->arr = larr_retain(v->arr);
+            break;
+        case LVAL_MAP:
+            x->map = lmap_retain(v->map);
+            break;
+        case LVAL_PMAP:
+            x->hamt = lhamt_node_retain(v->hamt);
+            break;
+        case LVAL_OMAP:
+            x->omap = lomap_retain(v->omap);
+            break;
+        case LVAL_DEQUE:
+            x->dq = ldeque_retain(v->dq);
+            break;
+        case LVAL_PQ:
+            x->pq = lpq_retain(v->pq);
+            break;
+        case LVAL_RECORD:
+            x->rec = lrec_retain(v->rec);
+            break;
+        case LVAL_BITS:
+            x->bits = lbits_retain(v->bits);
+            break;
+        case LVAL_BYTES:
+            x->bytes = lbytes_retain(v->bytes);
+            x->offset = v->offset;
+            x->length = v->length;
+            break;
+        case LVAL_LAZY:
+            x->lazy = llazy_retain(v->lazy);
+            break;
+        case LVAL_PROMISE:
+            x->promise = lpromise_retain(v->promise);
+            break;
+        case LVAL_OK:
+            break;
+        case LVAL_FUN:
+            x->flags = v->flags;
+            x->memo = v->memo != NULL ? lmemo_retain(v->memo) : NULL;
+            x->recfn = v->recfn != NULL ? lrecfn_retain(v->recfn) : NULL;
+            if (v->builtin == NULL)
+            {
+                x->builtin = NULL;
+                x->env = lenv_copy(v->env);
+                x->formals = lval_copy(v->formals);
+                x->body = lval_copy(v->body);
+                x->folded = v->folded != NULL ? lfolded_retain(v->folded) : NULL;
+            }
+            else
+            {
+                x->builtin = v->builtin;
+                x->env = NULL;
+                x->formals = NULL;
+                x->body = NULL;
+                x->folded = NULL;
+            }
+            break;
+        case LVAL_SYM:
+            x->sym = malloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            break;
+        case LVAL_ERR:
+            x->err = malloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+            break;
+        case LVAL_STR:
+            x->str = malloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_RECUR:
+            x->count = v->count;
+            x->cell = malloc(sizeof(lval) * v->count);
+            for (int i = 0; i < v->count; i++)
+            {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            break;
+        default:
+            free(x);
+            x = lval_err("Copy not implemented for %s", ltype_name(v->type));
+            break;
+    }
+    return x;
+}
+
+lval* lval_add(lval* v, lval* new_cell)
+{
+    v->count++;
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell[v->count - 1] = new_cell;
+    return v;
+}
+
+lenv* lenv_new(void)
+{
+    lenv* e = malloc(sizeof(lenv));
+    e->par = NULL;
+    e->count = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    return e;
+}
+
+void lenv_del(lenv* e)
+{
+    for (int i = 0; i < e->count; i++)
+    {
+        free(e->syms[i]);
+        lval_del(e->vals[i]);
+    }
+    free(e->syms);
+    free(e->vals);
+    free(e);
+}
+
+// Value bound to the symbol without copying it, NULL if unbound
+lval* lenv_find(lenv* e, char* sym)
+{
+    while (e != NULL)
+    {
+        for (int i = 0; i < e->count; i++)
+        {
+            if (strcmp(e->syms[i], sym) == 0)
+            {
+                return e->vals[i];
+            }
+        }
+        e = e->par;
+    }
+    return NULL;
+}
+
+lval* lenv_lookup(lenv* e, char* sym)
+{
+    lval* v = lenv_find(e, sym);
+    return v != NULL ? lval_copy(v) : lval_err("Unbound symbol '%s'", sym);
+}
+
+lval* lenv_get(lenv* e, lval* k)
+{
+    return lenv_lookup(e, k->sym);
+}
+
+char* lenv_get_name(lenv* e, lval* v)
+{
+    for (int i = 0; i < e->count; i++)
+    {
+        if (v->type == LVAL_FUN && e->vals[i]->type == LVAL_FUN && v->builtin == e->vals[i]->builtin)
+        {
+            return e->syms[i];
+        }
+    }
+    if (e->par != NULL)
+    {
+        return lenv_get_name(e->par, v);
+    }
+    return "(Unknown)";
+}
+
+void lenv_bind(lenv* e, char* sym, lval* v)
+{
+    for (int i = 0; i < e->count; i++)
+    {
+        if (strcmp(e->syms[i], sym) == 0)
+        {
+            lval_del(e->vals[i]);
+            e->vals[i] = lval_copy(v);
+            return;
+        }
+    }
+    e->count++;
+    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    e->vals = realloc(e->vals, sizeof(lval) * e->count);
+    int last = e->count - 1;
+    e->vals[last] = lval_copy(v);
+    e->syms[last] = malloc(strlen(sym) + 1);
+    strcpy(e->syms[last], sym);
+}
+
+void lenv_put(lenv* e, lval* k, lval* v)
+{
+    lenv_bind(e, k->sym, v);
+}
+
+// Index of sym among the bindings of e itself, binding it to () first if needed. Loops keep the index to update
+// their variables in place, it stays valid as bindings are only ever added.
+int lenv_slot(lenv* e, char* sym)
+{
+    for (int i = 0; i < e->count; i++)
+    {
+        if (strcmp(e->syms[i], sym) == 0)
+        {
+            return i;
+        }
+    }
+    lval* v = lval_sexpr();
+    lenv_bind(e, sym, v);
+    lval_del(v);
+    return e->count - 1;
+}
+
+lenv* lenv_copy(lenv* e)
+{
+    lenv* n = lenv_new();
+    n->par = e->par;
+    n->count = e->count;
+    n->syms = malloc(sizeof(char*) * n->count);
+    n->vals = malloc(sizeof(lval*) * n->count);
+    for (int i = 0; i < e->count; i++)
+    {
+        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+        strcpy(n->syms[i], e->syms[i]);
+    }
+    return n;
+}
+
+lval* lval_read(mpc_ast_t* t)
+{
+    if (strstr(t->tag, "integer"))
+    {
+        return lval_read_integer(t);
+    }
+    else if (strstr(t->tag, "decimal"))
+    {
+        return lval_read_decimal(t);
+    }
+    else if (strstr(t->tag, "symbol"))
+    {
+        return lval_symbol(t->contents);
+    }
+    else if (strstr(t->tag, "string"))
+    {
+        return lval_read_string(t);
+    }
+
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0)
+    {
+        x = lval_sexpr();
+    }
+    else if (strstr(t->tag, "sexpr"))
+    {
+        x = lval_sexpr();
+    }
+    else if (strstr(t->tag, "qexpr"))
+    {
+        x = lval_qexpr();
+    }
+
+    for (int i = 0; i < t->children_num - 1; i++)
+    {
+        if (strcmp(t->children[i]->contents, "(") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, ")") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, "{") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, "}") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->tag, "regex") == 0)
+        {
+            continue;
+        }
+        if (strstr(t->children[i]->tag, "comment"))
+        {
+            continue;
+        }
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+
+    return x;
+
+}
+
+void lval_print(lenv* e, lval* v);
+
+void lval_expr_print(lenv* e, lval* v, char open, char close)
+{
+    putchar(open);
+    for (int i = 0; i < v->count; i++)
+    {
+        lval_print(e, v->cell[i]);
+        if (i != (v->count - 1))
+        {
+            putchar(' ');
+        }
+    }
+    putchar(close);
+}
+
+void lval_str_print(lval* v)
+{
+    char* str = malloc(strlen(v->str) + 1);
+    strcpy(str, v->str);
+    char* escaped = mpcf_escape(str);
+    //debug_update_ptr(str, escaped);
+    printf("\"%s\"", escaped);
+    free(escaped);
+}
+
+void lmemo_print(lenv* e, lmemo* m);
+void lrecfn_print(lrecfn* f);
+int lctz64(unsigned long long x);
+void lhamt_print(lenv* e, lhamt_node* n, int* first);
+void lomap_print(lenv* e, lomap_node* n, int* first);
+
+void lval_print(lenv* e, lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_OK:
+            printf("ok");
+            break;
+        case LVAL_BOOLEAN:
+            printf("%s", v->integer ? "true" : "false");
+            break;
+        case LVAL_INTEGER:
+            printf("%li", v->integer);
+            break;
+        case LVAL_DECIMAL:
+            printf("%lf", v->decimal);
+            break;
+        case LVAL_BIGNUM:
+        {
+            char* digits = lbig_to_string(v->big);
+            printf("%s", digits);
+            free(digits);
+            break;
+        }
+        case LVAL_SYM:
+            printf("%s", v->sym);
+            break;
+        case LVAL_STR:
+            lval_str_print(v);
+            break;
+        case LVAL_SEXPR:
+            lval_expr_print(e, v, '(', ')');
+            break;
+        case LVAL_QEXPR:
+            lval_expr_print(e, v, '{', '}');
+            break;
+        case LVAL_VECTOR:
+            putchar('[');
+            for (int i = 0; i < v->vec->count; i++)
+            {
+                if (i > 0)
+                {
+                    putchar(' ');
+                }
+                lval_print(e, v->vec->items[i]);
+            }
+            putchar(']');
+            break;
+        case LVAL_ARRAY:
+            printf("%s[", v->arr->kind == LARR_F64 ? "f64" : "i64");
+            for (int i = 0; i < v->arr->count; i++)
+            {
+                if (v->arr->kind == LARR_F64)
+                {
+                    printf(i > 0 ? " %lf" : "%lf", ((double*) v->arr->data)[i]);
+                }
+                else
+                {
+                    printf(i > 0 ? " %lli" : "%lli", ((long long*) v->arr->data)[i]);
+                }
+            }
+            putchar(']');
+            break;
+        case LVAL_MAP:
+        {
+            printf("#{");
+            int first = 1;
+            for (int i = 0; i < v->map->capacity; i++)
+            {
+                lmap_entry* entry = &v->map->entries[i];
+                if (entry->key != NULL)
+                {
+                    printf(first ? "" : ", ");
+                    lval_print(e, entry->key);
+                    putchar(' ');
+                    lval_print(e, entry->val);
+                    first = 0;
+                }
+            }
+            putchar('}');
+            break;
+        }
+        case LVAL_PMAP:
+        {
+            int first = 1;
+            printf("#p{");
+            lhamt_print(e, v->hamt, &first);
+            putchar('}');
+            break;
+        }
+        case LVAL_OMAP:
+        {
+            int first = 1;
+            printf("#o{");
+            lomap_print(e, v->omap->root, &first);
+            putchar('}');
+            break;
+        }
+        case LVAL_DEQUE:
+            printf("#q[");
+            for (int i = 0; i < v->dq->count; i++)
+            {
+                if (i > 0)
+                {
+                    putchar(' ');
+                }
+                lval_print(e, LDEQUE_AT(v->dq, i));
+            }
+            putchar(']');
+            break;
+        case LVAL_PQ:
+            // Heap order, only the first item is in its final place
+            printf("#pq[");
+            for (int i = 0; i < v->pq->count; i++)
+            {
+                if (i > 0)
+                {
+                    putchar(' ');
+                }
+                lval_print(e, v->pq->entries[i].item);
+            }
+            putchar(']');
+            break;
+        case LVAL_RECORD:
+            printf("#%s{", v->rec->shape->name);
+            for (int i = 0; i < v->rec->shape->count; i++)
+            {
+                printf(i > 0 ? ", %s " : "%s ", v->rec->shape->fields[i]);
+                lval_print(e, v->rec->slots[i]);
+            }
+            putchar('}');
+            break;
+        case LVAL_BITS:
+        {
+            // The indices of the set bits
+            int first = 1;
+            printf("#bits{");
+            for (int w = 0; w < v->bits->words; w++)
+            {
+                for (unsigned long long word = v->bits->data[w]; word != 0; word &= word - 1)
+                {
+                    printf(first ? "%i" : " %i", w * 64 + lctz64(word));
+                    first = 0;
+                }
+            }
+            putchar('}');
+            break;
+        }
+        case LVAL_BYTES:
+            printf("#bytes[");
+            for (int i = 0; i < v->length; i++)
+            {
+                printf(i > 0 ? " %02x" : "%02x", LBYTES_AT(v)[i]);
+            }
+            putchar(']');
+            break;
+        case LVAL_LAZY:
+            // Only what has been realised, printing does not pull
+            printf("#lazy[");
+            for (int i = 0; i < v->lazy->items->count; i++)
+            {
+                if (i > 0)
+                {
+                    putchar(' ');
+                }
+                lval_print(e, v->lazy->items->items[i]);
+            }
+            printf(v->lazy->finished ? "]" : v->lazy->items->count > 0 ? " ...]" : "...]");
+            break;
+        case LVAL_PROMISE:
+            printf("#delay[");
+            if (v->promise->value != NULL)
+            {
+                lval_print(e, v->promise->value);
+            }
+            else
+            {
+                printf("...");
+            }
+            putchar(']');
+            break;
+        case LVAL_RECUR:
+            printf("(recur");
+            for (int i = 0; i < v->count; i++)
+            {
+                putchar(' ');
+                lval_print(e, v->cell[i]);
+            }
+            putchar(')');
+            break;
+        case LVAL_FUN:
+            if (v->builtin == NULL)
+            {
+                printf(v->flags & LBUILTIN_MACRO ? "(macro " : "(\\ ");
+                lval_print(e, v->formals);
+                putchar(' ');
+                lval_print(e, v->body);
+                putchar(')');
+            }
+            else if (v->memo != NULL)
+            {
+                lmemo_print(e, v->memo);
+            }
+            else if (v->recfn != NULL)
+            {
+                lrecfn_print(v->recfn);
+            }
+            else
+            {
+                char* s = lenv_get_name(e, v);
+                printf("<builtin: %s>", s);
+            }
+            break;
+        case LVAL_ERR:
+            fore_color(12);
+            printf("Error: %s", v->err);
+            break;
+        default:
+            fore_color(12);
+            printf("Internal error!!!");
+            exit(2);
+    }
+}
+
+void lval_println(lenv* e, lval* v)
+{
+    lval_print(e, v);
+    putchar('\n');
+}
+
+void lenv_list(lenv* e)
+{
+    for (int i = 0; i < e->count; i++)
+    {
+        fore_color(13);
+        printf("%s = ", e->syms[i]);
+        lval_println(e, e->vals[i]);
+    }
+}
+
+lval* lval_pop(lval* v, int i)
+{
+    if (v->count == 0)
+    {
+        return lval_err("Popping a value from empty expression");
+    }
+    if (i < 0 || i >= v->count)
+    {
+        return lval_err("Trying to access out of bounds at %i (count %i)", i, v->count);
+    }
+    lval* x = v->cell[i];
+    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+    v->count--;
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    return x;
+}
+
+lval* lval_take(lval* v, int i)
+{
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+lval *lval_join(lval *x, lval *y)
+{
+    while (y->count > 0)
+    {
+        x = lval_add(x, lval_pop(y, 0));
+    }
+    lval_del(y);
+    return x;
+}
+
+int lmap_find(lmap* map, lval* key, unsigned long hash);
+int lhamt_subset(lhamt_node* x, lhamt_node* y);
+unsigned long long lhamt_hash(lhamt_node* n);
+int lomap_subset(lomap_node* n, lomap* y);
+unsigned long long lomap_hash(lomap_node* n);
+
+int lval_eq(lval* x, lval* y)
+{
+    // Numbers of different types are compared by value, a big integer never equals a long
+    if (x->type != y->type && lval_is_number(x) && lval_is_number(y))
+    {
+        if (x->type == LVAL_DECIMAL || y->type == LVAL_DECIMAL)
+        {
+            return lnum_to_double(x) == lnum_to_double(y);
+        }
+        return 0;
+    }
+
+    int result;
+    if (x->type != y->type)
+    {
+        result = 0;
+    }
+    else
+    {
+        switch (x->type)
+        {
+            case LVAL_DECIMAL:
+                result = x->decimal == y->decimal;
+                break;
+            case LVAL_BIGNUM:
+                result = lbig_cmp(x->big, y->big) == 0;
+                break;
+            case LVAL_BOOLEAN:
+            case LVAL_INTEGER:
+                result = x->integer == y->integer;
+                break;
+            case LVAL_ERR:
+                result = strcmp(x->err, y->err) == 0;
+                break;
+            case LVAL_SYM:
+                result = strcmp(x->sym, y->sym) == 0;
+                break;
+            case LVAL_STR:
+                result = strcmp(x->str, y->str) == 0;
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                if (x->count != y->count)
+                {
+                    result = 0;
+                }
+                else
+                {
+                    result = 1;
+                    for (int i = 0; i < x->count; i++)
+                    {
+                        if (!lval_eq(x->cell[i], y->cell[i]))
+                        {
+                            result = 0;
+                            break;
+                        }
+                    }
+                }
+                break;
+            case LVAL_VECTOR:
+                result = x->vec->count == y->vec->count;
+                for (int i = 0; i < x->vec->count && result && x->vec != y->vec; i++)
+                {
+                    result = lval_eq(x->vec->items[i], y->vec->items[i]);
+                }
+                break;
+            case LVAL_ARRAY:
+                result = x->arr->kind == y->arr->kind && x->arr->count == y->arr->count;
+                for (int i = 0; i < x->arr->count && result && x->arr != y->arr; i++)
+                {
+                    result = x->arr->kind == LARR_F64 ? ((double*) x->arr->data)[i] == ((double*) y->arr->data)[i]
+                                                      : ((long long*) x->arr->data)[i] == ((long long*) y->arr->data)[i];
+                }
+                break;
+            case LVAL_MAP:
+                result = x->map->count == y->map->count;
+                for (int i = 0; i < x->map->capacity && result && x->map != y->map; i++)
+                {
+                    lmap_entry* entry = &x->map->entries[i];
+                    if (entry->key != NULL)
+                    {
+                        int j = lmap_find(y->map, entry->key, entry->hash);
+                        result = j >= 0 && lval_eq(entry->val, y->map->entries[j].val);
+                    }
+                }
+                break;
+            case LVAL_PMAP:
+                result = x->hamt == y->hamt || (x->hamt->size == y->hamt->size && lhamt_subset(x->hamt, y->hamt));
+                break;
+            case LVAL_OMAP:
+                result = x->omap == y->omap || (x->omap->count == y->omap->count && lomap_subset(x->omap->root, y->omap));
+                break;
+            case LVAL_DEQUE:
+                result = x->dq->count == y->dq->count;
+                for (int i = 0; i < x->dq->count && result && x->dq != y->dq; i++)
+                {
+                    result = lval_eq(LDEQUE_AT(x->dq, i), LDEQUE_AT(y->dq, i));
+                }
+                break;
+            case LVAL_PQ:
+                // The layout of a heap depends on its history, only the same queue is equal
+                result = x->pq == y->pq;
+                break;
+            case LVAL_LAZY:
+                result = x->lazy == y->lazy;
+                break;
+            case LVAL_PROMISE:
+                result = x->promise == y->promise;
+                break;
+            case LVAL_RECORD:
+                result = x->rec->shape == y->rec->shape;
+                for (int i = 0; i < x->rec->shape->count && result && x->rec != y->rec; i++)
+                {
+                    result = lval_eq(x->rec->slots[i], y->rec->slots[i]);
+                }
+                break;
+            case LVAL_BITS:
+                result = x->bits->count == y->bits->count
+                    && memcmp(x->bits->data, y->bits->data, sizeof(unsigned long long) * x->bits->words) == 0;
+                break;
+            case LVAL_BYTES:
+                result = x->length == y->length && memcmp(LBYTES_AT(x), LBYTES_AT(y), x->length) == 0;
+                break;
+            case LVAL_FUN:
+                if (x->builtin != NULL || y->builtin != NULL)
+                {
+                    result = x->builtin == y->builtin && x->memo == y->memo && x->recfn == y->recfn;
+                }
+                else
+                {
+                    result = lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body) && x->flags == y->flags;
+                }
+                break;
+            default:
+                result = 0;
+                break;
+        }
+    }
+    return result;
+}
+
+unsigned long lhash_mix(unsigned long h, unsigned long long x)
+{
+    x ^= (unsigned long long) h * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned long) (x ^ (x >> 31));
+}
+
+unsigned long lhash_str(unsigned long h, char* s)
+{
+    unsigned long long x = 14695981039346656037ULL;
+    for (; *s != '\0'; s++)
+    {
+        x = (x ^ (unsigned char) *s) * 1099511628211ULL;
+    }
+    return lhash_mix(h, x);
+}
+
+// Structural hash, values equal under lval_eq hash alike. Numbers are hashed by their value as a double.
+unsigned long lval_hash(lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_INTEGER:
+        case LVAL_DECIMAL:
+        case LVAL_BIGNUM:
+        {
+            double d = lnum_to_double(v);
+            unsigned long long bits = 0;
+            if (d != 0.0)  // 0.0 == -0.0
+            {
+                memcpy(&bits, &d, sizeof(d));
+            }
+            return lhash_mix(LVAL_DECIMAL, bits);
+        }
+        case LVAL_BOOLEAN:
+            return lhash_mix(v->type, (unsigned long long) v->integer);
+        case LVAL_ERR:
+            return lhash_str(v->type, v->err);
+        case LVAL_SYM:
+            return lhash_str(v->type, v->sym);
+        case LVAL_STR:
+            return lhash_str(v->type, v->str);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) v->count);
+            for (int i = 0; i < v->count; i++)
+            {
+                h = lhash_mix(h, lval_hash(v->cell[i]));
+            }
+            return h;
+        }
+        case LVAL_VECTOR:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) v->vec->count);
+            for (int i = 0; i < v->vec->count; i++)
+            {
+                h = lhash_mix(h, lval_hash(v->vec->items[i]));
+            }
+            return h;
+        }
+        case LVAL_ARRAY:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) v->arr->kind);
+            for (int i = 0; i < v->arr->count; i++)
+            {
+                unsigned long long bits = 0;
+                if (v->arr->kind == LARR_I64)
+                {
+                    bits = (unsigned long long) ((long long*) v->arr->data)[i];
+                }
+                else if (((double*) v->arr->data)[i] != 0.0)  // 0.0 == -0.0
+                {
+                    memcpy(&bits, (double*) v->arr->data + i, sizeof(double));
+                }
+                h = lhash_mix(h, bits);
+            }
+            return h;
+        }
+        case LVAL_MAP:
+        {
+            // Independent of the order of the entries
+            unsigned long long sum = 0;
+            for (int i = 0; i < v->map->capacity; i++)
+            {
+                lmap_entry* entry = &v->map->entries[i];
+                if (entry->key != NULL)
+                {
+                    sum += lhash_mix(entry->hash, lval_hash(entry->val));
+                }
+            }
+            return lhash_mix(lhash_mix(v->type, (unsigned long long) v->map->count), sum);
+        }
+        case LVAL_PMAP:
+            return lhash_mix(lhash_mix(v->type, (unsigned long long) v->hamt->size), lhamt_hash(v->hamt));
+        case LVAL_OMAP:
+            // Entries are hashed in key order, which equal maps share
+            return lhash_mix(lhash_mix(v->type, (unsigned long long) v->omap->count), lomap_hash(v->omap->root));
+        case LVAL_DEQUE:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) v->dq->count);
+            for (int i = 0; i < v->dq->count; i++)
+            {
+                h = lhash_mix(h, lval_hash(LDEQUE_AT(v->dq, i)));
+            }
+            return h;
+        }
+        case LVAL_PQ:
+            return lhash_mix(v->type, (unsigned long long) (size_t) v->pq);
+        case LVAL_LAZY:
+            return lhash_mix(v->type, (unsigned long long) (size_t) v->lazy);
+        case LVAL_PROMISE:
+            return lhash_mix(v->type, (unsigned long long) (size_t) v->promise);
+        case LVAL_RECORD:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) (size_t) v->rec->shape);
+            for (int i = 0; i < v->rec->shape->count; i++)
+            {
+                h = lhash_mix(h, lval_hash(v->rec->slots[i]));
+            }
+            return h;
+        }
+        case LVAL_BITS:
+        {
+            unsigned long h = lhash_mix(v->type, (unsigned long long) v->bits->count);
+            for (int i = 0; i < v->bits->words; i++)
+            {
+                h = lhash_mix(h, v->bits->data[i]);
+            }
+            return h;
+        }
+        case LVAL_BYTES:
+        {
+            unsigned long long x = 14695981039346656037ULL;
+            for (int i = 0; i < v->length; i++)
+            {
+                x = (x ^ LBYTES_AT(v)[i]) * 1099511628211ULL;
+            }
+            return lhash_mix(v->type, x);
+        }
+        case LVAL_FUN:
+            if (v->builtin != NULL)
+            {
+                return lhash_mix(v->type, (unsigned long long) (size_t) v->builtin);
+            }
+            return lhash_mix(lval_hash(v->formals), lval_hash(v->body));
+        default:
+            return lhash_mix(v->type, 0);
+    }
+}
+
+int lval_find_sym(lval* q, char* sym)
+{
+    for (int i = 0; i < q->count; i++)
+    {
+        if (q->cell[i]->type == LVAL_SYM && strcmp(q->cell[i]->sym, sym) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 1 or 0 for values usable as conditions, -1 for anything else
+int lval_truth(lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_BOOLEAN:
+        case LVAL_INTEGER:
+            return v->integer != 0;
+        case LVAL_DECIMAL:
+            return v->decimal != 0.0;
+        case LVAL_BIGNUM:
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+// Error for a condition that is not a truth value, errors are passed through
+lval* lval_truth_error(char* fun, lval* x, int pos)
+{
+    if (x->type == LVAL_ERR)
+    {
+        return x;
+    }
+    lval* err = lval_err("Function '%s' got invalid type %s at position %d.", fun, ltype_name(x->type), pos);
+    lval_del(x);
+    return err;
+}
+
+lval* lval_eval(lenv* e, lval* v);
+
+// The values of 'recur' only go back to the 'loop' around it, anywhere else they are an error
+lval* lval_no_recur(lval* x)
+{
+    if (x->type != LVAL_RECUR)
+    {
+        return x;
+    }
+    lval_del(x);
+    return lval_err("Function 'recur' was used outside 'loop'.");
+}
+
+#define LASSERT(args, cond, fmt, ...) \
+    if (!(cond)) { \
+        lval* err = lval_err(fmt, ##__VA_ARGS__); \
+        lval_del(args); \
+        return err; \
+                }
+
+#define LASSERT_ARG_COUNT(a, c1, n1) \
+    LASSERT(a, a->count == c1, "Function '%s' takes %i arguments but %i was given.", n1, c1, a->count)
+
+#define LASSERT_ARG_MIN(a, cmin, n1) \
+    LASSERT(a, a->count >= cmin, "Function '%s' takes at least %i arguments but %i was given.", n1, cmin, a->count)
+
+#define LASSERT_ARG_TYPE(a, pos, t1, n1) \
+    LASSERT(a, a->cell[pos]->type == t1, "Function '%s' expected %s at position %i but got %s.", n1, ltype_name(t1), pos, ltype_name(a->cell[pos]->type))
+
+#define LASSERT_ARG_TYPE2(a, pos, t1, t2, n1) \
+    LASSERT(a, a->cell[pos]->type == t1 || a->cell[pos]->type == t2, "Function '%s' expected %s or %s at position %i but got %s.", n1, ltype_name(t1), ltype_name(t2), pos, ltype_name(a->cell[pos]->type))
+
+#define LASSERT_ARG_NUMBER(a, pos, n1) \
+    LASSERT(a, lval_is_number(a->cell[pos]), "Function '%s' expected a number at position %i but got %s.", n1, pos, ltype_name(a->cell[pos]->type))
+
+#define LASSERT_ARG_NOT_EMPTY(a, pos, t1, n1) \
+    LASSERT(a, a->cell[pos]->count != 0, "Function '%s' expected a non-empty %s at position %i.", n1, ltype_name(t1), pos)
+
+void lval_fold(lenv* e, lval* f);
+lval* lval_run_body(lenv* e, lval* f);
+void lfold_rebind(lenv* e, char* sym, int local);
+lenv* lenv_frame(lenv* par);
+
+lval* builtin_var(lenv* e, lval* a, char* fun)
+{
+    LASSERT_ARG_MIN(a, 2, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, fun);
+    lval *k = lval_pop(a, 0);
+    if (k->count != a->count)
+    {
+        lval* err = lval_err("Function '%' got %i symbols but %i values.", k->count, a->count);
+        lval_del(k);
+        lval_del(a);
+        return err;
+    }
+    for (int i = 0; i < k->count; i++)
+    {
+        if (k->cell[i]->type != LVAL_SYM)
+        {
+            lval* err = lval_err("Function '%s' expected %s at position %i got %s.", fun, ltype_name(LVAL_SYM), i, ltype_name(k->cell[i]->type));
+            lval_del(k);
+            lval_del(a);
+            return err;
+        }
+    }
+
+    // Global definition
+    if (strcmp(fun, "def") == 0)
+    {
+        while (e->par != NULL)
+        {
+            e = e->par;
+        }
+    }
+    for (int i = 0; i < k->count; i++)
+    {
+        lfold_rebind(e, k->cell[i]->sym, e->par != NULL);
+        if (a->cell[i]->type == LVAL_FUN && a->cell[i]->builtin == NULL)
+        {
+            lval_fold(e, a->cell[i]);
+        }
+        lenv_put(e, k->cell[i], a->cell[i]);
+    }
+    lval_del(k);
+    lval_del(a);
+    return lval_sexpr(); // Empty ()
+}
+
+LBUILTIN_DECL(builtin_def)
+{
+    return builtin_var(e, a, "def");
+}
+
+LBUILTIN_DECL(builtin_put)
+{
+    return builtin_var(e, a, "=");
+}
+
+LBUILTIN_DECL(builtin_lambda)
+{
+    LASSERT_ARG_COUNT(a, 2, "\\");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "\\");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "\\");
+
+    for (int i = 0; i < a->cell[0]->count; i++)
+    {
+        LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+                "Cannot define non-symbol at position %d. Expected %s got %s.",
+                i, ltype_name(LVAL_SYM), ltype_name(a->cell[0]->cell[i]->type));
+    }
+
+    for (int i = 0; i < a->cell[0]->count; i++)
+    {
+        lfold_rebind(e, a->cell[0]->cell[i]->sym, 1);
+    }
+
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval* v = lval_lambda(formals, body);
+    lval_fold(e, v);
+    lval_del(a);
+    return v;
+}
+
+LBUILTIN_DECL(builtin_head)
+{
+    LASSERT_ARG_COUNT(a, 1, "head");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_STR, "head");
+
+    if (a->cell[0]->type == LVAL_QEXPR)
+    {
+        LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "head");
+
+        lval* v = lval_take(a, 0);
+        while (v->count > 1)
+        {
+            lval_del(lval_pop(v, 1));
+        }
+        return v;
+    }
+    else
+    {
+        LASSERT(a, a->cell[0]->str[0] != '\0', "Function 'head' was given an empty string.");
+
+        a->cell[0]->str[1] = '\0';
+        lval* v = lval_string(a->cell[0]->str);
+        return v;
+    }    
+}
+
+LBUILTIN_DECL(builtin_tail)
+{
+    LASSERT_ARG_COUNT(a, 1, "tail");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_STR, "tail");
+
+    if (a->cell[0]->type == LVAL_QEXPR)
+    {
+        LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "tail");
+
+        lval *v = lval_take(a, 0);
+        lval_del(lval_pop(v, 0));
+        return v;
+    }
+    else
+    {
+        LASSERT(a, a->cell[0]->str[0] != '\0', "Function 'tail' was given an empty string.");
+
+        lval* v = lval_string(a->cell[0]->str + 1);
+        lval_del(a);
+        return v;
+    }
+}
+
+LBUILTIN_DECL(builtin_list)
+{
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+LBUILTIN_DECL(builtin_get_env)
+{
+    lval* q = lval_qexpr();
+    for (int i = 0; i < e->count; i++)
+    {
+        q = lval_add(q, lval_symbol(e->syms[i]));
+    }
+    return q;
+}
+
+LBUILTIN_DECL(builtin_eval)
+{
+    LASSERT_ARG_COUNT(a, 1, "eval");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "eval");
+    lval *x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+LBUILTIN_DECL(builtin_join)
+{
+    LASSERT_ARG_MIN(a, 1, "join");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_STR, LVAL_QEXPR, "join");
+    lval_type_t base_type = a->cell[0]->type;
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, base_type, "join");
+    }
+
+    if (base_type == LVAL_QEXPR)
+    {
+        lval* x = lval_pop(a, 0);
+        while (a->count > 0)
+        {
+            x = lval_join(x, lval_pop(a, 0));
+        }
+        lval_del(a);
+        return x;
+    }
+    else
+    {
+        int total_size = 0;
+        for (int i = 0; i < a->count; i++)
+        {
+            total_size += strlen(a->cell[i]->str);
+        }
+        char* str = malloc(total_size + 1);
+        str[0] = '\0';
+        for (int i = 0; i < a->count; i++)
+        {
+            strcat(str, a->cell[i]->str);
+        }
+        lval_del(a);
+        lval* x = lval_string(str);
+        free(str);
+        return x;
+    }
+}
+
+LBUILTIN_DECL(builtin_cons)
+{
+    LASSERT_ARG_COUNT(a, 2, "cons");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "cons");
+
+    lval* x = lval_pop(a, 0);
+    lval* q = lval_qexpr();
+    q = lval_add(q, x);
+    lval* p = lval_take(a, 0);
+    return lval_join(q, p);
+}
+
+LBUILTIN_DECL(builtin_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "len");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "len");
+
+    lval* x = lval_take(a, 0);
+    lval* l = lval_integer(x->count);
+    lval_del(x);
+    return l;
+}
+
+LBUILTIN_DECL(builtin_init)
+{
+    LASSERT_ARG_COUNT(a, 1, "init");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "init");
+    LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "init");
+
+    lval* x = lval_take(a, 0);
+    lval* y = lval_pop(x, x->count - 1);
+    lval_del(y);
+    return x;
+}
+
+// Quoted branches and loop bodies are evaluated as S-Expressions, like function bodies
+lval* lval_eval_branch(lenv* e, lval* x)
+{
+    if (x->type == LVAL_QEXPR)
+    {
+        x->type = LVAL_SEXPR;
+    }
+    return lval_eval(e, x);
+}
+
+// Value of a branch that is not quoted, a Q-Expression it gives is run as code like a quoted branch
+lval* lval_branch_value(lenv* e, lval* x)
+{
+    return x->type == LVAL_QEXPR ? lval_eval_branch(e, x) : x;
+}
+
+// Only the branch taken is evaluated
+LBUILTIN_DECL(builtin_if)
+{
+    LASSERT_ARG_COUNT(a, 3, "if");
+
+    lval* cond = lval_eval(e, lval_pop(a, 0));
+    int truth = lval_truth(cond);
+    if (truth < 0)
+    {
+        lval_del(a);
+        return lval_truth_error("if", cond, 0);
+    }
+    lval_del(cond);
+
+    lval* x = lval_take(a, truth ? 0 : 1);
+    return x->type == LVAL_QEXPR ? lval_eval_branch(e, x) : lval_branch_value(e, lval_eval(e, x));
+}
+
+/* Loops
+
+'while' and 'for' run their body in the calling environment, so the body can update variables with '='. 'for'
+binds its variable there too. 'loop' binds its variables in a single new frame and 'recur' returns the values
+for the next iteration, which replace the old ones in place. Nothing allocates a frame per iteration, so loops
+run in constant memory however many times they go round.
+*/
+
+// Evaluates a copy of each body expression in [from, to), returns the first error or NULL
+lval* lval_eval_each(lenv* e, lval* a, int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        lval* x = lval_no_recur(lval_eval_branch(e, lval_copy(a->cell[i])));
+        if (x->type == LVAL_ERR)
+        {
+            return x;
+        }
+        lval_del(x);
+    }
+    return NULL;
+}
+
+// (while cond body...)
+LBUILTIN_DECL(builtin_while)
+{
+    LASSERT_ARG_MIN(a, 1, "while");
+    while (1)
+    {
+        lval* cond = lval_eval_branch(e, lval_copy(a->cell[0]));
+        int truth = lval_truth(cond);
+        if (truth < 0)
+        {
+            lval_del(a);
+            return lval_truth_error("while", cond, 0);
+        }
+        lval_del(cond);
+        if (!truth)
+        {
+            break;
+        }
+        lval* err = lval_eval_each(e, a, 1, a->count);
+        if (err != NULL)
+        {
+            lval_del(a);
+            return err;
+        }
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// (for i start end body...) with i going from start up to end, end excluded
+LBUILTIN_DECL(builtin_for)
+{
+    LASSERT_ARG_MIN(a, 3, "for");
+    if (a->cell[0]->type == LVAL_QEXPR && a->cell[0]->count == 1)
+    {
+        a->cell[0] = lval_take(a->cell[0], 0);
+    }
+    LASSERT_ARG_TYPE(a, 0, LVAL_SYM, "for");
+    for (int i = 1; i < 3; i++)
+    {
+        a->cell[i] = lval_eval(e, a->cell[i]);
+        if (a->cell[i]->type == LVAL_ERR)
+        {
+            return lval_take(a, i);
+        }
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "for");
+    }
+
+    // The variable lives in a frame of its own, like the bindings of 'loop'
+    char* sym = a->cell[0]->sym;
+    lenv* f = lenv_frame(e);
+    lfold_rebind(e, sym, 1);
+    int slot = lenv_slot(f, sym);
+    lval* err = NULL;
+    for (long i = a->cell[1]->integer; i < a->cell[2]->integer && err == NULL; i++)
+    {
+        if (f->vals[slot]->type == LVAL_INTEGER)
+        {
+            f->vals[slot]->integer = i;
+        }
+        else
+        {
+            lval_del(f->vals[slot]);
+            f->vals[slot] = lval_integer(i);
+        }
+        err = lval_eval_each(f, a, 3, a->count);
+    }
+    lenv_del(f);
+    lval_del(a);
+    return err != NULL ? err : lval_sexpr();
+}
+
+// (loop {name value...} body...), the value of the last body expression unless it is a 'recur'
+LBUILTIN_DECL(builtin_loop)
+{
+    LASSERT_ARG_MIN(a, 2, "loop");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_SEXPR, "loop");
+    lval* bindings = a->cell[0];
+    LASSERT(a, bindings->count % 2 == 0,
+            "Function 'loop' expected names and values in pairs but got %i items.", bindings->count);
+    for (int i = 0; i < bindings->count; i += 2)
+    {
+        LASSERT(a, bindings->cell[i]->type == LVAL_SYM,
+                "Function 'loop' expected %s at binding %i but got %s.", ltype_name(LVAL_SYM), i / 2, ltype_name(bindings->cell[i]->type));
+    }
+
+    // Each value sees the bindings before it
+    int n = bindings->count / 2;
+    int* slots = malloc(sizeof(int) * (n > 0 ? n : 1));
+    lenv* f = lenv_frame(e);
+    lval* result = NULL;
+    for (int i = 0; i < n && result == NULL; i++)
+    {
+        lval* v = lval_eval(f, lval_copy(bindings->cell[2 * i + 1]));
+        if (v->type == LVAL_ERR)
+        {
+            result = v;
+            break;
+        }
+        lfold_rebind(e, bindings->cell[2 * i]->sym, 1);
+        slots[i] = lenv_slot(f, bindings->cell[2 * i]->sym);
+        lval_del(f->vals[slots[i]]);
+        f->vals[slots[i]] = v;
+    }
+
+    while (result == NULL)
+    {
+        result = lval_eval_each(f, a, 1, a->count - 1);
+        if (result != NULL)
+        {
+            break;
+        }
+        result = lval_eval_branch(f, lval_copy(a->cell[a->count - 1]));
+        if (result->type != LVAL_RECUR)
+        {
+            break;
+        }
+        if (result->count != n)
+        {
+            lval* err = lval_err("Function 'recur' got %i values but 'loop' binds %i.", result->count, n);
+            lval_del(result);
+            result = err;
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            lval_del(f->vals[slots[i]]);
+            f->vals[slots[i]] = result->cell[i];
+        }
+        result->count = 0;
+        lval_del(result);
+        result = NULL;
+    }
+
+    lenv_del(f);
+    free(slots);
+    lval_del(a);
+    return result;
+}
+
+// The arguments become the loop variables of the enclosing 'loop'
+LBUILTIN_DECL(builtin_recur)
+{
+    a->type = LVAL_RECUR;
+    return a;
+}
+
+LBUILTIN_DECL(builtin_load)
+{
+    LASSERT_ARG_COUNT(a, 1, "load");
+    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "load");
+
+    char* filename = a->cell[0]->str;
+
+    mpc_result_t r;
+    if (mpc_parse_contents(filename, Lispy, &r))
+    {
+        lval* prog = lval_read(r.output);
+        mpc_ast_delete(r.output);
+
+        while (prog->count)
+        {
+            lval* expr = lval_pop(prog, 0);
+            lval* x = lval_no_recur(lval_eval(e, expr));
+            if (x->type == LVAL_ERR)
+            {
+                lval_println(e, x);
+            }
+            lval_del(x);
+        }
+
+        lval_del(prog);
+        lval_del(a);
+        return lval_ok();
+    }
+    else
+    {
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        lval* err = lval_err("Could not load library: %s ", err_msg);
+        free(err_msg);
+        lval_del(a);
+        return err;
+    }   
+    
+}
+
+
+LBUILTIN_DECL(builtin_read)
+{
+    LASSERT_ARG_COUNT(a, 1, "load");
+    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "load");
+
+    char* expr = a->cell[0]->str;
+
+    mpc_result_t r;
+    if (mpc_parse("-", expr, Lispy, &r))
+    {
+        lval* prog = lval_read(r.output);
+        mpc_ast_delete(r.output);
+        prog->type = LVAL_QEXPR;
+        return prog;
+    }
+    else
+    {
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        lval* err = lval_err("Could not read expression: %s ", err_msg);
+        free(err_msg);
+        lval_del(a);
+        return err;
+    }
+}
+
+LBUILTIN_DECL(builtin_print)
+{
+    for (int i = 0; i < a->count; i++)
+    {
+        if (i > 0)
+        {
+            putchar(' ');
+        }
+        lval_print(e, a->cell[i]);
+    }
+    putchar('\n');
+
+    lval_del(a);
+    return lval_ok();
+}
+
+LBUILTIN_DECL(builtin_show)
+{
+    for (int i = 0; i < a->count; i++)
+    {
+        if (i > 0)
+        {
+            putchar(' ');
+        }
+        LASSERT_ARG_TYPE(a, i, LVAL_STR, "show");
+        printf("%s", a->cell[i]->str);
+    }
+    putchar('\n');
+
+    lval_del(a);
+    return lval_ok();
+}
+
+LBUILTIN_DECL(builtin_error)
+{
+    LASSERT_ARG_COUNT(a, 1, "error");
+    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "error");
+    lval* err = lval_err(a->cell[0]->str);
+    lval_del(a);
+    return err;
+}
+
+#ifdef FELISPY_TESTS
+// Only in the builds of tests/run.sh: (catch {expr}) evaluates expr like 'eval', an error it gives becomes its
+// message as a string, so the checks compare errors like any other value
+LBUILTIN_DECL(builtin_catch)
+{
+    lval* x = lval_no_recur(builtin_eval(e, a));
+    if (x->type != LVAL_ERR)
+    {
+        return x;
+    }
+    lval* msg = lval_string(x->err);
+    lval_del(x);
+    return msg;
+}
+
+// Also only in those builds: (folded-body f) is the body a call to the lambda f runs, so the checks can tell
+// whether it was folded
+LBUILTIN_DECL(builtin_folded_body)
+{
+    LASSERT_ARG_COUNT(a, 1, "folded-body");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN && a->cell[0]->builtin == NULL,
+            "Function 'folded-body' expected a lambda but got %s.", ltype_name(a->cell[0]->type));
+    lval* body = lval_copy(lval_run_body(e, a->cell[0]));
+    lval_del(a);
+    return body;
+}
+#endif
+
+lval* builtin_op(lval* v, lop_t op)
+{
+    LASSERT_ARG_MIN(v, 1, lop_names[op]);
+
+    // Decimals win over big integers, which win over integers
+    int kind = 0;
+    for (int i = 0; i < v->count; i++)
+    {
+        if (!lval_is_number(v->cell[i]))
+        {
+            lval *err = lval_err("Function '%s' got invalid operand type at position %i: %s", lop_names[op], i, ltype_name(v->cell[i]->type));
+            lval_del(v);
+            return err;
+        }
+        if (kind != 1 && v->cell[i]->type != LVAL_INTEGER)
+        {
+            kind = LNUM(v->cell[i]);
+        }
+    }
+    if (kind != 0)
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            kind == 1 ? lval_to_decimal(v->cell[i]) : lval_to_big(v->cell[i]);
+        }
+    }
+
+    lval* x = lval_pop(v, 0);
+    if (v->count == 0 && op == LOP_SUB)
+    {
+        if (x->type == LVAL_INTEGER && x->integer == LONG_MIN)
+        {
+            lval_to_big(x);
+            kind = 2;
+        }
+        if (x->type == LVAL_INTEGER)
+        {
+            x->integer = -x->integer;
+        }
+        else if (x->type == LVAL_DECIMAL)
+        {
+            x->decimal = -x->decimal;
+        }
+        else
+        {
+            x->big->sign = -x->big->sign;
+        }
+    }
+
+    lval* result = lop_kernels[op][kind](x, v->cell, v->count);
+    if (result == NULL)
+    {
+        // Overflowed a long, x is untouched and the whole fold is redone with big integers
+        lval_to_big(x);
+        for (int i = 0; i < v->count; i++)
+        {
+            lval_to_big(v->cell[i]);
+        }
+        result = lop_kernels[op][2](x, v->cell, v->count);
+    }
+    lval_del(v);
+    return result;
+}
+
+lval* builtin_ord(lval* a, lord_t op)
+{
+    LASSERT_ARG_COUNT(a, 2, lord_names[op]);
+    LASSERT_ARG_NUMBER(a, 0, lord_names[op]);
+    LASSERT_ARG_NUMBER(a, 1, lord_names[op]);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    lval* result = lval_boolean(lord_kernels[op][LNUM(x)][LNUM(y)](x, y));
+    lval_del(a);
+    return result;
+}
+
+void lenv_add_builtin(lenv *e, char* name, lbuiltin func)
+{
+    lval* sym = lval_symbol(name);
+    lval* fun = lval_builtin(func);
+    lenv_put(e, sym, fun);
+    lval_del(sym);
+    lval_del(fun);
+}
+
+#define LBUILTIN_DECL_OP(id, sym, name) LBUILTIN_DECL(builtin_##name) { return builtin_op(a, LOP_##id); }
+LOPS(LBUILTIN_DECL_OP)
+
+#define LBUILTIN_DECL_ORD(id, sym, name, op) LBUILTIN_DECL(builtin_##name) { return builtin_ord(a, LORD_##id); }
+LORDS(LBUILTIN_DECL_ORD)
+
+// Evaluates operands until one of them has the deciding truth value
+lval* builtin_logic(lenv* e, lval* a, char* fun, int decisive)
+{
+    LASSERT_ARG_MIN(a, 2, fun);
+    int result = !decisive;
+    for (int i = 0; i < a->count; i++)
+    {
+        a->cell[i] = lval_eval(e, a->cell[i]);
+        int truth = lval_truth(a->cell[i]);
+        if (truth < 0)
+        {
+            return lval_truth_error(fun, lval_take(a, i), i);
+        }
+        if (truth == decisive)
+        {
+            result = decisive;
+            break;
+        }
+    }
+    lval_del(a);
+    return lval_boolean(result);
+}
+
+LBUILTIN_DECL(builtin_and)
+{
+    return builtin_logic(e, a, "&&", 0);
+}
+
+LBUILTIN_DECL(builtin_or)
+{
+    return builtin_logic(e, a, "||", 1);
+}
+
+LBUILTIN_DECL(builtin_not)
+{
+    LASSERT_ARG_COUNT(a, 1, "!");
+    LASSERT(a, a->cell[0]->type == LVAL_BOOLEAN || a->cell[0]->type == LVAL_INTEGER || a->cell[0]->type == LVAL_DECIMAL,
+            "Function '!' got argument of invalid type %s.", ltype_name(a->cell[0]->type));
+    lval* x = lval_take(a, 0);
+    int result = x->type == LVAL_DECIMAL ? !x->decimal : !x->integer;
+    lval_del(x);
+    return lval_boolean(result);
+}
+
+LBUILTIN_DECL(builtin_eq)
+{
+    LASSERT_ARG_COUNT(a, 2, "==");
+    int result = lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_boolean(result);
+}
+
+LBUILTIN_DECL(builtin_ne)
+{
+    LASSERT_ARG_COUNT(a, 2, "!=");
+    int result = !lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_boolean(result);
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* Binary encoding of values
+
+A tag character followed by the payload. Counts, lengths and integers are LEB128 varints (integers zigzag encoded
+first), decimals and big integer limbs are little-endian. Hash map entries are written in the order of their
+encoded keys. The encoding of a value is canonical, so equal encodings mean structurally equal values and the bytes
+can be hashed as a stable key. Builtins are stored by name.
+*/
+
+lbuiltin_entry* lbuiltin_find(char* name);
+lbuiltin_entry* lbuiltin_find_func(lbuiltin func);
+
+typedef struct
+{
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+} lbuf;
+
+void lbuf_put(lbuf* b, const void* p, size_t n)
+{
+    if (b->len + n > b->cap)
+    {
+        b->cap = (b->len + n) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+void lbuf_byte(lbuf* b, unsigned char c)
+{
+    lbuf_put(b, &c, 1);
+}
+
+void lbuf_varint(lbuf* b, unsigned long long x)
+{
+    while (x >= 0x80)
+    {
+        lbuf_byte(b, (unsigned char) (x | 0x80));
+        x >>= 7;
+    }
+    lbuf_byte(b, (unsigned char) x);
+}
+
+void lbuf_u64(lbuf* b, unsigned long long x)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        lbuf_byte(b, (unsigned char) (x >> (8 * i)));
+    }
+}
+
+void lbuf_str(lbuf* b, char* s)
+{
+    size_t n = strlen(s);
+    lbuf_varint(b, n);
+    lbuf_put(b, s, n);
+}
+
+void lhamt_entries(lhamt_node* n, lval** kv, int* count);
+int lomap_encode(lbuf* b, lomap_node* n);
+int lval_encode(lbuf* b, lval* v);
+
+typedef struct
+{
+    lbuf bytes;  // encoded key followed by the encoded value
+    size_t key_len;
+} lbuf_entry;
+
+int lbuf_entry_cmp(const void* x, const void* y)
+{
+    const lbuf_entry* p = x;
+    const lbuf_entry* q = y;
+    size_t n = p->key_len < q->key_len ? p->key_len : q->key_len;
+    int c = memcmp(p->bytes.data, q->bytes.data, n);
+    return c != 0 ? c : (p->key_len > q->key_len) - (p->key_len < q->key_len);
+}
+
+// The n keys and values in kv, alternating, ordered by their encoded keys so the bytes do not depend on the
+// order in which a hash map stores its entries
+int lval_encode_entries(lbuf* b, lval** kv, int n)
+{
+    lbuf_entry* entries = calloc(n > 0 ? n : 1, sizeof(lbuf_entry));
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++)
+    {
+        ok = lval_encode(&entries[i].bytes, kv[2 * i]);
+        entries[i].key_len = entries[i].bytes.len;
+        ok = ok && lval_encode(&entries[i].bytes, kv[2 * i + 1]);
+    }
+    if (ok)
+    {
+        qsort(entries, n, sizeof(lbuf_entry), lbuf_entry_cmp);
+        for (int i = 0; i < n; i++)
+        {
+            lbuf_put(b, entries[i].bytes.data, entries[i].bytes.len);
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        free(entries[i].bytes.data);
+    }
+    free(entries);
+    return ok;
+}
+
+// Returns 0 if the value cannot be stored
+int lval_encode(lbuf* b, lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_INTEGER:
+        case LVAL_BOOLEAN:
+        {
+            long long n = v->integer;
+            lbuf_byte(b, v->type == LVAL_INTEGER ? 'i' : 'b');
+            lbuf_varint(b, ((unsigned long long) n << 1) ^ (unsigned long long) (n >> 63));
+            return 1;
+        }
+        case LVAL_DECIMAL:
+        {
+            unsigned long long bits;
+            memcpy(&bits, &v->decimal, sizeof(bits));
+            lbuf_byte(b, 'd');
+            lbuf_u64(b, bits);
+            return 1;
+        }
+        case LVAL_BIGNUM:
+            lbuf_byte(b, 'n');
+            lbuf_byte(b, v->big->sign < 0);
+            lbuf_varint(b, v->big->count);
+            for (int i = 0; i < v->big->count; i++)
+            {
+                lbuf_u64(b, v->big->limbs[i]);
+            }
+            return 1;
+        case LVAL_STR:
+            lbuf_byte(b, 's');
+            lbuf_str(b, v->str);
+            return 1;
+        case LVAL_SYM:
+            lbuf_byte(b, 'y');
+            lbuf_str(b, v->sym);
+            return 1;
+        case LVAL_ERR:
+            lbuf_byte(b, 'e');
+            lbuf_str(b, v->err);
+            return 1;
+        case LVAL_OK:
+            lbuf_byte(b, 'o');
+            return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lbuf_byte(b, v->type == LVAL_SEXPR ? '(' : '{');
+            lbuf_varint(b, v->count);
+            for (int i = 0; i < v->count; i++)
+            {
+                if (!lval_encode(b, v->cell[i]))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        case LVAL_VECTOR:
+            lbuf_byte(b, 'v');
+            lbuf_varint(b, v->vec->count);
+            for (int i = 0; i < v->vec->count; i++)
+            {
+                if (!lval_encode(b, v->vec->items[i]))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        case LVAL_MAP:
+        case LVAL_PMAP:
+        {
+            int n = v->type == LVAL_MAP ? v->map->count : v->hamt->size;
+            lval** kv = malloc(sizeof(lval*) * 2 * (n > 0 ? n : 1));
+            if (v->type == LVAL_MAP)
+            {
+                for (int i = 0, j = 0; i < v->map->capacity; i++)
+                {
+                    lmap_entry* entry = &v->map->entries[i];
+                    if (entry->key != NULL)
+                    {
+                        kv[j++] = entry->key;
+                        kv[j++] = entry->val;
+                    }
+                }
+            }
+            else
+            {
+                int count = 0;
+                lhamt_entries(v->hamt, kv, &count);
+            }
+            lbuf_byte(b, v->type == LVAL_MAP ? 'm' : 'h');
+            lbuf_varint(b, n);
+            int ok = lval_encode_entries(b, kv, n);
+            free(kv);
+            return ok;
+        }
+        case LVAL_OMAP:
+            lbuf_byte(b, 't');
+            lbuf_varint(b, v->omap->count);
+            return lomap_encode(b, v->omap->root);
+        case LVAL_BITS:
+            lbuf_byte(b, 'w');
+            lbuf_varint(b, v->bits->count);
+            for (int i = 0; i < v->bits->words; i++)
+            {
+                lbuf_u64(b, v->bits->data[i]);
+            }
+            return 1;
+        case LVAL_BYTES:
+            lbuf_byte(b, 'x');
+            lbuf_varint(b, v->length);
+            lbuf_put(b, LBYTES_AT(v), v->length);
+            return 1;
+        case LVAL_DEQUE:
+            lbuf_byte(b, 'q');
+            lbuf_varint(b, v->dq->count);
+            for (int i = 0; i < v->dq->count; i++)
+            {
+                if (!lval_encode(b, LDEQUE_AT(v->dq, i)))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        case LVAL_ARRAY:
+            lbuf_byte(b, 'a');
+            lbuf_byte(b, (unsigned char) v->arr->kind);
+            lbuf_varint(b, v->arr->count);
+            for (int i = 0; i < v->arr->count; i++)
+            {
+                unsigned long long bits;
+                memcpy(&bits, (char*) v->arr->data + 8 * (size_t) i, 8);
+                lbuf_u64(b, bits);
+            }
+            return 1;
+        case LVAL_FUN:
+            if (v->memo != NULL || v->recfn != NULL)
+            {
+                return 0;
+            }
+            if (v->builtin != NULL)
+            {
+                lbuiltin_entry* entry = lbuiltin_find_func(v->builtin);
+                if (entry == NULL)
+                {
+                    return 0;
+                }
+                lbuf_byte(b, 'p');
+                lbuf_str(b, entry->name);
+                return 1;
+            }
+            // Formals, body and the arguments a partial application has bound already
+            lbuf_byte(b, 'f');
+            if (!lval_encode(b, v->formals) || !lval_encode(b, v->body))
+            {
+                return 0;
+            }
+            lbuf_varint(b, v->env->count);
+            for (int i = 0; i < v->env->count; i++)
+            {
+                lbuf_str(b, v->env->syms[i]);
+                if (!lval_encode(b, v->env->vals[i]))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+typedef struct
+{
+    unsigned char* p;
+    unsigned char* end;
+} lreader;
+
+int lreader_varint(lreader* r, unsigned long long* x)
+{
+    *x = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7)
+    {
+        unsigned char c = *r->p++;
+        *x |= (unsigned long long) (c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lreader_u64(lreader* r, unsigned long long* x)
+{
+    if (r->end - r->p < 8)
+    {
+        return 0;
+    }
+    *x = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        *x |= (unsigned long long) r->p[i] << (8 * i);
+    }
+    r->p += 8;
+    return 1;
+}
+
+// Returns a new string or NULL
+char* lreader_str(lreader* r)
+{
+    unsigned long long n;
+    if (!lreader_varint(r, &n) || n > (unsigned long long) (r->end - r->p))
+    {
+        return NULL;
+    }
+    char* s = malloc(n + 1);
+    memcpy(s, r->p, n);
+    s[n] = '\0';
+    r->p += n;
+    return s;
+}
+
+lval* lval_vector_from(lval* q);
+larr* larr_new(larr_kind kind, int count);
+lmap* lmap_new(int capacity);
+lhamt_node* lhamt_node_new(int count);
+lhamt_node* lhamt_put(lhamt_node* root, lval* key, lval* val);
+lomap* lomap_new(void);
+int lomap_key_ok(lomap* m, lval* key);
+void lomap_put(lomap* m, lval* key, lval* val);
+ldeque* ldeque_new(int capacity);
+lbits* lbits_new(int count);
+lval* lval_bytes_of(const void* p, int n);
+void ldeque_push_back(ldeque* dq, lval* x);
+void lmap_put(lmap* map, lval* key, lval* val);
+
+// Returns NULL on malformed input
+lval* lval_decode(lreader* r)
+{
+    if (r->p >= r->end)
+    {
+        return NULL;
+    }
+    unsigned char tag = *r->p++;
+    unsigned long long x = 0;
+    char* s;
+    lval* v = NULL;
+    switch (tag)
+    {
+        case 'i':
+        case 'b':
+            if (lreader_varint(r, &x))
+            {
+                long n = (long) (long long) ((x >> 1) ^ (0 - (x & 1)));
+                v = tag == 'i' ? lval_integer(n) : lval_boolean(n);
+            }
+            break;
+        case 'd':
+            if (lreader_u64(r, &x))
+            {
+                double d;
+                memcpy(&d, &x, sizeof(d));
+                v = lval_decimal(d);
+            }
+            break;
+        case 'n':
+        {
+            unsigned long long count;
+            if (r->p >= r->end)
+            {
+                break;
+            }
+            int sign = *r->p++ ? -1 : 1;
+            if (!lreader_varint(r, &count) || count > (unsigned long long) (r->end - r->p) / 8)
+            {
+                break;
+            }
+            lbig* b = lbig_new((int) count);
+            for (int i = 0; i < (int) count; i++)
+            {
+                lreader_u64(r, &x);
+                b->limbs[i] = (lbig_limb) x;
+            }
+            b->sign = sign;
+            v = lval_bignum(lbig_trim(b));
+            break;
+        }
+        case 's':
+        case 'y':
+        case 'e':
+            if ((s = lreader_str(r)) != NULL)
+            {
+                v = tag == 's' ? lval_string(s) : tag == 'y' ? lval_symbol(s) : lval_err("%s", s);
+                free(s);
+            }
+            break;
+        case 'o':
+            v = lval_ok();
+            break;
+        case '(':
+        case '{':
+        case 'v':
+        case 'q':
+            if (lreader_varint(r, &x) && x <= (unsigned long long) (r->end - r->p))
+            {
+                v = tag == '(' ? lval_sexpr() : lval_qexpr();
+                for (unsigned long long i = 0; i < x; i++)
+                {
+                    lval* cell = lval_decode(r);
+                    if (cell == NULL)
+                    {
+                        lval_del(v);
+                        return NULL;
+                    }
+                    lval_add(v, cell);
+                }
+                if (tag == 'v')
+                {
+                    v = lval_vector_from(v);
+                }
+                else if (tag == 'q')
+                {
+                    ldeque* dq = ldeque_new(v->count);
+                    for (int i = 0; i < v->count; i++)
+                    {
+                        ldeque_push_back(dq, v->cell[i]);
+                    }
+                    v->count = 0;
+                    lval_del(v);
+                    v = lval_deque(dq);
+                }
+            }
+            break;
+        case 'h':
+            if (lreader_varint(r, &x) && x <= (unsigned long long) (r->end - r->p))
+            {
+                lhamt_node* root = lhamt_node_new(0);
+                for (unsigned long long i = 0; i < x && root != NULL; i++)
+                {
+                    lval* key = lval_decode(r);
+                    lval* val = key != NULL ? lval_decode(r) : NULL;
+                    if (val == NULL)
+                    {
+                        if (key != NULL)
+                        {
+                            lval_del(key);
+                        }
+                        lhamt_node_release(root);
+                        root = NULL;
+                        break;
+                    }
+                    lhamt_node* next = lhamt_put(root, key, val);
+                    lhamt_node_release(root);
+                    root = next;
+                }
+                v = root != NULL ? lval_pmap(root) : NULL;
+            }
+            break;
+        case 't':
+            if (lreader_varint(r, &x) && x <= (unsigned long long) (r->end - r->p))
+            {
+                lomap* m = lomap_new();
+                v = lval_omap(m);
+                for (unsigned long long i = 0; i < x && v != NULL; i++)
+                {
+                    lval* key = lval_decode(r);
+                    lval* val = key != NULL && lomap_key_ok(m, key) ? lval_decode(r) : NULL;
+                    if (val == NULL)
+                    {
+                        if (key != NULL)
+                        {
+                            lval_del(key);
+                        }
+                        lval_del(v);
+                        v = NULL;
+                        break;
+                    }
+                    lomap_put(m, key, val);
+                }
+            }
+            break;
+        case 'm':
+            if (lreader_varint(r, &x) && x <= (unsigned long long) (r->end - r->p))
+            {
+                lmap* map = lmap_new((int) x);
+                v = lval_map(map);
+                for (unsigned long long i = 0; i < x && v != NULL; i++)
+                {
+                    lval* key = lval_decode(r);
+                    lval* val = key != NULL ? lval_decode(r) : NULL;
+                    if (val == NULL)
+                    {
+                        if (key != NULL)
+                        {
+                            lval_del(key);
+                        }
+                        lval_del(v);
+                        v = NULL;
+                        break;
+                    }
+                    lmap_put(map, key, val);
+                }
+            }
+            break;
+        case 'a':
+        {
+            if (r->p >= r->end || *r->p > LARR_I64)
+            {
+                break;
+            }
+            larr_kind kind = (larr_kind) *r->p++;
+            if (!lreader_varint(r, &x) || x > (unsigned long long) (r->end - r->p) / 8)
+            {
+                break;
+            }
+            larr* arr = larr_new(kind, (int) x);
+            for (int i = 0; i < (int) x; i++)
+            {
+                unsigned long long bits = 0;
+                lreader_u64(r, &bits);
+                memcpy((char*) arr->data + 8 * (size_t) i, &bits, 8);
+            }
+            v = lval_array(arr);
+            break;
+        }
+        case 'w':
+        {
+            if (!lreader_varint(r, &x) || x > INT_MAX - 63 || (x + 63) / 64 > (unsigned long long) (r->end - r->p) / 8)
+            {
+                break;
+            }
+            lbits* bits = lbits_new((int) x);
+            for (int i = 0; i < bits->words; i++)
+            {
+                lreader_u64(r, &bits->data[i]);
+            }
+            // Bits past the size must stay 0
+            if (x % 64 != 0)
+            {
+                bits->data[bits->words - 1] &= (1ULL << (x % 64)) - 1;
+            }
+            v = lval_bits(bits);
+            break;
+        }
+        case 'x':
+            if (lreader_varint(r, &x) && x <= (unsigned long long) (r->end - r->p))
+            {
+                v = lval_bytes_of(r->p, (int) x);
+                r->p += x;
+            }
+            break;
+        case 'p':
+            if ((s = lreader_str(r)) != NULL)
+            {
+                lbuiltin_entry* entry = lbuiltin_find(s);
+                v = entry != NULL ? lval_builtin(entry->func) : NULL;
+                free(s);
+            }
+            break;
+        case 'f':
+        {
+            lval* formals = lval_decode(r);
+            lval* body = formals != NULL ? lval_decode(r) : NULL;
+            if (body == NULL)
+            {
+                if (formals != NULL)
+                {
+                    lval_del(formals);
+                }
+                break;
+            }
+            v = lval_lambda(formals, body);
+            if (!lreader_varint(r, &x) || x > (unsigned long long) (r->end - r->p))
+            {
+                lval_del(v);
+                return NULL;
+            }
+            for (unsigned long long i = 0; i < x; i++)
+            {
+                lval* val = (s = lreader_str(r)) != NULL ? lval_decode(r) : NULL;
+                if (val == NULL)
+                {
+                    free(s);
+                    lval_del(v);
+                    return NULL;
+                }
+                lenv_bind(v->env, s, val);
+                free(s);
+                lval_del(val);
+            }
+            break;
+        }
+    }
+    return v;
+}
+
+/* On-disk memo cache
+
+'name.idx' is an open addressing table of (key hash, record offset) slots behind a small header. It is memory
+mapped on POSIX systems and read into memory elsewhere, with changed slots written back. 'name.dat' is an append
+only file of records: the encoded key (function formals, body and bound arguments, then the argument list) and the
+encoded result. A probe that matches the hash compares the stored key bytes, so collisions never return a wrong
+result.
+*/
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LDISK_MAGIC "FLSPYIDX"
+#define LDISK_VERSION 2
+#define LDISK_HEADER 24  // magic, version, slot count, used slots
+#define LDISK_SLOT 16    // hash, offset
+#define LDISK_SLOTS 1024
+
+struct ldisk
+{
+    FILE* data;
+    unsigned char* index;
+    size_t index_size;
+#ifdef _WIN32
+    FILE* index_file;
+    char* index_path;
+#else
+    int index_fd;
+#endif
+    lbuf fun_key;  // encoded function, the prefix of every key
+};
+
+unsigned long long ldisk_get_u64(unsigned char* p)
+{
+    unsigned long long x = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        x |= (unsigned long long) p[i] << (8 * i);
+    }
+    return x;
+}
+
+void ldisk_put_u64(unsigned char* p, unsigned long long x)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char) (x >> (8 * i));
+    }
+}
+
+unsigned int ldisk_get_u32(unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+void ldisk_put_u32(unsigned char* p, unsigned int x)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (unsigned char) (x >> (8 * i));
+    }
+}
+
+unsigned long long ldisk_hash(unsigned char* p, size_t n)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h != 0 ? h : 1;  // 0 marks an empty slot
+}
+
+// Writes back a changed range of the index when it is not mapped
+void ldisk_sync(ldisk* d, size_t offset, size_t len)
+{
+#ifdef _WIN32
+    fseek(d->index_file, (long) offset, SEEK_SET);
+    fwrite(d->index + offset, 1, len, d->index_file);
+    fflush(d->index_file);
+#else
+    (void) d;
+    (void) offset;
+    (void) len;
+#endif
+}
+
+// Replaces the index by an empty one with the given number of slots and puts back the slots of 'old'
+int ldisk_reset(ldisk* d, unsigned int slots, unsigned char* old)
+{
+    size_t size = LDISK_HEADER + (size_t) slots * LDISK_SLOT;
+    unsigned char* index = calloc(size, 1);
+    memcpy(index, LDISK_MAGIC, 8);
+    ldisk_put_u32(index + 8, LDISK_VERSION);
+    ldisk_put_u32(index + 12, slots);
+    unsigned int used = 0;
+    if (old != NULL)
+    {
+        unsigned int old_slots = ldisk_get_u32(old + 12);
+        for (unsigned int i = 0; i < old_slots; i++)
+        {
+            unsigned char* slot = old + LDISK_HEADER + (size_t) i * LDISK_SLOT;
+            unsigned long long hash = ldisk_get_u64(slot);
+            if (hash == 0)
+            {
+                continue;
+            }
+            size_t j = hash & (slots - 1);
+            while (ldisk_get_u64(index + LDISK_HEADER + j * LDISK_SLOT) != 0)
+            {
+                j = (j + 1) & (slots - 1);
+            }
+            memcpy(index + LDISK_HEADER + j * LDISK_SLOT, slot, LDISK_SLOT);
+            used++;
+        }
+    }
+    ldisk_put_u32(index + 16, used);
+
+#ifdef _WIN32
+    free(d->index);
+    d->index = index;
+    d->index_size = size;
+    fclose(d->index_file);
+    d->index_file = fopen(d->index_path, "w+b");
+    if (d->index_file == NULL)
+    {
+        return 0;
+    }
+    ldisk_sync(d, 0, size);
+#else
+    if (d->index != NULL)
+    {
+        munmap(d->index, d->index_size);
+        d->index = NULL;
+    }
+    void* p = ftruncate(d->index_fd, (off_t) size) == 0 ?
+              mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, d->index_fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED)
+    {
+        free(index);
+        return 0;
+    }
+    d->index = p;
+    d->index_size = size;
+    memcpy(d->index, index, size);
+    free(index);
+#endif
+    return 1;
+}
+
+int ldisk_valid(unsigned char* index, size_t size)
+{
+    if (size < LDISK_HEADER || memcmp(index, LDISK_MAGIC, 8) != 0 || ldisk_get_u32(index + 8) != LDISK_VERSION)
+    {
+        return 0;
+    }
+    unsigned int slots = ldisk_get_u32(index + 12);
+    return slots != 0 && (slots & (slots - 1)) == 0 && size == LDISK_HEADER + (size_t) slots * LDISK_SLOT;
+}
+
+void ldisk_close(ldisk* d)
+{
+#ifdef _WIN32
+    free(d->index);
+    free(d->index_path);
+    if (d->index_file != NULL)
+    {
+        fclose(d->index_file);
+    }
+#else
+    if (d->index != NULL)
+    {
+        munmap(d->index, d->index_size);
+    }
+    if (d->index_fd >= 0)
+    {
+        close(d->index_fd);
+    }
+#endif
+    if (d->data != NULL)
+    {
+        fclose(d->data);
+    }
+    free(d->fun_key.data);
+    free(d);
+}
+
+ldisk* ldisk_open(char* name, lval* fun)
+{
+    ldisk* d = calloc(1, sizeof(ldisk));
+#ifndef _WIN32
+    d->index_fd = -1;
+#endif
+    if (!lval_encode(&d->fun_key, fun))
+    {
+        ldisk_close(d);
+        return NULL;
+    }
+
+    char* path = malloc(strlen(name) + 5);
+    if (path == NULL)
+    {
+        ldisk_close(d);
+        return NULL;
+    }
+    sprintf(path, "%s.dat", name);
+    d->data = fopen(path, "a+b");
+    sprintf(path, "%s.idx", name);
+#ifdef _WIN32
+    d->index_path = path;
+    d->index_file = fopen(path, "r+b");
+    if (d->index_file == NULL)
+    {
+        d->index_file = fopen(path, "w+b");
+    }
+    if (d->index_file != NULL)
+    {
+        fseek(d->index_file, 0, SEEK_END);
+        d->index_size = (size_t) ftell(d->index_file);
+        d->index = malloc(d->index_size + 1);
+        rewind(d->index_file);
+        d->index_size = fread(d->index, 1, d->index_size, d->index_file);
+    }
+    int opened = d->index_file != NULL;
+#else
+    d->index_fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (d->index_fd >= 0 && fstat(d->index_fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, d->index_fd, 0);
+        if (p != MAP_FAILED)
+        {
+            d->index = p;
+            d->index_size = (size_t) st.st_size;
+        }
+    }
+    int opened = d->index_fd >= 0;
+    free(path);
+#endif
+
+    if (d->data == NULL || !opened ||
+        (!ldisk_valid(d->index, d->index_size) && !ldisk_reset(d, LDISK_SLOTS, NULL)))
+    {
+        ldisk_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+// Another cache on the same files may have grown the index since this one mapped it, the header then counts more
+// slots than the mapping holds. The index is mapped again at its current size before it is used.
+int ldisk_refresh(ldisk* d)
+{
+    if (d->index == NULL || ldisk_valid(d->index, d->index_size))
+    {
+        return d->index != NULL;
+    }
+#ifndef _WIN32
+    munmap(d->index, d->index_size);
+    d->index = NULL;
+    struct stat st;
+    if (fstat(d->index_fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, d->index_fd, 0);
+        if (p != MAP_FAILED)
+        {
+            d->index = p;
+            d->index_size = (size_t) st.st_size;
+        }
+    }
+#endif
+    return ldisk_valid(d->index, d->index_size) || ldisk_reset(d, LDISK_SLOTS, NULL);
+}
+
+// Reads the record at offset, returns its value if the stored key equals key
+lval* ldisk_record(ldisk* d, unsigned long long offset, lbuf* key)
+{
+    if (fseek(d->data, (long) offset, SEEK_SET) != 0)
+    {
+        return NULL;
+    }
+    unsigned long long lens[2];
+    lval* v = NULL;
+    for (int part = 0; part < 2; part++)
+    {
+        // Varint length prefix read a byte at a time
+        lens[part] = 0;
+        int c;
+        for (int shift = 0; (c = fgetc(d->data)) != EOF; shift += 7)
+        {
+            lens[part] |= (unsigned long long) (c & 0x7F) << shift;
+            if (!(c & 0x80) || shift > 56)
+            {
+                break;
+            }
+        }
+        if (c == EOF || (part == 0 && lens[0] != key->len))
+        {
+            return NULL;
+        }
+        unsigned char* bytes = malloc(lens[part] > 0 ? lens[part] : 1);
+        if (fread(bytes, 1, lens[part], d->data) != lens[part] ||
+            (part == 0 && memcmp(bytes, key->data, key->len) != 0))
+        {
+            free(bytes);
+            return NULL;
+        }
+        if (part == 1)
+        {
+            lreader r = { bytes, bytes + lens[1] };
+            v = lval_decode(&r);
+        }
+        free(bytes);
+    }
+    return v;
+}
+
+// Key for a call: the encoded function followed by the encoded arguments
+void ldisk_key(ldisk* d, lbuf* args, lbuf* key)
+{
+    lbuf_put(key, d->fun_key.data, d->fun_key.len);
+    lbuf_put(key, args->data, args->len);
+}
+
+lval* ldisk_get(ldisk* d, lbuf* args)
+{
+    lbuf key = { NULL, 0, 0 };
+    lval* v = NULL;
+    if (ldisk_refresh(d))
+    {
+        ldisk_key(d, args, &key);
+        unsigned long long hash = ldisk_hash(key.data, key.len);
+        unsigned int mask = ldisk_get_u32(d->index + 12) - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask)
+        {
+            unsigned char* slot = d->index + LDISK_HEADER + i * LDISK_SLOT;
+            unsigned long long h = ldisk_get_u64(slot);
+            if (h == 0 || (h == hash && (v = ldisk_record(d, ldisk_get_u64(slot + 8), &key)) != NULL))
+            {
+                break;
+            }
+        }
+    }
+    free(key.data);
+    return v;
+}
+
+void ldisk_put(ldisk* d, lbuf* args, lbuf* result)
+{
+    lbuf key = { NULL, 0, 0 };
+    lbuf record = { NULL, 0, 0 };
+    if (ldisk_refresh(d))
+    {
+        ldisk_key(d, args, &key);
+        lbuf_varint(&record, key.len);
+        lbuf_put(&record, key.data, key.len);
+        lbuf_varint(&record, result->len);
+        lbuf_put(&record, result->data, result->len);
+
+        fseek(d->data, 0, SEEK_END);
+        long offset = ftell(d->data);
+        if (offset >= 0 && fwrite(record.data, 1, record.len, d->data) == record.len && fflush(d->data) == 0)
+        {
+            unsigned long long hash = ldisk_hash(key.data, key.len);
+            unsigned int slots = ldisk_get_u32(d->index + 12);
+            size_t i = hash & (slots - 1);
+            while (ldisk_get_u64(d->index + LDISK_HEADER + i * LDISK_SLOT) != 0)
+            {
+                i = (i + 1) & (slots - 1);
+            }
+            unsigned char* slot = d->index + LDISK_HEADER + i * LDISK_SLOT;
+            ldisk_put_u64(slot, hash);
+            ldisk_put_u64(slot + 8, (unsigned long long) offset);
+            ldisk_sync(d, LDISK_HEADER + i * LDISK_SLOT, LDISK_SLOT);
+            unsigned int used = ldisk_get_u32(d->index + 16) + 1;
+            ldisk_put_u32(d->index + 16, used);
+            ldisk_sync(d, 16, 4);
+
+            // Keep the table at most three quarters full
+            if ((unsigned long long) used * 4 >= (unsigned long long) slots * 3)
+            {
+                unsigned char* old = malloc(d->index_size);
+                memcpy(old, d->index, d->index_size);
+                ldisk_reset(d, slots * 2, old);
+                free(old);
+            }
+        }
+    }
+    free(key.data);
+    free(record.data);
+}
+
+/* Memoisation
+
+(memo f) wraps f in a function value that looks its arguments up in a hash table first. Entries are chained
+per bucket and kept on a doubly linked LRU list, the least recently used one is evicted once the table holds
+'capacity' results. Copies of the function value share the table, which is reference counted. (disk-memo name f)
+puts the on-disk cache behind the table.
+
+Arguments and results are kept in their binary encoding. Keys then match only values of the same types, 1 is not
+1.0, and every hit decodes a fresh result, so a caller changing a vector it got or gave never changes the cache.
+Calls with arguments or results that have no encoding, like records or queues, are not cached.
+*/
+
+#define LMEMO_CAPACITY 4096
+
+typedef struct
+{
+    unsigned long hash;
+    lbuf args;
+    lbuf result;
+    int chain;  // next entry in the same bucket
+    int newer;
+    int older;
+} lmemo_entry;
+
+struct lmemo
+{
+    int refs;
+    lval* fun;
+    int capacity;
+    int count;
+    lmemo_entry* entries;
+    int* buckets;
+    unsigned long mask;
+    int newest;
+    int oldest;
+    unsigned long hits;
+    unsigned long misses;
+    ldisk* disk;
+};
+
+lmemo* lmemo_new(lval* fun, int capacity)
+{
+    lmemo* m = malloc(sizeof(lmemo));
+    m->refs = 1;
+    m->fun = fun;
+    m->capacity = capacity;
+    m->count = 0;
+    m->entries = malloc(sizeof(lmemo_entry) * capacity);
+    unsigned long buckets = 1;
+    while (buckets < (unsigned long) capacity)
+    {
+        buckets <<= 1;
+    }
+    m->mask = buckets - 1;
+    m->buckets = malloc(sizeof(int) * buckets);
+    for (unsigned long i = 0; i < buckets; i++)
+    {
+        m->buckets[i] = -1;
+    }
+    m->newest = -1;
+    m->oldest = -1;
+    m->hits = 0;
+    m->misses = 0;
+    m->disk = NULL;
+    return m;
+}
+
+lmemo* lmemo_retain(lmemo* m)
+{
+    m->refs++;
+    return m;
+}
+
+void lmemo_release(lmemo* m)
+{
+    if (--m->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < m->count; i++)
+    {
+        free(m->entries[i].args.data);
+        free(m->entries[i].result.data);
+    }
+    if (m->disk != NULL)
+    {
+        ldisk_close(m->disk);
+    }
+    lval_del(m->fun);
+    free(m->entries);
+    free(m->buckets);
+    free(m);
+}
+
+void lmemo_print(lenv* e, lmemo* m)
+{
+    printf("<memo: ");
+    lval_print(e, m->fun);
+    putchar('>');
+}
+
+void lmemo_unlink(lmemo* m, int i)
+{
+    lmemo_entry* x = &m->entries[i];
+    if (x->newer >= 0)
+    {
+        m->entries[x->newer].older = x->older;
+    }
+    else
+    {
+        m->newest = x->older;
+    }
+    if (x->older >= 0)
+    {
+        m->entries[x->older].newer = x->newer;
+    }
+    else
+    {
+        m->oldest = x->newer;
+    }
+}
+
+void lmemo_push(lmemo* m, int i)
+{
+    lmemo_entry* x = &m->entries[i];
+    x->newer = -1;
+    x->older = m->newest;
+    if (m->newest >= 0)
+    {
+        m->entries[m->newest].newer = i;
+    }
+    m->newest = i;
+    if (m->oldest < 0)
+    {
+        m->oldest = i;
+    }
+}
+
+// Slot for a new entry, evicting the least recently used one when the table is full
+int lmemo_slot(lmemo* m)
+{
+    if (m->count < m->capacity)
+    {
+        return m->count++;
+    }
+    int i = m->oldest;
+    lmemo_entry* x = &m->entries[i];
+    int* link = &m->buckets[x->hash & m->mask];
+    while (*link != i)
+    {
+        link = &m->entries[*link].chain;
+    }
+    *link = x->chain;
+    lmemo_unlink(m, i);
+    free(x->args.data);
+    free(x->result.data);
+    return i;
+}
+
+lval* lmemo_call(lenv* e, lmemo* m, lval* a)
+{
+    lbuf args = { NULL, 0, 0 };
+    if (!lval_encode(&args, a))
+    {
+        free(args.data);
+        m->misses++;
+        lval* f = lval_copy(m->fun);
+        lval* result = lval_call(e, f, a);
+        lval_del(f);
+        return result;
+    }
+
+    unsigned long hash = (unsigned long) ldisk_hash(args.data, args.len);
+    for (int i = m->buckets[hash & m->mask]; i >= 0; i = m->entries[i].chain)
+    {
+        lmemo_entry* x = &m->entries[i];
+        if (x->hash == hash && x->args.len == args.len && memcmp(x->args.data, args.data, args.len) == 0)
+        {
+            m->hits++;
+            lmemo_unlink(m, i);
+            lmemo_push(m, i);
+            free(args.data);
+            lval_del(a);
+            lreader r = { x->result.data, x->result.data + x->result.len };
+            return lval_decode(&r);
+        }
+    }
+
+    lbuf encoded = { NULL, 0, 0 };
+    lval* result = m->disk != NULL ? ldisk_get(m->disk, &args) : NULL;
+    if (result != NULL)
+    {
+        m->hits++;
+        lval_del(a);
+        lval_encode(&encoded, result);
+    }
+    else
+    {
+        m->misses++;
+        lval* f = lval_copy(m->fun);
+        result = lval_call(e, f, a);
+        lval_del(f);
+        // Errors are not cached, the next call may well succeed
+        if (result->type == LVAL_ERR || !lval_encode(&encoded, result))
+        {
+            free(args.data);
+            free(encoded.data);
+            return result;
+        }
+        if (m->disk != NULL)
+        {
+            ldisk_put(m->disk, &args, &encoded);
+        }
+    }
+
+    int i = lmemo_slot(m);
+    lmemo_entry* x = &m->entries[i];
+    x->hash = hash;
+    x->args = args;
+    x->result = encoded;
+    x->chain = m->buckets[hash & m->mask];
+    m->buckets[hash & m->mask] = i;
+    lmemo_push(m, i);
+    return result;
+}
+
+LBUILTIN_DECL(builtin_memo)
+{
+    LASSERT_ARG_MIN(a, 1, "memo");
+    LASSERT(a, a->count <= 2, "Function 'memo' takes at most 2 arguments but %i was given.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "memo");
+    if (a->count == 2)
+    {
+        LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "memo");
+        LASSERT(a, a->cell[1]->integer > 0 && a->cell[1]->integer <= INT_MAX,
+                "Function 'memo' expected a positive capacity but got %li.", a->cell[1]->integer);
+    }
+
+    int capacity = a->count == 2 ? (int) a->cell[1]->integer : LMEMO_CAPACITY;
+    lval* v = lval_builtin(builtin_memo);
+    v->memo = lmemo_new(lval_pop(a, 0), capacity);
+    lval_del(a);
+    return v;
+}
+
+LBUILTIN_DECL(builtin_disk_memo)
+{
+    LASSERT_ARG_COUNT(a, 2, "disk-memo");
+    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "disk-memo");
+    LASSERT_ARG_TYPE(a, 1, LVAL_FUN, "disk-memo");
+
+    ldisk* d = ldisk_open(a->cell[0]->str, a->cell[1]);
+    LASSERT(a, d != NULL, "Function 'disk-memo' could not open the cache '%s'.", a->cell[0]->str);
+    lval* v = lval_builtin(builtin_memo);
+    v->memo = lmemo_new(lval_pop(a, 1), LMEMO_CAPACITY);
+    v->memo->disk = d;
+    lval_del(a);
+    return v;
+}
+
+// {hits misses size} of a memoised function
+LBUILTIN_DECL(builtin_memo_stats)
+{
+    LASSERT_ARG_COUNT(a, 1, "memo-stats");
+    LASSERT(a, a->cell[0]->type == LVAL_FUN && a->cell[0]->memo != NULL,
+            "Function 'memo-stats' expected a memoised function but got %s.", ltype_name(a->cell[0]->type));
+
+    lmemo* m = a->cell[0]->memo;
+    lval* q = lval_qexpr();
+    lval_add(q, lval_integer((long) m->hits));
+    lval_add(q, lval_integer((long) m->misses));
+    lval_add(q, lval_integer(m->count));
+    lval_del(a);
+    return q;
+}
+
+/* Sequences
+
+The list builtins work on the cell array of their argument directly: 'map', 'filter' and 'reverse' reuse the array
+of the list they are given, the others allocate the result at its final size. User functions are called through
+lval_apply, which binds the arguments straight into a new frame instead of copying the function value first.
+*/
+
+// Calls f with the arguments in a, takes ownership of a but not of f
+lval* lval_apply(lenv* e, lval* f, lval* a)
+{
+    if (f->builtin != NULL || f->memo != NULL)
+    {
+        return lval_call(e, f, a);
+    }
+    if (a->count != f->formals->count || lval_find_sym(f->formals, "&") >= 0)
+    {
+        // Partial application and variadic functions take the general path
+        lval* g = lval_copy(f);
+        lval* result = lval_call(e, g, a);
+        lval_del(g);
+        return result;
+    }
+
+    lenv* frame = lenv_copy(f->env);
+    frame->par = e;
+    for (int i = 0; i < a->count; i++)
+    {
+        int slot = lenv_slot(frame, f->formals->cell[i]->sym);
+        lval_del(frame->vals[slot]);
+        frame->vals[slot] = a->cell[i];
+    }
+    a->count = 0;
+    lval_del(a);
+    lval* body = lval_run_body(e, f);
+    lval* result = lval_no_recur(lval_eval_branch(frame, lval_copy(body)));
+    lenv_del(frame);
+    return result;
+}
+
+lval* lval_apply1(lenv* e, lval* f, lval* x)
+{
+    return lval_apply(e, f, lval_add(lval_sexpr(), x));
+}
+
+lval* lval_apply2(lenv* e, lval* f, lval* x, lval* y)
+{
+    return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+// Q-Expression with room for exactly n cells, filled in by the caller
+lval* lval_qexpr_sized(int n)
+{
+    lval* v = lval_qexpr();
+    v->count = n;
+    v->cell = malloc(sizeof(lval*) * (n > 0 ? n : 1));
+    return v;
+}
+
+// Clamps the integer at position pos to [0, n]
+long lval_clamp_count(lval* a, int pos, int n)
+{
+    long k = a->cell[pos]->integer;
+    return k < 0 ? 0 : k > n ? n : k;
+}
+
+// (map f l)
+LBUILTIN_DECL(builtin_map)
+{
+    LASSERT_ARG_COUNT(a, 2, "map");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "map");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "map");
+
+    lval* l = lval_pop(a, 1);
+    for (int i = 0; i < l->count; i++)
+    {
+        l->cell[i] = lval_apply1(e, a->cell[0], l->cell[i]);
+        if (l->cell[i]->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return lval_take(l, i);
+        }
+    }
+    lval_del(a);
+    return l;
+}
+
+// (filter f l), the items for which f is true
+LBUILTIN_DECL(builtin_filter)
+{
+    LASSERT_ARG_COUNT(a, 2, "filter");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "filter");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "filter");
+
+    lval* l = lval_pop(a, 1);
+    int kept = 0;
+    for (int i = 0; i < l->count; i++)
+    {
+        lval* x = l->cell[i];
+        lval* keep = lval_apply1(e, a->cell[0], lval_copy(x));
+        int truth = lval_truth(keep);
+        if (truth < 0)
+        {
+            // The cells from kept to i have been moved or deleted already
+            for (int j = i; j < l->count; j++)
+            {
+                lval_del(l->cell[j]);
+            }
+            l->count = kept;
+            lval_del(l);
+            lval_del(a);
+            return lval_truth_error("filter", keep, 0);
+        }
+        lval_del(keep);
+        if (truth)
+        {
+            l->cell[kept++] = x;
+        }
+        else
+        {
+            lval_del(x);
+        }
+    }
+    l->count = kept;
+    lval_del(a);
+    return l;
+}
+
+// (foldl f init l) is (f (f (f init x0) x1) x2)
+LBUILTIN_DECL(builtin_foldl)
+{
+    LASSERT_ARG_COUNT(a, 3, "foldl");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "foldl");
+    LASSERT_ARG_TYPE(a, 2, LVAL_QEXPR, "foldl");
+
+    lval* l = a->cell[2];
+    lval* acc = lval_pop(a, 1);
+    int used = 0;
+    while (used < l->count && acc->type != LVAL_ERR)
+    {
+        acc = lval_apply2(e, a->cell[0], acc, l->cell[used++]);
+    }
+    // Items passed to f belong to it now
+    if (used > 0)
+    {
+        memmove(&l->cell[0], &l->cell[used], sizeof(lval*) * (l->count - used));
+        l->count -= used;
+    }
+    lval_del(a);
+    return acc;
+}
+
+// (foldr f init l) is (f x0 (f x1 (f x2 init)))
+LBUILTIN_DECL(builtin_foldr)
+{
+    LASSERT_ARG_COUNT(a, 3, "foldr");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "foldr");
+    LASSERT_ARG_TYPE(a, 2, LVAL_QEXPR, "foldr");
+
+    lval* l = a->cell[2];
+    lval* acc = lval_pop(a, 1);
+    for (int i = l->count - 1; i >= 0 && acc->type != LVAL_ERR; i--)
+    {
+        acc = lval_apply2(e, a->cell[0], l->cell[i], acc);
+        l->count = i;
+    }
+    lval_del(a);
+    return acc;
+}
+
+// (range end), (range start end) or (range start end step), end excluded
+LBUILTIN_DECL(builtin_range)
+{
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+            "Function 'range' expected 1 to 3 arguments but got %i.", a->count);
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "range");
+    }
+
+    long start = a->count > 1 ? a->cell[0]->integer : 0;
+    long end = a->cell[a->count > 1 ? 1 : 0]->integer;
+    long step = a->count > 2 ? a->cell[2]->integer : 1;
+    LASSERT(a, step != 0, "Function 'range' was given a step of 0.");
+
+    long n = 0;
+    if (step > 0 && end > start)
+    {
+        n = (long) (((unsigned long) end - (unsigned long) start - 1) / (unsigned long) step) + 1;
+    }
+    else if (step < 0 && end < start)
+    {
+        n = (long) (((unsigned long) start - (unsigned long) end - 1) / (0UL - (unsigned long) step)) + 1;
+    }
+    LASSERT(a, n <= INT_MAX, "Function 'range' would produce %li items, more than a list holds.", n);
+    lval_del(a);
+
+    lval* q = lval_qexpr_sized((int) n);
+    for (long i = 0; i < n; i++)
+    {
+        q->cell[i] = lval_integer(start + i * step);
+    }
+    return q;
+}
+
+lval* llazy_take(lval* a);
+
+// (take n l), the first n items, of a lazy sequence too
+LBUILTIN_DECL(builtin_take)
+{
+    LASSERT_ARG_COUNT(a, 2, "take");
+    LASSERT_ARG_TYPE(a, 0, LVAL_INTEGER, "take");
+    LASSERT_ARG_TYPE2(a, 1, LVAL_QEXPR, LVAL_LAZY, "take");
+    if (a->cell[1]->type == LVAL_LAZY)
+    {
+        return llazy_take(a);
+    }
+
+    lval* l = a->cell[1];
+    int n = (int) lval_clamp_count(a, 0, l->count);
+    for (int i = n; i < l->count; i++)
+    {
+        lval_del(l->cell[i]);
+    }
+    l->count = n;
+    return lval_take(a, 1);
+}
+
+// (drop n l), all but the first n items
+LBUILTIN_DECL(builtin_drop)
+{
+    LASSERT_ARG_COUNT(a, 2, "drop");
+    LASSERT_ARG_TYPE(a, 0, LVAL_INTEGER, "drop");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "drop");
+
+    lval* l = a->cell[1];
+    int n = (int) lval_clamp_count(a, 0, l->count);
+    if (n > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            lval_del(l->cell[i]);
+        }
+        memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count - n));
+        l->count -= n;
+    }
+    return lval_take(a, 1);
+}
+
+// (zip l1 l2 ...), lists of the items at the same position, as long as the shortest list
+LBUILTIN_DECL(builtin_zip)
+{
+    LASSERT_ARG_MIN(a, 1, "zip");
+    int n = INT_MAX;
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_QEXPR, "zip");
+        n = a->cell[i]->count < n ? a->cell[i]->count : n;
+    }
+
+    lval* q = lval_qexpr_sized(n);
+    for (int i = 0; i < n; i++)
+    {
+        lval* t = lval_qexpr_sized(a->count);
+        for (int j = 0; j < a->count; j++)
+        {
+            t->cell[j] = a->cell[j]->cell[i];
+            a->cell[j]->cell[i] = NULL;
+        }
+        q->cell[i] = t;
+    }
+    for (int j = 0; j < a->count && n > 0; j++)
+    {
+        lval* l = a->cell[j];
+        memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count - n));
+        l->count -= n;
+    }
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_reverse)
+{
+    LASSERT_ARG_COUNT(a, 1, "reverse");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_STR, "reverse");
+
+    lval* x = lval_take(a, 0);
+    if (x->type == LVAL_QEXPR)
+    {
+        for (int i = 0, j = x->count - 1; i < j; i++, j--)
+        {
+            lval* t = x->cell[i];
+            x->cell[i] = x->cell[j];
+            x->cell[j] = t;
+        }
+    }
+    else
+    {
+        for (size_t i = 0, j = strlen(x->str); i + 1 < j; i++, j--)
+        {
+            char t = x->str[i];
+            x->str[i] = x->str[j - 1];
+            x->str[j - 1] = t;
+        }
+    }
+    return x;
+}
+
+// (nth n l), counting from 0
+LBUILTIN_DECL(builtin_nth)
+{
+    LASSERT_ARG_COUNT(a, 2, "nth");
+    LASSERT_ARG_TYPE(a, 0, LVAL_INTEGER, "nth");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "nth");
+
+    long n = a->cell[0]->integer;
+    int count = a->cell[1]->count;
+    LASSERT(a, n >= 0 && n < count, "Function 'nth' was given index %li for a list of %i items.", n, count);
+    return lval_take(lval_take(a, 1), (int) n);
+}
+
+LBUILTIN_DECL(builtin_last)
+{
+    LASSERT_ARG_COUNT(a, 1, "last");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "last");
+    LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "last");
+
+    lval* l = lval_take(a, 0);
+    return lval_take(l, l->count - 1);
+}
+
+/* Sorting
+
+(sort l) orders numbers by value and strings lexicographically. Lists of only integers go through an LSD radix
+sort, lists of only decimals or only strings through pdqsort, mixed numbers through the merge sort. (sort l less)
+and (sort-by key l) use a stable merge sort, calling the comparator or comparing keys computed once per item.
+*/
+
+#define LSORT_SMALL 24
+
+typedef struct
+{
+    lenv* e;
+    lval* less;  // user comparator, NULL for the natural order
+    int by_key;  // items are {key value} pairs ordered by key
+    char* fun;
+    lval* err;   // first error, comparisons are skipped after it
+} lsort_ctx;
+
+// Natural order of numbers and of strings, ok is cleared for anything else
+int lval_order(lval* x, lval* y, int* ok)
+{
+    if (x->type == LVAL_STR && y->type == LVAL_STR)
+    {
+        return strcmp(x->str, y->str);
+    }
+    if (!lval_is_number(x) || !lval_is_number(y))
+    {
+        *ok = 0;
+        return 0;
+    }
+    if (x->type == LVAL_INTEGER && y->type == LVAL_INTEGER)
+    {
+        return (x->integer > y->integer) - (x->integer < y->integer);
+    }
+    return lnum_cmp(x, y);
+}
+
+int lsort_less(lsort_ctx* c, lval* x, lval* y)
+{
+    if (c->err != NULL)
+    {
+        return 0;
+    }
+    if (c->by_key)
+    {
+        x = x->cell[0];
+        y = y->cell[0];
+    }
+    if (c->less == NULL)
+    {
+        int ok = 1;
+        int order = lval_order(x, y, &ok);
+        if (!ok)
+        {
+            c->err = lval_err("Function '%s' cannot order %s and %s.", c->fun, ltype_name(x->type), ltype_name(y->type));
+        }
+        return order < 0;
+    }
+    lval* r = lval_apply2(c->e, c->less, lval_copy(x), lval_copy(y));
+    int truth = lval_truth(r);
+    if (truth < 0)
+    {
+        c->err = lval_truth_error(c->fun, r, 1);
+        return 0;
+    }
+    lval_del(r);
+    return truth;
+}
+
+// Stable top-down merge sort of v[0, n) using tmp[0, n) as scratch
+void lsort_merge(lsort_ctx* c, lval** v, lval** tmp, int n)
+{
+    if (n <= LSORT_SMALL)
+    {
+        for (int i = 1; i < n; i++)
+        {
+            lval* x = v[i];
+            int j = i;
+            while (j > 0 && lsort_less(c, x, v[j - 1]))
+            {
+                v[j] = v[j - 1];
+                j--;
+            }
+            v[j] = x;
+        }
+        return;
+    }
+    int mid = n / 2;
+    lsort_merge(c, v, tmp, mid);
+    lsort_merge(c, v + mid, tmp, n - mid);
+    if (!lsort_less(c, v[mid], v[mid - 1]))
+    {
+        return;  // already in order
+    }
+    memcpy(tmp, v, sizeof(lval*) * mid);
+    int i = 0, j = mid, k = 0;
+    while (i < mid && j < n)
+    {
+        // Taking from the right only when strictly less keeps equal items in order
+        v[k++] = lsort_less(c, v[j], tmp[i]) ? v[j++] : tmp[i++];
+    }
+    while (i < mid)
+    {
+        v[k++] = tmp[i++];
+    }
+}
+
+// LSD radix sort of integers, one pass per byte, skipping bytes that are the same in every key
+void lsort_radix(lval** v, int n)
+{
+    unsigned long long* keys = malloc(sizeof(unsigned long long) * n * 2);
+    lval** tmp = malloc(sizeof(lval*) * n);
+    unsigned long long* kin = keys;
+    unsigned long long* kout = keys + n;
+    for (int i = 0; i < n; i++)
+    {
+        // Flipping the sign bit makes unsigned order match signed order
+        kin[i] = (unsigned long long) (long long) v[i]->integer ^ (1ULL << 63);
+    }
+
+    lval** vin = v;
+    lval** vout = tmp;
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        int counts[256] = { 0 };
+        for (int i = 0; i < n; i++)
+        {
+            counts[(kin[i] >> shift) & 0xff]++;
+        }
+        if (counts[(kin[0] >> shift) & 0xff] == n)
+        {
+            continue;
+        }
+        int pos = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            int k = counts[b];
+            counts[b] = pos;
+            pos += k;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int at = counts[(kin[i] >> shift) & 0xff]++;
+            kout[at] = kin[i];
+            vout[at] = vin[i];
+        }
+        unsigned long long* kt = kin; kin = kout; kout = kt;
+        lval** vt = vin; vin = vout; vout = vt;
+    }
+    if (vin != v)
+    {
+        memcpy(v, vin, sizeof(lval*) * n);
+    }
+    free(keys);
+    free(tmp);
+}
+
+typedef int (*lsort_cmp)(lval*, lval*);
+
+int lsort_cmp_decimal(lval* x, lval* y)
+{
+    return x->decimal < y->decimal;
+}
+
+int lsort_cmp_string(lval* x, lval* y)
+{
+    return strcmp(x->str, y->str) < 0;
+}
+
+void lsort_swap(lval** v, int i, int j)
+{
+    lval* t = v[i];
+    v[i] = v[j];
+    v[j] = t;
+}
+
+void lsort_insertion(lval** v, int n, lsort_cmp less)
+{
+    for (int i = 1; i < n; i++)
+    {
+        lval* x = v[i];
+        int j = i;
+        while (j > 0 && less(x, v[j - 1]))
+        {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = x;
+    }
+}
+
+// Insertion sort that gives up after a few moves, tells whether v is sorted
+int lsort_partial_insertion(lval** v, int n, lsort_cmp less)
+{
+    int moves = 0;
+    for (int i = 1; i < n; i++)
+    {
+        if (!less(v[i], v[i - 1]))
+        {
+            continue;
+        }
+        lval* x = v[i];
+        int j = i;
+        while (j > 0 && less(x, v[j - 1]))
+        {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = x;
+        moves += i - j;
+        if (moves > 8)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void lsort_sift(lval** v, int root, int n, lsort_cmp less)
+{
+    while (2 * root + 1 < n)
+    {
+        int child = 2 * root + 1;
+        if (child + 1 < n && less(v[child], v[child + 1]))
+        {
+            child++;
+        }
+        if (!less(v[root], v[child]))
+        {
+            return;
+        }
+        lsort_swap(v, root, child);
+        root = child;
+    }
+}
+
+void lsort_heap(lval** v, int n, lsort_cmp less)
+{
+    for (int i = n / 2 - 1; i >= 0; i--)
+    {
+        lsort_sift(v, i, n, less);
+    }
+    for (int i = n - 1; i > 0; i--)
+    {
+        lsort_swap(v, 0, i);
+        lsort_sift(v, 0, i, less);
+    }
+}
+
+void lsort_median3(lval** v, int a, int b, int c, lsort_cmp less)
+{
+    if (less(v[b], v[a])) lsort_swap(v, a, b);
+    if (less(v[c], v[b])) lsort_swap(v, b, c);
+    if (less(v[b], v[a])) lsort_swap(v, a, b);
+}
+
+/* Pattern-defeating quicksort
+
+Quicksort with a median of three (a pseudomedian of nine on large ranges) moved to the front as pivot. Runs of
+items equal to the pivot are partitioned to the left in one go, an already partitioned range is finished with a
+bounded insertion sort, and after too many unbalanced partitions a range falls back to heapsort, so the worst
+case stays O(n log n).
+*/
+void lsort_pdq(lval** v, int n, lsort_cmp less, int bad_allowed, int leftmost)
+{
+    while (n > LSORT_SMALL)
+    {
+        int half = n / 2;
+        if (n > 128)
+        {
+            lsort_median3(v, 0, half, n - 1, less);
+            lsort_median3(v, 1, half - 1, n - 2, less);
+            lsort_median3(v, 2, half + 1, n - 3, less);
+            lsort_median3(v, half - 1, half, half + 1, less);
+        }
+        else
+        {
+            lsort_median3(v, half, 0, n - 1, less);
+        }
+        lsort_swap(v, 0, half);
+
+        // Equal to the item before this range: everything equal to the pivot goes left and is done
+        if (!leftmost && !less(v[-1], v[0]))
+        {
+            int i = 0;
+            for (int j = 1; j < n; j++)
+            {
+                if (!less(v[0], v[j]))
+                {
+                    lsort_swap(v, ++i, j);
+                }
+            }
+            lsort_swap(v, 0, i);
+            v += i + 1;
+            n -= i + 1;
+            continue;
+        }
+
+        // Partition v[1, n) around v[0], items equal to the pivot go right
+        lval* pivot = v[0];
+        int first = 1;
+        int last = n - 1;
+        int already = 1;
+        while (1)
+        {
+            while (first <= last && less(v[first], pivot))
+            {
+                first++;
+            }
+            while (first <= last && !less(v[last], pivot))
+            {
+                last--;
+            }
+            if (first >= last)
+            {
+                break;
+            }
+            lsort_swap(v, first++, last--);
+            already = 0;
+        }
+        int p = first - 1;
+        lsort_swap(v, 0, p);
+
+        int left = p;
+        int right = n - p - 1;
+        if (left < n / 8 || right < n / 8)
+        {
+            if (--bad_allowed == 0)
+            {
+                lsort_heap(v, n, less);
+                return;
+            }
+            // Break up patterns that produced the unbalanced split
+            if (left >= LSORT_SMALL)
+            {
+                lsort_swap(v, 0, left / 4);
+                lsort_swap(v, p - 1, p - left / 4);
+            }
+            if (right >= LSORT_SMALL)
+            {
+                lsort_swap(v, p + 1, p + 1 + right / 4);
+                lsort_swap(v, n - 1, n - right / 4);
+            }
+        }
+        else if (already && lsort_partial_insertion(v, p, less) && lsort_partial_insertion(v + p + 1, right, less))
+        {
+            return;
+        }
+
+        // Recurse into the smaller side, loop on the larger one
+        if (left < right)
+        {
+            lsort_pdq(v, left, less, bad_allowed, leftmost);
+            v += p + 1;
+            n = right;
+            leftmost = 0;
+        }
+        else
+        {
+            lsort_pdq(v + p + 1, right, less, bad_allowed, 0);
+            n = left;
+        }
+    }
+    lsort_insertion(v, n, less);
+}
+
+int lsort_log2(int n)
+{
+    int log = 0;
+    while (n >>= 1)
+    {
+        log++;
+    }
+    return log;
+}
+
+// Sorts the cells of l in place, returns the first error or NULL
+lval* lsort_cells(lenv* e, lval* l, lval* less)
+{
+    int n = l->count;
+    if (n < 2)
+    {
+        return NULL;
+    }
+    lsort_ctx c = { e, less, 0, "sort", NULL };
+    if (less == NULL)
+    {
+        int ints = 0, decimals = 0, strings = 0;
+        for (int i = 0; i < n; i++)
+        {
+            lval_type_t t = l->cell[i]->type;
+            ints += t == LVAL_INTEGER;
+            decimals += t == LVAL_DECIMAL;
+            strings += t == LVAL_STR;
+            if (t != LVAL_STR && !lval_is_number(l->cell[i]))
+            {
+                return lval_err("Function 'sort' expected numbers or strings but got %s at position %i.", ltype_name(t), i);
+            }
+        }
+        if (strings > 0 && strings < n)
+        {
+            return lval_err("Function 'sort' cannot order strings together with numbers.");
+        }
+        if (ints == n)
+        {
+            lsort_radix(l->cell, n);
+            return NULL;
+        }
+        if (decimals == n || strings == n)
+        {
+            lsort_pdq(l->cell, n, decimals == n ? lsort_cmp_decimal : lsort_cmp_string, lsort_log2(n), 1);
+            return NULL;
+        }
+    }
+    lval** tmp = malloc(sizeof(lval*) * n);
+    lsort_merge(&c, l->cell, tmp, n);
+    free(tmp);
+    return c.err;
+}
+
+// (sort l) or (sort l less)
+LBUILTIN_DECL(builtin_sort)
+{
+    LASSERT(a, a->count == 1 || a->count == 2, "Function 'sort' expected 1 or 2 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "sort");
+    if (a->count == 2)
+    {
+        LASSERT_ARG_TYPE(a, 1, LVAL_FUN, "sort");
+    }
+
+    lval* err = lsort_cells(e, a->cell[0], a->count == 2 ? a->cell[1] : NULL);
+    if (err != NULL)
+    {
+        lval_del(a);
+        return err;
+    }
+    return lval_take(a, 0);
+}
+
+// (sort-by key l), ordered by (key x) computed once per item, stable
+LBUILTIN_DECL(builtin_sort_by)
+{
+    LASSERT_ARG_COUNT(a, 2, "sort-by");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "sort-by");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "sort-by");
+
+    // Sort {key item} pairs, the merge sort keeps items with equal keys in order
+    lval* l = lval_pop(a, 1);
+    for (int i = 0; i < l->count; i++)
+    {
+        lval* k = lval_apply1(e, a->cell[0], lval_copy(l->cell[i]));
+        l->cell[i] = lval_add(lval_add(lval_qexpr(), k), l->cell[i]);
+        if (k->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return lval_take(lval_take(l, i), 0);
+        }
+    }
+    lval_del(a);
+
+    lsort_ctx c = { e, NULL, 1, "sort-by", NULL };
+    lval** tmp = malloc(sizeof(lval*) * (l->count + 1));
+    lsort_merge(&c, l->cell, tmp, l->count);
+    free(tmp);
+    if (c.err != NULL)
+    {
+        lval_del(l);
+        return c.err;
+    }
+    for (int i = 0; i < l->count; i++)
+    {
+        l->cell[i] = lval_take(l->cell[i], 1);
+    }
+    return l;
+}
+
+// (binary-search x l) or (binary-search x l less) on a sorted list. The position of an item equal to x, or
+// -(p + 1) where p is the position x would be inserted at.
+LBUILTIN_DECL(builtin_binary_search)
+{
+    LASSERT(a, a->count == 2 || a->count == 3, "Function 'binary-search' expected 2 or 3 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "binary-search");
+    if (a->count == 3)
+    {
+        LASSERT_ARG_TYPE(a, 2, LVAL_FUN, "binary-search");
+    }
+
+    lsort_ctx c = { e, a->count == 3 ? a->cell[2] : NULL, 0, "binary-search", NULL };
+    lval* x = a->cell[0];
+    lval* l = a->cell[1];
+
+    // First position whose item is not less than x
+    int lo = 0;
+    int hi = l->count;
+    while (lo < hi && c.err == NULL)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (lsort_less(&c, l->cell[mid], x))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    int found = lo < l->count && !lsort_less(&c, x, l->cell[lo]);
+    lval_del(a);
+    if (c.err != NULL)
+    {
+        return c.err;
+    }
+    return lval_integer(found ? lo : -(lo + 1));
+}
+
+/* Vectors
+
+A vector is a growable array of values with O(1) indexed access. Unlike Q-Expressions its storage is shared
+between copies, so 'vec-set!' and 'vec-push!' on a vector bound to a variable update that variable. The
+storage is reference counted, a vector is never stored inside itself so counts cannot form cycles.
+*/
+
+lvec* lvec_new(int capacity)
+{
+    lvec* vec = malloc(sizeof(lvec));
+    vec->refs = 1;
+    vec->count = 0;
+    vec->capacity = capacity > 0 ? capacity : 1;
+    vec->items = malloc(sizeof(lval*) * vec->capacity);
+    return vec;
+}
+
+lvec* lvec_retain(lvec* vec)
+{
+    vec->refs++;
+    return vec;
+}
+
+void lvec_release(lvec* vec)
+{
+    if (--vec->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < vec->count; i++)
+    {
+        lval_del(vec->items[i]);
+    }
+    free(vec->items);
+    free(vec);
+}
+
+void lvec_push(lvec* vec, lval* x)
+{
+    if (vec->count == vec->capacity)
+    {
+        vec->capacity *= 2;
+        vec->items = realloc(vec->items, sizeof(lval*) * vec->capacity);
+    }
+    vec->items[vec->count++] = x;
+}
+
+// Vector holding the cells of q, which is consumed
+lval* lval_vector_from(lval* q)
+{
+    lvec* vec = malloc(sizeof(lvec));
+    vec->refs = 1;
+    vec->count = q->count;
+    vec->capacity = q->count > 0 ? q->count : 1;
+    vec->items = q->count > 0 ? q->cell : malloc(sizeof(lval*));
+    if (q->count == 0)
+    {
+        free(q->cell);
+    }
+    free(q);
+    return lval_vector(vec);
+}
+
+int lhamt_holds(lhamt_node* n, void* storage);
+int lomap_holds(lomap_node* n, void* storage);
+int llazy_holds(llazy* l, void* storage);
+int lpromise_holds(lpromise* p, void* storage);
+
+// Whether storing x in the vector, map, deque, queue or record with the given storage would make it contain itself
+int lval_holds(lval* x, void* storage)
+{
+    switch (x->type)
+    {
+        case LVAL_VECTOR:
+            if (x->vec == storage)
+            {
+                return 1;
+            }
+            for (int i = 0; i < x->vec->count; i++)
+            {
+                if (lval_holds(x->vec->items[i], storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        case LVAL_MAP:
+            if (x->map == storage)
+            {
+                return 1;
+            }
+            for (int i = 0; i < x->map->capacity; i++)
+            {
+                if (x->map->entries[i].key != NULL && lval_holds(x->map->entries[i].val, storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        case LVAL_PMAP:
+            return lhamt_holds(x->hamt, storage);
+        case LVAL_OMAP:
+            return x->omap == storage || lomap_holds(x->omap->root, storage);
+        case LVAL_DEQUE:
+            if (x->dq == storage)
+            {
+                return 1;
+            }
+            for (int i = 0; i < x->dq->count; i++)
+            {
+                if (lval_holds(LDEQUE_AT(x->dq, i), storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        case LVAL_PQ:
+            if (x->pq == storage)
+            {
+                return 1;
+            }
+            for (int i = 0; i < x->pq->count; i++)
+            {
+                if (lval_holds(x->pq->entries[i].item, storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        case LVAL_LAZY:
+            return llazy_holds(x->lazy, storage);
+        case LVAL_PROMISE:
+            return lpromise_holds(x->promise, storage);
+        case LVAL_RECORD:
+            if (x->rec == storage)
+            {
+                return 1;
+            }
+            for (int i = 0; i < x->rec->shape->count; i++)
+            {
+                if (lval_holds(x->rec->slots[i], storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < x->count; i++)
+            {
+                if (lval_holds(x->cell[i], storage))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+#define LASSERT_VEC_INDEX(a, vpos, ipos, n1) \
+    LASSERT(a, a->cell[ipos]->integer >= 0 && a->cell[ipos]->integer < a->cell[vpos]->vec->count, \
+            "Function '%s' was given index %li for a vector of %i items.", n1, a->cell[ipos]->integer, a->cell[vpos]->vec->count)
+
+LBUILTIN_DECL(builtin_vec)
+{
+    a->type = LVAL_QEXPR;
+    return lval_vector_from(a);
+}
+
+// (vec-make n fill), n copies of fill
+LBUILTIN_DECL(builtin_vec_make)
+{
+    LASSERT_ARG_COUNT(a, 2, "vec-make");
+    LASSERT_ARG_TYPE(a, 0, LVAL_INTEGER, "vec-make");
+    LASSERT(a, a->cell[0]->integer >= 0 && a->cell[0]->integer <= INT_MAX,
+            "Function 'vec-make' was given a size of %li.", a->cell[0]->integer);
+
+    int n = (int) a->cell[0]->integer;
+    lvec* vec = lvec_new(n);
+    for (int i = 0; i < n; i++)
+    {
+        vec->items[i] = lval_copy(a->cell[1]);
+    }
+    vec->count = n;
+    lval_del(a);
+    return lval_vector(vec);
+}
+
+// (vec-from l), the items of a Q-Expression
+LBUILTIN_DECL(builtin_vec_from)
+{
+    LASSERT_ARG_COUNT(a, 1, "vec-from");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "vec-from");
+    return lval_vector_from(lval_take(a, 0));
+}
+
+// (vec-list v), the items as a Q-Expression
+LBUILTIN_DECL(builtin_vec_list)
+{
+    LASSERT_ARG_COUNT(a, 1, "vec-list");
+    LASSERT_ARG_TYPE(a, 0, LVAL_VECTOR, "vec-list");
+
+    lvec* vec = a->cell[0]->vec;
+    lval* q = lval_qexpr_sized(vec->count);
+    for (int i = 0; i < vec->count; i++)
+    {
+        q->cell[i] = lval_copy(vec->items[i]);
+    }
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_vec_ref)
+{
+    LASSERT_ARG_COUNT(a, 2, "vec-ref");
+    LASSERT_ARG_TYPE(a, 0, LVAL_VECTOR, "vec-ref");
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "vec-ref");
+    LASSERT_VEC_INDEX(a, 0, 1, "vec-ref");
+
+    lval* x = lval_copy(a->cell[0]->vec->items[a->cell[1]->integer]);
+    lval_del(a);
+    return x;
+}
+
+// (vec-set! v i x) replaces item i, returns v
+LBUILTIN_DECL(builtin_vec_set)
+{
+    LASSERT_ARG_COUNT(a, 3, "vec-set!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_VECTOR, "vec-set!");
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "vec-set!");
+    LASSERT_VEC_INDEX(a, 0, 1, "vec-set!");
+    LASSERT(a, !lval_holds(a->cell[2], a->cell[0]->vec), "Function 'vec-set!' cannot store a vector inside itself.");
+
+    lvec* vec = a->cell[0]->vec;
+    long i = a->cell[1]->integer;
+    lval_del(vec->items[i]);
+    vec->items[i] = lval_pop(a, 2);
+    return lval_take(a, 0);
+}
+
+// (vec-push! v x...) appends the items, returns v
+LBUILTIN_DECL(builtin_vec_push)
+{
+    LASSERT_ARG_MIN(a, 1, "vec-push!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_VECTOR, "vec-push!");
+    for (int i = 1; i < a->count; i++)
+    {
+        LASSERT(a, !lval_holds(a->cell[i], a->cell[0]->vec), "Function 'vec-push!' cannot store a vector inside itself.");
+    }
+
+    lvec* vec = a->cell[0]->vec;
+    for (int i = 1; i < a->count; i++)
+    {
+        lvec_push(vec, a->cell[i]);
+    }
+    a->count = 1;
+    return lval_take(a, 0);
+}
+
+LBUILTIN_DECL(builtin_vec_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "vec-len");
+    LASSERT_ARG_TYPE(a, 0, LVAL_VECTOR, "vec-len");
+
+    lval* n = lval_integer(a->cell[0]->vec->count);
+    lval_del(a);
+    return n;
+}
+
+/* Typed arrays
+
+f64 and i64 arrays keep unboxed doubles or 64 bit integers in one contiguous block. Like vectors their storage
+is reference counted, but it is never changed after creation, so every operation returns a new array. The
+elementwise kernels have scalar, SSE2 and AVX2 versions, larr_kernels picks the best the CPU supports on first
+use. i64 arithmetic wraps around on overflow, comparisons produce i64 masks of 0 and 1. SIMD reductions add up
+decimals in a different order than a loop would, the last bits of a 'arr-sum' or 'arr-dot' may differ.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LARR_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LARR_TARGET_AVX2
+#else
+#define LARR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+typedef void (*larr_f64_binop)(double* r, double* x, double* y, int n);
+typedef void (*larr_i64_binop)(long long* r, long long* x, long long* y, int n);
+typedef void (*larr_f64_cmp)(long long* r, double* x, double* y, int n);
+typedef void (*larr_i64_cmp)(long long* r, long long* x, long long* y, int n);
+
+// Elementwise arithmetic: name, C operator, SSE2 and AVX2 intrinsics for doubles
+#define LARR_F64_OPS(X) \
+    X(add, +, _mm_add_pd, _mm256_add_pd) \
+    X(sub, -, _mm_sub_pd, _mm256_sub_pd) \
+    X(mul, *, _mm_mul_pd, _mm256_mul_pd) \
+    X(div, /, _mm_div_pd, _mm256_div_pd)
+
+// Comparisons: name, C operator, SSE2 intrinsic and AVX2 predicate for doubles
+#define LARR_CMPS(X) \
+    X(lt, <, _mm_cmplt_pd, _CMP_LT_OQ) \
+    X(le, <=, _mm_cmple_pd, _CMP_LE_OQ) \
+    X(gt, >, _mm_cmpgt_pd, _CMP_GT_OQ) \
+    X(ge, >=, _mm_cmpge_pd, _CMP_GE_OQ) \
+    X(eq, ==, _mm_cmpeq_pd, _CMP_EQ_OQ)
+
+#define LARR_CMP_ENUM(name, op, sse2, avx2) LARR_CMP_##name,
+typedef enum
+{
+    LARR_CMPS(LARR_CMP_ENUM)
+    LARR_CMP_COUNT
+} larr_cmp_t;
+
+typedef struct
+{
+    larr_f64_binop f64[4];  // add sub mul div
+    larr_i64_binop i64[3];  // add sub mul, division checks for zero and stays scalar
+    larr_f64_cmp f64_cmp[LARR_CMP_COUNT];
+    larr_i64_cmp i64_cmp[LARR_CMP_COUNT];
+    void (*f64_scale)(double* r, double* x, double k, int n);
+    double (*f64_sum)(double* x, int n);
+    double (*f64_dot)(double* x, double* y, int n);
+    long long (*i64_sum)(long long* x, int n);
+    double (*f64_min)(double* x, int n);
+    double (*f64_max)(double* x, int n);
+    long long (*i64_min)(long long* x, int n);
+    long long (*i64_max)(long long* x, int n);
+    char* level;
+} larr_kernel_set;
+
+/* Scalar kernels */
+
+#define LARR_F64_SCALAR(name, op, sse2, avx2) \
+    void larr_f64_##name##_scalar(double* r, double* x, double* y, int n) \
+    { \
+        for (int i = 0; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_F64_OPS(LARR_F64_SCALAR)
+
+// Unsigned arithmetic wraps instead of overflowing
+void larr_i64_add_scalar(long long* r, long long* x, long long* y, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = (long long) ((unsigned long long) x[i] + (unsigned long long) y[i]);
+}
+
+void larr_i64_sub_scalar(long long* r, long long* x, long long* y, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = (long long) ((unsigned long long) x[i] - (unsigned long long) y[i]);
+}
+
+void larr_i64_mul_scalar(long long* r, long long* x, long long* y, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = (long long) ((unsigned long long) x[i] * (unsigned long long) y[i]);
+}
+
+#define LARR_CMP_SCALAR(name, op, sse2, avx2) \
+    void larr_f64_##name##_scalar(long long* r, double* x, double* y, int n) \
+    { \
+        for (int i = 0; i < n; i++) r[i] = x[i] op y[i]; \
+    } \
+    void larr_i64_##name##_scalar(long long* r, long long* x, long long* y, int n) \
+    { \
+        for (int i = 0; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_CMPS(LARR_CMP_SCALAR)
+
+void larr_f64_scale_scalar(double* r, double* x, double k, int n)
+{
+    for (int i = 0; i < n; i++) r[i] = x[i] * k;
+}
+
+double larr_f64_sum_scalar(double* x, int n)
+{
+    double s = 0.0;
+    for (int i = 0; i < n; i++) s += x[i];
+    return s;
+}
+
+double larr_f64_dot_scalar(double* x, double* y, int n)
+{
+    double s = 0.0;
+    for (int i = 0; i < n; i++) s += x[i] * y[i];
+    return s;
+}
+
+long long larr_i64_sum_scalar(long long* x, int n)
+{
+    unsigned long long s = 0;
+    for (int i = 0; i < n; i++) s += (unsigned long long) x[i];
+    return (long long) s;
+}
+
+// Reductions of non-empty arrays
+#define LARR_MINMAX_SCALAR(name, type, op) \
+    type larr_##name##_scalar(type* x, int n) \
+    { \
+        type m = x[0]; \
+        for (int i = 1; i < n; i++) if (x[i] op m) m = x[i]; \
+        return m; \
+    }
+LARR_MINMAX_SCALAR(f64_min, double, <)
+LARR_MINMAX_SCALAR(f64_max, double, >)
+LARR_MINMAX_SCALAR(i64_min, long long, <)
+LARR_MINMAX_SCALAR(i64_max, long long, >)
+
+#ifdef LARR_X86
+
+/* SSE2 kernels, two doubles or two integers per instruction. The remaining items go through the scalar loop. */
+
+#define LARR_F64_SSE2(name, op, sse2, avx2) \
+    void larr_f64_##name##_sse2(double* r, double* x, double* y, int n) \
+    { \
+        int i = 0; \
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(r + i, sse2(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i))); \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_F64_OPS(LARR_F64_SSE2)
+
+#define LARR_CMP_SSE2(name, op, sse2, avx2) \
+    void larr_f64_##name##_sse2(long long* r, double* x, double* y, int n) \
+    { \
+        __m128i one = _mm_set1_epi64x(1); \
+        int i = 0; \
+        for (; i + 2 <= n; i += 2) \
+        { \
+            __m128d m = sse2(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)); \
+            _mm_storeu_si128((__m128i*) (r + i), _mm_and_si128(_mm_castpd_si128(m), one)); \
+        } \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_CMPS(LARR_CMP_SSE2)
+
+void larr_i64_add_sse2(long long* r, long long* x, long long* y, int n)
+{
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i s = _mm_add_epi64(_mm_loadu_si128((__m128i*) (x + i)), _mm_loadu_si128((__m128i*) (y + i)));
+        _mm_storeu_si128((__m128i*) (r + i), s);
+    }
+    larr_i64_add_scalar(r + i, x + i, y + i, n - i);
+}
+
+void larr_i64_sub_sse2(long long* r, long long* x, long long* y, int n)
+{
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i s = _mm_sub_epi64(_mm_loadu_si128((__m128i*) (x + i)), _mm_loadu_si128((__m128i*) (y + i)));
+        _mm_storeu_si128((__m128i*) (r + i), s);
+    }
+    larr_i64_sub_scalar(r + i, x + i, y + i, n - i);
+}
+
+void larr_f64_scale_sse2(double* r, double* x, double k, int n)
+{
+    __m128d kk = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(r + i, _mm_mul_pd(_mm_loadu_pd(x + i), kk));
+    for (; i < n; i++) r[i] = x[i] * k;
+}
+
+double larr_f64_sum_sse2(double* x, int n)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(x + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(x + i + 2));
+    }
+    double t[2];
+    _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+    return t[0] + t[1] + larr_f64_sum_scalar(x + i, n - i);
+}
+
+double larr_f64_dot_sse2(double* x, double* y, int n)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    double t[2];
+    _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+    return t[0] + t[1] + larr_f64_dot_scalar(x + i, y + i, n - i);
+}
+
+long long larr_i64_sum_sse2(long long* x, int n)
+{
+    __m128i s = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) s = _mm_add_epi64(s, _mm_loadu_si128((__m128i*) (x + i)));
+    long long t[2];
+    _mm_storeu_si128((__m128i*) t, s);
+    return (long long) ((unsigned long long) t[0] + (unsigned long long) t[1] + (unsigned long long) larr_i64_sum_scalar(x + i, n - i));
+}
+
+/* AVX2 kernels, four doubles or four integers per instruction. Compiled for AVX2 whatever the target of the
+rest of the file, only called once the CPU is known to support it. */
+
+#define LARR_F64_AVX2(name, op, sse2, avx2) \
+    LARR_TARGET_AVX2 void larr_f64_##name##_avx2(double* r, double* x, double* y, int n) \
+    { \
+        int i = 0; \
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(r + i, avx2(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i))); \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_F64_OPS(LARR_F64_AVX2)
+
+#define LARR_CMP_AVX2(name, op, sse2, avx2) \
+    LARR_TARGET_AVX2 void larr_f64_##name##_avx2(long long* r, double* x, double* y, int n) \
+    { \
+        __m256i one = _mm256_set1_epi64x(1); \
+        int i = 0; \
+        for (; i + 4 <= n; i += 4) \
+        { \
+            __m256d m = _mm256_cmp_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), avx2); \
+            _mm256_storeu_si256((__m256i*) (r + i), _mm256_and_si256(_mm256_castpd_si256(m), one)); \
+        } \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_CMPS(LARR_CMP_AVX2)
+
+// Integer comparisons from greater-than and equality, negating with xor where needed
+#define LARR_I64_CMP_AVX2(name, op, a, b, cmp, negate) \
+    LARR_TARGET_AVX2 void larr_i64_##name##_avx2(long long* r, long long* x, long long* y, int n) \
+    { \
+        __m256i one = _mm256_set1_epi64x(1); \
+        int i = 0; \
+        for (; i + 4 <= n; i += 4) \
+        { \
+            __m256i xx = _mm256_loadu_si256((__m256i*) (x + i)); \
+            __m256i yy = _mm256_loadu_si256((__m256i*) (y + i)); \
+            __m256i m = _mm256_and_si256(cmp(a, b), one); \
+            _mm256_storeu_si256((__m256i*) (r + i), negate ? _mm256_xor_si256(m, one) : m); \
+        } \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LARR_I64_CMP_AVX2(lt, <, yy, xx, _mm256_cmpgt_epi64, 0)
+LARR_I64_CMP_AVX2(le, <=, xx, yy, _mm256_cmpgt_epi64, 1)
+LARR_I64_CMP_AVX2(gt, >, xx, yy, _mm256_cmpgt_epi64, 0)
+LARR_I64_CMP_AVX2(ge, >=, yy, xx, _mm256_cmpgt_epi64, 1)
+LARR_I64_CMP_AVX2(eq, ==, xx, yy, _mm256_cmpeq_epi64, 0)
+
+LARR_TARGET_AVX2 void larr_i64_add_avx2(long long* r, long long* x, long long* y, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i s = _mm256_add_epi64(_mm256_loadu_si256((__m256i*) (x + i)), _mm256_loadu_si256((__m256i*) (y + i)));
+        _mm256_storeu_si256((__m256i*) (r + i), s);
+    }
+    larr_i64_add_scalar(r + i, x + i, y + i, n - i);
+}
+
+LARR_TARGET_AVX2 void larr_i64_sub_avx2(long long* r, long long* x, long long* y, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i s = _mm256_sub_epi64(_mm256_loadu_si256((__m256i*) (x + i)), _mm256_loadu_si256((__m256i*) (y + i)));
+        _mm256_storeu_si256((__m256i*) (r + i), s);
+    }
+    larr_i64_sub_scalar(r + i, x + i, y + i, n - i);
+}
+
+LARR_TARGET_AVX2 void larr_f64_scale_avx2(double* r, double* x, double k, int n)
+{
+    __m256d kk = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(r + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), kk));
+    for (; i < n; i++) r[i] = x[i] * k;
+}
+
+LARR_TARGET_AVX2 double larr_f64_sum_avx2(double* x, int n)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x + i + 4));
+    }
+    double t[4];
+    _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+    return (t[0] + t[1]) + (t[2] + t[3]) + larr_f64_sum_scalar(x + i, n - i);
+}
+
+LARR_TARGET_AVX2 double larr_f64_dot_avx2(double* x, double* y, int n)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    double t[4];
+    _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+    return (t[0] + t[1]) + (t[2] + t[3]) + larr_f64_dot_scalar(x + i, y + i, n - i);
+}
+
+LARR_TARGET_AVX2 long long larr_i64_sum_avx2(long long* x, int n)
+{
+    __m256i s = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) s = _mm256_add_epi64(s, _mm256_loadu_si256((__m256i*) (x + i)));
+    long long t[4];
+    _mm256_storeu_si256((__m256i*) t, s);
+    unsigned long long total = (unsigned long long) t[0] + (unsigned long long) t[1] + (unsigned long long) t[2] + (unsigned long long) t[3];
+    return (long long) (total + (unsigned long long) larr_i64_sum_scalar(x + i, n - i));
+}
+
+#define LARR_MINMAX_AVX2(name, pick, op) \
+    LARR_TARGET_AVX2 double larr_f64_##name##_avx2(double* x, int n) \
+    { \
+        int i = 0; \
+        double m = x[0]; \
+        if (n >= 4) \
+        { \
+            __m256d mm = _mm256_loadu_pd(x); \
+            for (i = 4; i + 4 <= n; i += 4) mm = pick(mm, _mm256_loadu_pd(x + i)); \
+            double t[4]; \
+            _mm256_storeu_pd(t, mm); \
+            m = t[0]; \
+            for (int j = 1; j < 4; j++) if (t[j] op m) m = t[j]; \
+        } \
+        for (; i < n; i++) if (x[i] op m) m = x[i]; \
+        return m; \
+    }
+LARR_MINMAX_AVX2(min, _mm256_min_pd, <)
+LARR_MINMAX_AVX2(max, _mm256_max_pd, >)
+
+#define LARR_I64_MINMAX_AVX2(name, a, b, op) \
+    LARR_TARGET_AVX2 long long larr_i64_##name##_avx2(long long* x, int n) \
+    { \
+        int i = 0; \
+        long long m = x[0]; \
+        if (n >= 4) \
+        { \
+            __m256i mm = _mm256_loadu_si256((__m256i*) x); \
+            for (i = 4; i + 4 <= n; i += 4) \
+            { \
+                __m256i xx = _mm256_loadu_si256((__m256i*) (x + i)); \
+                mm = _mm256_blendv_epi8(mm, xx, _mm256_cmpgt_epi64(a, b)); \
+            } \
+            long long t[4]; \
+            _mm256_storeu_si256((__m256i*) t, mm); \
+            m = t[0]; \
+            for (int j = 1; j < 4; j++) if (t[j] op m) m = t[j]; \
+        } \
+        for (; i < n; i++) if (x[i] op m) m = x[i]; \
+        return m; \
+    }
+LARR_I64_MINMAX_AVX2(min, mm, xx, <)
+LARR_I64_MINMAX_AVX2(max, xx, mm, >)
+
+int larr_has_avx2(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    // The OS must save the YMM registers too
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    {
+        return 0;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+#define LARR_F64_TABLE(level) \
+    { larr_f64_add_##level, larr_f64_sub_##level, larr_f64_mul_##level, larr_f64_div_##level }
+#define LARR_CMP_TABLE(kind, level) \
+    { larr_##kind##_lt_##level, larr_##kind##_le_##level, larr_##kind##_gt_##level, larr_##kind##_ge_##level, larr_##kind##_eq_##level }
+
+larr_kernel_set larr_scalar = {
+    LARR_F64_TABLE(scalar),
+    { larr_i64_add_scalar, larr_i64_sub_scalar, larr_i64_mul_scalar },
+    LARR_CMP_TABLE(f64, scalar),
+    LARR_CMP_TABLE(i64, scalar),
+    larr_f64_scale_scalar, larr_f64_sum_scalar, larr_f64_dot_scalar, larr_i64_sum_scalar,
+    larr_f64_min_scalar, larr_f64_max_scalar, larr_i64_min_scalar, larr_i64_max_scalar,
+    "scalar"
+};
+
+#ifdef LARR_X86
+larr_kernel_set larr_sse2 = {
+    LARR_F64_TABLE(sse2),
+    { larr_i64_add_sse2, larr_i64_sub_sse2, larr_i64_mul_scalar },
+    LARR_CMP_TABLE(f64, sse2),
+    LARR_CMP_TABLE(i64, scalar),
+    larr_f64_scale_sse2, larr_f64_sum_sse2, larr_f64_dot_sse2, larr_i64_sum_sse2,
+    larr_f64_min_scalar, larr_f64_max_scalar, larr_i64_min_scalar, larr_i64_max_scalar,
+    "sse2"
+};
+
+larr_kernel_set larr_avx2 = {
+    LARR_F64_TABLE(avx2),
+    { larr_i64_add_avx2, larr_i64_sub_avx2, larr_i64_mul_scalar },
+    LARR_CMP_TABLE(f64, avx2),
+    LARR_CMP_TABLE(i64, avx2),
+    larr_f64_scale_avx2, larr_f64_sum_avx2, larr_f64_dot_avx2, larr_i64_sum_avx2,
+    larr_f64_min_avx2, larr_f64_max_avx2, larr_i64_min_avx2, larr_i64_max_avx2,
+    "avx2"
+};
+#endif
+
+// SSE2 is part of every x86-64 CPU, AVX2 is checked for once
+larr_kernel_set* larr_kernels(void)
+{
+    static larr_kernel_set* k = NULL;
+    if (k == NULL)
+    {
+#ifdef LARR_X86
+        k = larr_has_avx2() ? &larr_avx2 : &larr_sse2;
+#else
+        k = &larr_scalar;
+#endif
+    }
+    return k;
+}
+
+larr* larr_new(larr_kind kind, int count)
+{
+    larr* arr = malloc(sizeof(larr));
+    arr->refs = 1;
+    arr->kind = kind;
+    arr->count = count;
+    arr->data = malloc(8 * (size_t) (count > 0 ? count : 1));
+    return arr;
+}
+
+larr* larr_retain(larr* arr)
+{
+    arr->refs++;
+    return arr;
+}
+
+void larr_release(larr* arr)
+{
+    if (--arr->refs == 0)
+    {
+        free(arr->data);
+        free(arr);
+    }
+}
+
+char* larr_kind_name(larr_kind kind)
+{
+    return kind == LARR_F64 ? "f64" : "i64";
+}
+
+// Item i as a number value
+lval* larr_item(larr* arr, int i)
+{
+    return arr->kind == LARR_F64 ? lval_decimal(((double*) arr->data)[i]) : lval_integer((long) ((long long*) arr->data)[i]);
+}
+
+// Builds an array of the given kind from a Q-Expression of numbers in one pass
+lval* larr_from_list(lval* q, larr_kind kind, char* fun)
+{
+    larr* arr = larr_new(kind, q->count);
+    for (int i = 0; i < q->count; i++)
+    {
+        lval* x = q->cell[i];
+        if (kind == LARR_F64 && lval_is_number(x))
+        {
+            ((double*) arr->data)[i] = lnum_to_double(x);
+        }
+        else if (kind == LARR_I64 && x->type == LVAL_INTEGER)
+        {
+            ((long long*) arr->data)[i] = x->integer;
+        }
+        else
+        {
+            larr_release(arr);
+            return lval_err("Function '%s' expected %s at position %i but got %s.", fun,
+                            ltype_name(kind == LARR_F64 ? LVAL_DECIMAL : LVAL_INTEGER), i, ltype_name(x->type));
+        }
+    }
+    return lval_array(arr);
+}
+
+// The operand at pos as an array like arr: an array of the same kind and length, or a number repeated
+larr* larr_operand(lval* a, int pos, larr* arr, char* fun, lval** err)
+{
+    lval* y = a->cell[pos];
+    if (y->type == LVAL_ARRAY)
+    {
+        if (y->arr->kind != arr->kind || y->arr->count != arr->count)
+        {
+            *err = lval_err("Function '%s' expected an %s array of %i items at position %i but got an %s array of %i.", fun,
+                            larr_kind_name(arr->kind), arr->count, pos, larr_kind_name(y->arr->kind), y->arr->count);
+            return NULL;
+        }
+        return larr_retain(y->arr);
+    }
+    if (arr->kind == LARR_F64 ? !lval_is_number(y) : y->type != LVAL_INTEGER)
+    {
+        *err = lval_err("Function '%s' expected an %s array or %s at position %i but got %s.", fun, larr_kind_name(arr->kind),
+                        ltype_name(arr->kind == LARR_F64 ? LVAL_DECIMAL : LVAL_INTEGER), pos, ltype_name(y->type));
+        return NULL;
+    }
+    larr* r = larr_new(arr->kind, arr->count);
+    for (int i = 0; i < arr->count; i++)
+    {
+        if (arr->kind == LARR_F64)
+        {
+            ((double*) r->data)[i] = lnum_to_double(y);
+        }
+        else
+        {
+            ((long long*) r->data)[i] = y->integer;
+        }
+    }
+    return r;
+}
+
+#define LASSERT_ARG_ARRAY(a, pos, n1) LASSERT_ARG_TYPE(a, pos, LVAL_ARRAY, n1)
+
+// (f64 l) and (i64 l)
+LBUILTIN_DECL(builtin_f64)
+{
+    LASSERT_ARG_COUNT(a, 1, "f64");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "f64");
+    lval* x = larr_from_list(a->cell[0], LARR_F64, "f64");
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_i64)
+{
+    LASSERT_ARG_COUNT(a, 1, "i64");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "i64");
+    lval* x = larr_from_list(a->cell[0], LARR_I64, "i64");
+    lval_del(a);
+    return x;
+}
+
+// (arr-list a), the items as a Q-Expression
+LBUILTIN_DECL(builtin_arr_list)
+{
+    LASSERT_ARG_COUNT(a, 1, "arr-list");
+    LASSERT_ARG_ARRAY(a, 0, "arr-list");
+
+    larr* arr = a->cell[0]->arr;
+    lval* q = lval_qexpr_sized(arr->count);
+    for (int i = 0; i < arr->count; i++)
+    {
+        q->cell[i] = larr_item(arr, i);
+    }
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_arr_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "arr-len");
+    LASSERT_ARG_ARRAY(a, 0, "arr-len");
+    lval* n = lval_integer(a->cell[0]->arr->count);
+    lval_del(a);
+    return n;
+}
+
+LBUILTIN_DECL(builtin_arr_ref)
+{
+    LASSERT_ARG_COUNT(a, 2, "arr-ref");
+    LASSERT_ARG_ARRAY(a, 0, "arr-ref");
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "arr-ref");
+    larr* arr = a->cell[0]->arr;
+    long i = a->cell[1]->integer;
+    LASSERT(a, i >= 0 && i < arr->count, "Function 'arr-ref' was given index %li for an array of %i items.", i, arr->count);
+    lval* x = larr_item(arr, (int) i);
+    lval_del(a);
+    return x;
+}
+
+typedef enum
+{
+    LARR_ADD,
+    LARR_SUB,
+    LARR_MUL,
+    LARR_DIV
+} larr_op;
+
+// Elementwise arithmetic, the second operand may be a number
+lval* builtin_arr_op(lenv* e, lval* a, char* fun, larr_op op)
+{
+    LASSERT_ARG_COUNT(a, 2, fun);
+    LASSERT_ARG_ARRAY(a, 0, fun);
+
+    larr* x = a->cell[0]->arr;
+    lval* err = NULL;
+    larr* y = larr_operand(a, 1, x, fun, &err);
+    if (y == NULL)
+    {
+        lval_del(a);
+        return err;
+    }
+
+    larr* r = larr_new(x->kind, x->count);
+    larr_kernel_set* k = larr_kernels();
+    if (x->kind == LARR_F64)
+    {
+        k->f64[op](r->data, x->data, y->data, x->count);
+    }
+    else if (op != LARR_DIV)
+    {
+        k->i64[op](r->data, x->data, y->data, x->count);
+    }
+    else
+    {
+        long long* xs = x->data;
+        long long* ys = y->data;
+        long long* rs = r->data;
+        for (int i = 0; i < x->count; i++)
+        {
+            if (ys[i] == 0 || (ys[i] == -1 && xs[i] == LLONG_MIN))
+            {
+                err = lval_err("Function '%s' cannot divide %lli by %lli at position %i.", fun, xs[i], ys[i], i);
+                break;
+            }
+            rs[i] = xs[i] / ys[i];
+        }
+    }
+    larr_release(y);
+    lval_del(a);
+    if (err != NULL)
+    {
+        larr_release(r);
+        return err;
+    }
+    return lval_array(r);
+}
+
+LBUILTIN_DECL(builtin_arr_add) { return builtin_arr_op(e, a, "arr-add", LARR_ADD); }
+LBUILTIN_DECL(builtin_arr_sub) { return builtin_arr_op(e, a, "arr-sub", LARR_SUB); }
+LBUILTIN_DECL(builtin_arr_mul) { return builtin_arr_op(e, a, "arr-mul", LARR_MUL); }
+LBUILTIN_DECL(builtin_arr_div) { return builtin_arr_op(e, a, "arr-div", LARR_DIV); }
+
+// (arr-scale a k), an f64 array multiplied by a number
+LBUILTIN_DECL(builtin_arr_scale)
+{
+    LASSERT_ARG_COUNT(a, 2, "arr-scale");
+    LASSERT_ARG_ARRAY(a, 0, "arr-scale");
+    LASSERT(a, a->cell[0]->arr->kind == LARR_F64, "Function 'arr-scale' expected an f64 array but got an i64 array.");
+    LASSERT_ARG_NUMBER(a, 1, "arr-scale");
+
+    larr* x = a->cell[0]->arr;
+    larr* r = larr_new(LARR_F64, x->count);
+    larr_kernels()->f64_scale(r->data, x->data, lnum_to_double(a->cell[1]), x->count);
+    lval_del(a);
+    return lval_array(r);
+}
+
+// Comparisons give an i64 mask of 1 where the comparison holds and 0 elsewhere
+lval* builtin_arr_cmp(lenv* e, lval* a, char* fun, larr_cmp_t cmp)
+{
+    LASSERT_ARG_COUNT(a, 2, fun);
+    LASSERT_ARG_ARRAY(a, 0, fun);
+
+    larr* x = a->cell[0]->arr;
+    lval* err = NULL;
+    larr* y = larr_operand(a, 1, x, fun, &err);
+    if (y == NULL)
+    {
+        lval_del(a);
+        return err;
+    }
+    larr* r = larr_new(LARR_I64, x->count);
+    larr_kernel_set* k = larr_kernels();
+    if (x->kind == LARR_F64)
+    {
+        k->f64_cmp[cmp](r->data, x->data, y->data, x->count);
+    }
+    else
+    {
+        k->i64_cmp[cmp](r->data, x->data, y->data, x->count);
+    }
+    larr_release(y);
+    lval_del(a);
+    return lval_array(r);
+}
+
+#define LARR_CMP_BUILTIN(name, op, sse2, avx2) \
+    LBUILTIN_DECL(builtin_arr_##name) { return builtin_arr_cmp(e, a, "arr-" #name, LARR_CMP_##name); }
+LARR_CMPS(LARR_CMP_BUILTIN)
+
+LBUILTIN_DECL(builtin_arr_sum)
+{
+    LASSERT_ARG_COUNT(a, 1, "arr-sum");
+    LASSERT_ARG_ARRAY(a, 0, "arr-sum");
+    larr* x = a->cell[0]->arr;
+    larr_kernel_set* k = larr_kernels();
+    lval* s = x->kind == LARR_F64 ? lval_decimal(k->f64_sum(x->data, x->count))
+                                  : lval_integer((long) k->i64_sum(x->data, x->count));
+    lval_del(a);
+    return s;
+}
+
+// (arr-dot a b), the sum of the products
+LBUILTIN_DECL(builtin_arr_dot)
+{
+    LASSERT_ARG_COUNT(a, 2, "arr-dot");
+    LASSERT_ARG_ARRAY(a, 0, "arr-dot");
+    larr* x = a->cell[0]->arr;
+    lval* err = NULL;
+    larr* y = larr_operand(a, 1, x, "arr-dot", &err);
+    if (y == NULL)
+    {
+        lval_del(a);
+        return err;
+    }
+
+    lval* s;
+    if (x->kind == LARR_F64)
+    {
+        s = lval_decimal(larr_kernels()->f64_dot(x->data, y->data, x->count));
+    }
+    else
+    {
+        // No SIMD multiply for 64 bit integers before AVX-512, products wrap like the other i64 operations
+        long long* xs = x->data;
+        long long* ys = y->data;
+        unsigned long long n = 0;
+        for (int i = 0; i < x->count; i++)
+        {
+            n += (unsigned long long) xs[i] * (unsigned long long) ys[i];
+        }
+        s = lval_integer((long) n);
+    }
+    larr_release(y);
+    lval_del(a);
+    return s;
+}
+
+lval* builtin_arr_extreme(lenv* e, lval* a, char* fun, int max)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_ARRAY(a, 0, fun);
+    larr* x = a->cell[0]->arr;
+    LASSERT(a, x->count > 0, "Function '%s' was given an empty array.", fun);
+
+    larr_kernel_set* k = larr_kernels();
+    lval* m;
+    if (x->kind == LARR_F64)
+    {
+        m = lval_decimal(max ? k->f64_max(x->data, x->count) : k->f64_min(x->data, x->count));
+    }
+    else
+    {
+        m = lval_integer((long) (max ? k->i64_max(x->data, x->count) : k->i64_min(x->data, x->count)));
+    }
+    lval_del(a);
+    return m;
+}
+
+LBUILTIN_DECL(builtin_arr_min) { return builtin_arr_extreme(e, a, "arr-min", 0); }
+LBUILTIN_DECL(builtin_arr_max) { return builtin_arr_extreme(e, a, "arr-max", 1); }
+
+/* Hash maps
+
+A map is a mutable hash table keyed by any value that is not itself mutable, with the hashing and equality of
+lval_hash and lval_eq, so 1 and 1.0 are the same key. Like vectors its storage is shared between copies.
+
+The table uses open addressing with Robin Hood probing. Every entry remembers how far it sits from the slot its
+hash points at; an insertion that has travelled further than the entry it meets takes that slot and carries on
+inserting the displaced entry. Probe lengths stay short and even at a 7/8 load, and a lookup can stop as soon
+as it meets an entry closer to home than the key would be. Deletion shifts the following entries back one slot
+instead of leaving tombstones.
+*/
+
+lmap* lmap_new(int capacity)
+{
+    int n = 8;
+    while (n * 7 / 8 < capacity)
+    {
+        n *= 2;
+    }
+    lmap* map = malloc(sizeof(lmap));
+    map->refs = 1;
+    map->count = 0;
+    map->capacity = n;
+    map->entries = calloc(n, sizeof(lmap_entry));
+    return map;
+}
+
+lmap* lmap_retain(lmap* map)
+{
+    map->refs++;
+    return map;
+}
+
+void lmap_release(lmap* map)
+{
+    if (--map->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < map->capacity; i++)
+    {
+        if (map->entries[i].key != NULL)
+        {
+            lval_del(map->entries[i].key);
+            lval_del(map->entries[i].val);
+        }
+    }
+    free(map->entries);
+    free(map);
+}
+
+// Slot holding key, or -1
+int lmap_find(lmap* map, lval* key, unsigned long hash)
+{
+    int mask = map->capacity - 1;
+    for (int dist = 0, i = (int) (hash & mask); ; dist++, i = (i + 1) & mask)
+    {
+        lmap_entry* entry = &map->entries[i];
+        if (entry->key == NULL || entry->dist < dist)
+        {
+            return -1;
+        }
+        if (entry->hash == hash && lval_eq(entry->key, key))
+        {
+            return i;
+        }
+    }
+}
+
+void lmap_insert(lmap* map, lmap_entry entry);
+
+void lmap_grow(lmap* map)
+{
+    lmap_entry* old = map->entries;
+    int capacity = map->capacity;
+    map->capacity *= 2;
+    map->count = 0;
+    map->entries = calloc(map->capacity, sizeof(lmap_entry));
+    for (int i = 0; i < capacity; i++)
+    {
+        if (old[i].key != NULL)
+        {
+            lmap_insert(map, old[i]);
+        }
+    }
+    free(old);
+}
+
+// Adds an entry whose key is not in the map yet, taking ownership of its key and value
+void lmap_insert(lmap* map, lmap_entry entry)
+{
+    if ((map->count + 1) * 8 > map->capacity * 7)
+    {
+        lmap_grow(map);
+    }
+    int mask = map->capacity - 1;
+    entry.dist = 0;
+    for (int i = (int) (entry.hash & mask); ; i = (i + 1) & mask, entry.dist++)
+    {
+        lmap_entry* slot = &map->entries[i];
+        if (slot->key == NULL)
+        {
+            *slot = entry;
+            map->count++;
+            return;
+        }
+        if (slot->dist < entry.dist)
+        {
+            lmap_entry t = *slot;
+            *slot = entry;
+            entry = t;
+        }
+    }
+}
+
+// Sets key to val, taking ownership of both
+void lmap_put(lmap* map, lval* key, lval* val)
+{
+    unsigned long hash = lval_hash(key);
+    int i = lmap_find(map, key, hash);
+    if (i >= 0)
+    {
+        lval_del(key);
+        lval_del(map->entries[i].val);
+        map->entries[i].val = val;
+        return;
+    }
+    lmap_entry entry = { hash, 0, key, val };
+    lmap_insert(map, entry);
+}
+
+void lmap_remove(lmap* map, lval* key)
+{
+    int i = lmap_find(map, key, lval_hash(key));
+    if (i < 0)
+    {
+        return;
+    }
+    lval_del(map->entries[i].key);
+    lval_del(map->entries[i].val);
+    int mask = map->capacity - 1;
+    int next = (i + 1) & mask;
+    while (map->entries[next].key != NULL && map->entries[next].dist > 0)
+    {
+        map->entries[i] = map->entries[next];
+        map->entries[i].dist--;
+        i = next;
+        next = (next + 1) & mask;
+    }
+    map->entries[i].key = NULL;
+    map->entries[i].val = NULL;
+    map->count--;
+}
+
+// Vectors, mutable maps, deques, queues, records, bitsets, bytes, lazy sequences and promises change under the
+// table, they cannot be keys
+int lmap_key_ok(lval* key)
+{
+    switch (key->type)
+    {
+        case LVAL_VECTOR:
+        case LVAL_MAP:
+        case LVAL_OMAP:
+        case LVAL_DEQUE:
+        case LVAL_PQ:
+        case LVAL_RECORD:
+        case LVAL_BITS:
+        case LVAL_BYTES:
+        case LVAL_LAZY:
+        case LVAL_PROMISE:
+            return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < key->count; i++)
+            {
+                if (!lmap_key_ok(key->cell[i]))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return 1;
+    }
+}
+
+#define LASSERT_MAP_KEY(a, pos, n1) \
+    LASSERT(a, lmap_key_ok(a->cell[pos]), "Function '%s' cannot use a mutable %s as a key.", n1, ltype_name(a->cell[pos]->type))
+
+// (map-new {k1 v1 k2 v2 ...}), (map-new {}) for an empty map
+LBUILTIN_DECL(builtin_map_new)
+{
+    LASSERT_ARG_COUNT(a, 1, "map-new");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "map-new");
+    lval* q = a->cell[0];
+    LASSERT(a, q->count % 2 == 0, "Function 'map-new' expected keys and values in pairs but got %i items.", q->count);
+    for (int i = 0; i < q->count; i += 2)
+    {
+        LASSERT(a, lmap_key_ok(q->cell[i]), "Function 'map-new' cannot use a mutable %s as a key.", ltype_name(q->cell[i]->type));
+    }
+
+    lmap* map = lmap_new(q->count / 2);
+    for (int i = 0; i < q->count; i += 2)
+    {
+        lmap_put(map, q->cell[i], q->cell[i + 1]);
+    }
+    q->count = 0;
+    lval_del(a);
+    return lval_map(map);
+}
+
+// (map-get m k) or (map-get m k default)
+LBUILTIN_DECL(builtin_map_get)
+{
+    LASSERT(a, a->count == 2 || a->count == 3, "Function 'map-get' expected 2 or 3 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, "map-get");
+
+    lmap* map = a->cell[0]->map;
+    int i = lmap_find(map, a->cell[1], lval_hash(a->cell[1]));
+    if (i >= 0)
+    {
+        lval* v = lval_copy(map->entries[i].val);
+        lval_del(a);
+        return v;
+    }
+    LASSERT(a, a->count == 3, "Function 'map-get' found no such key.");
+    return lval_take(a, 2);
+}
+
+LBUILTIN_DECL(builtin_map_has)
+{
+    LASSERT_ARG_COUNT(a, 2, "map-has");
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, "map-has");
+    lval* b = lval_boolean(lmap_find(a->cell[0]->map, a->cell[1], lval_hash(a->cell[1])) >= 0);
+    lval_del(a);
+    return b;
+}
+
+// (map-put! m k v), returns m
+LBUILTIN_DECL(builtin_map_put)
+{
+    LASSERT_ARG_COUNT(a, 3, "map-put!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, "map-put!");
+    LASSERT_MAP_KEY(a, 1, "map-put!");
+    LASSERT(a, !lval_holds(a->cell[2], a->cell[0]->map), "Function 'map-put!' cannot store a map inside itself.");
+
+    lval* val = lval_pop(a, 2);
+    lval* key = lval_pop(a, 1);
+    lmap_put(a->cell[0]->map, key, val);
+    return lval_take(a, 0);
+}
+
+// (map-del! m k), returns m
+LBUILTIN_DECL(builtin_map_del)
+{
+    LASSERT_ARG_COUNT(a, 2, "map-del!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, "map-del!");
+    lmap_remove(a->cell[0]->map, a->cell[1]);
+    return lval_take(a, 0);
+}
+
+LBUILTIN_DECL(builtin_map_size)
+{
+    LASSERT_ARG_COUNT(a, 1, "map-size");
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, "map-size");
+    lval* n = lval_integer(a->cell[0]->map->count);
+    lval_del(a);
+    return n;
+}
+
+// Keys, values or {key value} items of a map as a Q-Expression, in table order
+lval* lmap_list(lval* a, char* fun, int what)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_MAP, fun);
+
+    lmap* map = a->cell[0]->map;
+    lval* q = lval_qexpr_sized(map->count);
+    for (int i = 0, j = 0; i < map->capacity; i++)
+    {
+        lmap_entry* entry = &map->entries[i];
+        if (entry->key == NULL)
+        {
+            continue;
+        }
+        if (what == 0)
+        {
+            q->cell[j++] = lval_copy(entry->key);
+        }
+        else if (what == 1)
+        {
+            q->cell[j++] = lval_copy(entry->val);
+        }
+        else
+        {
+            q->cell[j++] = lval_add(lval_add(lval_qexpr(), lval_copy(entry->key)), lval_copy(entry->val));
+        }
+    }
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_map_keys) { return lmap_list(a, "map-keys", 0); }
+LBUILTIN_DECL(builtin_map_vals) { return lmap_list(a, "map-vals", 1); }
+LBUILTIN_DECL(builtin_map_items) { return lmap_list(a, "map-items", 2); }
+
+// (map-each f m) calls (f key value) for every entry
+LBUILTIN_DECL(builtin_map_each)
+{
+    LASSERT_ARG_COUNT(a, 2, "map-each");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "map-each");
+    LASSERT_ARG_TYPE(a, 1, LVAL_MAP, "map-each");
+
+    // Iterate over a snapshot, f may change the map
+    lval* items = lmap_list(lval_add(lval_sexpr(), lval_copy(a->cell[1])), "map-each", 2);
+    for (int i = 0; i < items->count; i++)
+    {
+        lval* item = items->cell[i];
+        lval* r = lval_apply2(e, a->cell[0], lval_copy(item->cell[0]), lval_copy(item->cell[1]));
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(items);
+            lval_del(a);
+            return r;
+        }
+        lval_del(r);
+    }
+    lval_del(items);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* Persistent maps
+
+(pmap {k v ...}) builds an immutable map, 'assoc' and 'dissoc' return new versions and leave the old one as it
+was. The map is a hash array mapped trie: each node covers 5 bits of the key hash and keeps a 32 bit bitmap of
+which of its 32 slots are used, with only the used slots stored, so finding a slot is a popcount. An update
+copies the nodes on the path from the root to the entry, at most one per 5 bits of hash, and shares every other
+node and entry with the old version. Nodes and entries are reference counted; copying a persistent map value,
+as reading a variable does, retains the root and never copies the trie. Keys whose whole hashes are equal share
+a collision node that is searched linearly.
+*/
+
+#define LHAMT_BITS 5
+#define LHAMT_HASH_BITS ((int) sizeof(unsigned long) * 8)
+
+int lpopcount32(unsigned int x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return (int) __popcnt(x);
+#else
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    return (int) ((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+}
+
+lhamt_leaf* lhamt_leaf_new(unsigned long hash, lval* key, lval* val)
+{
+    lhamt_leaf* leaf = malloc(sizeof(lhamt_leaf));
+    leaf->refs = 1;
+    leaf->hash = hash;
+    leaf->key = key;
+    leaf->val = val;
+    return leaf;
+}
+
+void lhamt_leaf_release(lhamt_leaf* leaf)
+{
+    if (--leaf->refs == 0)
+    {
+        lval_del(leaf->key);
+        lval_del(leaf->val);
+        free(leaf);
+    }
+}
+
+lhamt_node* lhamt_node_new(int count)
+{
+    lhamt_node* n = malloc(sizeof(lhamt_node));
+    n->refs = 1;
+    n->size = 0;
+    n->bitmap = 0;
+    n->collision = 0;
+    n->count = count;
+    n->slots = calloc(count > 0 ? count : 1, sizeof(lhamt_slot));
+    return n;
+}
+
+lhamt_node* lhamt_node_retain(lhamt_node* n)
+{
+    n->refs++;
+    return n;
+}
+
+void lhamt_node_release(lhamt_node* n)
+{
+    if (--n->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL)
+        {
+            lhamt_node_release(n->slots[i].node);
+        }
+        else
+        {
+            lhamt_leaf_release(n->slots[i].leaf);
+        }
+    }
+    free(n->slots);
+    free(n);
+}
+
+// Copy of n sharing its children and entries. grow 1 opens an empty slot at 'at', -1 drops the slot at 'at'.
+lhamt_node* lhamt_node_edit(lhamt_node* n, int at, int grow)
+{
+    lhamt_node* c = lhamt_node_new(n->count + grow);
+    c->size = n->size;
+    c->bitmap = n->bitmap;
+    c->collision = n->collision;
+    for (int i = 0, j = 0; i < n->count; i++, j++)
+    {
+        if (i == at && grow > 0)
+        {
+            j++;
+        }
+        if (i == at && grow < 0)
+        {
+            j--;
+            continue;
+        }
+        c->slots[j] = n->slots[i];
+        if (c->slots[j].node != NULL)
+        {
+            c->slots[j].node->refs++;
+        }
+        else
+        {
+            c->slots[j].leaf->refs++;
+        }
+    }
+    return c;
+}
+
+void lhamt_slot_release(lhamt_slot* s)
+{
+    if (s->node != NULL)
+    {
+        lhamt_node_release(s->node);
+    }
+    else
+    {
+        lhamt_leaf_release(s->leaf);
+    }
+    s->node = NULL;
+    s->leaf = NULL;
+}
+
+unsigned int lhamt_chunk(unsigned long hash, int shift)
+{
+    return (unsigned int) (hash >> shift) & ((1u << LHAMT_BITS) - 1);
+}
+
+// Position of bit among the used slots
+int lhamt_index(lhamt_node* n, unsigned int bit)
+{
+    return lpopcount32(n->bitmap & ((1u << bit) - 1));
+}
+
+lhamt_leaf* lhamt_get(lhamt_node* n, unsigned long hash, lval* key)
+{
+    for (int shift = 0; ; shift += LHAMT_BITS)
+    {
+        if (n->collision)
+        {
+            for (int i = 0; i < n->count; i++)
+            {
+                if (n->slots[i].leaf->hash == hash && lval_eq(n->slots[i].leaf->key, key))
+                {
+                    return n->slots[i].leaf;
+                }
+            }
+            return NULL;
+        }
+        unsigned int bit = lhamt_chunk(hash, shift);
+        if (!(n->bitmap & (1u << bit)))
+        {
+            return NULL;
+        }
+        lhamt_slot* s = &n->slots[lhamt_index(n, bit)];
+        if (s->leaf != NULL)
+        {
+            return s->leaf->hash == hash && lval_eq(s->leaf->key, key) ? s->leaf : NULL;
+        }
+        n = s->node;
+    }
+}
+
+// Node holding two entries with different keys, below the given shift
+lhamt_node* lhamt_pair(int shift, lhamt_leaf* a, lhamt_leaf* b)
+{
+    if (a->hash == b->hash || shift >= LHAMT_HASH_BITS)
+    {
+        lhamt_node* n = lhamt_node_new(2);
+        n->collision = 1;
+        n->size = 2;
+        n->slots[0].leaf = a;
+        n->slots[1].leaf = b;
+        a->refs++;
+        b->refs++;
+        return n;
+    }
+    unsigned int ca = lhamt_chunk(a->hash, shift);
+    unsigned int cb = lhamt_chunk(b->hash, shift);
+    if (ca == cb)
+    {
+        lhamt_node* n = lhamt_node_new(1);
+        n->bitmap = 1u << ca;
+        n->size = 2;
+        n->slots[0].node = lhamt_pair(shift + LHAMT_BITS, a, b);
+        return n;
+    }
+    lhamt_node* n = lhamt_node_new(2);
+    n->bitmap = (1u << ca) | (1u << cb);
+    n->size = 2;
+    n->slots[ca < cb ? 0 : 1].leaf = a;
+    n->slots[ca < cb ? 1 : 0].leaf = b;
+    a->refs++;
+    b->refs++;
+    return n;
+}
+
+// New version of n with the entry of leaf, sets added when the key was not there before
+lhamt_node* lhamt_assoc(lhamt_node* n, int shift, lhamt_leaf* leaf, int* added)
+{
+    if (n->collision)
+    {
+        for (int i = 0; i < n->count; i++)
+        {
+            if (lval_eq(n->slots[i].leaf->key, leaf->key))
+            {
+                lhamt_node* c = lhamt_node_edit(n, i, 0);
+                lhamt_slot_release(&c->slots[i]);
+                c->slots[i].leaf = leaf;
+                leaf->refs++;
+                *added = 0;
+                return c;
+            }
+        }
+        lhamt_node* c = lhamt_node_edit(n, n->count, 1);
+        c->slots[n->count].leaf = leaf;
+        leaf->refs++;
+        c->size++;
+        *added = 1;
+        return c;
+    }
+
+    unsigned int bit = lhamt_chunk(leaf->hash, shift);
+    int i = lhamt_index(n, bit);
+    if (!(n->bitmap & (1u << bit)))
+    {
+        lhamt_node* c = lhamt_node_edit(n, i, 1);
+        c->bitmap |= 1u << bit;
+        c->slots[i].leaf = leaf;
+        leaf->refs++;
+        c->size++;
+        *added = 1;
+        return c;
+    }
+
+    lhamt_slot* s = &n->slots[i];
+    lhamt_node* child;
+    if (s->node != NULL)
+    {
+        child = lhamt_assoc(s->node, shift + LHAMT_BITS, leaf, added);
+    }
+    else if (s->leaf->hash == leaf->hash && lval_eq(s->leaf->key, leaf->key))
+    {
+        lhamt_node* c = lhamt_node_edit(n, i, 0);
+        lhamt_slot_release(&c->slots[i]);
+        c->slots[i].leaf = leaf;
+        leaf->refs++;
+        *added = 0;
+        return c;
+    }
+    else
+    {
+        child = lhamt_pair(shift + LHAMT_BITS, s->leaf, leaf);
+        *added = 1;
+    }
+    lhamt_node* c = lhamt_node_edit(n, i, 0);
+    lhamt_slot_release(&c->slots[i]);
+    c->slots[i].node = child;
+    c->size += *added;
+    return c;
+}
+
+// New version of n without key, or n itself retained when the key is not there
+lhamt_node* lhamt_dissoc(lhamt_node* n, int shift, unsigned long hash, lval* key, int* removed)
+{
+    *removed = 0;
+    int i = -1;
+    unsigned int bit = 0;
+    if (n->collision)
+    {
+        for (int j = 0; j < n->count && i < 0; j++)
+        {
+            if (lval_eq(n->slots[j].leaf->key, key))
+            {
+                i = j;
+            }
+        }
+    }
+    else
+    {
+        bit = lhamt_chunk(hash, shift);
+        if (n->bitmap & (1u << bit))
+        {
+            i = lhamt_index(n, bit);
+        }
+    }
+    if (i < 0)
+    {
+        return lhamt_node_retain(n);
+    }
+
+    lhamt_slot* s = &n->slots[i];
+    if (s->leaf != NULL)
+    {
+        if (s->leaf->hash != hash || !lval_eq(s->leaf->key, key))
+        {
+            return lhamt_node_retain(n);
+        }
+        lhamt_node* c = lhamt_node_edit(n, i, -1);
+        c->bitmap &= ~(1u << bit);
+        c->size--;
+        *removed = 1;
+        return c;
+    }
+
+    lhamt_node* child = lhamt_dissoc(s->node, shift + LHAMT_BITS, hash, key, removed);
+    if (!*removed)
+    {
+        lhamt_node_release(child);
+        return lhamt_node_retain(n);
+    }
+    lhamt_node* c;
+    if (child->size == 0)
+    {
+        c = lhamt_node_edit(n, i, -1);
+        c->bitmap &= ~(1u << bit);
+        lhamt_node_release(child);
+    }
+    else if (child->count == 1 && child->slots[0].leaf != NULL)
+    {
+        // A lone entry moves up into this node
+        c = lhamt_node_edit(n, i, 0);
+        lhamt_slot_release(&c->slots[i]);
+        c->slots[i].leaf = child->slots[0].leaf;
+        c->slots[i].leaf->refs++;
+        lhamt_node_release(child);
+    }
+    else
+    {
+        c = lhamt_node_edit(n, i, 0);
+        lhamt_slot_release(&c->slots[i]);
+        c->slots[i].node = child;
+    }
+    c->size--;
+    return c;
+}
+
+// Calls f on every entry
+void lhamt_each(lhamt_node* n, void (*f)(lhamt_leaf* leaf, void* arg), void* arg)
+{
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL)
+        {
+            lhamt_each(n->slots[i].node, f, arg);
+        }
+        else
+        {
+            f(n->slots[i].leaf, arg);
+        }
+    }
+}
+
+// New version of root with key set to val, takes ownership of both
+lhamt_node* lhamt_put(lhamt_node* root, lval* key, lval* val)
+{
+    lhamt_leaf* leaf = lhamt_leaf_new(lval_hash(key), key, val);
+    int added;
+    lhamt_node* r = lhamt_assoc(root, 0, leaf, &added);
+    lhamt_leaf_release(leaf);
+    return r;
+}
+
+void lhamt_print(lenv* e, lhamt_node* n, int* first)
+{
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL)
+        {
+            lhamt_print(e, n->slots[i].node, first);
+            continue;
+        }
+        printf(*first ? "" : ", ");
+        lval_print(e, n->slots[i].leaf->key);
+        putchar(' ');
+        lval_print(e, n->slots[i].leaf->val);
+        *first = 0;
+    }
+}
+
+int lhamt_holds(lhamt_node* n, void* storage)
+{
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL ? lhamt_holds(n->slots[i].node, storage) : lval_holds(n->slots[i].leaf->val, storage))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether every entry of x is in y with an equal value
+int lhamt_subset(lhamt_node* x, lhamt_node* y)
+{
+    for (int i = 0; i < x->count; i++)
+    {
+        if (x->slots[i].node != NULL)
+        {
+            if (!lhamt_subset(x->slots[i].node, y))
+            {
+                return 0;
+            }
+            continue;
+        }
+        lhamt_leaf* leaf = x->slots[i].leaf;
+        lhamt_leaf* other = lhamt_get(y, leaf->hash, leaf->key);
+        if (other == NULL || !lval_eq(leaf->val, other->val))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sum of the entry hashes, the same whatever shape the trie has
+unsigned long long lhamt_hash(lhamt_node* n)
+{
+    unsigned long long sum = 0;
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL)
+        {
+            sum += lhamt_hash(n->slots[i].node);
+        }
+        else
+        {
+            sum += lhash_mix(n->slots[i].leaf->hash, lval_hash(n->slots[i].leaf->val));
+        }
+    }
+    return sum;
+}
+
+// Appends the keys and values of the subtree to kv, alternating
+void lhamt_entries(lhamt_node* n, lval** kv, int* count)
+{
+    for (int i = 0; i < n->count; i++)
+    {
+        if (n->slots[i].node != NULL)
+        {
+            lhamt_entries(n->slots[i].node, kv, count);
+        }
+        else
+        {
+            kv[(*count)++] = n->slots[i].leaf->key;
+            kv[(*count)++] = n->slots[i].leaf->val;
+        }
+    }
+}
+
+// (pmap {k1 v1 k2 v2 ...}), (pmap {}) for an empty map
+LBUILTIN_DECL(builtin_pmap)
+{
+    LASSERT_ARG_COUNT(a, 1, "pmap");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "pmap");
+    lval* q = a->cell[0];
+    LASSERT(a, q->count % 2 == 0, "Function 'pmap' expected keys and values in pairs but got %i items.", q->count);
+    for (int i = 0; i < q->count; i += 2)
+    {
+        LASSERT(a, lmap_key_ok(q->cell[i]), "Function 'pmap' cannot use a mutable %s as a key.", ltype_name(q->cell[i]->type));
+    }
+
+    lhamt_node* root = lhamt_node_new(0);
+    for (int i = 0; i < q->count; i += 2)
+    {
+        lhamt_node* r = lhamt_put(root, q->cell[i], q->cell[i + 1]);
+        lhamt_node_release(root);
+        root = r;
+    }
+    q->count = 0;
+    lval_del(a);
+    return lval_pmap(root);
+}
+
+// (assoc m k v ...), m with the keys set
+LBUILTIN_DECL(builtin_assoc)
+{
+    LASSERT_ARG_MIN(a, 3, "assoc");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "assoc");
+    LASSERT(a, a->count % 2 == 1, "Function 'assoc' expected keys and values in pairs but got %i items.", a->count - 1);
+    for (int i = 1; i < a->count; i += 2)
+    {
+        LASSERT_MAP_KEY(a, i, "assoc");
+    }
+
+    lhamt_node* root = lhamt_node_retain(a->cell[0]->hamt);
+    for (int i = 1; i < a->count; i += 2)
+    {
+        lhamt_node* r = lhamt_put(root, a->cell[i], a->cell[i + 1]);
+        lhamt_node_release(root);
+        root = r;
+    }
+    a->count = 1;
+    lval_del(a);
+    return lval_pmap(root);
+}
+
+// (dissoc m k ...), m without the keys
+LBUILTIN_DECL(builtin_dissoc)
+{
+    LASSERT_ARG_MIN(a, 2, "dissoc");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "dissoc");
+
+    lhamt_node* root = lhamt_node_retain(a->cell[0]->hamt);
+    for (int i = 1; i < a->count; i++)
+    {
+        int removed;
+        lhamt_node* r = lhamt_dissoc(root, 0, lval_hash(a->cell[i]), a->cell[i], &removed);
+        lhamt_node_release(root);
+        root = r;
+    }
+    lval_del(a);
+    return lval_pmap(root);
+}
+
+// (pmap-get m k) or (pmap-get m k default)
+LBUILTIN_DECL(builtin_pmap_get)
+{
+    LASSERT(a, a->count == 2 || a->count == 3, "Function 'pmap-get' expected 2 or 3 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "pmap-get");
+
+    lhamt_leaf* leaf = lhamt_get(a->cell[0]->hamt, lval_hash(a->cell[1]), a->cell[1]);
+    if (leaf != NULL)
+    {
+        lval* v = lval_copy(leaf->val);
+        lval_del(a);
+        return v;
+    }
+    LASSERT(a, a->count == 3, "Function 'pmap-get' found no such key.");
+    return lval_take(a, 2);
+}
+
+LBUILTIN_DECL(builtin_pmap_has)
+{
+    LASSERT_ARG_COUNT(a, 2, "pmap-has");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "pmap-has");
+    lval* b = lval_boolean(lhamt_get(a->cell[0]->hamt, lval_hash(a->cell[1]), a->cell[1]) != NULL);
+    lval_del(a);
+    return b;
+}
+
+LBUILTIN_DECL(builtin_pmap_size)
+{
+    LASSERT_ARG_COUNT(a, 1, "pmap-size");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "pmap-size");
+    lval* n = lval_integer(a->cell[0]->hamt->size);
+    lval_del(a);
+    return n;
+}
+
+void lhamt_add_key(lhamt_leaf* leaf, void* q)
+{
+    lval_add(q, lval_copy(leaf->key));
+}
+
+void lhamt_add_item(lhamt_leaf* leaf, void* q)
+{
+    lval_add(q, lval_add(lval_add(lval_qexpr(), lval_copy(leaf->key)), lval_copy(leaf->val)));
+}
+
+LBUILTIN_DECL(builtin_pmap_keys)
+{
+    LASSERT_ARG_COUNT(a, 1, "pmap-keys");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "pmap-keys");
+    lval* q = lval_qexpr();
+    lhamt_each(a->cell[0]->hamt, lhamt_add_key, q);
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_pmap_items)
+{
+    LASSERT_ARG_COUNT(a, 1, "pmap-items");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PMAP, "pmap-items");
+    lval* q = lval_qexpr();
+    lhamt_each(a->cell[0]->hamt, lhamt_add_item, q);
+    lval_del(a);
+    return q;
+}
+
+/* Ordered maps
+
+An ordered map is a mutable B-tree keyed by numbers or by strings, kept in the order of '<' for numbers and of
+strcmp for strings; one map cannot mix the two. Like hash maps its storage is shared between copies.
+
+Every node holds up to LOMAP_MAX entries. Next to each key it keeps an unboxed sort key, the value as a double
+for numbers or the first eight bytes of a string packed big endian, in a 64 byte aligned array at the start of
+the node. A search scans these cache lines and only looks at the keys themselves when two sort keys are equal,
+which decides between huge integers that round to the same double or strings sharing a prefix. Insertion splits
+full nodes on the way down and deletion tops up thin ones, so both finish in a single pass from the root.
+*/
+
+// Nodes are only allocated while a put is splitting them, which has no way back, so running out of memory ends
+// the program instead of leaving a half split tree
+lomap_node* lomap_node_new(void)
+{
+#if defined(_MSC_VER)
+    lomap_node* n = _aligned_malloc(sizeof(lomap_node), 64);
+#else
+    void* p;
+    lomap_node* n = posix_memalign(&p, 64, sizeof(lomap_node)) == 0 ? p : NULL;
+#endif
+    if (n == NULL)
+    {
+        fputs("Out of memory for an ordered map node\n", stderr);
+        abort();
+    }
+    n->count = 0;
+    n->children[0] = NULL;
+    return n;
+}
+
+void lomap_node_free(lomap_node* n)
+{
+#if defined(_MSC_VER)
+    _aligned_free(n);
+#else
+    free(n);
+#endif
+}
+
+void lomap_node_release(lomap_node* n)
+{
+    for (int i = 0; i < n->count; i++)
+    {
+        lval_del(n->keys[i]);
+        lval_del(n->vals[i]);
+    }
+    if (n->children[0] != NULL)
+    {
+        for (int i = 0; i <= n->count; i++)
+        {
+            lomap_node_release(n->children[i]);
+        }
+    }
+    lomap_node_free(n);
+}
+
+lomap* lomap_new(void)
+{
+    lomap* m = malloc(sizeof(lomap));
+    m->refs = 1;
+    m->count = 0;
+    m->strings = 0;
+    m->root = lomap_node_new();
+    return m;
+}
+
+lomap* lomap_retain(lomap* m)
+{
+    m->refs++;
+    return m;
+}
+
+void lomap_release(lomap* m)
+{
+    if (--m->refs > 0)
+    {
+        return;
+    }
+    lomap_node_release(m->root);
+    free(m);
+}
+
+// 1 for strings, 0 for numbers other than NaN, -1 for values that cannot be keys
+int lomap_key_kind(lval* key)
+{
+    if (key->type == LVAL_STR)
+    {
+        return 1;
+    }
+    return lval_is_number(key) && !(key->type == LVAL_DECIMAL && isnan(key->decimal)) ? 0 : -1;
+}
+
+// One map cannot mix string and number keys
+int lomap_key_ok(lomap* m, lval* key)
+{
+    int kind = lomap_key_kind(key);
+    return kind >= 0 && (m->count == 0 || kind == m->strings);
+}
+
+lomap_key lomap_sort_key(lval* key)
+{
+    lomap_key k;
+    if (key->type == LVAL_STR)
+    {
+        k.prefix = 0;
+        for (int i = 0; i < 8 && key->str[i] != '\0'; i++)
+        {
+            k.prefix |= (unsigned long long) (unsigned char) key->str[i] << (56 - 8 * i);
+        }
+    }
+    else
+    {
+        k.num = lnum_to_double(key);
+    }
+    return k;
+}
+
+int lomap_cmp(lomap* m, lomap_key ka, lval* a, lomap_key kb, lval* b)
+{
+    if (m->strings)
+    {
+        if (ka.prefix != kb.prefix)
+        {
+            return ka.prefix < kb.prefix ? -1 : 1;
+        }
+        return strcmp(a->str, b->str);
+    }
+    if (ka.num != kb.num)
+    {
+        return ka.num < kb.num ? -1 : 1;
+    }
+    int ok = 1;
+    return lval_order(a, b, &ok);
+}
+
+// Index of the first entry of n that is not below key
+int lomap_lower(lomap* m, lomap_node* n, lomap_key k, lval* key)
+{
+    int i = 0;
+    while (i < n->count && lomap_cmp(m, n->sort[i], n->keys[i], k, key) < 0)
+    {
+        i++;
+    }
+    return i;
+}
+
+// Node holding key with its index in *at, or NULL
+lomap_node* lomap_find(lomap* m, lval* key, int* at)
+{
+    if (!lomap_key_ok(m, key) || m->count == 0)
+    {
+        return NULL;
+    }
+    lomap_key k = lomap_sort_key(key);
+    lomap_node* n = m->root;
+    while (n != NULL)
+    {
+        int i = lomap_lower(m, n, k, key);
+        if (i < n->count && lomap_cmp(m, n->sort[i], n->keys[i], k, key) == 0)
+        {
+            *at = i;
+            return n;
+        }
+        n = n->children[0] != NULL ? n->children[i] : NULL;
+    }
+    return NULL;
+}
+
+// Opens a gap at entry i, and at child c in inner nodes
+void lomap_shift_up(lomap_node* n, int i, int c)
+{
+    int moved = n->count - i;
+    memmove(&n->sort[i + 1], &n->sort[i], sizeof(lomap_key) * moved);
+    memmove(&n->keys[i + 1], &n->keys[i], sizeof(lval*) * moved);
+    memmove(&n->vals[i + 1], &n->vals[i], sizeof(lval*) * moved);
+    if (n->children[0] != NULL)
+    {
+        memmove(&n->children[c + 1], &n->children[c], sizeof(lomap_node*) * (n->count + 1 - c));
+    }
+    n->count++;
+}
+
+// Closes the gap at entry i and at child c
+void lomap_shift_down(lomap_node* n, int i, int c)
+{
+    int moved = n->count - i - 1;
+    memmove(&n->sort[i], &n->sort[i + 1], sizeof(lomap_key) * moved);
+    memmove(&n->keys[i], &n->keys[i + 1], sizeof(lval*) * moved);
+    memmove(&n->vals[i], &n->vals[i + 1], sizeof(lval*) * moved);
+    if (n->children[0] != NULL)
+    {
+        memmove(&n->children[c], &n->children[c + 1], sizeof(lomap_node*) * (n->count - c));
+    }
+    n->count--;
+}
+
+void lomap_move(lomap_node* to, int i, lomap_node* from, int j)
+{
+    to->sort[i] = from->sort[j];
+    to->keys[i] = from->keys[j];
+    to->vals[i] = from->vals[j];
+}
+
+// Splits the full child i of n, its middle entry moves up into n
+void lomap_split(lomap_node* n, int i)
+{
+    lomap_node* left = n->children[i];
+    lomap_node* right = lomap_node_new();
+    right->count = LOMAP_DEGREE - 1;
+    for (int j = 0; j < LOMAP_DEGREE - 1; j++)
+    {
+        lomap_move(right, j, left, j + LOMAP_DEGREE);
+    }
+    if (left->children[0] != NULL)
+    {
+        memcpy(right->children, &left->children[LOMAP_DEGREE], sizeof(lomap_node*) * LOMAP_DEGREE);
+    }
+    left->count = LOMAP_DEGREE - 1;
+
+    lomap_shift_up(n, i, i + 1);
+    lomap_move(n, i, left, LOMAP_DEGREE - 1);
+    n->children[i + 1] = right;
+}
+
+// Sets key to val, taking ownership of both
+void lomap_put(lomap* m, lval* key, lval* val)
+{
+    if (m->count == 0)
+    {
+        m->strings = key->type == LVAL_STR;
+    }
+    if (m->root->count == LOMAP_MAX)
+    {
+        lomap_node* root = lomap_node_new();
+        root->children[0] = m->root;
+        m->root = root;
+        lomap_split(root, 0);
+    }
+
+    lomap_key k = lomap_sort_key(key);
+    lomap_node* n = m->root;
+    for (;;)
+    {
+        int i = lomap_lower(m, n, k, key);
+        if (i < n->count && lomap_cmp(m, n->sort[i], n->keys[i], k, key) == 0)
+        {
+            lval_del(key);
+            lval_del(n->vals[i]);
+            n->vals[i] = val;
+            return;
+        }
+        if (n->children[0] == NULL)
+        {
+            lomap_shift_up(n, i, i + 1);
+            n->sort[i] = k;
+            n->keys[i] = key;
+            n->vals[i] = val;
+            m->count++;
+            return;
+        }
+        if (n->children[i]->count == LOMAP_MAX)
+        {
+            lomap_split(n, i);
+            // The middle entry that came up may be the key, or decide which half to take
+            continue;
+        }
+        n = n->children[i];
+    }
+}
+
+// Joins child i + 1 of n and the entry between them onto child i
+void lomap_merge(lomap_node* n, int i)
+{
+    lomap_node* left = n->children[i];
+    lomap_node* right = n->children[i + 1];
+    lomap_move(left, left->count, n, i);
+    for (int j = 0; j < right->count; j++)
+    {
+        lomap_move(left, left->count + 1 + j, right, j);
+    }
+    if (left->children[0] != NULL)
+    {
+        memcpy(&left->children[left->count + 1], right->children, sizeof(lomap_node*) * (right->count + 1));
+    }
+    left->count += 1 + right->count;
+    lomap_node_free(right);
+    lomap_shift_down(n, i, i + 1);
+}
+
+// Makes sure child i of n has more than the minimum of entries before the search descends into it, returns the
+// child to descend into
+lomap_node* lomap_fill(lomap_node* n, int i)
+{
+    lomap_node* c = n->children[i];
+    if (c->count >= LOMAP_DEGREE)
+    {
+        return c;
+    }
+    if (i > 0 && n->children[i - 1]->count >= LOMAP_DEGREE)
+    {
+        // Rotate the last entry of the left sibling through n
+        lomap_node* left = n->children[i - 1];
+        lomap_shift_up(c, 0, 0);
+        if (c->children[0] != NULL)
+        {
+            c->children[0] = left->children[left->count];
+        }
+        lomap_move(c, 0, n, i - 1);
+        lomap_move(n, i - 1, left, left->count - 1);
+        left->count--;
+        return c;
+    }
+    if (i < n->count && n->children[i + 1]->count >= LOMAP_DEGREE)
+    {
+        // Rotate the first entry of the right sibling through n
+        lomap_node* right = n->children[i + 1];
+        lomap_move(c, c->count, n, i);
+        if (c->children[0] != NULL)
+        {
+            c->children[c->count + 1] = right->children[0];
+        }
+        c->count++;
+        lomap_move(n, i, right, 0);
+        lomap_shift_down(right, 0, 0);
+        return c;
+    }
+    if (i == n->count)
+    {
+        i--;
+    }
+    lomap_merge(n, i);
+    return n->children[i];
+}
+
+// Takes the entry for key out of the subtree of n into *key_out and *val_out, returns 0 if there is none
+int lomap_take(lomap* m, lomap_node* n, lomap_key k, lval* key, lomap_key* k_out, lval** key_out, lval** val_out)
+{
+    for (;;)
+    {
+        int i = lomap_lower(m, n, k, key);
+        int found = i < n->count && lomap_cmp(m, n->sort[i], n->keys[i], k, key) == 0;
+        if (n->children[0] == NULL)
+        {
+            if (!found)
+            {
+                return 0;
+            }
+            *k_out = n->sort[i];
+            *key_out = n->keys[i];
+            *val_out = n->vals[i];
+            lomap_shift_down(n, i, i + 1);
+            return 1;
+        }
+        if (!found)
+        {
+            n = lomap_fill(n, i);
+            continue;
+        }
+
+        lomap_node* left = n->children[i];
+        lomap_node* right = n->children[i + 1];
+        if (left->count < LOMAP_DEGREE && right->count < LOMAP_DEGREE)
+        {
+            lomap_merge(n, i);
+            n = left;
+            continue;
+        }
+        // Replace the entry by its predecessor or successor, taken out of the fuller side
+        *k_out = n->sort[i];
+        *key_out = n->keys[i];
+        *val_out = n->vals[i];
+        lomap_node* side = left->count >= LOMAP_DEGREE ? left : right;
+        lomap_node* leaf = side;
+        while (leaf->children[0] != NULL)
+        {
+            leaf = leaf->children[side == left ? leaf->count : 0];
+        }
+        int j = side == left ? leaf->count - 1 : 0;
+        lomap_key sk = leaf->sort[j];
+        lval* sval;
+        lomap_take(m, side, sk, leaf->keys[j], &n->sort[i], &n->keys[i], &sval);
+        n->vals[i] = sval;
+        return 1;
+    }
+}
+
+void lomap_remove(lomap* m, lval* key)
+{
+    if (!lomap_key_ok(m, key) || m->count == 0)
+    {
+        return;
+    }
+    lomap_key k;
+    lval* old_key;
+    lval* old_val;
+    if (lomap_take(m, m->root, lomap_sort_key(key), key, &k, &old_key, &old_val))
+    {
+        lval_del(old_key);
+        lval_del(old_val);
+        m->count--;
+    }
+    if (m->root->count == 0 && m->root->children[0] != NULL)
+    {
+        lomap_node* root = m->root;
+        m->root = root->children[0];
+        lomap_node_free(root);
+    }
+}
+
+// Appends the entries of the subtree of n from lo up to but not including hi to q, either bound may be NULL.
+// what picks keys, values or {key value} items. Returns 0 once an entry reaches hi.
+int lomap_collect(lomap* m, lomap_node* n, lval* lo, lval* hi, lval* q, int what)
+{
+    int i = 0;
+    if (lo != NULL)
+    {
+        i = lomap_lower(m, n, lomap_sort_key(lo), lo);
+    }
+    lomap_key khi = { 0 };
+    if (hi != NULL)
+    {
+        khi = lomap_sort_key(hi);
+    }
+    for (; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL && !lomap_collect(m, n->children[i], lo, hi, q, what))
+        {
+            return 0;
+        }
+        // Only the first child visited can hold entries below lo
+        lo = NULL;
+        if (i == n->count)
+        {
+            break;
+        }
+        if (hi != NULL && lomap_cmp(m, n->sort[i], n->keys[i], khi, hi) >= 0)
+        {
+            return 0;
+        }
+        if (what == 0)
+        {
+            q->cell[q->count++] = lval_copy(n->keys[i]);
+        }
+        else if (what == 1)
+        {
+            q->cell[q->count++] = lval_copy(n->vals[i]);
+        }
+        else
+        {
+            q->cell[q->count++] = lval_add(lval_add(lval_qexpr(), lval_copy(n->keys[i])), lval_copy(n->vals[i]));
+        }
+    }
+    return 1;
+}
+
+lval* lomap_list(lomap* m, lval* lo, lval* hi, int what)
+{
+    lval* q = lval_qexpr_sized(m->count);
+    q->count = 0;
+    lomap_collect(m, m->root, lo, hi, q, what);
+    if (q->count > 0 && q->count < m->count)
+    {
+        q->cell = realloc(q->cell, sizeof(lval*) * q->count);
+    }
+    return q;
+}
+
+void lomap_print(lenv* e, lomap_node* n, int* first)
+{
+    for (int i = 0; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL)
+        {
+            lomap_print(e, n->children[i], first);
+        }
+        if (i < n->count)
+        {
+            printf(*first ? "" : ", ");
+            lval_print(e, n->keys[i]);
+            putchar(' ');
+            lval_print(e, n->vals[i]);
+            *first = 0;
+        }
+    }
+}
+
+// Whether every entry of the subtree of n is in y with an equal value
+int lomap_subset(lomap_node* n, lomap* y)
+{
+    for (int i = 0; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL && !lomap_subset(n->children[i], y))
+        {
+            return 0;
+        }
+        if (i < n->count)
+        {
+            int at;
+            lomap_node* other = lomap_find(y, n->keys[i], &at);
+            if (other == NULL || !lval_eq(n->vals[i], other->vals[at]))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+unsigned long long lomap_hash(lomap_node* n)
+{
+    unsigned long long h = 0;
+    for (int i = 0; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL)
+        {
+            h = lhash_mix(h, lomap_hash(n->children[i]));
+        }
+        if (i < n->count)
+        {
+            h = lhash_mix(h, lhash_mix(lval_hash(n->keys[i]), lval_hash(n->vals[i])));
+        }
+    }
+    return h;
+}
+
+int lomap_holds(lomap_node* n, void* storage)
+{
+    for (int i = 0; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL && lomap_holds(n->children[i], storage))
+        {
+            return 1;
+        }
+        if (i < n->count && lval_holds(n->vals[i], storage))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lomap_encode(lbuf* b, lomap_node* n)
+{
+    for (int i = 0; i <= n->count; i++)
+    {
+        if (n->children[0] != NULL && !lomap_encode(b, n->children[i]))
+        {
+            return 0;
+        }
+        if (i < n->count && (!lval_encode(b, n->keys[i]) || !lval_encode(b, n->vals[i])))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define LASSERT_OMAP_KEY(a, m, pos, n1) \
+    LASSERT(a, lomap_key_ok(m, a->cell[pos]), "Function '%s' cannot order a %s key among %s keys.", \
+            n1, ltype_name(a->cell[pos]->type), (m)->count == 0 ? "Number or String" : (m)->strings ? "String" : "Number")
+
+// (omap-new {k1 v1 k2 v2 ...}), (omap-new {}) for an empty map
+LBUILTIN_DECL(builtin_omap_new)
+{
+    LASSERT_ARG_COUNT(a, 1, "omap-new");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "omap-new");
+    lval* q = a->cell[0];
+    LASSERT(a, q->count % 2 == 0, "Function 'omap-new' expected keys and values in pairs but got %i items.", q->count);
+
+    for (int i = 0; i < q->count; i += 2)
+    {
+        int kind = lomap_key_kind(q->cell[i]);
+        LASSERT(a, kind >= 0 && kind == lomap_key_kind(q->cell[0]), "Function 'omap-new' cannot order a %s key among %s keys.",
+                ltype_name(q->cell[i]->type), q->cell[0]->type == LVAL_STR ? "String" : "Number");
+    }
+
+    lomap* m = lomap_new();
+    for (int i = 0; i < q->count; i += 2)
+    {
+        lomap_put(m, q->cell[i], q->cell[i + 1]);
+    }
+    q->count = 0;
+    lval_del(a);
+    return lval_omap(m);
+}
+
+// (omap-get m k) or (omap-get m k default)
+LBUILTIN_DECL(builtin_omap_get)
+{
+    LASSERT(a, a->count == 2 || a->count == 3, "Function 'omap-get' expected 2 or 3 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-get");
+
+    int at;
+    lomap_node* n = lomap_find(a->cell[0]->omap, a->cell[1], &at);
+    if (n != NULL)
+    {
+        lval* v = lval_copy(n->vals[at]);
+        lval_del(a);
+        return v;
+    }
+    LASSERT(a, a->count == 3, "Function 'omap-get' found no such key.");
+    return lval_take(a, 2);
+}
+
+LBUILTIN_DECL(builtin_omap_has)
+{
+    LASSERT_ARG_COUNT(a, 2, "omap-has");
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-has");
+    int at;
+    lval* b = lval_boolean(lomap_find(a->cell[0]->omap, a->cell[1], &at) != NULL);
+    lval_del(a);
+    return b;
+}
+
+// (omap-put! m k v), returns m
+LBUILTIN_DECL(builtin_omap_put)
+{
+    LASSERT_ARG_COUNT(a, 3, "omap-put!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-put!");
+    LASSERT_OMAP_KEY(a, a->cell[0]->omap, 1, "omap-put!");
+    LASSERT(a, !lval_holds(a->cell[2], a->cell[0]->omap), "Function 'omap-put!' cannot store a map inside itself.");
+
+    lval* val = lval_pop(a, 2);
+    lval* key = lval_pop(a, 1);
+    lomap_put(a->cell[0]->omap, key, val);
+    return lval_take(a, 0);
+}
+
+// (omap-del! m k), returns m
+LBUILTIN_DECL(builtin_omap_del)
+{
+    LASSERT_ARG_COUNT(a, 2, "omap-del!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-del!");
+    lomap_remove(a->cell[0]->omap, a->cell[1]);
+    return lval_take(a, 0);
+}
+
+LBUILTIN_DECL(builtin_omap_size)
+{
+    LASSERT_ARG_COUNT(a, 1, "omap-size");
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-size");
+    lval* n = lval_integer(a->cell[0]->omap->count);
+    lval_del(a);
+    return n;
+}
+
+// {key value} of the smallest or largest key
+lval* lomap_end(lval* a, char* fun, int last)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, fun);
+    lomap* m = a->cell[0]->omap;
+    LASSERT(a, m->count > 0, "Function '%s' was given an empty ordered map.", fun);
+
+    lomap_node* n = m->root;
+    while (n->children[0] != NULL)
+    {
+        n = n->children[last ? n->count : 0];
+    }
+    int i = last ? n->count - 1 : 0;
+    lval* item = lval_add(lval_add(lval_qexpr(), lval_copy(n->keys[i])), lval_copy(n->vals[i]));
+    lval_del(a);
+    return item;
+}
+
+LBUILTIN_DECL(builtin_omap_first) { return lomap_end(a, "omap-first", 0); }
+LBUILTIN_DECL(builtin_omap_last) { return lomap_end(a, "omap-last", 1); }
+
+// (omap-range m lo hi), the {key value} items with lo <= key < hi in order
+LBUILTIN_DECL(builtin_omap_range)
+{
+    LASSERT_ARG_COUNT(a, 3, "omap-range");
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, "omap-range");
+    lomap* m = a->cell[0]->omap;
+    LASSERT_OMAP_KEY(a, m, 1, "omap-range");
+    LASSERT_OMAP_KEY(a, m, 2, "omap-range");
+
+    lval* q = m->count > 0 ? lomap_list(m, a->cell[1], a->cell[2], 2) : lval_qexpr();
+    lval_del(a);
+    return q;
+}
+
+// Keys, values or {key value} items of an ordered map as a Q-Expression, in key order
+lval* lomap_all(lval* a, char* fun, int what)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_OMAP, fun);
+    lval* q = lomap_list(a->cell[0]->omap, NULL, NULL, what);
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_omap_keys) { return lomap_all(a, "omap-keys", 0); }
+LBUILTIN_DECL(builtin_omap_vals) { return lomap_all(a, "omap-vals", 1); }
+LBUILTIN_DECL(builtin_omap_items) { return lomap_all(a, "omap-items", 2); }
+
+// (omap-each f m) calls (f key value) for every entry in key order
+LBUILTIN_DECL(builtin_omap_each)
+{
+    LASSERT_ARG_COUNT(a, 2, "omap-each");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "omap-each");
+    LASSERT_ARG_TYPE(a, 1, LVAL_OMAP, "omap-each");
+
+    // Iterate over a snapshot, f may change the map
+    lval* items = lomap_list(a->cell[1]->omap, NULL, NULL, 2);
+    for (int i = 0; i < items->count; i++)
+    {
+        lval* item = items->cell[i];
+        lval* r = lval_apply2(e, a->cell[0], lval_copy(item->cell[0]), lval_copy(item->cell[1]));
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(items);
+            lval_del(a);
+            return r;
+        }
+        lval_del(r);
+    }
+    lval_del(items);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* Deques
+
+A deque is a ring buffer of values with amortised O(1) pushes and pops at both ends. Its storage is shared
+between copies like a vector's. Items are kept in a power of two sized array starting at head and wrapping
+around, the array only doubles when it is full, so pushing and popping never allocate otherwise: a pushed
+argument is stored as it is and a popped item is handed back without a copy.
+*/
+
+ldeque* ldeque_new(int capacity)
+{
+    int n = 8;
+    while (n < capacity)
+    {
+        n *= 2;
+    }
+    ldeque* dq = malloc(sizeof(ldeque));
+    dq->refs = 1;
+    dq->head = 0;
+    dq->count = 0;
+    dq->capacity = n;
+    dq->items = malloc(sizeof(lval*) * n);
+    return dq;
+}
+
+ldeque* ldeque_retain(ldeque* dq)
+{
+    dq->refs++;
+    return dq;
+}
+
+void ldeque_release(ldeque* dq)
+{
+    if (--dq->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < dq->count; i++)
+    {
+        lval_del(LDEQUE_AT(dq, i));
+    }
+    free(dq->items);
+    free(dq);
+}
+
+// Doubles the capacity, unwrapping the items to start at 0
+void ldeque_grow(ldeque* dq)
+{
+    lval** items = malloc(sizeof(lval*) * dq->capacity * 2);
+    int first = dq->capacity - dq->head;
+    if (first > dq->count)
+    {
+        first = dq->count;
+    }
+    memcpy(items, &dq->items[dq->head], sizeof(lval*) * first);
+    memcpy(&items[first], dq->items, sizeof(lval*) * (dq->count - first));
+    free(dq->items);
+    dq->items = items;
+    dq->head = 0;
+    dq->capacity *= 2;
+}
+
+void ldeque_push_back(ldeque* dq, lval* x)
+{
+    if (dq->count == dq->capacity)
+    {
+        ldeque_grow(dq);
+    }
+    LDEQUE_AT(dq, dq->count) = x;
+    dq->count++;
+}
+
+void ldeque_push_front(ldeque* dq, lval* x)
+{
+    if (dq->count == dq->capacity)
+    {
+        ldeque_grow(dq);
+    }
+    dq->head = (dq->head - 1) & (dq->capacity - 1);
+    dq->items[dq->head] = x;
+    dq->count++;
+}
+
+#define LASSERT_DEQUE_NOT_EMPTY(a, n1) \
+    LASSERT(a, a->cell[0]->dq->count > 0, "Function '%s' was given an empty deque.", n1)
+
+// (dq x...), a deque of the arguments
+LBUILTIN_DECL(builtin_dq)
+{
+    ldeque* dq = ldeque_new(a->count);
+    for (int i = 0; i < a->count; i++)
+    {
+        ldeque_push_back(dq, a->cell[i]);
+    }
+    a->count = 0;
+    lval_del(a);
+    return lval_deque(dq);
+}
+
+// (dq-from l), the items of a Q-Expression, (dq-from {}) for an empty deque
+LBUILTIN_DECL(builtin_dq_from)
+{
+    LASSERT_ARG_COUNT(a, 1, "dq-from");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "dq-from");
+    lval* q = lval_take(a, 0);
+    q->type = LVAL_SEXPR;
+    return builtin_dq(e, q);
+}
+
+// (dq-list d), the items front to back as a Q-Expression
+LBUILTIN_DECL(builtin_dq_list)
+{
+    LASSERT_ARG_COUNT(a, 1, "dq-list");
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, "dq-list");
+
+    ldeque* dq = a->cell[0]->dq;
+    lval* q = lval_qexpr_sized(dq->count);
+    for (int i = 0; i < dq->count; i++)
+    {
+        q->cell[i] = lval_copy(LDEQUE_AT(dq, i));
+    }
+    lval_del(a);
+    return q;
+}
+
+// (dq-push-front! d x...) and (dq-push-back! d x...) add the items one after another, return d
+lval* ldeque_push(lval* a, char* fun, int front)
+{
+    LASSERT_ARG_MIN(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, fun);
+    for (int i = 1; i < a->count; i++)
+    {
+        LASSERT(a, !lval_holds(a->cell[i], a->cell[0]->dq), "Function '%s' cannot store a deque inside itself.", fun);
+    }
+
+    ldeque* dq = a->cell[0]->dq;
+    for (int i = 1; i < a->count; i++)
+    {
+        if (front)
+        {
+            ldeque_push_front(dq, a->cell[i]);
+        }
+        else
+        {
+            ldeque_push_back(dq, a->cell[i]);
+        }
+    }
+    a->count = 1;
+    return lval_take(a, 0);
+}
+
+LBUILTIN_DECL(builtin_dq_push_front) { return ldeque_push(a, "dq-push-front!", 1); }
+LBUILTIN_DECL(builtin_dq_push_back) { return ldeque_push(a, "dq-push-back!", 0); }
+
+// Removes and returns the item at the front or back
+lval* ldeque_pop(lval* a, char* fun, int front)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, fun);
+    LASSERT_DEQUE_NOT_EMPTY(a, fun);
+
+    ldeque* dq = a->cell[0]->dq;
+    lval* x;
+    if (front)
+    {
+        x = dq->items[dq->head];
+        dq->head = (dq->head + 1) & (dq->capacity - 1);
+    }
+    else
+    {
+        x = LDEQUE_AT(dq, dq->count - 1);
+    }
+    dq->count--;
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_dq_pop_front) { return ldeque_pop(a, "dq-pop-front!", 1); }
+LBUILTIN_DECL(builtin_dq_pop_back) { return ldeque_pop(a, "dq-pop-back!", 0); }
+
+// (dq-peek d) and (dq-peek-back d), the item at the front or back
+lval* ldeque_peek(lval* a, char* fun, int front)
+{
+    LASSERT_ARG_COUNT(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, fun);
+    LASSERT_DEQUE_NOT_EMPTY(a, fun);
+
+    ldeque* dq = a->cell[0]->dq;
+    lval* x = lval_copy(LDEQUE_AT(dq, front ? 0 : dq->count - 1));
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_dq_peek) { return ldeque_peek(a, "dq-peek", 1); }
+LBUILTIN_DECL(builtin_dq_peek_back) { return ldeque_peek(a, "dq-peek-back", 0); }
+
+// (dq-ref d i), item i counting from the front
+LBUILTIN_DECL(builtin_dq_ref)
+{
+    LASSERT_ARG_COUNT(a, 2, "dq-ref");
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, "dq-ref");
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "dq-ref");
+    ldeque* dq = a->cell[0]->dq;
+    long i = a->cell[1]->integer;
+    LASSERT(a, i >= 0 && i < dq->count, "Function 'dq-ref' was given index %li for a deque of %i items.", i, dq->count);
+
+    lval* x = lval_copy(LDEQUE_AT(dq, i));
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_dq_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "dq-len");
+    LASSERT_ARG_TYPE(a, 0, LVAL_DEQUE, "dq-len");
+    lval* n = lval_integer(a->cell[0]->dq->count);
+    lval_del(a);
+    return n;
+}
+
+/* Priority queues
+
+A priority queue is a binary heap stored implicitly in an array, entry i having its children at 2i + 1 and
+2i + 2. The priority of an item is the item itself, which must then be a number, or the number its key function
+returns, computed once when the item is pushed. Entries keep the priority unboxed as a double and only compare
+the numbers themselves when the doubles are equal; a running sequence number breaks the remaining ties, so
+items of equal priority come out in the order they went in. Like vectors the storage is shared between copies.
+*/
+
+lpq* lpq_new(int max, lval* key)
+{
+    lpq* q = malloc(sizeof(lpq));
+    q->refs = 1;
+    q->max = max;
+    q->count = 0;
+    q->capacity = 16;
+    q->seq = 0;
+    q->key = key;
+    q->entries = malloc(sizeof(lpq_entry) * q->capacity);
+    return q;
+}
+
+lpq* lpq_retain(lpq* q)
+{
+    q->refs++;
+    return q;
+}
+
+void lpq_release(lpq* q)
+{
+    if (--q->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < q->count; i++)
+    {
+        lval_del(q->entries[i].item);
+        if (q->entries[i].prio != NULL)
+        {
+            lval_del(q->entries[i].prio);
+        }
+    }
+    if (q->key != NULL)
+    {
+        lval_del(q->key);
+    }
+    free(q->entries);
+    free(q);
+}
+
+// Whether entry x comes out before entry y
+int lpq_before(lpq* q, lpq_entry* x, lpq_entry* y)
+{
+    int order;
+    if (x->rank != y->rank)
+    {
+        order = x->rank < y->rank ? -1 : 1;
+    }
+    else
+    {
+        int ok = 1;
+        order = lval_order(x->prio != NULL ? x->prio : x->item, y->prio != NULL ? y->prio : y->item, &ok);
+    }
+    if (order == 0)
+    {
+        return x->seq < y->seq;
+    }
+    return q->max ? order > 0 : order < 0;
+}
+
+// Adds an entry, taking ownership of its item and priority
+void lpq_push(lpq* q, lpq_entry entry)
+{
+    if (q->count == q->capacity)
+    {
+        q->capacity *= 2;
+        q->entries = realloc(q->entries, sizeof(lpq_entry) * q->capacity);
+    }
+    entry.seq = q->seq++;
+    // Move parents down into the hole until the entry fits
+    int i = q->count++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!lpq_before(q, &entry, &q->entries[parent]))
+        {
+            break;
+        }
+        q->entries[i] = q->entries[parent];
+        i = parent;
+    }
+    q->entries[i] = entry;
+}
+
+// Removes the first entry, handing its item to the caller
+lval* lpq_pop(lpq* q)
+{
+    lval* item = q->entries[0].item;
+    if (q->entries[0].prio != NULL)
+    {
+        lval_del(q->entries[0].prio);
+    }
+    lpq_entry last = q->entries[--q->count];
+    // Move children up into the hole at the root until the last entry fits
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= q->count)
+        {
+            break;
+        }
+        if (child + 1 < q->count && lpq_before(q, &q->entries[child + 1], &q->entries[child]))
+        {
+            child++;
+        }
+        if (!lpq_before(q, &q->entries[child], &last))
+        {
+            break;
+        }
+        q->entries[i] = q->entries[child];
+        i = child;
+    }
+    if (q->count > 0)
+    {
+        q->entries[i] = last;
+    }
+    return item;
+}
+
+#define LASSERT_PQ_NOT_EMPTY(a, n1) \
+    LASSERT(a, a->cell[0]->pq->count > 0, "Function '%s' was given an empty priority queue.", n1)
+
+// (pq-new "min") or (pq-new "max"), optionally with a key function (pq-new "min" f)
+LBUILTIN_DECL(builtin_pq_new)
+{
+    LASSERT(a, a->count == 1 || a->count == 2, "Function 'pq-new' expected 1 or 2 arguments but got %i.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "pq-new");
+    char* order = a->cell[0]->str;
+    LASSERT(a, strcmp(order, "min") == 0 || strcmp(order, "max") == 0,
+            "Function 'pq-new' expected \"min\" or \"max\" but got \"%s\".", order);
+    if (a->count == 2)
+    {
+        LASSERT_ARG_TYPE(a, 1, LVAL_FUN, "pq-new");
+    }
+
+    lval* key = a->count == 2 ? lval_pop(a, 1) : NULL;
+    lpq* q = lpq_new(strcmp(order, "max") == 0, key);
+    lval_del(a);
+    return lval_pq(q);
+}
+
+// NULL if p can rank an item, else the error to report
+lval* lpq_rank_error(lval* p, int keyed)
+{
+    if (!lval_is_number(p))
+    {
+        if (keyed)
+        {
+            return lval_err("Function 'pq-push!' expected the key function to return a Number but got %s.", ltype_name(p->type));
+        }
+        return lval_err("Function 'pq-push!' expected a Number but got %s, a key function can rank other values.", ltype_name(p->type));
+    }
+    if (p->type == LVAL_DECIMAL && isnan(p->decimal))
+    {
+        return lval_err("Function 'pq-push!' cannot rank NaN.");
+    }
+    return NULL;
+}
+
+// (pq-push! q x...) adds the items, returns q
+LBUILTIN_DECL(builtin_pq_push)
+{
+    LASSERT_ARG_MIN(a, 1, "pq-push!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PQ, "pq-push!");
+    lpq* q = a->cell[0]->pq;
+    for (int i = 1; i < a->count; i++)
+    {
+        LASSERT(a, !lval_holds(a->cell[i], q), "Function 'pq-push!' cannot store a priority queue inside itself.");
+        lval* err = q->key == NULL ? lpq_rank_error(a->cell[i], 0) : NULL;
+        if (err != NULL)
+        {
+            lval_del(a);
+            return err;
+        }
+    }
+
+    for (int i = 1; i < a->count; i++)
+    {
+        lpq_entry entry = { 0.0, 0, NULL, a->cell[i] };
+        if (q->key != NULL)
+        {
+            entry.prio = lval_apply1(e, q->key, lval_copy(entry.item));
+            lval* err = entry.prio->type == LVAL_ERR ? entry.prio : lpq_rank_error(entry.prio, 1);
+            if (err != NULL)
+            {
+                if (err != entry.prio)
+                {
+                    lval_del(entry.prio);
+                }
+                // The items before this one belong to the queue now
+                memmove(&a->cell[1], &a->cell[i], sizeof(lval*) * (a->count - i));
+                a->count -= i - 1;
+                lval_del(a);
+                return err;
+            }
+        }
+        entry.rank = lnum_to_double(entry.prio != NULL ? entry.prio : entry.item);
+        lpq_push(q, entry);
+    }
+    a->count = 1;
+    return lval_take(a, 0);
+}
+
+// (pq-pop! q) removes and returns the first item
+LBUILTIN_DECL(builtin_pq_pop)
+{
+    LASSERT_ARG_COUNT(a, 1, "pq-pop!");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PQ, "pq-pop!");
+    LASSERT_PQ_NOT_EMPTY(a, "pq-pop!");
+    lval* x = lpq_pop(a->cell[0]->pq);
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_pq_peek)
+{
+    LASSERT_ARG_COUNT(a, 1, "pq-peek");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PQ, "pq-peek");
+    LASSERT_PQ_NOT_EMPTY(a, "pq-peek");
+    lval* x = lval_copy(a->cell[0]->pq->entries[0].item);
+    lval_del(a);
+    return x;
+}
+
+LBUILTIN_DECL(builtin_pq_size)
+{
+    LASSERT_ARG_COUNT(a, 1, "pq-size");
+    LASSERT_ARG_TYPE(a, 0, LVAL_PQ, "pq-size");
+    lval* n = lval_integer(a->cell[0]->pq->count);
+    lval_del(a);
+    return n;
+}
+
+/* Records
+
+(defrecord point {x y}) defines a record type with a fixed list of fields and binds four kinds of functions in
+the global environment: the constructor (point 1 2), the predicate (point? p), an accessor (point-x p) and a
+setter (set-point-x! p 3) for every field. All records of a type point to one shared shape that names the type
+and its fields, a record itself is just that pointer and an array of slots, so an accessor is one index. Like
+vectors, records are shared between copies and a setter changes the record in place.
+
+The generated functions are builtins that carry an lrecfn telling lval_call what to do and with which shape,
+the same way functions made by 'memo' carry their cache.
+*/
+
+lshape* lshape_retain(lshape* shape)
+{
+    shape->refs++;
+    return shape;
+}
+
+void lshape_release(lshape* shape)
+{
+    if (--shape->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < shape->count; i++)
+    {
+        free(shape->fields[i]);
+    }
+    free(shape->fields);
+    free(shape->name);
+    free(shape);
+}
+
+lrec* lrec_retain(lrec* r)
+{
+    r->refs++;
+    return r;
+}
+
+void lrec_release(lrec* r)
+{
+    if (--r->refs > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < r->shape->count; i++)
+    {
+        lval_del(r->slots[i]);
+    }
+    lshape_release(r->shape);
+    free(r);
+}
+
+lrecfn* lrecfn_retain(lrecfn* f)
+{
+    f->refs++;
+    return f;
+}
+
+void lrecfn_release(lrecfn* f)
+{
+    if (--f->refs > 0)
+    {
+        return;
+    }
+    lshape_release(f->shape);
+    free(f);
+}
+
+// Marks the functions made by 'defrecord', lval_call runs them through lrecfn_call instead
+LBUILTIN_DECL(builtin_record_fn)
+{
+    lval_del(a);
+    return lval_err("Record function called without its record type.");
+}
+
+lval* lval_recfn(lshape* shape, lrec_op op, int slot)
+{
+    lval* v = lval_builtin(builtin_record_fn);
+    v->recfn = malloc(sizeof(lrecfn));
+    v->recfn->refs = 1;
+    v->recfn->op = op;
+    v->recfn->slot = slot;
+    v->recfn->shape = lshape_retain(shape);
+    return v;
+}
+
+// Name of a generated function, as it is bound by 'defrecord'
+char* lrecfn_name(lrecfn* f)
+{
+    char* type = f->shape->name;
+    char* field = f->op == LREC_GET || f->op == LREC_SET ? f->shape->fields[f->slot] : "";
+    char* name = malloc(strlen(type) + strlen(field) + 8);
+    switch (f->op)
+    {
+        case LREC_MAKE: strcpy(name, type); break;
+        case LREC_IS: sprintf(name, "%s?", type); break;
+        case LREC_GET: sprintf(name, "%s-%s", type, field); break;
+        case LREC_SET: sprintf(name, "set-%s-%s!", type, field); break;
+    }
+    return name;
+}
+
+void lrecfn_print(lrecfn* f)
+{
+    char* name = lrecfn_name(f);
+    printf("<record: %s>", name);
+    free(name);
+}
+
+lval* lrecfn_call(lrecfn* f, lval* a)
+{
+    lshape* shape = f->shape;
+    if (f->op == LREC_MAKE)
+    {
+        LASSERT(a, a->count == shape->count, "Function '%s' expected %i arguments but got %i.", shape->name, shape->count, a->count);
+        lrec* r = malloc(sizeof(lrec) + sizeof(lval*) * shape->count);
+        r->refs = 1;
+        r->shape = lshape_retain(shape);
+        memcpy(r->slots, a->cell, sizeof(lval*) * shape->count);
+        a->count = 0;
+        lval_del(a);
+        return lval_record(r);
+    }
+
+    char* name = lrecfn_name(f);
+    lval* err = NULL;
+    if (a->count != (f->op == LREC_SET ? 2 : 1))
+    {
+        err = lval_err("Function '%s' expected %i arguments but got %i.", name, f->op == LREC_SET ? 2 : 1, a->count);
+    }
+    else if (f->op == LREC_IS)
+    {
+        err = lval_boolean(a->cell[0]->type == LVAL_RECORD && a->cell[0]->rec->shape == shape);
+    }
+    else if (a->cell[0]->type != LVAL_RECORD || a->cell[0]->rec->shape != shape)
+    {
+        char* got = a->cell[0]->type == LVAL_RECORD ? a->cell[0]->rec->shape->name : ltype_name(a->cell[0]->type);
+        err = lval_err("Function '%s' expected a %s record but got %s.", name, shape->name, got);
+    }
+    else if (f->op == LREC_SET && lval_holds(a->cell[1], a->cell[0]->rec))
+    {
+        err = lval_err("Function '%s' cannot store a record inside itself.", name);
+    }
+    free(name);
+    if (err != NULL)
+    {
+        lval_del(a);
+        return err;
+    }
+
+    lrec* r = a->cell[0]->rec;
+    if (f->op == LREC_GET)
+    {
+        lval* x = lval_copy(r->slots[f->slot]);
+        lval_del(a);
+        return x;
+    }
+    lval_del(r->slots[f->slot]);
+    r->slots[f->slot] = lval_pop(a, 1);
+    return lval_take(a, 0);
+}
+
+// Binds a function made by 'defrecord' in the global environment e
+void lrecfn_def(lenv* e, lshape* shape, lrec_op op, int slot)
+{
+    lval* f = lval_recfn(shape, op, slot);
+    char* name = lrecfn_name(f->recfn);
+    lval* sym = lval_symbol(name);
+    lfold_rebind(e, name, 0);
+    lenv_put(e, sym, f);
+    lval_del(sym);
+    lval_del(f);
+    free(name);
+}
+
+// (defrecord name {field...})
+LBUILTIN_DECL(builtin_defrecord)
+{
+    LASSERT_ARG_COUNT(a, 2, "defrecord");
+    if (a->cell[0]->type == LVAL_QEXPR && a->cell[0]->count == 1)
+    {
+        a->cell[0] = lval_take(a->cell[0], 0);
+    }
+    LASSERT_ARG_TYPE(a, 0, LVAL_SYM, "defrecord");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "defrecord");
+    lval* fields = a->cell[1];
+    LASSERT(a, fields->count > 0, "Function 'defrecord' expected at least one field.");
+    for (int i = 0; i < fields->count; i++)
+    {
+        LASSERT(a, fields->cell[i]->type == LVAL_SYM, "Function 'defrecord' expected %s fields but got %s.",
+                ltype_name(LVAL_SYM), ltype_name(fields->cell[i]->type));
+        LASSERT(a, lval_find_sym(fields, fields->cell[i]->sym) == i, "Function 'defrecord' was given the field '%s' twice.",
+                fields->cell[i]->sym);
+    }
+
+    lshape* shape = malloc(sizeof(lshape));
+    shape->refs = 1;
+    shape->name = malloc(strlen(a->cell[0]->sym) + 1);
+    strcpy(shape->name, a->cell[0]->sym);
+    shape->count = fields->count;
+    shape->fields = malloc(sizeof(char*) * fields->count);
+    for (int i = 0; i < fields->count; i++)
+    {
+        shape->fields[i] = malloc(strlen(fields->cell[i]->sym) + 1);
+        strcpy(shape->fields[i], fields->cell[i]->sym);
+    }
+
+    while (e->par != NULL)
+    {
+        e = e->par;
+    }
+    lrecfn_def(e, shape, LREC_MAKE, 0);
+    lrecfn_def(e, shape, LREC_IS, 0);
+    for (int i = 0; i < shape->count; i++)
+    {
+        lrecfn_def(e, shape, LREC_GET, i);
+        lrecfn_def(e, shape, LREC_SET, i);
+    }
+    lshape_release(shape);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* Bitsets
+
+A bitset packs a fixed number of booleans into 64 bit words, bits past the size in the last word are always 0.
+Like vectors its storage is shared between copies, 'bits-set!' and 'bits-clear!' change it in place while
+'bits-and', 'bits-or' and 'bits-xor' return a new bitset of the size both operands have. The word loops of the
+set operations and 'bits-count' have scalar, SSE2 and AVX2 versions picked like the typed array kernels; the
+AVX2 count looks up the bit count of each nibble with a byte shuffle and adds the bytes up with a SAD, the
+others use the popcount instruction where the compiler has it.
+*/
+
+typedef void (*lbits_op)(unsigned long long* r, unsigned long long* x, unsigned long long* y, int n);
+
+// Set operations: name, C operator, SSE2 and AVX2 intrinsics
+#define LBITS_OPS(X) \
+    X(and, &, _mm_and_si128, _mm256_and_si256) \
+    X(or, |, _mm_or_si128, _mm256_or_si256) \
+    X(xor, ^, _mm_xor_si128, _mm256_xor_si256)
+
+#define LBITS_OP_ENUM(name, op, sse2, avx2) LBITS_##name,
+typedef enum
+{
+    LBITS_OPS(LBITS_OP_ENUM)
+    LBITS_OP_COUNT
+} lbits_op_t;
+
+typedef struct
+{
+    lbits_op ops[LBITS_OP_COUNT];
+    long long (*count)(unsigned long long* x, int n);
+} lbits_kernel_set;
+
+int lpopcount64(unsigned long long x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (int) __popcnt64(x);
+#else
+    return lpopcount32((unsigned int) x) + lpopcount32((unsigned int) (x >> 32));
+#endif
+}
+
+// Index of the lowest set bit of a non-zero word
+int lctz64(unsigned long long x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int) i;
+#else
+    int i = 0;
+    while (!(x & 1))
+    {
+        x >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+#define LBITS_SCALAR(name, op, sse2, avx2) \
+    void lbits_##name##_scalar(unsigned long long* r, unsigned long long* x, unsigned long long* y, int n) \
+    { \
+        for (int i = 0; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LBITS_OPS(LBITS_SCALAR)
+
+long long lbits_count_scalar(unsigned long long* x, int n)
+{
+    long long c = 0;
+    for (int i = 0; i < n; i++) c += lpopcount64(x[i]);
+    return c;
+}
+
+#ifdef LARR_X86
+
+#define LBITS_SSE2(name, op, sse2, avx2) \
+    void lbits_##name##_sse2(unsigned long long* r, unsigned long long* x, unsigned long long* y, int n) \
+    { \
+        int i = 0; \
+        for (; i + 2 <= n; i += 2) \
+            _mm_storeu_si128((__m128i*) (r + i), sse2(_mm_loadu_si128((__m128i*) (x + i)), _mm_loadu_si128((__m128i*) (y + i)))); \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LBITS_OPS(LBITS_SSE2)
+
+#define LBITS_AVX2(name, op, sse2, avx2) \
+    LARR_TARGET_AVX2 void lbits_##name##_avx2(unsigned long long* r, unsigned long long* x, unsigned long long* y, int n) \
+    { \
+        int i = 0; \
+        for (; i + 4 <= n; i += 4) \
+            _mm256_storeu_si256((__m256i*) (r + i), avx2(_mm256_loadu_si256((__m256i*) (x + i)), _mm256_loadu_si256((__m256i*) (y + i)))); \
+        for (; i < n; i++) r[i] = x[i] op y[i]; \
+    }
+LBITS_OPS(LBITS_AVX2)
+
+LARR_TARGET_AVX2 long long lbits_count_avx2(unsigned long long* x, int n)
+{
+    __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*) (x + i));
+        __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero));
+    }
+    long long t[4];
+    _mm256_storeu_si256((__m256i*) t, total);
+    long long c = t[0] + t[1] + t[2] + t[3];
+    for (; i < n; i++) c += lpopcount64(x[i]);
+    return c;
+}
+
+#endif
+
+lbits_kernel_set lbits_scalar = { { lbits_and_scalar, lbits_or_scalar, lbits_xor_scalar }, lbits_count_scalar };
+
+#ifdef LARR_X86
+lbits_kernel_set lbits_sse2 = { { lbits_and_sse2, lbits_or_sse2, lbits_xor_sse2 }, lbits_count_scalar };
+lbits_kernel_set lbits_avx2 = { { lbits_and_avx2, lbits_or_avx2, lbits_xor_avx2 }, lbits_count_avx2 };
+#endif
+
+lbits_kernel_set* lbits_kernels(void)
+{
+    static lbits_kernel_set* k = NULL;
+    if (k == NULL)
+    {
+#ifdef LARR_X86
+        k = larr_has_avx2() ? &lbits_avx2 : &lbits_sse2;
+#else
+        k = &lbits_scalar;
+#endif
+    }
+    return k;
+}
+
+lbits* lbits_new(int count)
+{
+    lbits* b = malloc(sizeof(lbits));
+    b->refs = 1;
+    b->count = count;
+    b->words = (count + 63) / 64;
+    b->data = calloc(b->words > 0 ? b->words : 1, sizeof(unsigned long long));
+    return b;
+}
+
+lbits* lbits_retain(lbits* b)
+{
+    b->refs++;
+    return b;
+}
+
+void lbits_release(lbits* b)
+{
+    if (--b->refs > 0)
+    {
+        return;
+    }
+    free(b->data);
+    free(b);
+}
+
+// Calls f(i, arg) for every set bit i in increasing order until it returns 0
+void lbits_each(lbits* b, int (*f)(int i, void* arg), void* arg)
+{
+    for (int w = 0; w < b->words; w++)
+    {
+        for (unsigned long long word = b->data[w]; word != 0; word &= word - 1)
+        {
+            if (!f(w * 64 + lctz64(word), arg))
+            {
+                return;
+            }
+        }
+    }
+}
+
+// (bits-new n), n cleared bits
+LBUILTIN_DECL(builtin_bits_new)
+{
+    LASSERT_ARG_COUNT(a, 1, "bits-new");
+    LASSERT_ARG_TYPE(a, 0, LVAL_INTEGER, "bits-new");
+    LASSERT(a, a->cell[0]->integer >= 0 && a->cell[0]->integer <= INT_MAX - 63,
+            "Function 'bits-new' was given a size of %li.", a->cell[0]->integer);
+    lval* v = lval_bits(lbits_new((int) a->cell[0]->integer));
+    lval_del(a);
+    return v;
+}
+
+// (bits-set! b i...) and (bits-clear! b i...), return b
+lval* lbits_change(lval* a, char* fun, int set)
+{
+    LASSERT_ARG_MIN(a, 1, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, fun);
+    lbits* b = a->cell[0]->bits;
+    for (int i = 1; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, fun);
+        LASSERT(a, a->cell[i]->integer >= 0 && a->cell[i]->integer < b->count,
+                "Function '%s' was given bit %li of a bitset of %i bits.", fun, a->cell[i]->integer, b->count);
+    }
+
+    for (int i = 1; i < a->count; i++)
+    {
+        long n = a->cell[i]->integer;
+        if (set)
+        {
+            b->data[n / 64] |= 1ULL << (n % 64);
+        }
+        else
+        {
+            b->data[n / 64] &= ~(1ULL << (n % 64));
+        }
+    }
+    return lval_take(a, 0);
+}
+
+LBUILTIN_DECL(builtin_bits_set) { return lbits_change(a, "bits-set!", 1); }
+LBUILTIN_DECL(builtin_bits_clear) { return lbits_change(a, "bits-clear!", 0); }
+
+LBUILTIN_DECL(builtin_bits_test)
+{
+    LASSERT_ARG_COUNT(a, 2, "bits-test");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, "bits-test");
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, "bits-test");
+    lbits* b = a->cell[0]->bits;
+    long n = a->cell[1]->integer;
+    LASSERT(a, n >= 0 && n < b->count, "Function 'bits-test' was given bit %li of a bitset of %i bits.", n, b->count);
+
+    lval* v = lval_boolean((b->data[n / 64] >> (n % 64)) & 1);
+    lval_del(a);
+    return v;
+}
+
+// Applies a set operation word by word to two bitsets of the same size
+lval* lbits_combine(lval* a, char* fun, lbits_op_t op)
+{
+    LASSERT_ARG_COUNT(a, 2, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, fun);
+    LASSERT_ARG_TYPE(a, 1, LVAL_BITS, fun);
+    lbits* x = a->cell[0]->bits;
+    lbits* y = a->cell[1]->bits;
+    LASSERT(a, x->count == y->count, "Function '%s' expected a bitset of %i bits at position 1 but got one of %i.",
+            fun, x->count, y->count);
+
+    lbits* r = lbits_new(x->count);
+    lbits_kernels()->ops[op](r->data, x->data, y->data, x->words);
+    lval_del(a);
+    return lval_bits(r);
+}
+
+LBUILTIN_DECL(builtin_bits_and) { return lbits_combine(a, "bits-and", LBITS_and); }
+LBUILTIN_DECL(builtin_bits_or) { return lbits_combine(a, "bits-or", LBITS_or); }
+LBUILTIN_DECL(builtin_bits_xor) { return lbits_combine(a, "bits-xor", LBITS_xor); }
+
+// Number of set bits
+LBUILTIN_DECL(builtin_bits_count)
+{
+    LASSERT_ARG_COUNT(a, 1, "bits-count");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, "bits-count");
+    lbits* b = a->cell[0]->bits;
+    lval* v = lval_integer((long) lbits_kernels()->count(b->data, b->words));
+    lval_del(a);
+    return v;
+}
+
+LBUILTIN_DECL(builtin_bits_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "bits-len");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, "bits-len");
+    lval* v = lval_integer(a->cell[0]->bits->count);
+    lval_del(a);
+    return v;
+}
+
+int lbits_list_add(int i, void* q)
+{
+    lval* l = q;
+    l->cell[l->count++] = lval_integer(i);
+    return 1;
+}
+
+// (bits-list b), the indices of the set bits in increasing order
+LBUILTIN_DECL(builtin_bits_list)
+{
+    LASSERT_ARG_COUNT(a, 1, "bits-list");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BITS, "bits-list");
+    lbits* b = a->cell[0]->bits;
+    lval* q = lval_qexpr_sized((int) lbits_kernels()->count(b->data, b->words));
+    q->count = 0;
+    lbits_each(b, lbits_list_add, q);
+    lval_del(a);
+    return q;
+}
+
+typedef struct
+{
+    lenv* e;
+    lval* f;
+    lval* err;
+} lbits_each_ctx;
+
+int lbits_each_call(int i, void* arg)
+{
+    lbits_each_ctx* c = arg;
+    lval* r = lval_apply1(c->e, c->f, lval_integer(i));
+    if (r->type == LVAL_ERR)
+    {
+        c->err = r;
+        return 0;
+    }
+    lval_del(r);
+    return 1;
+}
+
+// (bits-each f b) calls (f i) for every set bit i in increasing order
+LBUILTIN_DECL(builtin_bits_each)
+{
+    LASSERT_ARG_COUNT(a, 2, "bits-each");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "bits-each");
+    LASSERT_ARG_TYPE(a, 1, LVAL_BITS, "bits-each");
+
+    // Iterate over a snapshot, f may change the bitset
+    lbits* b = a->cell[1]->bits;
+    lbits* snapshot = lbits_new(b->count);
+    memcpy(snapshot->data, b->data, sizeof(unsigned long long) * b->words);
+    lbits_each_ctx c = { e, a->cell[0], NULL };
+    lbits_each(snapshot, lbits_each_call, &c);
+    lbits_release(snapshot);
+    lval_del(a);
+    return c.err != NULL ? c.err : lval_sexpr();
+}
+
+/* Byte buffers
+
+A bytes value is a view, an offset and a length, into a buffer of raw bytes that may hold NULs. Copies and
+slices share the buffer, so slicing never copies and writes are seen through every view of the same bytes. The
+buffer remembers how much of it is in use: 'bytes-concat' appends in place when its first operand is the view
+ending there and the capacity suffices, which makes growing an accumulator with it amortised O(1) per byte,
+and only copies otherwise. Fixed width integers are read and written at any offset in either byte order.
+*/
+
+lbytes* lbytes_new(int capacity)
+{
+    lbytes* b = malloc(sizeof(lbytes));
+    b->refs = 1;
+    b->length = 0;
+    b->capacity = capacity;
+    b->data = calloc(capacity > 0 ? capacity : 1, 1);
+    return b;
+}
+
+lbytes* lbytes_retain(lbytes* b)
+{
+    b->refs++;
+    return b;
+}
+
+void lbytes_release(lbytes* b)
+{
+    if (--b->refs > 0)
+    {
+        return;
+    }
+    free(b->data);
+    free(b);
+}
+
+// A value of n new bytes copied from p
+lval* lval_bytes_of(const void* p, int n)
+{
+    lbytes* b = lbytes_new(n);
+    memcpy(b->data, p, n);
+    b->length = n;
+    return lval_bytes(b, 0, n);
+}
+
+// The bytes of a Bytes or String argument
+unsigned char* lbytes_arg(lval* v, int* n)
+{
+    if (v->type == LVAL_STR)
+    {
+        *n = strlen(v->str);
+        return (unsigned char*) v->str;
+    }
+    *n = v->length;
+    return LBYTES_AT(v);
+}
+
+#define LASSERT_BYTES_RANGE(a, pos, n, len, n1) \
+    LASSERT(a, a->cell[pos]->integer >= 0 && a->cell[pos]->integer <= (long) (len) - (n), \
+            "Function '%s' was given offset %li for %i bytes of %i.", n1, a->cell[pos]->integer, (int) (n), (int) (len))
+
+// (bytes-new n [capacity]), n zero bytes with room to grow to capacity
+LBUILTIN_DECL(builtin_bytes_new)
+{
+    LASSERT_ARG_MIN(a, 1, "bytes-new");
+    LASSERT(a, a->count <= 2, "Function 'bytes-new' takes at most 2 arguments but %i was given.", a->count);
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "bytes-new");
+    }
+    long n = a->cell[0]->integer;
+    long capacity = a->count == 2 ? a->cell[1]->integer : n;
+    LASSERT(a, n >= 0 && n <= capacity && capacity <= INT_MAX,
+            "Function 'bytes-new' was given a size of %li with a capacity of %li.", n, capacity);
+
+    lbytes* b = lbytes_new((int) capacity);
+    b->length = (int) n;
+    lval_del(a);
+    return lval_bytes(b, 0, (int) n);
+}
+
+// (bytes-from x), the characters of a string or the integers 0 to 255 of a Q-Expression
+LBUILTIN_DECL(builtin_bytes_from)
+{
+    LASSERT_ARG_COUNT(a, 1, "bytes-from");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_STR, LVAL_QEXPR, "bytes-from");
+
+    lval* x = a->cell[0];
+    if (x->type == LVAL_STR)
+    {
+        lval* v = lval_bytes_of(x->str, strlen(x->str));
+        lval_del(a);
+        return v;
+    }
+    for (int i = 0; i < x->count; i++)
+    {
+        LASSERT(a, x->cell[i]->type == LVAL_INTEGER && x->cell[i]->integer >= 0 && x->cell[i]->integer <= 255,
+                "Function 'bytes-from' expected bytes from 0 to 255 but item %i is not one.", i);
+    }
+    lbytes* b = lbytes_new(x->count);
+    for (int i = 0; i < x->count; i++)
+    {
+        b->data[i] = (unsigned char) x->cell[i]->integer;
+    }
+    b->length = x->count;
+    lval_del(a);
+    return lval_bytes(b, 0, b->length);
+}
+
+// (bytes-str b), the bytes as a string, which cannot hold a NUL
+LBUILTIN_DECL(builtin_bytes_str)
+{
+    LASSERT_ARG_COUNT(a, 1, "bytes-str");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-str");
+
+    lval* x = a->cell[0];
+    unsigned char* nul = memchr(LBYTES_AT(x), 0, x->length);
+    LASSERT(a, nul == NULL, "Function 'bytes-str' cannot make a string of bytes with a NUL at %i.",
+            (int) (nul - LBYTES_AT(x)));
+
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_STR;
+    v->str = malloc(x->length + 1);
+    memcpy(v->str, LBYTES_AT(x), x->length);
+    v->str[x->length] = '\0';
+    lval_del(a);
+    return v;
+}
+
+// (bytes-list b), the bytes as a Q-Expression of integers
+LBUILTIN_DECL(builtin_bytes_list)
+{
+    LASSERT_ARG_COUNT(a, 1, "bytes-list");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-list");
+
+    lval* x = a->cell[0];
+    lval* q = lval_qexpr_sized(x->length);
+    for (int i = 0; i < x->length; i++)
+    {
+        q->cell[i] = lval_integer(LBYTES_AT(x)[i]);
+    }
+    lval_del(a);
+    return q;
+}
+
+LBUILTIN_DECL(builtin_bytes_len)
+{
+    LASSERT_ARG_COUNT(a, 1, "bytes-len");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-len");
+    lval* n = lval_integer(a->cell[0]->length);
+    lval_del(a);
+    return n;
+}
+
+// (bytes-cap b), how long b can grow before 'bytes-concat' has to copy it
+LBUILTIN_DECL(builtin_bytes_cap)
+{
+    LASSERT_ARG_COUNT(a, 1, "bytes-cap");
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-cap");
+    lval* n = lval_integer(a->cell[0]->bytes->capacity - a->cell[0]->offset);
+    lval_del(a);
+    return n;
+}
+
+// (bytes-slice b start [end]), the bytes from start up to end excluded, sharing the buffer of b
+LBUILTIN_DECL(builtin_bytes_slice)
+{
+    LASSERT_ARG_MIN(a, 2, "bytes-slice");
+    LASSERT(a, a->count <= 3, "Function 'bytes-slice' takes at most 3 arguments but %i was given.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-slice");
+    for (int i = 1; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "bytes-slice");
+    }
+
+    lval* x = a->cell[0];
+    long start = a->cell[1]->integer;
+    long end = a->count == 3 ? a->cell[2]->integer : x->length;
+    LASSERT(a, start >= 0 && start <= end && end <= x->length,
+            "Function 'bytes-slice' was given the range %li to %li of %i bytes.", start, end, x->length);
+
+    lval* v = lval_bytes(lbytes_retain(x->bytes), x->offset + (int) start, (int) (end - start));
+    lval_del(a);
+    return v;
+}
+
+// (bytes-concat x...), the bytes and strings one after another
+LBUILTIN_DECL(builtin_bytes_concat)
+{
+    LASSERT_ARG_MIN(a, 1, "bytes-concat");
+    long total = 0;
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE2(a, i, LVAL_BYTES, LVAL_STR, "bytes-concat");
+        int n;
+        lbytes_arg(a->cell[i], &n);
+        total += n;
+    }
+    LASSERT(a, total <= INT_MAX, "Function 'bytes-concat' cannot make %li bytes.", total);
+
+    // Append after the first operand when it is the end of its buffer and there is room
+    lval* x = a->cell[0];
+    lval* v;
+    int at;
+    if (x->type == LVAL_BYTES && x->offset + x->length == x->bytes->length
+        && (long) x->bytes->capacity - x->offset >= total)
+    {
+        v = lval_bytes(lbytes_retain(x->bytes), x->offset, (int) total);
+        at = x->length;
+    }
+    else
+    {
+        // Leave room for as much again so concatenating onto the result does not copy every time
+        int n;
+        lbytes_arg(x, &n);
+        long capacity = total > 2L * n ? total : 2L * n;
+        lbytes* b = lbytes_new(capacity > INT_MAX ? INT_MAX : (int) capacity);
+        memcpy(b->data, lbytes_arg(x, &n), n);
+        v = lval_bytes(b, 0, (int) total);
+        at = n;
+    }
+
+    for (int i = 1; i < a->count; i++)
+    {
+        int n;
+        unsigned char* p = lbytes_arg(a->cell[i], &n);
+        memcpy(LBYTES_AT(v) + at, p, n);
+        at += n;
+    }
+    v->bytes->length = v->offset + v->length;
+    lval_del(a);
+    return v;
+}
+
+// (bytes-find b needle [start]), offset of the first needle, bytes or string, at or after start, or -1
+LBUILTIN_DECL(builtin_bytes_find)
+{
+    LASSERT_ARG_MIN(a, 2, "bytes-find");
+    LASSERT(a, a->count <= 3, "Function 'bytes-find' takes at most 3 arguments but %i was given.", a->count);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, "bytes-find");
+    LASSERT_ARG_TYPE2(a, 1, LVAL_BYTES, LVAL_STR, "bytes-find");
+    if (a->count == 3)
+    {
+        LASSERT_ARG_TYPE(a, 2, LVAL_INTEGER, "bytes-find");
+        LASSERT_BYTES_RANGE(a, 2, 0, a->cell[0]->length, "bytes-find");
+    }
+
+    lval* x = a->cell[0];
+    int n;
+    unsigned char* needle = lbytes_arg(a->cell[1], &n);
+    unsigned char* p = LBYTES_AT(x) + (a->count == 3 ? a->cell[2]->integer : 0);
+    unsigned char* end = LBYTES_AT(x) + x->length;
+    long found = -1;
+    if (n == 0)
+    {
+        found = p - LBYTES_AT(x);
+    }
+    // Jump between occurrences of the first byte with memchr, compare the rest at each
+    while (n > 0 && end - p >= n && (p = memchr(p, needle[0], end - p - n + 1)) != NULL)
+    {
+        if (memcmp(p + 1, needle + 1, n - 1) == 0)
+        {
+            found = p - LBYTES_AT(x);
+            break;
+        }
+        p++;
+    }
+    lval_del(a);
+    return lval_integer(found);
+}
+
+// Fixed width integer fields: name, size in bytes and 1 for big endian
+#define LBYTES_FIELDS(X) \
+    X(u8, 1, 0) \
+    X(u16le, 2, 0) \
+    X(u16be, 2, 1) \
+    X(u32le, 4, 0) \
+    X(u32be, 4, 1) \
+    X(u64le, 8, 0) \
+    X(u64be, 8, 1)
+
+// (bytes-u32le b offset) and the like, the unsigned integer stored at offset
+lval* lbytes_read(lval* a, char* fun, int size, int big)
+{
+    LASSERT_ARG_COUNT(a, 2, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, fun);
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, fun);
+    LASSERT_BYTES_RANGE(a, 1, size, a->cell[0]->length, fun);
+
+    unsigned char* p = LBYTES_AT(a->cell[0]) + a->cell[1]->integer;
+    unsigned long long x = 0;
+    for (int i = 0; i < size; i++)
+    {
+        x |= (unsigned long long) p[big ? size - 1 - i : i] << (8 * i);
+    }
+    lval_del(a);
+    if (x > (unsigned long long) LONG_MAX)
+    {
+        lbig* b = lbig_new(2);
+        b->limbs[0] = (lbig_limb) x;
+        b->limbs[1] = (lbig_limb) (x >> 32);
+        return lval_bignum(b);
+    }
+    return lval_integer((long) x);
+}
+
+// (bytes-set-u32le! b offset x) and the like store x at offset, negative numbers as two's complement, return b
+lval* lbytes_write(lval* a, char* fun, int size, int big)
+{
+    LASSERT_ARG_COUNT(a, 3, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_BYTES, fun);
+    LASSERT_ARG_TYPE(a, 1, LVAL_INTEGER, fun);
+    LASSERT_ARG_TYPE2(a, 2, LVAL_INTEGER, LVAL_BIGNUM, fun);
+    LASSERT_BYTES_RANGE(a, 1, size, a->cell[0]->length, fun);
+
+    lval* v = a->cell[2];
+    unsigned long long x;
+    if (v->type == LVAL_BIGNUM)
+    {
+        // Only 64 bit fields take the unsigned values past the range of long
+        LASSERT(a, size == 8 && v->big->sign > 0 && v->big->count == 2,
+                "Function '%s' cannot store a number that large.", fun);
+        x = ((unsigned long long) v->big->limbs[1] << 32) | v->big->limbs[0];
+    }
+    else
+    {
+        long lo = size == 8 ? LONG_MIN : -(1L << (8 * size - 1));
+        long hi = size == 8 ? LONG_MAX : (1L << (8 * size)) - 1;
+        LASSERT(a, v->integer >= lo && v->integer <= hi,
+                "Function '%s' cannot store %li in %i bytes.", fun, v->integer, size);
+        x = (unsigned long long) v->integer;
+    }
+
+    unsigned char* p = LBYTES_AT(a->cell[0]) + a->cell[1]->integer;
+    for (int i = 0; i < size; i++)
+    {
+        p[big ? size - 1 - i : i] = (unsigned char) (x >> (8 * i));
+    }
+    return lval_take(a, 0);
+}
+
+#define LBYTES_FIELD_BUILTINS(name, size, big) \
+    LBUILTIN_DECL(builtin_bytes_##name) { return lbytes_read(a, "bytes-" #name, size, big); } \
+    LBUILTIN_DECL(builtin_bytes_set_##name) { return lbytes_write(a, "bytes-set-" #name "!", size, big); }
+LBYTES_FIELDS(LBYTES_FIELD_BUILTINS)
+
+/* Lazy sequences
+
+A lazy sequence produces its items on demand and keeps the ones realised so far, so they are computed once
+however often the sequence is read; copies share them. It pulls from a source, which is a range of integers
+('lazy-from' has no end), the items of a list or another sequence, and passes every pulled item through its
+stages in turn: 'lazy-map', 'lazy-filter', 'drop-while' and 'take'. Adding a stage to a sequence that has not been read yet
+and is held nowhere else copies its source and stages instead of pulling through it, so a whole pipeline runs as
+one loop that moves each item from the source to the cache of the last sequence without storing it anywhere in
+between. A sequence that has been read already, or that is shared, as one bound to a name is, is pulled through
+its cache instead, so its stages run once however many sequences are built on it.
+*/
+
+llazy* llazy_new(void)
+{
+    llazy* l = calloc(1, sizeof(llazy));
+    l->refs = 1;
+    l->items = lvec_new(8);
+    return l;
+}
+
+llazy* llazy_retain(llazy* l)
+{
+    l->refs++;
+    return l;
+}
+
+void llazy_release(llazy* l)
+{
+    if (--l->refs > 0)
+    {
+        return;
+    }
+    if (l->list != NULL)
+    {
+        lvec_release(l->list);
+    }
+    if (l->seq != NULL)
+    {
+        llazy_release(l->seq);
+    }
+    for (int i = 0; i < l->stage_count; i++)
+    {
+        if (l->stages[i].fn != NULL)
+        {
+            lval_del(l->stages[i].fn);
+        }
+    }
+    free(l->stages);
+    if (l->err != NULL)
+    {
+        lval_del(l->err);
+    }
+    lvec_release(l->items);
+    free(l);
+}
+
+lval* llazy_ref(lenv* e, llazy* l, long i);
+
+// Ends the sequence with an error, keeping the first one
+void llazy_fail(llazy* l, lval* err)
+{
+    if (l->err == NULL)
+    {
+        l->err = err;
+    }
+    else
+    {
+        lval_del(err);
+    }
+    l->finished = 1;
+}
+
+// Next item of the source, NULL at its end or on an error of a source sequence
+lval* llazy_source_next(lenv* e, llazy* l)
+{
+    switch (l->source)
+    {
+        case LLAZY_RANGE:
+        {
+            if (l->bounded && (l->step > 0 ? l->next >= l->end : l->next <= l->end))
+            {
+                return NULL;
+            }
+            lval* x = lval_integer(l->next);
+            if (LADD_OVERFLOW(l->next, l->step, &l->next))
+            {
+                // Nothing past the last long
+                l->bounded = 1;
+                l->end = l->next = l->step > 0 ? LONG_MAX : LONG_MIN;
+            }
+            return x;
+        }
+        case LLAZY_LIST:
+            return l->next < l->list->count ? lval_copy(l->list->items[l->next++]) : NULL;
+        case LLAZY_SEQ:
+        {
+            lval* x = llazy_ref(e, l->seq, l->next);
+            if (x == NULL)
+            {
+                if (l->seq->err != NULL)
+                {
+                    llazy_fail(l, lval_copy(l->seq->err));
+                }
+                return NULL;
+            }
+            l->next++;
+            return lval_copy(x);
+        }
+    }
+    return NULL;
+}
+
+// Pulls from the source through the stages until an item comes out, returns whether one did
+int llazy_pull(lenv* e, llazy* l)
+{
+    if (l->busy)
+    {
+        llazy_fail(l, lval_err("A lazy sequence was read by its own stages."));
+        return 0;
+    }
+    l->busy = 1;
+    l->started = 1;
+    lval* x = NULL;
+    while (x == NULL && !l->finished)
+    {
+        x = llazy_source_next(e, l);
+        if (x == NULL)
+        {
+            l->finished = 1;
+            break;
+        }
+        for (int i = 0; i < l->stage_count && x != NULL; i++)
+        {
+            llazy_stage* s = &l->stages[i];
+            switch (s->kind)
+            {
+                case LLAZY_MAP:
+                    x = lval_apply1(e, s->fn, x);
+                    if (x->type == LVAL_ERR)
+                    {
+                        llazy_fail(l, x);
+                        x = NULL;
+                    }
+                    break;
+                case LLAZY_FILTER:
+                case LLAZY_DROP_WHILE:
+                {
+                    if (s->kind == LLAZY_DROP_WHILE && s->seen)
+                    {
+                        break;
+                    }
+                    lval* t = lval_apply1(e, s->fn, lval_copy(x));
+                    int truth = lval_truth(t);
+                    if (truth < 0)
+                    {
+                        llazy_fail(l, lval_truth_error(s->kind == LLAZY_FILTER ? "lazy-filter" : "drop-while", t, 0));
+                        lval_del(x);
+                        x = NULL;
+                        break;
+                    }
+                    lval_del(t);
+                    if (s->kind == LLAZY_FILTER ? !truth : truth)
+                    {
+                        lval_del(x);
+                        x = NULL;
+                    }
+                    else
+                    {
+                        s->seen = 1;
+                    }
+                    break;
+                }
+                case LLAZY_TAKE:
+                    // Nothing gets past a full take stage, so stop pulling after this item
+                    if (++s->seen >= s->n)
+                    {
+                        l->finished = 1;
+                    }
+                    break;
+            }
+        }
+    }
+    if (x != NULL)
+    {
+        lvec_push(l->items, x);
+    }
+    l->busy = 0;
+    return x != NULL;
+}
+
+// Item i, realising the sequence up to it, NULL past its end
+lval* llazy_ref(lenv* e, llazy* l, long i)
+{
+    while (l->items->count <= i)
+    {
+        if (!llazy_pull(e, l))
+        {
+            return NULL;
+        }
+    }
+    return l->items->items[i];
+}
+
+// A sequence passing the items of s, a list or a sequence, through one more stage. Consumes s and fn.
+lval* llazy_stage_onto(lval* s, llazy_stage_t kind, lval* fn, long n)
+{
+    llazy* l = llazy_new();
+    int count = 0;
+    if (s->type == LVAL_QEXPR)
+    {
+        lval* v = lval_vector_from(s);
+        l->source = LLAZY_LIST;
+        l->list = v->vec;
+        free(v);
+    }
+    else if (!s->lazy->started && s->lazy->refs == 1)
+    {
+        // Fuse with the stages of s, which nothing else reads
+        llazy* p = s->lazy;
+        l->source = p->source;
+        l->next = p->next;
+        l->end = p->end;
+        l->step = p->step;
+        l->bounded = p->bounded;
+        l->list = p->list != NULL ? lvec_retain(p->list) : NULL;
+        l->seq = p->seq != NULL ? llazy_retain(p->seq) : NULL;
+        l->finished = p->finished;
+        count = p->stage_count;
+        l->stages = malloc(sizeof(llazy_stage) * (count + 1));
+        for (int i = 0; i < count; i++)
+        {
+            l->stages[i] = p->stages[i];
+            l->stages[i].fn = p->stages[i].fn != NULL ? lval_copy(p->stages[i].fn) : NULL;
+        }
+        lval_del(s);
+    }
+    else
+    {
+        l->source = LLAZY_SEQ;
+        l->seq = llazy_retain(s->lazy);
+        lval_del(s);
+    }
+
+    if (l->stages == NULL)
+    {
+        l->stages = malloc(sizeof(llazy_stage));
+    }
+    l->stages[count].kind = kind;
+    l->stages[count].fn = fn;
+    l->stages[count].n = n;
+    l->stages[count].seen = 0;
+    l->stage_count = count + 1;
+    if (kind == LLAZY_TAKE && n <= 0)
+    {
+        l->finished = 1;
+    }
+    return lval_lazy(l);
+}
+
+// (lazy-range end), (lazy-range start end) or (lazy-range start end step), the items of 'range' one at a time
+LBUILTIN_DECL(builtin_lazy_range)
+{
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+            "Function 'lazy-range' expected 1 to 3 arguments but got %i.", a->count);
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "lazy-range");
+    }
+    LASSERT(a, a->count < 3 || a->cell[2]->integer != 0, "Function 'lazy-range' was given a step of 0.");
+
+    llazy* l = llazy_new();
+    l->source = LLAZY_RANGE;
+    l->next = a->count > 1 ? a->cell[0]->integer : 0;
+    l->end = a->cell[a->count > 1 ? 1 : 0]->integer;
+    l->step = a->count > 2 ? a->cell[2]->integer : 1;
+    l->bounded = 1;
+    lval_del(a);
+    return lval_lazy(l);
+}
+
+// (lazy-from start) or (lazy-from start step), counting without end
+LBUILTIN_DECL(builtin_lazy_from)
+{
+    LASSERT(a, a->count >= 1 && a->count <= 2,
+            "Function 'lazy-from' expected 1 or 2 arguments but got %i.", a->count);
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_ARG_TYPE(a, i, LVAL_INTEGER, "lazy-from");
+    }
+    LASSERT(a, a->count < 2 || a->cell[1]->integer != 0, "Function 'lazy-from' was given a step of 0.");
+
+    llazy* l = llazy_new();
+    l->source = LLAZY_RANGE;
+    l->next = a->cell[0]->integer;
+    l->step = a->count > 1 ? a->cell[1]->integer : 1;
+    lval_del(a);
+    return lval_lazy(l);
+}
+
+// (lazy-map f s) and (lazy-filter f s) over a sequence or a list
+lval* llazy_apply_stage(lval* a, char* fun, llazy_stage_t kind)
+{
+    LASSERT_ARG_COUNT(a, 2, fun);
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, fun);
+    LASSERT_ARG_TYPE2(a, 1, LVAL_LAZY, LVAL_QEXPR, fun);
+    lval* s = lval_pop(a, 1);
+    return llazy_stage_onto(s, kind, lval_take(a, 0), 0);
+}
+
+LBUILTIN_DECL(builtin_lazy_map)
+{
+    return llazy_apply_stage(a, "lazy-map", LLAZY_MAP);
+}
+
+LBUILTIN_DECL(builtin_lazy_filter)
+{
+    return llazy_apply_stage(a, "lazy-filter", LLAZY_FILTER);
+}
+
+// (drop-while f l), the items from the first one for which f is false, lazily for a sequence
+LBUILTIN_DECL(builtin_drop_while)
+{
+    LASSERT_ARG_COUNT(a, 2, "drop-while");
+    LASSERT_ARG_TYPE(a, 0, LVAL_FUN, "drop-while");
+    LASSERT_ARG_TYPE2(a, 1, LVAL_QEXPR, LVAL_LAZY, "drop-while");
+    if (a->cell[1]->type == LVAL_LAZY)
+    {
+        return llazy_apply_stage(a, "drop-while", LLAZY_DROP_WHILE);
+    }
+
+    lval* l = a->cell[1];
+    int n = 0;
+    while (n < l->count)
+    {
+        lval* t = lval_apply1(e, a->cell[0], lval_copy(l->cell[n]));
+        int truth = lval_truth(t);
+        if (truth < 0)
+        {
+            lval_del(a);
+            return lval_truth_error("drop-while", t, 0);
+        }
+        lval_del(t);
+        if (!truth)
+        {
+            break;
+        }
+        n++;
+    }
+    if (n > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            lval_del(l->cell[i]);
+        }
+        memmove(l->cell, l->cell + n, sizeof(lval*) * (l->count - n));
+        l->count -= n;
+    }
+    return lval_take(a, 1);
+}
+
+// (take n s) of a sequence is a sequence of at most n items
+lval* llazy_take(lval* a)
+{
+    long n = a->cell[0]->integer;
+    return llazy_stage_onto(lval_take(a, 1), LLAZY_TAKE, NULL, n);
+}
+
+// (realize s), all the items of a sequence as a Q-Expression, which never returns for an unbounded one
+LBUILTIN_DECL(builtin_realize)
+{
+    LASSERT_ARG_COUNT(a, 1, "realize");
+    LASSERT_ARG_TYPE2(a, 0, LVAL_LAZY, LVAL_QEXPR, "realize");
+    if (a->cell[0]->type == LVAL_QEXPR)
+    {
+        return lval_take(a, 0);
+    }
+
+    llazy* l = a->cell[0]->lazy;
+    while (llazy_pull(e, l))
+    {
+    }
+    if (l->err != NULL)
+    {
+        lval* err = lval_copy(l->err);
+        lval_del(a);
+        return err;
+    }
+    lval* q = lval_qexpr_sized(l->items->count);
+    for (int i = 0; i < l->items->count; i++)
+    {
+        q->cell[i] = lval_copy(l->items->items[i]);
+    }
+    lval_del(a);
+    return q;
+}
+
+// Whether the realised items or the source of a sequence hold storage
+int llazy_holds(llazy* l, void* storage)
+{
+    for (int i = 0; i < l->items->count; i++)
+    {
+        if (lval_holds(l->items->items[i], storage))
+        {
+            return 1;
+        }
+    }
+    for (int i = 0; l->list != NULL && i < l->list->count; i++)
+    {
+        if (lval_holds(l->list->items[i], storage))
+        {
+            return 1;
+        }
+    }
+    return l->seq != NULL && llazy_holds(l->seq, storage);
+}
+
+/* Promises
+
+'delay' is a special form that keeps its operand unevaluated in a promise, 'force' evaluates it the first time
+and hands back the cached value from then on, to every copy of the promise. Functions here see the local
+variables of their callers, so the promise keeps a copy of the local bindings around the 'delay' and evaluates
+in them with the environment of the first 'force' as parent, like a lambda body does. Once the value is known
+the expression and the bindings are dropped. A failed evaluation is not cached, forcing again retries it.
+*/
+
+lpromise* lpromise_retain(lpromise* p)
+{
+    p->refs++;
+    return p;
+}
+
+void lpromise_release(lpromise* p)
+{
+    if (--p->refs > 0)
+    {
+        return;
+    }
+    if (p->expr != NULL)
+    {
+        lval_del(p->expr);
+    }
+    if (p->env != NULL)
+    {
+        lenv_del(p->env);
+    }
+    if (p->value != NULL)
+    {
+        lval_del(p->value);
+    }
+    free(p);
+}
+
+// The local bindings visible from e in one frame without parent, inner ones hiding outer ones
+lenv* lenv_snapshot(lenv* e)
+{
+    lenv* s = lenv_new();
+    for (; e != NULL && e->par != NULL; e = e->par)
+    {
+        for (int i = 0; i < e->count; i++)
+        {
+            if (lenv_find(s, e->syms[i]) == NULL)
+            {
+                lenv_bind(s, e->syms[i], e->vals[i]);
+            }
+        }
+    }
+    return s;
+}
+
+// (delay expr), a promise of the value of expr, a Q-Expression is evaluated like a branch of 'if'
+LBUILTIN_DECL(builtin_delay)
+{
+    LASSERT_ARG_COUNT(a, 1, "delay");
+    lpromise* p = malloc(sizeof(lpromise));
+    p->refs = 1;
+    p->forcing = 0;
+    p->expr = lval_take(a, 0);
+    p->env = lenv_snapshot(e);
+    p->value = NULL;
+    return lval_promise(p);
+}
+
+// (force x), the value of a promise, computed on the first call. Anything else is its own value.
+LBUILTIN_DECL(builtin_force)
+{
+    LASSERT_ARG_COUNT(a, 1, "force");
+    if (a->cell[0]->type != LVAL_PROMISE)
+    {
+        return lval_take(a, 0);
+    }
+
+    lpromise* p = a->cell[0]->promise;
+    if (p->value == NULL)
+    {
+        LASSERT(a, !p->forcing, "Function 'force' was given a promise whose value depends on itself.");
+        p->forcing = 1;
+        p->env->par = e;
+        lval* v = lval_eval_branch(p->env, lval_copy(p->expr));
+        p->env->par = NULL;
+        p->forcing = 0;
+        if (v->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return v;
+        }
+        p->value = v;
+        lval_del(p->expr);
+        lenv_del(p->env);
+        p->expr = NULL;
+        p->env = NULL;
+    }
+    lval* v = lval_copy(p->value);
+    lval_del(a);
+    return v;
+}
+
+// Whether a promise holds storage in its value or its pending expression and bindings
+int lpromise_holds(lpromise* p, void* storage)
+{
+    if (p->value != NULL)
+    {
+        return lval_holds(p->value, storage);
+    }
+    for (int i = 0; i < p->env->count; i++)
+    {
+        if (lval_holds(p->env->vals[i], storage))
+        {
+            return 1;
+        }
+    }
+    return lval_holds(p->expr, storage);
+}
+
+/* Macros
+
+A macro is a lambda flagged LBUILTIN_MACRO. A call to it passes the operands unevaluated, so they can be put in
+code built with 'list', and evaluates what the macro returns in place of the call, a Q-Expression like a branch
+of 'if'.
+Macro calls in a lambda body are expanded when the body is folded, at creation, at 'def' and at the first call after
+a rebinding, so the folded body keeps the expansion and the macro runs once per call site instead of once per call. Calls the folder cannot
+resolve, or met before the macro was defined, are expanded each time they are evaluated. Macros are resolved
+and run in the global environment either way so both give the same code.
+*/
+
+#define LMACRO_DEPTH 64  // expansions of expansions before the folder leaves a call to runtime
+
+int lmacro_depth = 0;
+
+lenv* lenv_root(lenv* e);
+
+// Code for a call to the macro m with the operands in a, which is consumed
+lval* lmacro_expand(lenv* e, lval* m, lval* a)
+{
+    int variadic = lval_find_sym(m->formals, "&") >= 0;
+    int n = m->formals->count - (variadic ? 2 : 0);
+    LASSERT(a, variadic ? a->count >= n : a->count == n,
+            "Macro expected %s%i operands but got %i.", variadic ? "at least " : "", n, a->count);
+    a->type = LVAL_SEXPR;
+    lval* f = lval_copy(m);  // the macro may redefine itself
+    lval* code = lval_apply(e, f, a);
+    lval_del(f);
+    return code;
+}
+
+// (defmacro {name params...} {body}), the macro version of 'fun'
+LBUILTIN_DECL(builtin_defmacro)
+{
+    LASSERT_ARG_COUNT(a, 2, "defmacro");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "defmacro");
+    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "defmacro");
+    LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "defmacro");
+    for (int i = 0; i < a->cell[0]->count; i++)
+    {
+        LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+                "Function 'defmacro' expected %s at position %i but got %s.",
+                ltype_name(LVAL_SYM), i, ltype_name(a->cell[0]->cell[i]->type));
+    }
+
+    lenv* root = lenv_root(e);
+    lval* formals = lval_pop(a, 0);
+    lval* name = lval_pop(formals, 0);
+    for (int i = 0; i < formals->count; i++)
+    {
+        lfold_rebind(e, formals->cell[i]->sym, 1);
+    }
+    lval* m = lval_lambda(formals, lval_pop(a, 0));
+    m->flags = LBUILTIN_MACRO;
+    lfold_rebind(root, name->sym, 0);
+    lval_fold(root, m);
+    lenv_put(root, name, m);
+    lval_del(name);
+    lval_del(m);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// The macro a call starts with, by name or as a value a macro put there, NULL for anything else
+lval* lmacro_head(lenv* root, lval* v)
+{
+    lval* m = v->cell[0]->type == LVAL_SYM ? lenv_find(root, v->cell[0]->sym) : v->cell[0];
+    return m != NULL && m->type == LVAL_FUN && (m->flags & LBUILTIN_MACRO) ? m : NULL;
+}
+
+// (macroexpand {form}), the code form stands for while it is a macro call, as a Q-Expression
+LBUILTIN_DECL(builtin_macroexpand)
+{
+    LASSERT_ARG_COUNT(a, 1, "macroexpand");
+    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "macroexpand");
+
+    lenv* root = lenv_root(e);
+    lval* form = lval_take(a, 0);
+    for (int depth = 0; form->count > 1; depth++)
+    {
+        lval* m = lmacro_head(root, form);
+        if (m == NULL)
+        {
+            break;
+        }
+        LASSERT(form, depth < LMACRO_DEPTH, "Function 'macroexpand' gave up after %i expansions.", LMACRO_DEPTH);
+        m = lval_copy(m);
+        lval_del(lval_pop(form, 0));
+        lval* code = lmacro_expand(root, m, form);
+        lval_del(m);
+        if (code->type == LVAL_ERR)
+        {
+            return code;
+        }
+        form = code->type == LVAL_QEXPR ? code : lval_add(lval_qexpr(), code);
+    }
+    return form;
+}
+
+#define LBUILTIN_ENTRY(name, func, flags) { name, #func, func, flags }
+
+lbuiltin_entry lbuiltins[] = {
+    LBUILTIN_ENTRY("def", builtin_def, 0),
+    LBUILTIN_ENTRY("=", builtin_put, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("\\", builtin_lambda, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("get_env", builtin_get_env, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("list", builtin_list, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("head", builtin_head, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("tail", builtin_tail, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("eval", builtin_eval, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("join", builtin_join, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("init", builtin_init, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("cons", builtin_cons, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("len", builtin_len, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("map", builtin_map, 0),
+    LBUILTIN_ENTRY("filter", builtin_filter, 0),
+    LBUILTIN_ENTRY("foldl", builtin_foldl, 0),
+    LBUILTIN_ENTRY("foldr", builtin_foldr, 0),
+    LBUILTIN_ENTRY("range", builtin_range, 0),
+    LBUILTIN_ENTRY("take", builtin_take, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("drop", builtin_drop, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("zip", builtin_zip, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("reverse", builtin_reverse, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("nth", builtin_nth, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("last", builtin_last, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("sort", builtin_sort, 0),
+    LBUILTIN_ENTRY("sort-by", builtin_sort_by, 0),
+    LBUILTIN_ENTRY("binary-search", builtin_binary_search, 0),
+    LBUILTIN_ENTRY("vec", builtin_vec, 0),
+    LBUILTIN_ENTRY("vec-make", builtin_vec_make, 0),
+    LBUILTIN_ENTRY("vec-from", builtin_vec_from, 0),
+    LBUILTIN_ENTRY("vec-list", builtin_vec_list, 0),
+    LBUILTIN_ENTRY("vec-ref", builtin_vec_ref, 0),
+    LBUILTIN_ENTRY("vec-set!", builtin_vec_set, 0),
+    LBUILTIN_ENTRY("vec-push!", builtin_vec_push, 0),
+    LBUILTIN_ENTRY("vec-len", builtin_vec_len, 0),
+    LBUILTIN_ENTRY("f64", builtin_f64, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("i64", builtin_i64, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-list", builtin_arr_list, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-len", builtin_arr_len, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-ref", builtin_arr_ref, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-add", builtin_arr_add, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-sub", builtin_arr_sub, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-mul", builtin_arr_mul, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-div", builtin_arr_div, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-scale", builtin_arr_scale, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-sum", builtin_arr_sum, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-dot", builtin_arr_dot, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-min", builtin_arr_min, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-max", builtin_arr_max, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-lt", builtin_arr_lt, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-le", builtin_arr_le, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-gt", builtin_arr_gt, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-ge", builtin_arr_ge, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("arr-eq", builtin_arr_eq, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("map-new", builtin_map_new, 0),
+    LBUILTIN_ENTRY("map-get", builtin_map_get, 0),
+    LBUILTIN_ENTRY("map-has", builtin_map_has, 0),
+    LBUILTIN_ENTRY("map-put!", builtin_map_put, 0),
+    LBUILTIN_ENTRY("map-del!", builtin_map_del, 0),
+    LBUILTIN_ENTRY("map-size", builtin_map_size, 0),
+    LBUILTIN_ENTRY("map-keys", builtin_map_keys, 0),
+    LBUILTIN_ENTRY("map-vals", builtin_map_vals, 0),
+    LBUILTIN_ENTRY("map-items", builtin_map_items, 0),
+    LBUILTIN_ENTRY("map-each", builtin_map_each, 0),
+    LBUILTIN_ENTRY("pmap", builtin_pmap, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("assoc", builtin_assoc, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("dissoc", builtin_dissoc, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("pmap-get", builtin_pmap_get, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("pmap-has", builtin_pmap_has, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("pmap-size", builtin_pmap_size, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("pmap-keys", builtin_pmap_keys, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("pmap-items", builtin_pmap_items, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("omap-new", builtin_omap_new, 0),
+    LBUILTIN_ENTRY("omap-get", builtin_omap_get, 0),
+    LBUILTIN_ENTRY("omap-has", builtin_omap_has, 0),
+    LBUILTIN_ENTRY("omap-put!", builtin_omap_put, 0),
+    LBUILTIN_ENTRY("omap-del!", builtin_omap_del, 0),
+    LBUILTIN_ENTRY("omap-size", builtin_omap_size, 0),
+    LBUILTIN_ENTRY("omap-first", builtin_omap_first, 0),
+    LBUILTIN_ENTRY("omap-last", builtin_omap_last, 0),
+    LBUILTIN_ENTRY("omap-range", builtin_omap_range, 0),
+    LBUILTIN_ENTRY("omap-keys", builtin_omap_keys, 0),
+    LBUILTIN_ENTRY("omap-vals", builtin_omap_vals, 0),
+    LBUILTIN_ENTRY("omap-items", builtin_omap_items, 0),
+    LBUILTIN_ENTRY("omap-each", builtin_omap_each, 0),
+    LBUILTIN_ENTRY("dq", builtin_dq, 0),
+    LBUILTIN_ENTRY("dq-from", builtin_dq_from, 0),
+    LBUILTIN_ENTRY("dq-list", builtin_dq_list, 0),
+    LBUILTIN_ENTRY("dq-push-front!", builtin_dq_push_front, 0),
+    LBUILTIN_ENTRY("dq-push-back!", builtin_dq_push_back, 0),
+    LBUILTIN_ENTRY("dq-pop-front!", builtin_dq_pop_front, 0),
+    LBUILTIN_ENTRY("dq-pop-back!", builtin_dq_pop_back, 0),
+    LBUILTIN_ENTRY("dq-peek", builtin_dq_peek, 0),
+    LBUILTIN_ENTRY("dq-peek-back", builtin_dq_peek_back, 0),
+    LBUILTIN_ENTRY("dq-ref", builtin_dq_ref, 0),
+    LBUILTIN_ENTRY("dq-len", builtin_dq_len, 0),
+    LBUILTIN_ENTRY("pq-new", builtin_pq_new, 0),
+    LBUILTIN_ENTRY("pq-push!", builtin_pq_push, 0),
+    LBUILTIN_ENTRY("pq-pop!", builtin_pq_pop, 0),
+    LBUILTIN_ENTRY("pq-peek", builtin_pq_peek, 0),
+    LBUILTIN_ENTRY("pq-size", builtin_pq_size, 0),
+    LBUILTIN_ENTRY("defrecord", builtin_defrecord, LBUILTIN_ENV | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("bits-new", builtin_bits_new, 0),
+    LBUILTIN_ENTRY("bits-set!", builtin_bits_set, 0),
+    LBUILTIN_ENTRY("bits-clear!", builtin_bits_clear, 0),
+    LBUILTIN_ENTRY("bits-test", builtin_bits_test, 0),
+    LBUILTIN_ENTRY("bits-and", builtin_bits_and, 0),
+    LBUILTIN_ENTRY("bits-or", builtin_bits_or, 0),
+    LBUILTIN_ENTRY("bits-xor", builtin_bits_xor, 0),
+    LBUILTIN_ENTRY("bits-count", builtin_bits_count, 0),
+    LBUILTIN_ENTRY("bits-len", builtin_bits_len, 0),
+    LBUILTIN_ENTRY("bits-list", builtin_bits_list, 0),
+    LBUILTIN_ENTRY("bits-each", builtin_bits_each, 0),
+    LBUILTIN_ENTRY("bytes-new", builtin_bytes_new, 0),
+    LBUILTIN_ENTRY("bytes-from", builtin_bytes_from, 0),
+    LBUILTIN_ENTRY("bytes-str", builtin_bytes_str, 0),
+    LBUILTIN_ENTRY("bytes-list", builtin_bytes_list, 0),
+    LBUILTIN_ENTRY("bytes-len", builtin_bytes_len, 0),
+    LBUILTIN_ENTRY("bytes-cap", builtin_bytes_cap, 0),
+    LBUILTIN_ENTRY("bytes-slice", builtin_bytes_slice, 0),
+    LBUILTIN_ENTRY("bytes-concat", builtin_bytes_concat, 0),
+    LBUILTIN_ENTRY("bytes-find", builtin_bytes_find, 0),
+    LBUILTIN_ENTRY("bytes-u8", builtin_bytes_u8, 0),
+    LBUILTIN_ENTRY("bytes-set-u8!", builtin_bytes_set_u8, 0),
+    LBUILTIN_ENTRY("bytes-u16le", builtin_bytes_u16le, 0),
+    LBUILTIN_ENTRY("bytes-set-u16le!", builtin_bytes_set_u16le, 0),
+    LBUILTIN_ENTRY("bytes-u16be", builtin_bytes_u16be, 0),
+    LBUILTIN_ENTRY("bytes-set-u16be!", builtin_bytes_set_u16be, 0),
+    LBUILTIN_ENTRY("bytes-u32le", builtin_bytes_u32le, 0),
+    LBUILTIN_ENTRY("bytes-set-u32le!", builtin_bytes_set_u32le, 0),
+    LBUILTIN_ENTRY("bytes-u32be", builtin_bytes_u32be, 0),
+    LBUILTIN_ENTRY("bytes-set-u32be!", builtin_bytes_set_u32be, 0),
+    LBUILTIN_ENTRY("bytes-u64le", builtin_bytes_u64le, 0),
+    LBUILTIN_ENTRY("bytes-set-u64le!", builtin_bytes_set_u64le, 0),
+    LBUILTIN_ENTRY("bytes-u64be", builtin_bytes_u64be, 0),
+    LBUILTIN_ENTRY("bytes-set-u64be!", builtin_bytes_set_u64be, 0),
+    LBUILTIN_ENTRY("lazy-range", builtin_lazy_range, 0),
+    LBUILTIN_ENTRY("lazy-from", builtin_lazy_from, 0),
+    LBUILTIN_ENTRY("lazy-map", builtin_lazy_map, 0),
+    LBUILTIN_ENTRY("lazy-filter", builtin_lazy_filter, 0),
+    LBUILTIN_ENTRY("drop-while", builtin_drop_while, 0),
+    LBUILTIN_ENTRY("realize", builtin_realize, 0),
+    LBUILTIN_ENTRY("delay", builtin_delay, LBUILTIN_ENV | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("force", builtin_force, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("defmacro", builtin_defmacro, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("macroexpand", builtin_macroexpand, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("+", builtin_add, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("-", builtin_sub, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("*", builtin_mul, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("/", builtin_div, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("%", builtin_mod, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("^", builtin_pow, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("min", builtin_min, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("max", builtin_max, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("==", builtin_eq, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("!=", builtin_ne, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("<", builtin_lt, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("<=", builtin_le, LBUILTIN_PURE),
+    LBUILTIN_ENTRY(">", builtin_gt, LBUILTIN_PURE),
+    LBUILTIN_ENTRY(">=", builtin_ge, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("&&", builtin_and, LBUILTIN_PURE | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("||", builtin_or, LBUILTIN_PURE | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("!", builtin_not, LBUILTIN_PURE),
+    LBUILTIN_ENTRY("if", builtin_if, LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("while", builtin_while, LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("for", builtin_for, LBUILTIN_ENV | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("loop", builtin_loop, LBUILTIN_ENV | LBUILTIN_SPECIAL),
+    LBUILTIN_ENTRY("recur", builtin_recur, 0),
+    LBUILTIN_ENTRY("load", builtin_load, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("print", builtin_print, 0),
+    LBUILTIN_ENTRY("error", builtin_error, 0),
+#ifdef FELISPY_TESTS
+    LBUILTIN_ENTRY("catch", builtin_catch, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("folded-body", builtin_folded_body, 0),
+#endif
+    LBUILTIN_ENTRY("read", builtin_read, LBUILTIN_ENV),
+    LBUILTIN_ENTRY("show", builtin_show, 0),
+    LBUILTIN_ENTRY("memo", builtin_memo, 0),
+    LBUILTIN_ENTRY("memo-stats", builtin_memo_stats, 0),
+    LBUILTIN_ENTRY("disk-memo", builtin_disk_memo, 0),
+    { NULL, NULL, NULL, 0 }
+};
+
+lbuiltin_entry* lbuiltin_find(char* name)
+{
+    for (int i = 0; lbuiltins[i].name != NULL; i++)
+    {
+        if (strcmp(lbuiltins[i].name, name) == 0)
+        {
+            return &lbuiltins[i];
+        }
+    }
+    return NULL;
+}
+
+lbuiltin_entry* lbuiltin_find_func(lbuiltin func)
+{
+    for (int i = 0; lbuiltins[i].name != NULL; i++)
+    {
+        if (lbuiltins[i].func == func)
+        {
+            return &lbuiltins[i];
+        }
+    }
+    return NULL;
+}
+
+int lbuiltin_flags(lbuiltin func)
+{
+    lbuiltin_entry* b = lbuiltin_find_func(func);
+    return b != NULL ? b->flags : 0;
+}
+
+/* Constant folding and inlining of lambda bodies
+
+Bodies are folded when a lambda is created and again when it is bound with 'def' or '='. Macro calls are expanded
+first, then applications of pure builtins to literals are replaced by their result and an 'if' with a literal
+condition is replaced by the branch it takes. Builtins are only applied to operands that are sure to run, so a
+branch never taken costs nothing at creation. Calls to small global functions are replaced by their body with the
+arguments substituted, when that cannot change the result: the callee is not recursive or variadic, keeps to its
+parameters and only calls pure builtins, and the arguments are literals, symbols or pure expressions used once.
+
+The folded body is cached next to the original one, which is still used for printing and comparisons, and shared
+by the copies of the lambda. Names are resolved in the global environment, so rebinding a function or shadowing it
+bumps lfold_epoch and bodies folded before that are folded again at their next call.
+*/
+
+#define LFOLD_INLINE_NODES 24
+#define LFOLD_INLINE_DEPTH 2
+
+typedef struct
+{
+    lenv* root;
+    lval* formals;
+    int changed;
+    int depth;
+    int lazy;  // folding operands that may not run, where builtins are left unevaluated
+} lfold_ctx;
+
+// Folded body of a lambda, shared by its copies, so a call, which runs a copy, neither copies it nor folds it
+// again. 'formals' are the names it was folded against: the parameters and the names the lambda had already bound,
+// as a partial application made from a copy runs the same body.
+struct lfolded
+{
+    int refs;
+    lval* formals;
+    lval* body;  // NULL when folding changed nothing
+    unsigned long epoch;
+};
+
+lfolded* lfolded_new(lval* f)
+{
+    lfolded* c = malloc(sizeof(lfolded));
+    c->refs = 1;
+    c->formals = lval_copy(f->formals);
+    for (int i = 0; i < f->env->count; i++)
+    {
+        lval_add(c->formals, lval_symbol(f->env->syms[i]));
+    }
+    c->body = NULL;
+    c->epoch = 0;
+    return c;
+}
+
+lfolded* lfolded_retain(lfolded* c)
+{
+    c->refs++;
+    return c;
+}
+
+void lfolded_release(lfolded* c)
+{
+    if (--c->refs > 0)
+    {
+        return;
+    }
+    lval_del(c->formals);
+    if (c->body != NULL)
+    {
+        lval_del(c->body);
+    }
+    free(c);
+}
+
+lenv* lenv_root(lenv* e)
+{
+    while (e->par != NULL)
+    {
+        e = e->par;
+    }
+    return e;
+}
+
+void lfold_rebind(lenv* e, char* sym, int local)
+{
+    lval* v = lenv_find(lenv_root(e), sym);
+    if (v == NULL || v->type != LVAL_FUN)
+    {
+        return;
+    }
+    lfold_epoch++;
+    // A local binding hides the global only for some callers, so stop folding that name altogether
+    if (local)
+    {
+        if (lfold_shadowed == NULL)
+        {
+            lfold_shadowed = lval_qexpr();
+        }
+        if (lval_find_sym(lfold_shadowed, sym) < 0)
+        {
+            lval_add(lfold_shadowed, lval_symbol(sym));
+        }
+    }
+}
+
+int lval_is_literal(lval* v)
+{
+    switch (v->type)
+    {
+        case LVAL_BOOLEAN:
+        case LVAL_INTEGER:
+        case LVAL_DECIMAL:
+        case LVAL_BIGNUM:
+        case LVAL_STR:
+        case LVAL_QEXPR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Function bound to the symbol in the global environment, NULL if the name could mean anything else at runtime
+lval* lfold_global(lfold_ctx* ctx, lval* head)
+{
+    if (head->type != LVAL_SYM || lval_find_sym(ctx->formals, head->sym) >= 0)
+    {
+        return NULL;
+    }
+    if (lfold_shadowed != NULL && lval_find_sym(lfold_shadowed, head->sym) >= 0)
+    {
+        return NULL;
+    }
+    lval* v = lenv_find(ctx->root, head->sym);
+    return v != NULL && v->type == LVAL_FUN ? v : NULL;
+}
+
+lbuiltin_entry* lfold_builtin(lfold_ctx* ctx, lval* head)
+{
+    lval* v = lfold_global(ctx, head);
+    return v != NULL && v->builtin != NULL ? lbuiltin_find_func(v->builtin) : NULL;
+}
+
+int lfold_is_if(lfold_ctx* ctx, lval* v)
+{
+    lbuiltin_entry* b = v->count == 4 ? lfold_builtin(ctx, v->cell[0]) : NULL;
+    return b != NULL && b->func == builtin_if;
+}
+
+// Position of the first operand a special form may skip or evaluate more than once, v->count if all of them are
+// evaluated exactly once
+int lfold_first_lazy(lfold_ctx* ctx, lval* v)
+{
+    lbuiltin_entry* b = v->count > 1 ? lfold_builtin(ctx, v->cell[0]) : NULL;
+    if (b == NULL)
+    {
+        return v->count;
+    }
+    if (b->func == builtin_while)
+    {
+        return 1;
+    }
+    if (b->func == builtin_if || b->func == builtin_and || b->func == builtin_or || b->func == builtin_loop)
+    {
+        return 2;
+    }
+    if (b->func == builtin_for)
+    {
+        return 4;
+    }
+    return v->count;
+}
+
+// 'for' takes the name of its variable as a bare symbol
+int lfold_is_binding(lfold_ctx* ctx, lval* v)
+{
+    lbuiltin_entry* b = v->count > 1 ? lfold_builtin(ctx, v->cell[0]) : NULL;
+    return b != NULL && b->func == builtin_for;
+}
+
+lval* lfold_expr(lfold_ctx* ctx, lval* v);
+
+// Bodies and 'if' branches are Q-Expressions evaluated as S-Expressions
+lval* lfold_body(lfold_ctx* ctx, lval* q)
+{
+    q->type = LVAL_SEXPR;
+    lval* x = lfold_expr(ctx, q);
+    if (x->type == LVAL_SEXPR)
+    {
+        x->type = LVAL_QEXPR;
+        return x;
+    }
+    return lval_add(lval_qexpr(), x);
+}
+
+// Expression with the same value as evaluating the body
+lval* lfold_unwrap(lval* q)
+{
+    if (q->count == 1)
+    {
+        return lval_take(q, 0);
+    }
+    q->type = LVAL_SEXPR;
+    return q;
+}
+
+int lfold_count_nodes(lval* v)
+{
+    int count = 1;
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            count += lfold_count_nodes(v->cell[i]);
+        }
+    }
+    return count;
+}
+
+typedef struct
+{
+    int uses;
+    int branch_uses;
+    int escapes;  // appears as data, where substitution would change the meaning
+} lfold_uses;
+
+// Counts where sym appears in code (bodies, S-Expressions and 'if' branches) and outside of it. Uses in operands
+// a special form may skip count as branch uses.
+void lfold_count_uses(lfold_ctx* ctx, lval* v, char* sym, int code, int branch, lfold_uses* u)
+{
+    switch (v->type)
+    {
+        case LVAL_SYM:
+            if (strcmp(v->sym, sym) == 0)
+            {
+                u->uses++;
+                u->branch_uses += branch;
+                u->escapes += !code;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        {
+            int is_if = code && lfold_is_if(ctx, v);
+            int lazy = code ? lfold_first_lazy(ctx, v) : v->count;
+            int binding = code && lfold_is_binding(ctx, v);
+            for (int i = 0; i < v->count; i++)
+            {
+                lval* x = v->cell[i];
+                int x_code = code && (x->type != LVAL_QEXPR || (is_if && i >= 2)) && !(binding && i == 1);
+                lfold_count_uses(ctx, x, sym, x_code, branch || i >= lazy, u);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Literal, symbol or application of pure builtins to those
+int lfold_is_pure(lfold_ctx* ctx, lval* v)
+{
+    if (lval_is_literal(v) || v->type == LVAL_SYM)
+    {
+        return 1;
+    }
+    if (v->type != LVAL_SEXPR || v->count < 2)
+    {
+        return 0;
+    }
+    lbuiltin_entry* b = lfold_builtin(ctx, v->cell[0]);
+    if (b == NULL || !(b->flags & LBUILTIN_PURE))
+    {
+        return 0;
+    }
+    for (int i = 1; i < v->count; i++)
+    {
+        if (!lfold_is_pure(ctx, v->cell[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether every call in the code of v is to a pure builtin or 'if'. A function called from the body of a callee
+// sees its parameters through the calling environment, which is gone once the callee is inlined.
+int lfold_calls_pure(lfold_ctx* ctx, lval* v)
+{
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+    {
+        return 1;
+    }
+    int is_if = lfold_is_if(ctx, v);
+    if (v->count > 1 && !is_if)
+    {
+        lbuiltin_entry* b = lfold_builtin(ctx, v->cell[0]);
+        if (b == NULL || !(b->flags & LBUILTIN_PURE))
+        {
+            return 0;
+        }
+    }
+    for (int i = 0; i < v->count; i++)
+    {
+        // Other Q-Expressions are data, anything that could run them is not pure
+        if (v->cell[i]->type == LVAL_QEXPR && !(is_if && i >= 2))
+        {
+            continue;
+        }
+        // So is the value of a branch that is not quoted
+        if (is_if && i >= 2 && !lval_is_literal(v->cell[i]))
+        {
+            return 0;
+        }
+        if (!lfold_calls_pure(ctx, v->cell[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+lval* lfold_subst(lval* v, lval* formals, lval* args)
+{
+    if (v->type == LVAL_SYM)
+    {
+        int i = lval_find_sym(formals, v->sym);
+        if (i >= 0)
+        {
+            lval_del(v);
+            return lval_copy(args->cell[i]);
+        }
+    }
+    else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            v->cell[i] = lfold_subst(v->cell[i], formals, args);
+        }
+    }
+    return v;
+}
+
+// Body of the call with the arguments substituted, or NULL if the call has to stay
+lval* lfold_inline(lfold_ctx* ctx, lval* v)
+{
+    lval* f = lfold_global(ctx, v->cell[0]);
+    if (f == NULL || f->builtin != NULL || f->env->count != 0 || ctx->depth >= LFOLD_INLINE_DEPTH)
+    {
+        return NULL;
+    }
+    lval* formals = f->formals;
+    lval* body = lval_run_body(ctx->root, f);
+    if (formals->count != v->count - 1 || lval_find_sym(formals, "&") >= 0 ||
+        lfold_count_nodes(body) > LFOLD_INLINE_NODES)
+    {
+        return NULL;
+    }
+
+    lfold_ctx callee = { ctx->root, formals, 0, ctx->depth + 1, ctx->lazy };
+    lfold_uses self = { 0, 0, 0 };
+    lfold_count_uses(&callee, body, v->cell[0]->sym, 0, 0, &self);
+    if (self.uses > 0 || !lfold_calls_pure(&callee, body))
+    {
+        return NULL;
+    }
+    for (int i = 0; i < formals->count; i++)
+    {
+        lfold_uses u = { 0, 0, 0 };
+        lval* arg = v->cell[i + 1];
+        lfold_count_uses(&callee, body, formals->cell[i]->sym, 1, 0, &u);
+        if (u.escapes > 0 || !lfold_is_pure(ctx, arg))
+        {
+            return NULL;
+        }
+        // Evaluating a symbol or an expression can fail, so it must happen exactly as often as before
+        if (!lval_is_literal(arg) && (u.uses != 1 || u.branch_uses != 0))
+        {
+            return NULL;
+        }
+    }
+
+    lval* args = lval_sexpr();
+    for (int i = 1; i < v->count; i++)
+    {
+        lval_add(args, lval_copy(v->cell[i]));
+    }
+    lval* x = lfold_unwrap(lfold_subst(lval_copy(body), formals, args));
+    lval_del(args);
+
+    lfold_ctx inner = { ctx->root, ctx->formals, 0, ctx->depth + 1, ctx->lazy };
+    x = lfold_expr(&inner, x);
+    ctx->changed += inner.changed + 1;
+    return x;
+}
+
+lval* lfold_expr(lfold_ctx* ctx, lval* v)
+{
+    if (v->type != LVAL_SEXPR)
+    {
+        return v;
+    }
+
+    // A macro sees its operands as written, so it is expanded before they are folded
+    lval* m = v->count > 1 ? (v->cell[0]->type == LVAL_SYM ? lfold_global(ctx, v->cell[0]) : v->cell[0]) : NULL;
+    if (m != NULL && m->type == LVAL_FUN && (m->flags & LBUILTIN_MACRO) && lmacro_depth < LMACRO_DEPTH)
+    {
+        lval* a = lval_copy(v);
+        lval_del(lval_pop(a, 0));
+        lval* code = lmacro_expand(ctx->root, m, a);
+        if (code->type == LVAL_ERR)
+        {
+            // Left for the runtime to report
+            lval_del(code);
+            return v;
+        }
+        lval_del(v);
+        ctx->changed++;
+        lmacro_depth++;
+        code = lfold_expr(ctx, code->type == LVAL_QEXPR ? lfold_unwrap(code) : code);
+        lmacro_depth--;
+        return code;
+    }
+
+    int lazy = ctx->lazy;
+    int first_lazy = lfold_first_lazy(ctx, v);
+    for (int i = 0; i < v->count; i++)
+    {
+        ctx->lazy = lazy || i >= first_lazy;
+        v->cell[i] = lfold_expr(ctx, v->cell[i]);
+    }
+    ctx->lazy = lazy;
+    if (v->count < 2)
+    {
+        return v;
+    }
+
+    lbuiltin_entry* b = lfold_builtin(ctx, v->cell[0]);
+    if (b == NULL)
+    {
+        lval* x = lfold_inline(ctx, v);
+        if (x == NULL)
+        {
+            return v;
+        }
+        lval_del(v);
+        return x;
+    }
+
+    if (lfold_is_if(ctx, v))
+    {
+        ctx->lazy = 1;
+        for (int i = 2; i < 4; i++)
+        {
+            if (v->cell[i]->type == LVAL_QEXPR)
+            {
+                v->cell[i] = lfold_body(ctx, v->cell[i]);
+            }
+        }
+        ctx->lazy = lazy;
+        int cond = lval_is_literal(v->cell[1]) ? lval_truth(v->cell[1]) : -1;
+        // The value of a branch that is not quoted may be code to run, which only the runtime knows
+        if (cond < 0 || !lval_is_literal(v->cell[cond ? 2 : 3]))
+        {
+            return v;
+        }
+        ctx->changed++;
+        lval* branch = lval_take(v, cond ? 2 : 3);
+        return branch->type == LVAL_QEXPR ? lfold_unwrap(branch) : branch;
+    }
+
+    if (!(b->flags & LBUILTIN_PURE) || ctx->lazy)
+    {
+        return v;
+    }
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; i++)
+    {
+        if (!lval_is_literal(v->cell[i]))
+        {
+            lval_del(a);
+            return v;
+        }
+        lval_add(a, lval_copy(v->cell[i]));
+    }
+    lval* x = b->func(ctx->root, a);
+    if (!lval_is_literal(x))
+    {
+        // Errors and anything else are left to happen at runtime
+        lval_del(x);
+        return v;
+    }
+    ctx->changed++;
+    lval_del(v);
+    return x;
+}
+
+// Body a call runs. A body folded before a name it used was rebound is folded again first, so a call after any
+// rebinding does not go back to the original code, where every macro call would be expanded again.
+lval* lval_run_body(lenv* e, lval* f)
+{
+    lval_fold(e, f);
+    return f->folded->body != NULL ? f->folded->body : f->body;
+}
+
+void lval_fold(lenv* e, lval* f)
+{
+    if (f->folded == NULL)
+    {
+        f->folded = lfolded_new(f);
+    }
+    lfolded* c = f->folded;
+    if (c->epoch == lfold_epoch)
+    {
+        return;
+    }
+    if (c->body != NULL)
+    {
+        lval_del(c->body);
+        c->body = NULL;
+    }
+    // Set first, a recursive call inlined while folding gets the original body instead of folding this one again
+    c->epoch = lfold_epoch;
+    lfold_ctx ctx = { lenv_root(e), c->formals, 0, 0, 0 };
+    lval* body = lfold_body(&ctx, lval_copy(f->body));
+    if (ctx.changed)
+    {
+        c->body = body;
+    }
+    else
+    {
+        lval_del(body);
+    }
+}
+
+void lenv_add_builtins(lenv* e)
+{
+    lval* sym = lval_symbol("true");
+    lval* fun = lval_boolean(1);
+    lenv_put(e, sym, fun);
+    lval_del(sym);
+    lval_del(fun);
+
+    sym = lval_symbol("false");
+    fun = lval_boolean(0);
+    lenv_put(e, sym, fun);
+    lval_del(sym);
+    lval_del(fun);
+
+    for (int i = 0; lbuiltins[i].name != NULL; i++)
+    {
+        lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+    }
+}
+
+void lenv_add_library(lenv* e, mpc_parser_t* parser)
+{
+    char* input[] = {
+        "def{ fun } (\\ {args body} {def(head args) (\\ (tail args) body)})",
+        /*
+        "fun {unpack f xs} {eval (join (list f) xs)}",
+        "fun { pack f & xs } {f xs}",
+        "def {uncurry} pack",
+        "def {curry} unpack",
+        "def {first} (curry (\\ {x & xs} {x}))",
+        "fun {second xs} {first (tail xs)}",
+        "fun {reverse f x y} {f y x}",
+        "fun {combine f g & xs} {g ((curry f) xs)}",
+        "fun {and x & xs} { if (! x) {false} {if (== xs {}) {true} { curry and xs }}}",
+        "fun {or x & xs} { if (x) {true} {if (== xs {}) {false} { curry or xs }}}",
+        "fun {not x} { if (x) {false} {true}}",
+        */
+        NULL
+    };
+
+    for (int i = 0; input[i] != NULL; i++)
+    {
+        mpc_result_t result;
+        mpc_parse("<stdin>", input[i], parser, &result);
+        lval_del(lval_eval(e, lval_read(result.output)));
+        mpc_ast_delete(result.output);
+    }
+}
+
+// A special form called with arguments that are already values would evaluate them again. Symbols and
+// S-Expressions among them are wrapped in (last {x}), which evaluates back to x.
+lval* lval_quote_args(lval* a)
+{
+    for (int i = 0; i < a->count; i++)
+    {
+        lval* x = a->cell[i];
+        if (x->type == LVAL_SYM || (x->type == LVAL_SEXPR && x->count > 0))
+        {
+            a->cell[i] = lval_add(lval_add(lval_sexpr(), lval_builtin(builtin_last)), lval_add(lval_qexpr(), x));
+        }
+    }
+    return a;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+    if (f->memo != NULL)
+    {
+        return lmemo_call(e, f->memo, a);
+    }
+    if (f->recfn != NULL)
+    {
+        return lrecfn_call(f->recfn, a);
+    }
+    if (f->builtin != NULL)
+    {
+        if (f->flags & LBUILTIN_SPECIAL)
+        {
+            a = lval_quote_args(a);
+        }
+        return f->builtin(e, a);
+    }
+
+    int args_given = a->count;
+    int args_total = f->formals->count;
+
+    while (a->count > 0)
+    {
+        if (f->formals->count == 0)
         {
-            lval* err = lval_err("Function '%s' expected %s at position %i got %s.", fun, ltype_name(LVAL_SYM), i, ltype_name(k->cell[i]->type));
-            lval_del(k);
             lval_del(a);
-            return err;
+            return lval_err("Function given too many arguments. Expected %d given %d.", args_total, args_given);
+        }
+        lval* sym = lval_pop(f->formals, 0);
+        // special case: function supports variable size argument list in the format (\ {x & xs} {...})
+        // when called, the first argument is assigned to x and the rest of the arguments are assigned to xs as a list
+        if (strcmp(sym->sym, "&") == 0)
+        {
+            if (f->formals->count != 1)
+            {
+                lval_del(a);
+                // TODO: Shouldn't this be checked on lambda definition?
+                return lval_err("Function format invalid. '&' not followed by a single symbol.");
+            }
+
+            lval* nsym = lval_pop(f->formals, 0);
+            lenv_put(f->env, nsym, builtin_list(e, a));
+            lval_del(sym);
+            lval_del(nsym);
+            break;
         }
+        lval* val = lval_pop(a, 0);
+        lenv_put(f->env, sym, val);
+        lval_del(sym);
+        lval_del(val);
     }
+    lval_del(a);
 
-    // Global definition
-    if (strcmp(fun, "def") == 0)
+    // special case: function supports variable size argument list but was given none, assign empty list to rest of arguments
+    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0)
     {
-        while (e->par != NULL)
+        if (args_total - args_given != 2)
         {
-            e = e->par;
+            return lval_err("Function format invalid. '&' not followed by a single symbol.");
         }
+
+        // remove &
+        lval_del(lval_pop(f->formals, 0));
+
+        lval* sym = lval_pop(f->formals, 0);
+        lval* val = lval_qexpr();
+        lenv_put(f->env, sym, val);
+        lval_del(sym);
+        lval_del(val);
     }
-    for (int i = 0; i < k->count; i++)
+
+    if (f->formals->count == 0)
     {
-        lenv_put(e, k->cell[i], a->cell[i]);
+        lval* tmp = lval_sexpr();
+        lval_add(tmp, lval_copy(lval_run_body(e, f)));
+        f->env->par = e;
+        return lval_no_recur(builtin_eval(f->env, tmp));
+    }
+    else
+    {
+        // Partially applied function
+        return lval_copy(f);
     }
-    lval_del(k);
-    lval_del(a);
-    return lval_sexpr(); // Empty ()
 }
 
-LBUILTIN_DECL(builtin_def)
-{
-    return builtin_var(e, a, "def");
-}
+lval* lval_eval_call(lenv* e, lval* v);
 
-LBUILTIN_DECL(builtin_put)
+lval* lval_eval_sexpr(lenv* e, lval* v)
 {
-    return builtin_var(e, a, "=");
-}
+    if (v->count == 0)
+    {
+        return v;
+    }
 
-LBUILTIN_DECL(builtin_lambda)
-{
-    LASSERT_ARG_COUNT(a, 2, "\\");
-    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "\\");
-    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "\\");
+    v->cell[0] = lval_eval(e, v->cell[0]);
+    if (v->cell[0]->type == LVAL_FUN && (v->cell[0]->flags & LBUILTIN_MACRO) && v->count > 1)
+    {
+        lval* m = lval_pop(v, 0);
+        lval* code = lmacro_expand(lenv_root(e), m, v);
+        lval_del(m);
+        return code->type == LVAL_ERR ? code : lval_eval_branch(e, code);
+    }
+    if (v->cell[0]->type == LVAL_FUN && (v->cell[0]->flags & LBUILTIN_SPECIAL) && v->count > 1)
+    {
+        lval* f = lval_pop(v, 0);
+        lval* result = f->builtin(e, v);
+        lval_del(f);
+        return result;
+    }
 
-    for (int i = 0; i < a->cell[0]->count; i++)
+    for (int i = 1; i < v->count; i++)
     {
-        LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
-                "Cannot define non-symbol at position %d. Expected %s got %s.",
-                i, ltype_name(LVAL_SYM), ltype_name(a->cell[0]->cell[i]->type));
+        v->cell[i] = lval_eval(e, v->cell[i]);
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval* v = lval_lambda(formals, body);
-    lval_del(a);
-    return v;
+    return lval_eval_call(e, v);
 }
 
-LBUILTIN_DECL(builtin_head)
+// Second half of S-Expression evaluation: all cells are already evaluated, the first one is the function
+lval* lval_eval_call(lenv* e, lval* v)
 {
-    LASSERT_ARG_COUNT(a, 1, "head");
-    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_STR, "head");
-
-    if (a->cell[0]->type == LVAL_QEXPR)
+    if (v->count == 0)
     {
-        LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "head");
+        return v;
+    }
 
-        lval* v = lval_take(a, 0);
-        while (v->count > 1)
+    for (int i = 0; i < v->count; i++)
+    {
+        v->cell[i] = lval_no_recur(v->cell[i]);
+        if (v->cell[i]->type == LVAL_ERR)
         {
-            lval_del(lval_pop(v, 1));
+            return lval_take(v, i);
         }
-        return v;
     }
-    else
+
+    if (v->count == 1)
     {
-        LASSERT(a, a->cell[0]->str[0] != '\0', "Function 'head' was given an empty string.");
+        lval* u = lval_take(v, 0);
+        return u;
+    }
 
-        a->cell[0]->str[1] = '\0';
-        lval* v = lval_string(a->cell[0]->str);
-        return v;
-    }    
+    lval* f = lval_pop(v, 0);
+
+    if (f->type != LVAL_FUN)
+    {
+        lval* err = lval_err("Expected %s, got %s", ltype_name(LVAL_FUN), ltype_name(f->type));
+        lval_del(f);
+        lval_del(v);
+        return err;
+    }
+
+    lval* result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
 }
 
-LBUILTIN_DECL(builtin_tail)
+lval* lval_eval(lenv* e, lval* v)
 {
-    LASSERT_ARG_COUNT(a, 1, "tail");
-    LASSERT_ARG_TYPE2(a, 0, LVAL_QEXPR, LVAL_STR, "tail");
-
-    if (a->cell[0]->type == LVAL_QEXPR)
+    if (v->type == LVAL_SEXPR)
     {
-        LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "tail");
-
-        lval *v = lval_take(a, 0);
-        lval_del(lval_pop(v, 0));
-        return v;
+        return lval_eval_sexpr(e, v);
+    }
+    else if (v->type == LVAL_SYM)
+    {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
     }
     else
     {
-        LASSERT(a, a->cell[0]->str[0] != '\0', "Function 'tail' was given an empty string.");
-
-        lval* v = lval_string(a->cell[0]->str + 1);
-        lval_del(a);
         return v;
     }
 }
 
-LBUILTIN_DECL(builtin_list)
-{
-    a->type = LVAL_QEXPR;
-    return a;
-}
+// Runtime support for the code generated by --emit-c
 
-LBUILTIN_DECL(builtin_get_env)
+int lval_count(lval* v)
 {
-    lval* q = lval_qexpr();
-    for (int i = 0; i < e->count; i++)
-    {
-        q = lval_add(q, lval_symbol(e->syms[i]));
-    }
-    return q;
+    return v->count;
 }
 
-lval* lval_eval(lenv* e, lval* v);
-
-LBUILTIN_DECL(builtin_eval)
-{
-    LASSERT_ARG_COUNT(a, 1, "eval");
-    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "eval");
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
-}
 
-LBUILTIN_DECL(builtin_join)
+lval* lval_call_builtin(lenv* e, lbuiltin func, lval* a)
 {
-    LASSERT_ARG_MIN(a, 1, "join");
-    LASSERT_ARG_TYPE2(a, 0, LVAL_STR, LVAL_QEXPR, "join");
-    lval_type_t base_type = a->cell[0]->type;
     for (int i = 0; i < a->count; i++)
     {
-        LASSERT_ARG_TYPE(a, i, base_type, "join");
-    }
-
-    if (base_type == LVAL_QEXPR)
-    {
-        lval* x = lval_pop(a, 0);
-        while (a->count > 0)
-        {
-            x = lval_join(x, lval_pop(a, 0));
-        }
-        lval_del(a);
-        return x;
-    }
-    else
-    {
-        int total_size = 0;
-        for (int i = 0; i < a->count; i++)
-        {
-            total_size += strlen(a->cell[i]->str);
-        }
-        char* str = malloc(total_size + 1);
-        str[0] = '\0';
-        for (int i = 0; i < a->count; i++)
+        a->cell[i] = lval_no_recur(a->cell[i]);
+        if (a->cell[i]->type == LVAL_ERR)
         {
-            strcat(str, a->cell[i]->str);
+            return lval_take(a, i);
         }
-        lval_del(a);
-        lval* x = lval_string(str);
-        free(str);
-        return x;
     }
+    return func(e, a);
 }
 
-LBUILTIN_DECL(builtin_cons)
+lenv* lenv_frame(lenv* par)
 {
-    LASSERT_ARG_COUNT(a, 2, "cons");
-    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "cons");
-
-    lval* x = lval_pop(a, 0);
-    lval* q = lval_qexpr();
-    q = lval_add(q, x);
-    lval* p = lval_take(a, 0);
-    return lval_join(q, p);
+    lenv* e = lenv_new();
+    e->par = par;
+    return e;
 }
 
-LBUILTIN_DECL(builtin_len)
+void lval_report(lenv* e, lval* x)
 {
-    LASSERT_ARG_COUNT(a, 1, "len");
-    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "len");
-
-    lval* x = lval_take(a, 0);
-    lval* l = lval_integer(x->count);
+    x = lval_no_recur(x);
+    if (x->type == LVAL_ERR)
+    {
+        lval_println(e, x);
+    }
     lval_del(x);
-    return l;
 }
 
-LBUILTIN_DECL(builtin_init)
-{
-    LASSERT_ARG_COUNT(a, 1, "init");
-    LASSERT_ARG_TYPE(a, 0, LVAL_QEXPR, "init");
-    LASSERT_ARG_NOT_EMPTY(a, 0, LVAL_QEXPR, "init");
-
-    lval* x = lval_take(a, 0);
-    lval* y = lval_pop(x, x->count - 1);
-    lval_del(y);
-    return x;
-}
+/* Ahead-of-time compilation to C (felispy --emit-c file.lspy)
 
-LBUILTIN_DECL(builtin_if)
-{
-    LASSERT_ARG_COUNT(a, 3, "if");
-    LASSERT(a, a->cell[0]->type == LVAL_BOOLEAN || a->cell[0]->type == LVAL_INTEGER || a->cell[0]->type == LVAL_DECIMAL,
-            "Function 'if' got invalid type %s at position %d.", ltype_name(a->cell[0]->type), 0);
-    LASSERT_ARG_TYPE(a, 1, LVAL_QEXPR, "if");
-    LASSERT_ARG_TYPE(a, 2, LVAL_QEXPR, "if");
+Top-level statements become C statements run in order against the global environment. Functions defined once
+with 'fun' or 'def' become native builtins: parameters live in C variables and calls to builtins or to other
+native functions are direct C calls. Anything that cannot be resolved statically is rebuilt as data and handed
+to lval_eval at runtime, so the program behaves as if the file was loaded by the interpreter.
 
-    lval* cond = a->cell[0];
+The output links against the interpreter itself:
+    cc -DFELISPY_NO_MAIN out.c main.c mpc.c -lm -ledit
+*/
 
-    lval* result;
-    if (((cond->type == LVAL_DECIMAL) && (cond->decimal != 0.0)) || ((cond->type != LVAL_DECIMAL) && cond->integer))
-    {
-        lval* true_val = lval_pop(a, 1);
-        true_val->type = LVAL_SEXPR;
-        result = lval_eval(e, true_val);
-    }
-    else
+typedef struct
+{
+    FILE* out;
+    int temps;
+    int depth;
+    lval* formals;  // parameters of the function being compiled, NULL at top level
+    lval* defined;  // every name (re)defined at top level, duplicates included
+    lval* natives;  // names of the functions compiled to C
+    lval* macros;  // names defined with 'defmacro', calls to them are left to the interpreter
+    lval* open;     // natives that may look up the parameters of the native calling them
+    char* env;      // C name of the environment used for runtime lookups
+    char* used;     // builtins referenced by the generated code
+} lcompiler;
+
+int lcomp_count(lval* q, char* sym)
+{
+    int count = 0;
+    for (int i = 0; i < q->count; i++)
     {
-        lval* false_val = lval_pop(a, 2);
-        false_val->type = LVAL_SEXPR;
-        result = lval_eval(e, false_val);
-    }
-
-    lval_del(a);
-    return result;
+        if (strcmp(q->cell[i]->sym, sym) == 0)
+        {
+            count++;
+        }
+    }
+    return count;
 }
 
-LBUILTIN_DECL(builtin_load)
+int lcomp_formal(lcompiler* c, char* sym)
 {
-    LASSERT_ARG_COUNT(a, 1, "load");
-    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "load");
+    return c->formals == NULL ? -1 : lval_find_sym(c->formals, sym);
+}
 
-    char* filename = a->cell[0]->str;
+int lcomp_native(lcompiler* c, char* sym)
+{
+    return lcomp_formal(c, sym) >= 0 ? -1 : lval_find_sym(c->natives, sym);
+}
 
-    mpc_result_t r;
-    if (mpc_parse_contents(filename, Lispy, &r))
+// A builtin is only resolved statically if nothing in the file can rebind its name
+int lcomp_builtin(lcompiler* c, char* sym)
+{
+    if (lcomp_formal(c, sym) >= 0 || lval_find_sym(c->defined, sym) >= 0)
     {
-        lval* prog = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        while (prog->count)
+        return -1;
+    }
+    for (int i = 0; lbuiltins[i].name != NULL; i++)
+    {
+        if (strcmp(lbuiltins[i].name, sym) == 0)
         {
-            lval* expr = lval_pop(prog, 0);
-            lval* x = lval_eval(e, expr);
-            if (x->type == LVAL_ERR)
-            {
-                lval_println(e, x);
-            }
-            lval_del(x);
+            return i;
         }
-
-        lval_del(prog);
-        lval_del(a);
-        return lval_ok();
     }
-    else
-    {
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-        lval* err = lval_err("Could not load library: %s ", err_msg);
-        free(err_msg);
-        lval_del(a);
-        return err;
-    }   
-    
+    return -1;
 }
 
+int lcomp_is_if(lcompiler* c, lval* v)
+{
+    int b = v->count == 4 && v->cell[0]->type == LVAL_SYM ? lcomp_builtin(c, v->cell[0]->sym) : -1;
+    return b >= 0 && lbuiltins[b].func == builtin_if;
+}
 
-LBUILTIN_DECL(builtin_read)
+// 0 for '&&', 1 for '||' (the truth value that decides the result), -1 for anything else
+int lcomp_logic(lcompiler* c, lval* v)
 {
-    LASSERT_ARG_COUNT(a, 1, "load");
-    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "load");
+    int b = v->count > 2 && v->cell[0]->type == LVAL_SYM ? lcomp_builtin(c, v->cell[0]->sym) : -1;
+    if (b >= 0 && lbuiltins[b].func == builtin_and)
+    {
+        return 0;
+    }
+    return b >= 0 && lbuiltins[b].func == builtin_or ? 1 : -1;
+}
 
-    char* expr = a->cell[0]->str;
+int lcomp_check_body(lcompiler* c, lval* q, int* generic);
 
-    mpc_result_t r;
-    if (mpc_parse("-", expr, Lispy, &r))
+// Returns 0 if the expression reads or changes its environment in ways native code cannot reproduce.
+// Sets *generic when a call has to go through lval_eval_call, which then needs the parameters in a real frame.
+int lcomp_check(lcompiler* c, lval* v, int* generic)
+{
+    if (v->type != LVAL_SEXPR || v->count == 0)
     {
-        lval* prog = lval_read(r.output);
-        mpc_ast_delete(r.output);
-        prog->type = LVAL_QEXPR;
-        return prog;
+        return 1;
     }
-    else
+    if (v->count == 1)
     {
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-        lval* err = lval_err("Could not read expression: %s ", err_msg);
-        free(err_msg);
-        lval_del(a);
-        return err;
+        return lcomp_check(c, v->cell[0], generic);
     }
-}
 
-LBUILTIN_DECL(builtin_print)
-{
-    for (int i = 0; i < a->count; i++)
+    lval* head = v->cell[0];
+    if (head->type == LVAL_SYM && lcomp_formal(c, head->sym) < 0 && lval_find_sym(c->macros, head->sym) >= 0)
     {
-        if (i > 0)
+        return 0;
+    }
+    if (head->type == LVAL_SYM && lcomp_builtin(c, head->sym) >= 0)
+    {
+        if (lcomp_is_if(c, v))
         {
-            putchar(' ');
+            return lcomp_check(c, v->cell[1], generic) &&
+                   lcomp_check_body(c, v->cell[2], generic) &&
+                   lcomp_check_body(c, v->cell[3], generic);
+        }
+        // Other special forms take operands the generated code would evaluate too early
+        int flags = lbuiltins[lcomp_builtin(c, head->sym)].flags;
+        if ((flags & LBUILTIN_ENV) || ((flags & LBUILTIN_SPECIAL) && lcomp_logic(c, v) < 0))
+        {
+            return 0;
         }
-        lval_print(e, a->cell[i]);
     }
-    putchar('\n');
+    else if (head->type != LVAL_SYM || lcomp_native(c, head->sym) < 0 || lval_find_sym(c->open, head->sym) >= 0)
+    {
+        *generic = 1;
+    }
 
-    lval_del(a);
-    return lval_ok();
+    for (int i = 0; i < v->count; i++)
+    {
+        if (!lcomp_check(c, v->cell[i], generic))
+        {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-LBUILTIN_DECL(builtin_show)
+int lcomp_check_body(lcompiler* c, lval* q, int* generic)
 {
-    for (int i = 0; i < a->count; i++)
+    if (q->type != LVAL_QEXPR)
     {
-        if (i > 0)
+        // Its value may be code for the interpreter to run
+        if (!lval_is_literal(q))
         {
-            putchar(' ');
+            *generic = 1;
         }
-        LASSERT_ARG_TYPE(a, i, LVAL_STR, "show");
-        printf("%s", a->cell[i]->str);
+        return lcomp_check(c, q, generic);
     }
-    putchar('\n');
+    q->type = LVAL_SEXPR;
+    int result = lcomp_check(c, q, generic);
+    q->type = LVAL_QEXPR;
+    return result;
+}
 
-    lval_del(a);
-    return lval_ok();
+void lcomp_indent(lcompiler* c)
+{
+    for (int i = 0; i < c->depth; i++)
+    {
+        fputs("    ", c->out);
+    }
 }
 
-LBUILTIN_DECL(builtin_error)
+void lcomp_cstr(FILE* out, char* s)
 {
-    LASSERT_ARG_COUNT(a, 1, "error");
-    LASSERT_ARG_TYPE(a, 0, LVAL_STR, "error");
-    lval* err = lval_err(a->cell[0]->str);
-    lval_del(a);
-    return err;
+    char* str = malloc(strlen(s) + 1);
+    strcpy(str, s);
+    char* escaped = mpcf_escape(str);
+    fprintf(out, "\"%s\"", escaped);
+    free(escaped);
 }
 
-lval* builtin_op(lval* v, char* sym)
+// Emits code that builds v as plain data and returns the temporary holding it
+int lcomp_value(lcompiler* c, lval* v)
 {
-    for (int i = 0; i < v->count; i++)
+    int t = c->temps++;
+    lcomp_indent(c);
+    fprintf(c->out, "lval* t%d = ", t);
+    switch (v->type)
     {
-        if (v->cell[i]->type != LVAL_INTEGER && v->cell[i]->type != LVAL_DECIMAL)
+        case LVAL_BOOLEAN:
+            fprintf(c->out, "lval_boolean(%li);\n", v->integer);
+            break;
+        case LVAL_INTEGER:
+            // The literal of the smallest long would negate a constant too large for long
+            if (v->integer == LONG_MIN)
+            {
+                fprintf(c->out, "lval_integer(%liL - 1);\n", v->integer + 1);
+                break;
+            }
+            fprintf(c->out, "lval_integer(%liL);\n", v->integer);
+            break;
+        case LVAL_DECIMAL:
+            fprintf(c->out, "lval_decimal(%.17g);\n", v->decimal);
+            break;
+        case LVAL_BIGNUM:
         {
-            lval *err = lval_err("Function '%s' got invalid operand type at position %i: %s", sym, i, ltype_name(v->cell[i]->type));
-            lval_del(v);
-            return err;
+            char* digits = lbig_to_string(v->big);
+            fprintf(c->out, "lval_parse_integer(\"%s\");\n", digits);
+            free(digits);
+            break;
         }
+        case LVAL_SYM:
+            fputs("lval_symbol(", c->out);
+            lcomp_cstr(c->out, v->sym);
+            fputs(");\n", c->out);
+            break;
+        case LVAL_STR:
+            fputs("lval_string(", c->out);
+            lcomp_cstr(c->out, v->str);
+            fputs(");\n", c->out);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            fprintf(c->out, "%s;\n", v->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+            for (int i = 0; i < v->count; i++)
+            {
+                int x = lcomp_value(c, v->cell[i]);
+                lcomp_indent(c);
+                fprintf(c->out, "lval_add(t%d, t%d);\n", t, x);
+            }
+            break;
+        default:
+            fprintf(c->out, "lval_err(\"Cannot compile %s\");\n", ltype_name(v->type));
+            break;
     }
+    return t;
+}
 
-    lval* x = lval_pop(v, 0);
-    if (v->count == 0)
+int lcomp_expr(lcompiler* c, lval* v);
+
+int lcomp_body(lcompiler* c, lval* q);
+
+int lcomp_if(lcompiler* c, lval* v)
+{
+    int cond = lcomp_expr(c, v->cell[1]);
+    int t = c->temps++;
+    lcomp_indent(c);
+    fprintf(c->out, "lval* t%d;\n", t);
+    lcomp_indent(c);
+    fprintf(c->out, "int c%d = lval_truth(t%d);\n", t, cond);
+
+    for (int branch = 0; branch < 2; branch++)
     {
-        if (strcmp(sym, "-") == 0)
+        lcomp_indent(c);
+        fprintf(c->out, branch == 0 ? "if (c%d == 1)\n" : "else if (c%d == 0)\n", t);
+        lcomp_indent(c);
+        fputs("{\n", c->out);
+        c->depth++;
+        lcomp_indent(c);
+        fprintf(c->out, "lval_del(t%d);\n", cond);
+        int x = lcomp_body(c, v->cell[2 + branch]);
+        lcomp_indent(c);
+        if (v->cell[2 + branch]->type == LVAL_QEXPR)
         {
-            if (x->type == LVAL_INTEGER)
-            {
-                x->integer = -x->integer;
-            }
-            else if (x->type == LVAL_DECIMAL)
-            {
-                x->decimal = -x->decimal;
-            }
+            fprintf(c->out, "t%d = t%d;\n", t, x);
         }
+        else
+        {
+            fprintf(c->out, "t%d = lval_branch_value(%s, t%d);\n", t, c->env, x);
+        }
+        c->depth--;
+        lcomp_indent(c);
+        fputs("}\n", c->out);
     }
+    lcomp_indent(c);
+    fprintf(c->out, "else\n");
+    lcomp_indent(c);
+    fputs("{\n", c->out);
+    lcomp_indent(c);
+    fprintf(c->out, "    t%d = lval_truth_error(\"if\", t%d, 0);\n", t, cond);
+    lcomp_indent(c);
+    fputs("}\n", c->out);
+    return t;
+}
 
-    if (strcmp(sym, "not") == 0 && v->count > 0)
+// Each operand is evaluated in the else block of the previous one, so evaluation stops at the deciding value
+int lcomp_and_or(lcompiler* c, lval* v, int decisive)
+{
+    int t = c->temps++;
+    lcomp_indent(c);
+    fprintf(c->out, "lval* t%d;\n", t);
+    int opened = 0;
+    for (int i = 1; i < v->count; i++)
     {
-        lval *err = lval_err("Function 'not' got too many arguments.");
-        lval_del(x);
-        lval_del(v);
-        return err;
+        int x = lcomp_expr(c, v->cell[i]);
+        lcomp_indent(c);
+        fprintf(c->out, "int c%d = lval_truth(t%d);\n", x, x);
+        lcomp_indent(c);
+        fprintf(c->out, "if (c%d < 0)\n", x);
+        lcomp_indent(c);
+        fputs("{\n", c->out);
+        lcomp_indent(c);
+        fprintf(c->out, "    t%d = lval_truth_error(\"%s\", t%d, %d);\n", t, decisive ? "||" : "&&", x, i - 1);
+        lcomp_indent(c);
+        fputs("}\n", c->out);
+        lcomp_indent(c);
+        fputs("else\n", c->out);
+        lcomp_indent(c);
+        fputs("{\n", c->out);
+        c->depth++;
+        opened++;
+        lcomp_indent(c);
+        fprintf(c->out, "lval_del(t%d);\n", x);
+        lcomp_indent(c);
+        fprintf(c->out, "if (c%d == %d)\n", x, decisive);
+        lcomp_indent(c);
+        fputs("{\n", c->out);
+        lcomp_indent(c);
+        fprintf(c->out, "    t%d = lval_boolean(%d);\n", t, decisive);
+        lcomp_indent(c);
+        fputs("}\n", c->out);
+        lcomp_indent(c);
+        fputs("else\n", c->out);
+        lcomp_indent(c);
+        fputs("{\n", c->out);
+        c->depth++;
+        opened++;
+    }
+    lcomp_indent(c);
+    fprintf(c->out, "t%d = lval_boolean(%d);\n", t, !decisive);
+    while (opened-- > 0)
+    {
+        c->depth--;
+        lcomp_indent(c);
+        fputs("}\n", c->out);
+    }
+    return t;
+}
+
+int lcomp_sexpr(lcompiler* c, lval* v)
+{
+    if (v->count == 0)
+    {
+        return lcomp_value(c, v);
+    }
+    if (v->count == 1)
+    {
+        return lcomp_expr(c, v->cell[0]);
     }
 
-    while (v->count > 0)
+    lval* head = v->cell[0];
+    int builtin = head->type == LVAL_SYM ? lcomp_builtin(c, head->sym) : -1;
+    int native = head->type == LVAL_SYM ? lcomp_native(c, head->sym) : -1;
+    if (lcomp_is_if(c, v))
+    {
+        return lcomp_if(c, v);
+    }
+    if (lcomp_logic(c, v) >= 0)
     {
-        lval* y = lval_pop(v, 0);
-        x = eval_op(x, sym, y);
+        return lcomp_and_or(c, v, lcomp_logic(c, v));
     }
 
-    lval_del(v);
-    return x;
+    int first = builtin >= 0 || native >= 0 ? 1 : 0;
+    int args = c->temps++;
+    lcomp_indent(c);
+    fprintf(c->out, "lval* t%d = lval_sexpr();\n", args);
+    for (int i = first; i < v->count; i++)
+    {
+        int x = lcomp_expr(c, v->cell[i]);
+        lcomp_indent(c);
+        fprintf(c->out, "lval_add(t%d, t%d);\n", args, x);
+    }
+
+    int t = c->temps++;
+    lcomp_indent(c);
+    if (builtin >= 0)
+    {
+        c->used[builtin] = 1;
+        fprintf(c->out, "lval* t%d = lval_call_builtin(%s, %s, t%d);\n", t, c->env, lbuiltins[builtin].c_name, args);
+    }
+    else if (native >= 0)
+    {
+        fprintf(c->out, "lval* t%d = lval_call_builtin(%s, lspy_fn%d, t%d);\n", t, c->env, native, args);
+    }
+    else
+    {
+        fprintf(c->out, "lval* t%d = lval_eval_call(%s, t%d);\n", t, c->env, args);
+    }
+    return t;
 }
 
-lval* builtin_ord(lval* a, char* op)
+int lcomp_expr(lcompiler* c, lval* v)
 {
-    LASSERT_ARG_COUNT(a, 2, op);
-    LASSERT_ARG_TYPE2(a, 0, LVAL_DECIMAL, LVAL_INTEGER, op);
-    LASSERT_ARG_TYPE2(a, 1, LVAL_DECIMAL, LVAL_INTEGER, op);
-
-    lval* result = NULL;
-    lval* x = a->cell[0];
-    lval* y = a->cell[1];
+    if (v->type == LVAL_SEXPR)
+    {
+        return lcomp_sexpr(c, v);
+    }
+    if (v->type != LVAL_SYM)
+    {
+        return lcomp_value(c, v);
+    }
 
-    if (x->type == LVAL_DECIMAL && y->type == LVAL_INTEGER)
+    int t = c->temps++;
+    lcomp_indent(c);
+    int formal = lcomp_formal(c, v->sym);
+    if (formal >= 0)
     {
-        y->type = LVAL_DECIMAL;
-        y->decimal = (double) y->integer;
+        fprintf(c->out, "lval* t%d = lval_copy(a%d);\n", t, formal);
     }
-    else if (x->type == LVAL_INTEGER && y->type == LVAL_DECIMAL)
+    else
     {
-        x->type = LVAL_DECIMAL;
-        x->decimal = (double) x->integer;
+        fprintf(c->out, "lval* t%d = lenv_lookup(%s, ", t, c->env);
+        lcomp_cstr(c->out, v->sym);
+        fputs(");\n", c->out);
     }
+    return t;
+}
 
-    if (x->type == LVAL_INTEGER && y->type == LVAL_INTEGER)
+// Bodies and quoted branches are Q-Expressions evaluated as S-Expressions
+int lcomp_body(lcompiler* c, lval* q)
+{
+    if (q->type != LVAL_QEXPR)
+    {
+        return lcomp_expr(c, q);
+    }
+    q->type = LVAL_SEXPR;
+    int t = lcomp_sexpr(c, q);
+    q->type = LVAL_QEXPR;
+    return t;
+}
+
+// Recognises (fun {name formals...} {body}) and (def {name} (\ {formals...} {body})).
+// On success *formals is a new Q-Expression owned by the caller.
+int lcomp_definition(lcompiler* c, lval* v, char** name, lval** formals, lval** body)
+{
+    if (v->type != LVAL_SEXPR || v->count != 3 || v->cell[0]->type != LVAL_SYM || v->cell[1]->type != LVAL_QEXPR)
+    {
+        return 0;
+    }
+    char* head = v->cell[0]->sym;
+    lval* names = v->cell[1];
+    if (strcmp(head, "fun") == 0 && lval_find_sym(c->defined, "fun") < 0)
     {
-        if (strcmp(op, "<") == 0)
+        if (names->count < 1 || v->cell[2]->type != LVAL_QEXPR)
         {
-            result = lval_boolean(x->integer < y->integer);
+            return 0;
         }
-        else if (strcmp(op, "<=") == 0)
+        *formals = lval_copy(names);
+        lval_del(lval_pop(*formals, 0));
+        *body = v->cell[2];
+    }
+    else if (strcmp(head, "def") == 0 && lcomp_builtin(c, "def") >= 0)
+    {
+        lval* f = v->cell[2];
+        if (names->count != 1 || f->type != LVAL_SEXPR || f->count != 3 ||
+            f->cell[0]->type != LVAL_SYM || lcomp_builtin(c, f->cell[0]->sym) < 0 ||
+            lbuiltins[lcomp_builtin(c, f->cell[0]->sym)].func != builtin_lambda ||
+            f->cell[1]->type != LVAL_QEXPR || f->cell[2]->type != LVAL_QEXPR)
         {
-            result = lval_boolean(x->integer <= y->integer);
+            return 0;
         }
-        else if (strcmp(op, ">") == 0)
+        *formals = lval_copy(f->cell[1]);
+        *body = f->cell[2];
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (names->cell[0]->type != LVAL_SYM)
+    {
+        lval_del(*formals);
+        return 0;
+    }
+    *name = names->cell[0]->sym;
+    return 1;
+}
+
+// Only functions defined once, with fixed arity and a body that keeps to its own frame, become native
+int lcomp_eligible(lcompiler* c, char* name, lval* formals, lval* body)
+{
+    if (lcomp_count(c->defined, name) != 1 || lcomp_builtin(c, name) >= 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < formals->count; i++)
+    {
+        if (formals->cell[i]->type != LVAL_SYM || strcmp(formals->cell[i]->sym, "&") == 0)
         {
-            result = lval_boolean(x->integer > y->integer);
+            return 0;
         }
-        else if (strcmp(op, ">=") == 0)
+        for (int j = 0; j < i; j++)
         {
-            result = lval_boolean(x->integer >= y->integer);
+            if (strcmp(formals->cell[i]->sym, formals->cell[j]->sym) == 0)
+            {
+                return 0;
+            }
         }
     }
-    else if (x->type == LVAL_DECIMAL && y->type == LVAL_DECIMAL)
+    int generic = 0;
+    c->formals = formals;
+    int result = lcomp_check_body(c, body, &generic);
+    c->formals = NULL;
+    return result;
+}
+
+void lcomp_collect_defined(lcompiler* c, lval* prog)
+{
+    for (int i = 0; i < prog->count; i++)
     {
-        if (strcmp(op, "<") == 0)
+        lval* v = prog->cell[i];
+        if (v->type != LVAL_SEXPR || v->count < 2 || v->cell[0]->type != LVAL_SYM)
         {
-            result = lval_boolean(x->decimal < y->decimal);
+            continue;
         }
-        else if (strcmp(op, "<=") == 0)
+        char* head = v->cell[0]->sym;
+        if (strcmp(head, "defmacro") == 0)
         {
-            result = lval_boolean(x->decimal <= y->decimal);
+            if (v->cell[1]->type == LVAL_QEXPR && v->cell[1]->count > 0 && v->cell[1]->cell[0]->type == LVAL_SYM)
+            {
+                lval_add(c->defined, lval_copy(v->cell[1]->cell[0]));
+                lval_add(c->macros, lval_copy(v->cell[1]->cell[0]));
+            }
+            continue;
         }
-        else if (strcmp(op, ">") == 0)
+        if (strcmp(head, "def") != 0 && strcmp(head, "=") != 0 && strcmp(head, "fun") != 0)
         {
-            result = lval_boolean(x->decimal > y->decimal);
+            continue;
         }
-        else if (strcmp(op, ">=") == 0)
+        if (v->cell[1]->type != LVAL_QEXPR)
         {
-            result = lval_boolean(x->decimal >= y->decimal);
+            continue;
         }
-    }
-
-    if (result == NULL)
-    {
-        result = lval_err("Operator not implemented: %s", op);
-    }
-
-    lval_del(a);
-    return result;
-}
-
-void lenv_add_builtin(lenv *e, char* name, lbuiltin func)
-{
-    lval* sym = lval_symbol(name);
-    lval* fun = lval_builtin(func);
-    lenv_put(e, sym, fun);
-    lval_del(sym);
-    lval_del(fun);
-}
-
-#define LBUILTIN_DECL_OP(builtin_name, op) LBUILTIN_DECL(builtin_name) { return builtin_op(a, op); }
-LBUILTIN_DECL_OP(builtin_add, "+");
-LBUILTIN_DECL_OP(builtin_sub, "-");
-LBUILTIN_DECL_OP(builtin_mul, "*");
-LBUILTIN_DECL_OP(builtin_div, "/");
-LBUILTIN_DECL_OP(builtin_mod, "%");
-LBUILTIN_DECL_OP(builtin_pow, "^");
-LBUILTIN_DECL_OP(builtin_min, "min");
-LBUILTIN_DECL_OP(builtin_max, "max");
-//LBUILTIN_DECL_OP(builtin_and, "&&");
-//LBUILTIN_DECL_OP(builtin_or, "||");
-
-#define LBUILTIN_DECL_ORD(builtin_name, op) LBUILTIN_DECL(builtin_name) { return builtin_ord(a, op); }
-LBUILTIN_DECL_ORD(builtin_lt, "<");
-LBUILTIN_DECL_ORD(builtin_le, "<=");
-LBUILTIN_DECL_ORD(builtin_gt, ">");
-LBUILTIN_DECL_ORD(builtin_ge, ">=");
-
-LBUILTIN_DECL(builtin_and)
-{
-    LASSERT_ARG_MIN(a, 2, "&&");
-    for (int i = 0; i < a->count; i++)
-    {
-        LASSERT(a, a->cell[i]->type == LVAL_BOOLEAN || a->cell[i]->type == LVAL_INTEGER || a->cell[i]->type == LVAL_DECIMAL,
-                "Function '&&' got argument of invalid type %s at position %d.", ltype_name(a->cell[i]->type), i);
-    }
-    int result = 1;
-    while (a->count > 0)
-    {
-        lval* x = lval_pop(a, 0);
-        if (((x->type == LVAL_BOOLEAN || x->type == LVAL_INTEGER) && (x->integer == 0)) ||
-            ((x->type == LVAL_DECIMAL) && (x->decimal == 0.0)))
+        lval* names = v->cell[1];
+        int count = strcmp(head, "fun") == 0 ? (names->count > 0 ? 1 : 0) : names->count;
+        for (int j = 0; j < count; j++)
         {
-            lval_del(x);
-            result = 0;
-            break;
+            if (names->cell[j]->type == LVAL_SYM)
+            {
+                lval_add(c->defined, lval_copy(names->cell[j]));
+            }
         }
-        lval_del(x);
     }
-    lval_del(a);
-    return lval_boolean(result);
 }
 
-LBUILTIN_DECL(builtin_or)
+void lcomp_function(lcompiler* c, int index, char* name, lval* formals, lval* body)
 {
-    LASSERT_ARG_MIN(a, 2, "||");
-    for (int i = 0; i < a->count; i++)
+    int generic = 0;
+    c->formals = formals;
+    lcomp_check_body(c, body, &generic);
+    c->env = generic ? "f" : "e";
+    c->temps = 0;
+
+    fprintf(c->out, "// %s\n", name);
+    fprintf(c->out, "lval* lspy_fn%d(lenv* e, lval* a)\n{\n", index);
+    c->depth = 1;
+    lcomp_indent(c);
+    fprintf(c->out, "if (lval_count(a) != %d)\n", formals->count);
+    lcomp_indent(c);
+    fputs("{\n", c->out);
+    lcomp_indent(c);
+    fprintf(c->out, "    lval* f = lval_copy(lspy_lambda%d);\n", index);
+    lcomp_indent(c);
+    fputs("    lval* r = lval_call(e, f, a);\n", c->out);
+    lcomp_indent(c);
+    fputs("    lval_del(f);\n", c->out);
+    lcomp_indent(c);
+    fputs("    return r;\n", c->out);
+    lcomp_indent(c);
+    fputs("}\n", c->out);
+
+    for (int i = 0; i < formals->count; i++)
     {
-        LASSERT(a, a->cell[i]->type == LVAL_BOOLEAN || a->cell[i]->type == LVAL_INTEGER || a->cell[i]->type == LVAL_DECIMAL,
-                "Function '||' got argument of invalid type %s at position %d.", ltype_name(a->cell[i]->type), i);
+        lcomp_indent(c);
+        fprintf(c->out, "lval* a%d = lval_pop(a, 0);\n", i);
     }
-    int result = 0;
-    while (a->count > 0)
+    lcomp_indent(c);
+    fputs("lval_del(a);\n", c->out);
+    if (generic)
     {
-        lval* x = lval_pop(a, 0);
-        if (((x->type == LVAL_BOOLEAN || x->type == LVAL_INTEGER) && (x->integer != 0)) ||
-            ((x->type == LVAL_DECIMAL) && (x->decimal != 0.0)))
+        lcomp_indent(c);
+        fputs("lenv* f = lenv_frame(e);\n", c->out);
+        for (int i = 0; i < formals->count; i++)
         {
-            lval_del(x);
-            result = 1;
-            break;
+            lcomp_indent(c);
+            fputs("lenv_bind(f, ", c->out);
+            lcomp_cstr(c->out, formals->cell[i]->sym);
+            fprintf(c->out, ", a%d);\n", i);
         }
-        lval_del(x);
     }
-    lval_del(a);
-    return lval_boolean(result);
-}
 
-LBUILTIN_DECL(builtin_not)
-{
-    LASSERT_ARG_COUNT(a, 1, "!");
-    LASSERT(a, a->cell[0]->type == LVAL_BOOLEAN || a->cell[0]->type == LVAL_INTEGER || a->cell[0]->type == LVAL_DECIMAL,
-            "Function '!' got argument of invalid type %s.", ltype_name(a->cell[0]->type));
-    lval* x = lval_take(a, 0);
-    int result = x->type == LVAL_DECIMAL ? !x->decimal : !x->integer;
-    lval_del(x);
-    return lval_boolean(result);
-}
+    int t = lcomp_body(c, body);
 
-LBUILTIN_DECL(builtin_eq)
-{
-    LASSERT_ARG_COUNT(a, 2, "==");
-    int result = lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_boolean(result);
+    if (generic)
+    {
+        lcomp_indent(c);
+        fputs("lenv_del(f);\n", c->out);
+    }
+    for (int i = 0; i < formals->count; i++)
+    {
+        lcomp_indent(c);
+        fprintf(c->out, "lval_del(a%d);\n", i);
+    }
+    lcomp_indent(c);
+    fprintf(c->out, "return t%d;\n}\n\n", t);
+    c->depth = 0;
+    c->formals = NULL;
 }
 
-LBUILTIN_DECL(builtin_ne)
+void lcomp_statement(lcompiler* c, lval* v)
 {
-    LASSERT_ARG_COUNT(a, 2, "!=");
-    int result = !lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_boolean(result);
-}
-
+    char* name;
+    lval* formals;
+    lval* body;
+    int generic = 0;
 
-void lenv_add_builtins(lenv* e)
-{
-    lval* sym = lval_symbol("true");
-    lval* fun = lval_boolean(1);
-    lenv_put(e, sym, fun);
-    lval_del(sym);
-    lval_del(fun);
+    c->temps = 0;
+    c->env = "e";
+    c->depth = 1;
+    lcomp_indent(c);
+    fputs("{\n", c->out);
+    c->depth++;
 
-    sym = lval_symbol("false");
-    fun = lval_boolean(0);
-    lenv_put(e, sym, fun);
-    lval_del(sym);
-    lval_del(fun);
+    if (lcomp_definition(c, v, &name, &formals, &body) && lcomp_native(c, name) >= 0)
+    {
+        int index = lcomp_native(c, name);
+        lval* lambda = lval_add(lval_add(lval_add(lval_sexpr(), lval_symbol("\\")), formals), lval_copy(body));
+        int t = lcomp_value(c, lambda);
+        lval_del(lambda);
+        lcomp_indent(c);
+        fprintf(c->out, "lspy_lambda%d = lval_eval(e, t%d);\n", index, t);
+        lcomp_indent(c);
+        fputs("lenv_add_builtin(e, ", c->out);
+        lcomp_cstr(c->out, name);
+        fprintf(c->out, ", lspy_fn%d);\n", index);
+    }
+    else if (lcomp_check(c, v, &generic))
+    {
+        int t = lcomp_expr(c, v);
+        lcomp_indent(c);
+        fprintf(c->out, "lval_report(e, t%d);\n", t);
+    }
+    else
+    {
+        int t = lcomp_value(c, v);
+        lcomp_indent(c);
+        fprintf(c->out, "lval_report(e, lval_eval(e, t%d));\n", t);
+    }
 
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "get_env", builtin_get_env);
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "init", builtin_init);
-    lenv_add_builtin(e, "cons", builtin_cons);
-    lenv_add_builtin(e, "len", builtin_len);
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "^", builtin_pow);
-    lenv_add_builtin(e, "min", builtin_min);
-    lenv_add_builtin(e, "max", builtin_max);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "&&", builtin_and);
-    lenv_add_builtin(e, "||", builtin_or);
-    lenv_add_builtin(e, "!", builtin_not);
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "read", builtin_read);
-    lenv_add_builtin(e, "show", builtin_show);
+    c->depth--;
+    lcomp_indent(c);
+    fputs("}\n", c->out);
+    c->depth = 0;
 }
 
-void lenv_add_library(lenv* e, mpc_parser_t* parser)
+void lcomp_copy(FILE* from, FILE* to)
 {
-    char* input[] = {
-        "def{ fun } (\\ {args body} {def(head args) (\\ (tail args) body)})",
-        /*
-        "fun {unpack f xs} {eval (join (list f) xs)}",
-        "fun { pack f & xs } {f xs}",
-        "def {uncurry} pack",
-        "def {curry} unpack",
-        "def {first} (curry (\\ {x & xs} {x}))",
-        "fun {second xs} {first (tail xs)}",
-        "fun {reverse f x y} {f y x}",
-        "fun {combine f g & xs} {g ((curry f) xs)}",
-        "fun {len l} {if (== l {}) {0} {+ 1 (len (tail l))}}",
-        "fun {reverse l} {if (== l {}) {{}} {join (reverse (tail l)) (head l)}}",
-        "fun {nth n l} {if (== l {}) {()} {if (== n 0) {first l} {nth (- n 1) (tail l)}}}",
-        "fun {last l} {if (== l {}) {()} {if (== (tail l) {}) {first l} {last (tail l)}}}",
-        "fun {and x & xs} { if (! x) {false} {if (== xs {}) {true} { curry and xs }}}",
-        "fun {or x & xs} { if (x) {true} {if (== xs {}) {false} { curry or xs }}}",
-        "fun {not x} { if (x) {false} {true}}",
-        */
-        NULL
-    };
-
-    for (int i = 0; input[i] != NULL; i++)
+    char buffer[4096];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0)
     {
-        mpc_result_t result;
-        mpc_parse("<stdin>", input[i], parser, &result);
-        lval_del(lval_eval(e, lval_read(result.output)));
-        mpc_ast_delete(result.output);
+        fwrite(buffer, 1, n, to);
     }
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a)
+// Whether the code of v looks up one of the names in params at runtime instead of reading a parameter
+int lcomp_reads(lcompiler* c, lval* v, lval* params)
 {
-    if (f->builtin != NULL)
+    if (v->type == LVAL_SYM)
     {
-        return f->builtin(e, a);
+        return lcomp_formal(c, v->sym) < 0 && lval_find_sym(params, v->sym) >= 0;
     }
-
-    int args_given = a->count;
-    int args_total = f->formals->count;
-
-    while (a->count > 0)
+    if (v->type != LVAL_SEXPR)
     {
-        if (f->formals->count == 0)
+        return 0;
+    }
+    int is_if = lcomp_is_if(c, v);
+    for (int i = 0; i < v->count; i++)
+    {
+        lval* x = v->cell[i];
+        // Builtins and natives in the head are called directly
+        if (i == 0 && v->count > 1 && x->type == LVAL_SYM &&
+            (lcomp_builtin(c, x->sym) >= 0 || lcomp_native(c, x->sym) >= 0))
         {
-            lval_del(a);
-            return lval_err("Function given too many arguments. Expected %d given %d.", args_total, args_given);
+            continue;
         }
-        lval* sym = lval_pop(f->formals, 0);
-        // special case: function supports variable size argument list in the format (\ {x & xs} {...})
-        // when called, the first argument is assigned to x and the rest of the arguments are assigned to xs as a list
-        if (strcmp(sym->sym, "&") == 0)
+        if (x->type == LVAL_QEXPR)
         {
-            if (f->formals->count != 1)
+            if (is_if && i >= 2)
             {
-                lval_del(a);
-                // TODO: Shouldn't this be checked on lambda definition?
-                return lval_err("Function format invalid. '&' not followed by a single symbol.");
+                x->type = LVAL_SEXPR;
+                int reads = lcomp_reads(c, x, params);
+                x->type = LVAL_QEXPR;
+                if (reads)
+                {
+                    return 1;
+                }
             }
-
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
+            continue;
+        }
+        if (lcomp_reads(c, x, params))
+        {
+            return 1;
         }
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
     }
-    lval_del(a);
+    return 0;
+}
 
-    // special case: function supports variable size argument list but was given none, assign empty list to rest of arguments
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0)
+// Names are scoped dynamically, so a native called from another one may look up the parameters of its caller,
+// which are only in a real frame when the caller is generic. Natives that look up a name some native takes as a
+// parameter are open, and so are the generic ones, which includes every caller of an open native.
+void lcomp_collect_open(lcompiler* c, lval* prog)
+{
+    lval* params = lval_qexpr();
+    for (int i = 0; i < prog->count; i++)
     {
-        if (args_total - args_given != 2)
+        char* name;
+        lval* formals;
+        lval* body;
+        if (lcomp_definition(c, prog->cell[i], &name, &formals, &body))
         {
-            return lval_err("Function format invalid. '&' not followed by a single symbol.");
+            params = lval_join(params, formals);
         }
-
-        // remove &
-        lval_del(lval_pop(f->formals, 0));
-
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
     }
 
-    if (f->formals->count == 0)
-    {
-        lval* tmp = lval_sexpr();
-        lval_add(tmp, lval_copy(f->body));
-        f->env->par = e;
-        return builtin_eval(f->env, tmp);
-    }
-    else
+    int changed = 1;
+    while (changed)
     {
-        // Partially applied function
-        return lval_copy(f);
+        changed = 0;
+        for (int i = 0; i < prog->count; i++)
+        {
+            char* name;
+            lval* formals;
+            lval* body;
+            if (!lcomp_definition(c, prog->cell[i], &name, &formals, &body))
+            {
+                continue;
+            }
+            if (lcomp_native(c, name) >= 0 && lval_find_sym(c->open, name) < 0)
+            {
+                int generic = 0;
+                c->formals = formals;
+                lcomp_check_body(c, body, &generic);
+                body->type = LVAL_SEXPR;
+                if (generic || lcomp_reads(c, body, params))
+                {
+                    lval_add(c->open, lval_symbol(name));
+                    changed = 1;
+                }
+                body->type = LVAL_QEXPR;
+                c->formals = NULL;
+            }
+            lval_del(formals);
+        }
     }
+    lval_del(params);
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v)
+lval* lcompile_file(char* filename, FILE* out)
 {
-    if (v->count == 0)
+    mpc_result_t r;
+    if (!mpc_parse_contents(filename, Lispy, &r))
     {
-        return v;
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        lval* err = lval_err("Could not compile file: %s ", err_msg);
+        free(err_msg);
+        return err;
     }
+    lval* prog = lval_read(r.output);
+    mpc_ast_delete(r.output);
 
-    for (int i = 0; i < v->count; i++)
+    int builtins_count = 0;
+    while (lbuiltins[builtins_count].name != NULL)
     {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+        builtins_count++;
     }
 
-    for (int i = 0; i < v->count; i++)
+    lcompiler c;
+    c.out = tmpfile();
+    c.temps = 0;
+    c.depth = 0;
+    c.formals = NULL;
+    c.defined = lval_qexpr();
+    c.natives = lval_qexpr();
+    c.macros = lval_qexpr();
+    c.open = lval_qexpr();
+    c.env = "e";
+    c.used = calloc(builtins_count, 1);
+    if (c.out == NULL)
     {
-        if (v->cell[i]->type == LVAL_ERR)
-        {
-            return lval_take(v, i);
-        }
+        lval_del(prog);
+        lval_del(c.defined);
+        lval_del(c.natives);
+        lval_del(c.macros);
+        lval_del(c.open);
+        free(c.used);
+        return lval_err("Could not create temporary file");
     }
 
-    if (v->count == 1)
+    lcomp_collect_defined(&c, prog);
+
+    for (int i = 0; i < prog->count; i++)
     {
-        lval* u = lval_take(v, 0);
-        return u;
+        char* name;
+        lval* formals;
+        lval* body;
+        if (lcomp_definition(&c, prog->cell[i], &name, &formals, &body))
+        {
+            if (lcomp_eligible(&c, name, formals, body))
+            {
+                lval_add(c.natives, lval_symbol(name));
+            }
+            lval_del(formals);
+        }
     }
 
-    lval* f = lval_pop(v, 0);
+    lcomp_collect_open(&c, prog);
 
-    if (f->type != LVAL_FUN)
+    for (int i = 0; i < c.natives->count; i++)
     {
-        lval* err = lval_err("Expected %s, got %s", ltype_name(LVAL_FUN), ltype_name(f->type));
-        lval_del(f);
-        lval_del(v);
-        return err;
+        fprintf(c.out, "lval* lspy_fn%d(lenv* e, lval* a);\n", i);
+        fprintf(c.out, "lval* lspy_lambda%d;\n", i);
     }
+    fputs("\n", c.out);
 
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
-}
+    for (int i = 0; i < prog->count; i++)
+    {
+        char* name;
+        lval* formals;
+        lval* body;
+        if (lcomp_definition(&c, prog->cell[i], &name, &formals, &body))
+        {
+            int index = lcomp_native(&c, name);
+            if (index >= 0)
+            {
+                lcomp_function(&c, index, name, formals, body);
+            }
+            lval_del(formals);
+        }
+    }
 
-lval* lval_eval(lenv* e, lval* v)
-{
-    if (v->type == LVAL_SEXPR)
+    fputs("void lspy_run(lenv* e)\n{\n", c.out);
+    for (int i = 0; i < prog->count; i++)
     {
-        return lval_eval_sexpr(e, v);
+        lcomp_statement(&c, prog->cell[i]);
     }
-    else if (v->type == LVAL_SYM)
+    fputs("}\n\n", c.out);
+
+    fputs("int main(int argc, char** argv)\n{\n", c.out);
+    fputs("    lenv* e = felispy_init();\n", c.out);
+    fputs("    lspy_run(e);\n", c.out);
+    for (int i = 0; i < c.natives->count; i++)
     {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+        fprintf(c.out, "    lval_del(lspy_lambda%d);\n", i);
     }
-    else
+    fputs("    felispy_cleanup(e);\n", c.out);
+    fputs("    return 0;\n}\n", c.out);
+
+    fprintf(out, "// Generated by felispy --emit-c from %s\n", filename);
+    fputs("// Build with: cc -DFELISPY_NO_MAIN <this file> main.c mpc.c -lm -ledit\n\n", out);
+    fputs("typedef struct lval lval;\n", out);
+    fputs("typedef struct lenv lenv;\n", out);
+    fputs("typedef lval* (*lbuiltin)(lenv* e, lval* a);\n\n", out);
+    fputs("lenv* felispy_init(void);\n", out);
+    fputs("void felispy_cleanup(lenv* e);\n", out);
+    fputs("lval* lval_integer(long integer);\n", out);
+    fputs("lval* lval_boolean(long boolean);\n", out);
+    fputs("lval* lval_decimal(double decimal);\n", out);
+    fputs("lval* lval_parse_integer(char* s);\n", out);
+    fputs("lval* lval_symbol(char* symbol);\n", out);
+    fputs("lval* lval_string(char* str);\n", out);
+    fputs("lval* lval_err(char* fmt, ...);\n", out);
+    fputs("lval* lval_sexpr(void);\n", out);
+    fputs("lval* lval_qexpr(void);\n", out);
+    fputs("lval* lval_add(lval* v, lval* new_cell);\n", out);
+    fputs("lval* lval_copy(lval* v);\n", out);
+    fputs("lval* lval_pop(lval* v, int i);\n", out);
+    fputs("void lval_del(lval* v);\n", out);
+    fputs("int lval_count(lval* v);\n", out);
+    fputs("int lval_truth(lval* v);\n", out);
+    fputs("lval* lval_truth_error(char* fun, lval* x, int pos);\n", out);
+    fputs("lval* lval_eval(lenv* e, lval* v);\n", out);
+    fputs("lval* lval_eval_call(lenv* e, lval* v);\n", out);
+    fputs("lval* lval_branch_value(lenv* e, lval* x);\n", out);
+    fputs("lval* lval_call(lenv* e, lval* f, lval* a);\n", out);
+    fputs("lval* lval_call_builtin(lenv* e, lbuiltin func, lval* a);\n", out);
+    fputs("void lval_report(lenv* e, lval* x);\n", out);
+    fputs("lval* lenv_lookup(lenv* e, char* sym);\n", out);
+    fputs("lenv* lenv_frame(lenv* par);\n", out);
+    fputs("void lenv_bind(lenv* e, char* sym, lval* v);\n", out);
+    fputs("void lenv_del(lenv* e);\n", out);
+    fputs("void lenv_add_builtin(lenv* e, char* name, lbuiltin func);\n", out);
+    for (int i = 0; i < builtins_count; i++)
     {
-        return v;
+        if (c.used[i])
+        {
+            fprintf(out, "lval* %s(lenv* e, lval* a);\n", lbuiltins[i].c_name);
+        }
     }
+    fputs("\n", out);
+    lcomp_copy(c.out, out);
+
+    fclose(c.out);
+    lval_del(c.defined);
+    lval_del(c.natives);
+    lval_del(c.macros);
+    lval_del(c.open);
+    free(c.used);
+    lval_del(prog);
+    return lval_ok();
 }
 
-int main(int argc, char** argv)
+lenv* felispy_init(void)
 {
-
     Comment = mpc_new("comment");
     String = mpc_new("string");
     Boolean = mpc_new("boolean");
@@ -1789,7 +12456,7 @@ int main(int argc, char** argv)
         "integer  : /-?[0-9]+/ ; "
         "decimal  : /-?[0-9]*\\.[0-9]+/ ; "
         "number   : <decimal> | <integer> ; "
-        "symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\%\\^=<>!&|]+/ ; "
+        "symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\%\\^=<>!?&|]+/ ; "
         "sexpr    : '(' <expr>* ')' ; "
         "qexpr    : '{' <expr>* '}' ; "
         "expr     : <number> | <symbol> | <sexpr> | <qexpr> | <string> | <comment> ; "
@@ -1797,6 +12464,46 @@ int main(int argc, char** argv)
 
     mpca_lang(MPCA_LANG_DEFAULT, Grammar, Comment, String, Boolean, Integer, Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
+    lenv* e = lenv_new();
+    lenv_add_builtins(e);
+    lenv_add_library(e, Lispy);
+    return e;
+}
+
+void felispy_cleanup(lenv* e)
+{
+    lenv_del(e);
+    if (lfold_shadowed != NULL)
+    {
+        lval_del(lfold_shadowed);
+        lfold_shadowed = NULL;
+    }
+    mpc_cleanup(11, Comment, String, Boolean, Integer, Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+}
+
+#ifndef FELISPY_NO_MAIN
+
+int main(int argc, char** argv)
+{
+    //debug_check("lenv_new");
+
+    lenv* e = felispy_init();
+
+    //debug_check("Builtins loaded");
+
+    if (argc == 3 && strcmp(argv[1], "--emit-c") == 0)
+    {
+        lval* x = lcompile_file(argv[2], stdout);
+        int status = x->type == LVAL_ERR ? 1 : 0;
+        if (status)
+        {
+            fprintf(stderr, "Error: %s\n", x->err);
+        }
+        lval_del(x);
+        felispy_cleanup(e);
+        return status;
+    }
+
 #ifdef _WIN32
     CONSOLE_SCREEN_BUFFER_INFO csbInfo;
     hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -1807,14 +12514,6 @@ int main(int argc, char** argv)
     puts("Felispy 0.1.4 - by Felipo");
     puts("Type ctrl+C to exit.\n");
 
-    //debug_check("lenv_new");
-
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
-    lenv_add_library(e, Lispy);
-
-    //debug_check("Builtins loaded");
-
     if (argc > 1)
     {
         for (int i = 1; i < argc; i++)
@@ -1867,7 +12566,7 @@ int main(int argc, char** argv)
             lval* v = lval_read(result.output);
             //lval_println(v);
             fore_color(14);
-            v = lval_eval(e, v);
+            v = lval_no_recur(lval_eval(e, v));
             lval_println(e, v);
             lval_del(v);
 
@@ -1885,13 +12584,14 @@ int main(int argc, char** argv)
         //debug_check("REPL");
     }
 
-    lenv_del(e);
+    felispy_cleanup(e);
     //debug_check("lenv_del");
 
 #ifdef _WIN32
     SetConsoleTextAttribute(hOutput, csbInfo.wAttributes);
 #endif
 
-    mpc_cleanup(11, Comment, String, Boolean, Integer, Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
     return 0;
 }
+
+#endif
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Runs every tests/*.lspy with the interpreter and again compiled with --emit-c, from the top of the repository:
+#
+#     sh tests/run.sh
+#
+# A script with a .out file next to it must print exactly that, the others must not print FAIL or an error, and
+# the compiled program must print what the interpreter did. The checks print FAIL with 'print', which quotes it.
+# CC, CFLAGS and LIBS choose the compiler and libraries.
+# The programs run in a scratch directory, where the caches of disk-memo are removed before every run.
+
+CC=${CC:-cc}
+LIBS=${LIBS--ledit}
+dir=${TMPDIR:-/tmp}/felispy-tests
+mkdir -p "$dir" || exit 1
+top=$(pwd)
+
+$CC $CFLAGS -DFELISPY_TESTS -o "$dir/felispy" src/main.c src/mpc.c -lm $LIBS || exit 1
+
+status=0
+for t in tests/*.lspy
+do
+    name=$(basename "$t" .lspy)
+
+    # The interpreter prints a banner and waits for the REPL after loading the script
+    rm -f "$dir"/*.dat "$dir"/*.idx
+    echo exit | (cd "$dir" && ./felispy "$top/$t") | grep -v -e '^Felispy' -e '^Type ctrl' -e '^$' > "$dir/$name.txt"
+    if [ -f "tests/$name.out" ]
+    then
+        diff "tests/$name.out" "$dir/$name.txt" || { echo "FAIL $t does not print tests/$name.out"; status=1; }
+    elif grep -q -e '^"*FAIL' -e '^Error' "$dir/$name.txt"
+    then
+        grep -e '^"*FAIL' -e '^Error' "$dir/$name.txt"
+        status=1
+    fi
+
+    if "$dir/felispy" --emit-c "$t" > "$dir/$name.c" &&
+        $CC $CFLAGS -DFELISPY_TESTS -DFELISPY_NO_MAIN -o "$dir/$name" "$dir/$name.c" src/main.c src/mpc.c -lm $LIBS
+    then
+        rm -f "$dir"/*.dat "$dir"/*.idx
+        (cd "$dir" && "./$name") | grep -v '^$' > "$dir/$name.compiled.txt"
+        diff "$dir/$name.txt" "$dir/$name.compiled.txt" || { echo "FAIL $t prints something else compiled"; status=1; }
+    else
+        echo "FAIL $t does not compile"
+        status=1
+    fi
+
+    echo "$t: $(grep -c '^ok' "$dir/$name.txt") ok"
+done
+exit $status